@@ -0,0 +1,49 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include "kernel.h"
+
+// Root System Description Pointer, found in the EBDA or BIOS ROM
+typedef struct __attribute__((packed)) {
+    char     signature[8];          // "RSD PTR "
+    uint8_t  checksum;              // First 20 bytes
+    char     oem_id[6];
+    uint8_t  revision;              // 0: ACPI 1.0, 2: XSDT present
+    uint32_t rsdt_address;
+    uint32_t length;                // Revision 2 and later
+    uint64_t xsdt_address;
+    uint8_t  extended_checksum;
+    uint8_t  reserved[3];
+} acpi_rsdp_t;
+
+// Header shared by every system description table
+typedef struct __attribute__((packed)) {
+    char     signature[4];
+    uint32_t length;                // Including this header
+    uint8_t  revision;
+    uint8_t  checksum;
+    char     oem_id[6];
+    char     oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} acpi_sdt_header_t;
+
+// MCFG: one entry per PCI segment group with memory-mapped config space
+typedef struct __attribute__((packed)) {
+    acpi_sdt_header_t header;
+    uint64_t reserved;
+} acpi_mcfg_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t base_address;          // ECAM base for bus 0 of the segment
+    uint16_t segment;
+    uint8_t  start_bus;
+    uint8_t  end_bus;
+    uint32_t reserved;
+} acpi_mcfg_allocation_t;
+
+// Function prototypes
+acpi_sdt_header_t* acpi_find_table(const char* signature);
+
+#endif
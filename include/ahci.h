@@ -0,0 +1,177 @@
+#ifndef AHCI_H
+#define AHCI_H
+
+#include "kernel.h"
+
+// PCI class of an AHCI controller: Mass Storage / SATA / AHCI 1.0
+#define AHCI_PCI_CLASS          0x01
+#define AHCI_PCI_SUBCLASS       0x06
+#define AHCI_PCI_PROGIF         0x01
+
+// Generic Host Control registers (offsets from ABAR)
+#define AHCI_REG_CAP            0x00
+#define AHCI_REG_GHC            0x04
+#define AHCI_REG_IS             0x08
+#define AHCI_REG_PI             0x0C
+#define AHCI_REG_VS             0x10
+
+// CAP bits
+#define AHCI_CAP_SNCQ           (1u << 30)  // Native Command Queuing
+#define AHCI_CAP_SCLO           (1u << 24)  // Command list override
+#define AHCI_CAP_NCS_SHIFT      8           // Number of command slots - 1
+#define AHCI_CAP_NCS_MASK       0x1F
+
+// GHC bits
+#define AHCI_GHC_HR             (1u << 0)   // HBA reset
+#define AHCI_GHC_IE             (1u << 1)   // Interrupt enable
+#define AHCI_GHC_AE             (1u << 31)  // AHCI enable
+
+// Port registers (offsets from ABAR + 0x100 + port * 0x80)
+#define AHCI_PORT_BASE          0x100
+#define AHCI_PORT_SIZE          0x80
+#define AHCI_PxCLB              0x00
+#define AHCI_PxCLBU             0x04
+#define AHCI_PxFB               0x08
+#define AHCI_PxFBU              0x0C
+#define AHCI_PxIS               0x10
+#define AHCI_PxIE               0x14
+#define AHCI_PxCMD              0x18
+#define AHCI_PxTFD              0x20
+#define AHCI_PxSIG              0x24
+#define AHCI_PxSSTS             0x28
+#define AHCI_PxSCTL             0x2C
+#define AHCI_PxSERR             0x30
+#define AHCI_PxSACT             0x34
+#define AHCI_PxCI               0x38
+
+// PxCMD bits
+#define AHCI_PxCMD_ST           (1u << 0)
+#define AHCI_PxCMD_CLO          (1u << 3)   // Clear BSY and DRQ in PxTFD
+#define AHCI_PxCMD_FRE          (1u << 4)
+#define AHCI_PxCMD_FR           (1u << 14)
+#define AHCI_PxCMD_CR           (1u << 15)
+
+// PxIS / PxIE bits
+#define AHCI_PxIS_DHRS          (1u << 0)   // D2H register FIS
+#define AHCI_PxIS_PSS           (1u << 1)   // PIO setup FIS
+#define AHCI_PxIS_DSS           (1u << 2)   // DMA setup FIS
+#define AHCI_PxIS_SDBS          (1u << 3)   // Set device bits FIS (NCQ completion)
+#define AHCI_PxIS_IFS           (1u << 27)
+#define AHCI_PxIS_HBDS          (1u << 28)
+#define AHCI_PxIS_HBFS          (1u << 29)
+#define AHCI_PxIS_TFES          (1u << 30)  // Task file error
+#define AHCI_PxIS_ERROR         (AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+
+// PxSSTS device detection
+#define AHCI_SSTS_DET_MASK      0x0F
+#define AHCI_SCTL_DET_COMRESET  0x01
+#define AHCI_TFD_BSY            0x80
+#define AHCI_TFD_DRQ            0x08
+#define AHCI_SSTS_DET_PRESENT   0x03
+
+// PxSIG values
+#define AHCI_SIG_ATA            0x00000101
+#define AHCI_SIG_ATAPI          0xEB140101
+
+// FIS types
+#define FIS_TYPE_REG_H2D        0x27
+
+// ATA commands used over AHCI
+#define AHCI_ATA_CMD_IDENTIFY           0xEC
+#define AHCI_ATA_CMD_READ_DMA_EXT       0x25
+#define AHCI_ATA_CMD_WRITE_DMA_EXT      0x35
+#define AHCI_ATA_CMD_FLUSH_EXT          0xEA
+#define AHCI_ATA_CMD_READ_FPDMA_QUEUED  0x60
+#define AHCI_ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+
+// Driver limits
+#define AHCI_MAX_PORTS          32
+#define AHCI_MAX_SLOTS          32
+#define AHCI_MAX_DEVICES        8
+#define AHCI_PRDT_ENTRIES       8           // 8 x 4MB covers a 65536-sector command
+#define AHCI_PRD_MAX_BYTES      (4 * 1024 * 1024)
+#define AHCI_MAX_SECTORS        65536
+#define AHCI_TIMEOUT_MS         5000
+
+// Bound on register reads while waiting for the port engine, CLO or a
+// COMRESET. Error recovery runs with interrupts disabled, where
+// timer_ticks() stands still.
+#define AHCI_PORT_POLLS         1000000
+#define AHCI_COMRESET_POLLS     10000       // DET held at 1 for at least 1 ms
+
+// Request operations
+#define AHCI_OP_READ            0
+#define AHCI_OP_WRITE           1
+#define AHCI_OP_FLUSH           2
+
+// Request flags
+#define AHCI_REQ_FUA            0x01        // Force unit access (NCQ writes)
+
+// Request status
+#define AHCI_REQ_QUEUED         0
+#define AHCI_REQ_ACTIVE         1
+#define AHCI_REQ_DONE           2
+#define AHCI_REQ_ERROR          3
+
+// Command header (one per slot in the command list)
+typedef struct __attribute__((packed)) {
+    uint16_t flags;             // CFL[4:0], A, W, P, R, B, C, PMP
+    uint16_t prdtl;             // PRDT entries
+    volatile uint32_t prdbc;    // Bytes transferred
+    uint32_t ctba;              // Command table base (128-byte aligned)
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} ahci_cmd_header_t;
+
+// Physical region descriptor
+typedef struct __attribute__((packed)) {
+    uint32_t dba;               // Data base address
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc;               // Byte count - 1 [21:0], bit 31: interrupt
+} ahci_prd_t;
+
+// Command table (128-byte aligned)
+typedef struct __attribute__((packed)) {
+    uint8_t cfis[64];           // Command FIS
+    uint8_t acmd[16];           // ATAPI command
+    uint8_t reserved[48];
+    ahci_prd_t prdt[AHCI_PRDT_ENTRIES];
+} ahci_cmd_table_t;
+
+// Asynchronous request, queued per port with ahci_submit()
+typedef struct ahci_request {
+    uint8_t  device;            // Index into the AHCI device table
+    uint8_t  op;                // AHCI_OP_*
+    uint8_t  flags;             // AHCI_REQ_FUA
+    volatile uint8_t status;    // AHCI_REQ_*
+    uint64_t lba;
+    uint32_t count;             // Sectors
+    uint8_t* buffer;            // Physically contiguous buffer
+    void   (*complete)(struct ahci_request* req); // Called from IRQ context
+    void*    private_data;
+    struct ahci_request* next;
+} ahci_request_t;
+
+// SATA disk attached to an AHCI port
+typedef struct {
+    uint8_t  port;
+    uint8_t  ncq;               // NCQ usable
+    uint8_t  queue_depth;       // Outstanding commands allowed
+    uint8_t  rotational;        // Spinning disk (IDENTIFY word 217)
+    uint64_t size;              // Size in sectors
+    char     model[41];
+} ahci_device_t;
+
+// Function prototypes
+void init_ahci(void);
+void ahci_print_devices(void);
+int ahci_get_device_count(void);
+ahci_device_t* ahci_get_device(int index);
+void ahci_submit(ahci_request_t* req);
+uint8_t ahci_wait(ahci_request_t* req);
+uint8_t ahci_read_sectors(uint8_t device, uint64_t lba, uint32_t count, uint8_t* buffer);
+uint8_t ahci_write_sectors(uint8_t device, uint64_t lba, uint32_t count, uint8_t* buffer);
+uint8_t ahci_flush(uint8_t device);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "kernel.h"
+#include "blkdev.h"
+
+// Access patterns
+#define BENCH_READ              0       // Sequential
+#define BENCH_WRITE             1
+#define BENCH_RANDREAD          2
+#define BENCH_RANDWRITE         3
+
+// Limits and defaults
+#define BENCH_MAX_QD            64
+#define BENCH_MAX_BUFFER        (4 * 1024 * 1024)   // Queue depth * block size
+#define BENCH_DEFAULT_BS        4096
+#define BENCH_DEFAULT_QD        1
+#define BENCH_DEFAULT_SECONDS   5
+
+// Latency histogram: exact below 16 us, then 16 buckets per power of two
+// (at most 6.25% error)
+#define BENCH_LAT_SUB_BITS      4
+#define BENCH_LAT_BUCKETS       ((32 - BENCH_LAT_SUB_BITS + 1) << BENCH_LAT_SUB_BITS)
+
+// isa-debug-exit device used by `make bench-blk`; QEMU exits with
+// status (value << 1) | 1
+#define BENCH_DEBUG_EXIT_PORT   0xF4
+
+// One benchmark job
+typedef struct {
+    blkdev_t* dev;
+    uint8_t  pattern;           // BENCH_*
+    uint32_t block_size;        // Bytes per I/O, a power-of-two multiple of the device block
+    uint32_t queue_depth;       // I/Os kept in flight
+    uint32_t seconds;           // Run time
+} bench_job_t;
+
+// Results of one job
+typedef struct {
+    uint32_t ios;
+    uint32_t errors;
+    uint32_t elapsed_ms;
+    uint32_t iops;
+    uint32_t kib_per_sec;
+    uint32_t p50_us;
+    uint32_t p99_us;
+    uint32_t p999_us;
+    uint32_t max_us;
+} bench_result_t;
+
+// Function prototypes
+int bench_run(const bench_job_t* job, bench_result_t* result);
+void bench_run_cmdline(const char* cmdline);
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef BLKDEV_H
+#define BLKDEV_H
+
+#include "kernel.h"
+
+// Limits
+#define BLK_MAX_DEVICES         16
+#define BLK_NAME_LEN            8
+#define BLK_REQUEST_POOL        128     // Requests shared by all devices
+#define BLK_MAX_SEGMENTS        64      // Scatter list entries per request
+#define BLK_TIMEOUT_MS          10000
+
+// bio operations
+#define BIO_READ                0
+#define BIO_WRITE               1
+#define BIO_FLUSH               2
+
+// bio flags
+#define BIO_FUA                 0x01    // Write through the device cache
+
+// bio status
+#define BIO_PENDING             0
+#define BIO_DONE                1
+#define BIO_ERROR               2
+
+// Device flags
+#define BLKDEV_ROTATIONAL       0x01    // Seeks are expensive; prefer deadline
+#define BLKDEV_FUA              0x02    // Native FUA writes (emulated with a flush otherwise)
+
+// Completion modes
+#define BLK_POLL_OFF            0       // Sleep until the interrupt
+#define BLK_POLL_HYBRID         1       // Poll briefly for fast requests, then sleep
+#define BLK_POLL_MAX_US         500     // Slower devices always sleep
+#define BLK_LAT_BUCKETS         16      // Bucket n: service times of [2^n, 2^(n+1)) us
+
+// Scheduler tunables (deadline)
+#define DEADLINE_READ_EXPIRE_MS   500
+#define DEADLINE_WRITE_EXPIRE_MS  5000
+#define DEADLINE_FIFO_BATCH       16
+#define DEADLINE_WRITES_STARVED   2
+
+struct blkdev;
+struct blk_request;
+struct blk_reserve;
+
+// One I/O from a consumer: a contiguous run of blocks and a buffer
+typedef struct bio {
+    uint64_t sector;            // In device blocks
+    uint32_t count;             // Blocks
+    uint8_t* buffer;            // Physically contiguous, count * block_size bytes
+    uint8_t  op;                // BIO_*
+    uint8_t  flags;             // BIO_FUA
+    volatile uint8_t status;    // BIO_PENDING, BIO_DONE or BIO_ERROR
+    void   (*end_io)(struct bio* bio); // Called from IRQ context
+    void*    private_data;
+    struct blkdev* dev;         // Set by blk_submit_bio()
+    struct bio* next;           // Next bio in the same request
+} bio_t;
+
+// Scatter list entry handed to drivers
+typedef struct {
+    uint32_t addr;
+    uint32_t length;
+} blk_sg_t;
+
+// A dispatch unit: one or more merged bios covering adjacent blocks
+typedef struct blk_request {
+    struct blkdev* dev;
+    uint8_t  op;
+    uint8_t  flags;
+    uint16_t tag;               // Pool index; drivers key per-request state on it
+    struct blk_reserve* reserve;    // Where it goes when freed; NULL: shared pool
+    uint64_t sector;
+    uint32_t count;
+    bio_t*   bio_head;
+    bio_t*   bio_tail;
+    blk_sg_t sg[BLK_MAX_SEGMENTS];
+    uint32_t nsg;
+    uint32_t deadline;          // timer_ticks() by which it should be dispatched
+    uint32_t start;             // timer_cycles() at dispatch
+    struct blk_request* fifo_next;  // Arrival order
+    struct blk_request* fifo_prev;
+    struct blk_request* sort_next;  // Sector order (deadline)
+    struct blk_request* sort_prev;
+} blk_request_t;
+
+// Requests set aside from the pool for one submitter, so that it can
+// queue bios from completion context without waiting for a free request
+typedef struct blk_reserve {
+    blk_request_t* free;        // Chained through fifo_next
+    uint32_t count;             // Requests owned
+} blk_reserve_t;
+
+// Per-device I/O statistics, indexed by BIO_* where split by operation.
+// Times are in microseconds (milliseconds resolution without a TSC).
+typedef struct {
+    uint32_t ios[3];            // Completed requests
+    uint64_t sectors[2];        // Blocks read and written
+    uint32_t merges[2];         // Bios merged into a queued request
+    uint32_t errors;
+    uint64_t busy_us;           // Time with at least one request in flight
+    uint64_t queue_us;          // In-flight requests integrated over time
+    uint32_t max_inflight;
+    uint32_t latency[3][BLK_LAT_BUCKETS];   // Dispatch to completion, log2 us
+    uint32_t last_cycles;       // timer_cycles() at the last in-flight change
+    uint32_t last_ticks;        // timer_ticks() at the same point
+} blk_stats_t;
+
+// Driver entry points
+typedef struct blkdev_ops {
+    // Start a request; the driver calls blk_end_request() when it finishes
+    void (*submit)(struct blkdev* dev, blk_request_t* req);
+    // Optional: notify the hardware once after a batch of submits
+    void (*commit)(struct blkdev* dev);
+    // Optional: reap completions without waiting for the interrupt.
+    // Called with interrupts disabled; returns the number reaped.
+    int  (*poll)(struct blkdev* dev);
+    // Optional: a waiter has seen no progress for BLK_TIMEOUT_MS. Reap a
+    // lost completion, or abort and fail the requests that are stuck.
+    // Called from thread context with interrupts disabled; without it the
+    // block layer falls back to poll.
+    void (*timeout)(struct blkdev* dev);
+} blkdev_ops_t;
+
+// Scheduler state; each elevator uses the lists it needs (index = op)
+typedef struct {
+    blk_request_t* fifo_head[2];
+    blk_request_t* fifo_tail[2];
+    blk_request_t* sort_head[2];
+    uint64_t next_sector;       // Where the last dispatch ended
+    uint8_t  batch_dir;
+    uint32_t batch;             // Requests dispatched in the current batch
+    uint32_t starved;           // Read batches run while writes waited
+} elevator_queue_t;
+
+// I/O scheduler
+typedef struct elevator_ops {
+    const char* name;
+    void (*init)(struct blkdev* dev);
+    // Queued request that bio can be appended to (front = 0) or prepended
+    // to (front = 1), or NULL
+    blk_request_t* (*find_merge)(struct blkdev* dev, bio_t* bio, int* front);
+    void (*add)(struct blkdev* dev, blk_request_t* req);
+    // A queued request grew; front merges moved its start sector
+    void (*merged)(struct blkdev* dev, blk_request_t* req, int front);
+    // Remove and return the next request to dispatch, or NULL
+    blk_request_t* (*dispatch)(struct blkdev* dev);
+} elevator_ops_t;
+
+// Registered block device with its request queue
+typedef struct blkdev {
+    char     name[BLK_NAME_LEN];
+    const blkdev_ops_t* ops;
+    void*    driver_data;
+    uint32_t flags;             // BLKDEV_*
+    uint32_t block_size;        // Bytes per block
+    uint64_t size;              // Blocks
+    uint32_t max_sectors;       // Largest request in blocks
+    uint32_t max_segments;      // Scatter list entries the driver accepts
+    uint32_t queue_depth;       // Requests the driver may hold at once
+    
+    const elevator_ops_t* elevator;
+    elevator_queue_t queue;
+    blk_request_t* flush_head;  // Flushes bypass the elevator
+    blk_request_t* flush_tail;
+    uint32_t queued;
+    uint32_t inflight;
+    uint32_t plugged;           // Dispatch held back while > 0
+    uint8_t  dispatching;       // Guards against re-entry from completions
+    
+    uint8_t  poll_mode;         // BLK_POLL_*
+    uint8_t  polling;           // Completions now come from ops->poll
+    uint32_t mean_us;           // Recent mean service time, 0 before any
+    uint32_t polled;            // Requests completed by polling
+    uint32_t latency[2][BLK_LAT_BUCKETS];   // Service times under each poll mode
+    blk_stats_t stats;
+} blkdev_t;
+
+extern const elevator_ops_t elevator_noop;
+extern const elevator_ops_t elevator_deadline;
+
+// Function prototypes
+void init_blkdev(void);
+blkdev_t* blk_register(const char* prefix, const blkdev_ops_t* ops, void* driver_data,
+                       uint32_t block_size, uint64_t size, uint32_t flags);
+int blk_get_device_count(void);
+blkdev_t* blk_get_device(int index);
+blkdev_t* blk_find_device(const char* name);
+int blk_set_elevator(blkdev_t* dev, const char* name);
+int blk_set_poll_mode(blkdev_t* dev, uint8_t mode);
+void blk_reset_latency(blkdev_t* dev);
+void blk_print_latency(blkdev_t* dev);
+void blk_reset_stats(blkdev_t* dev);
+void blk_dump_stats(void);
+int blk_can_merge(blkdev_t* dev, blk_request_t* req, bio_t* bio, int front);
+void blk_submit_bio(blkdev_t* dev, bio_t* bio);
+int blk_reserve_init(blk_reserve_t* reserve, uint32_t count);
+void blk_reserve_release(blk_reserve_t* reserve);
+void blk_submit_bio_reserved(blkdev_t* dev, bio_t* bio, blk_reserve_t* reserve);
+uint8_t blk_wait_bio(bio_t* bio);
+void blk_timeout(blkdev_t* dev);
+void blk_plug(blkdev_t* dev);
+void blk_unplug(blkdev_t* dev);
+void blk_end_request(blk_request_t* req, int error);
+uint8_t blk_read(blkdev_t* dev, uint64_t sector, uint32_t count, void* buffer);
+uint8_t blk_write(blkdev_t* dev, uint64_t sector, uint32_t count, const void* buffer);
+uint8_t blk_write_fua(blkdev_t* dev, uint64_t sector, uint32_t count, const void* buffer);
+uint8_t blk_flush(blkdev_t* dev);
+void blk_print_devices(void);
+
+#endif
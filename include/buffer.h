@@ -0,0 +1,94 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include "kernel.h"
+#include "blkdev.h"
+
+// Cache geometry
+#define BCACHE_BUFFERS          256     // Cached blocks
+#define BCACHE_BLOCK_SIZE       4096    // Largest device block size cached
+#define BCACHE_HASH_SIZE        512     // Hash buckets (power of two)
+
+// 2Q tuning: A1in holds first-time blocks, A1out remembers blocks evicted
+// from A1in so a second reference promotes them straight to Am
+#define BCACHE_A1IN_MAX         (BCACHE_BUFFERS / 4)
+#define BCACHE_A1OUT_MAX        (BCACHE_BUFFERS / 2)
+
+// Write-back: dirty blocks older than BCACHE_DIRTY_EXPIRE_MS are written
+// every BCACHE_WRITEBACK_INTERVAL_MS, and everything dirty is written as
+// soon as BCACHE_DIRTY_HIGH blocks are dirty
+#define BCACHE_DIRTY_HIGH       (BCACHE_BUFFERS / 2)
+#define BCACHE_DIRTY_EXPIRE_MS  3000
+#define BCACHE_WRITEBACK_INTERVAL_MS 1000
+
+// Readahead: a stream's window starts at BCACHE_RA_MIN blocks, doubles
+// with every refill up to BCACHE_RA_MAX and halves on a random access
+#define BCACHE_RA_MIN           4
+#define BCACHE_RA_MAX           32
+#define BCACHE_RA_STREAMS       8       // Streams tracked for plain bread()
+
+// Buffer flags
+#define B_VALID                 0x01    // Data matches the disk (or is newer)
+#define B_DIRTY                 0x02    // Data must be written back
+#define B_WRITEBACK             0x04    // Write to the device in progress
+#define B_READING               0x08    // Read from the device in progress
+#define B_READAHEAD             0x10    // Prefetched and not used yet
+
+// Queue a buffer currently sits on
+#define BQ_FREE                 0
+#define BQ_A1IN                 1
+#define BQ_AM                   2
+
+// Cached block
+typedef struct buffer {
+    blkdev_t* dev;
+    uint64_t  block;            // In device blocks
+    uint8_t*  data;             // dev->block_size bytes
+    uint32_t  refcount;         // Holders between bread/bget and brelse
+    uint8_t   flags;            // B_*
+    uint8_t   queue;            // BQ_*
+    uint32_t  dirtied;          // timer_ticks() when it became dirty
+    bio_t     bio;              // Writeback I/O
+    struct buffer* hash_next;
+    struct buffer* hash_prev;
+    struct buffer* lru_next;    // Towards the least recently used end
+    struct buffer* lru_prev;
+} buffer_t;
+
+// Readahead state of one sequential stream, e.g. one per open file
+typedef struct {
+    blkdev_t* dev;
+    uint64_t  next;             // Block a sequential reader asks for next
+    uint64_t  ahead;            // First block not prefetched yet
+    uint32_t  window;           // Blocks per refill, 0 = not sequential
+    uint32_t  used;             // Last use (bread stream table)
+} bcache_ra_t;
+
+// Cache statistics
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t ghost_hits;        // Misses found in A1out (promoted to Am)
+    uint32_t evictions;
+    uint32_t dirty;             // Blocks waiting for writeback
+    uint32_t writebacks;        // Blocks written back
+    uint32_t ra_blocks;         // Blocks prefetched
+    uint32_t ra_hits;           // Prefetched blocks later read
+} bcache_stats_t;
+
+// Function prototypes
+void init_bcache(void);
+buffer_t* bget(blkdev_t* dev, uint64_t block);
+buffer_t* bread(blkdev_t* dev, uint64_t block);
+buffer_t* bread_ra(blkdev_t* dev, uint64_t block, bcache_ra_t* ra);
+void bcache_ra_init(bcache_ra_t* ra);
+uint8_t bwrite(buffer_t* buf);
+uint8_t bwrite_fua(buffer_t* buf);
+void bdwrite(buffer_t* buf);
+void brelse(buffer_t* buf);
+void bcache_invalidate(blkdev_t* dev);
+uint8_t bcache_sync(blkdev_t* dev);
+void bcache_periodic(void);
+void bcache_get_stats(bcache_stats_t* stats);
+
+#endif
@@ -27,6 +27,47 @@
 #define ATA_REG_CONTROL      0x0C
 #define ATA_REG_ALTSTATUS    0x0C
 
+// Device control register bits
+#define ATA_CTRL_NIEN        0x02   // Disable interrupts
+#define ATA_CTRL_SRST        0x04   // Software reset
+#define ATA_CTRL_HOB         0x80   // High order byte (LBA48)
+
+// Bus Master IDE registers (offsets from BAR4, +8 for the secondary channel)
+#define BMIDE_REG_COMMAND    0x00
+#define BMIDE_REG_STATUS     0x02
+#define BMIDE_REG_PRDT       0x04
+
+// Bus master command bits
+#define BMIDE_CMD_START      0x01
+#define BMIDE_CMD_READ       0x08   // Device to memory
+
+// Bus master status bits
+#define BMIDE_SR_ACTIVE      0x01
+#define BMIDE_SR_ERR         0x02
+#define BMIDE_SR_IRQ         0x04
+
+// PCI programming interface bit: controller supports bus mastering
+#define IDE_PROGIF_BUS_MASTER 0x80
+
+// Physical Region Descriptors per channel (enough for a contiguous
+// 65536-sector LBA48 transfer split at 64K boundaries)
+#define IDE_PRD_ENTRIES      512
+#define IDE_PRD_EOT          0x8000
+
+// Largest transfer of a single command (sector count 0 means 256/65536)
+#define IDE_MAX_SECTORS      256
+#define IDE_MAX_SECTORS_LBA48 65536
+
+// First sector that cannot be addressed with LBA28
+#define IDE_LBA28_LIMIT      0x10000000ULL
+
+// Give up waiting for an interrupt after this long and read status instead
+#define IDE_IRQ_TIMEOUT_MS   5000
+
+// Give up on a drive that stays busy for this many status reads (about
+// 1 s at ISA timing); used where the timer may not be ticking
+#define IDE_BUSY_POLLS       1000000
+
 // Status register bits
 #define ATA_SR_BSY           0x80
 #define ATA_SR_DRDY          0x40
@@ -52,6 +93,15 @@
 #define ATA_CMD_READ_PIO_EXT 0x24
 #define ATA_CMD_WRITE_PIO    0x30
 #define ATA_CMD_WRITE_PIO_EXT 0x34
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_DMA     0xC8
+#define ATA_CMD_WRITE_DMA    0xCA
+#define ATA_CMD_READ_MULTIPLE  0xC4
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_SET_MULTIPLE   0xC6
 #define ATA_CMD_CACHE_FLUSH  0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT 0xEA
 #define ATA_CMD_PACKET       0xA0
@@ -59,9 +109,17 @@
 #define ATA_CMD_IDENTIFY     0xEC
 
 // ATAPI Commands
-#define ATAPI_CMD_READ       0xA8
+#define ATAPI_CMD_READ       0xA8   // READ(12)
+#define ATAPI_CMD_READ_CAPACITY 0x25
 #define ATAPI_CMD_EJECT      0x1B
 
+// ATAPI packet interface
+#define ATAPI_PACKET_SIZE    12
+#define ATAPI_SECTOR_SIZE    2048
+#define ATAPI_FEATURE_DMA    0x01   // Features register: data phase by DMA
+#define ATAPI_BYTE_COUNT_LIMIT 0xF800 // Largest PIO DRQ block, 31 sectors
+#define IDE_ATAPI_MAX_SECTORS 1024  // 2 MiB per READ(12)
+
 // Device types
 #define IDE_ATA              0x00
 #define IDE_ATAPI            0x01
@@ -75,15 +133,79 @@ typedef struct {
     uint16_t signature;    // Drive signature
     uint16_t capabilities; // Features
     uint32_t command_sets; // Supported command sets
-    uint32_t size;         // Size in sectors
+    uint64_t size;         // Size in sectors
+    uint16_t sector_size;  // 512 (ATA) or 2048 (ATAPI)
+    uint16_t multiple;     // Sectors per DRQ block for READ/WRITE MULTIPLE (0 = off)
+    uint8_t  dma;          // Bus master DMA usable
+    uint8_t  lba48;        // 48-bit addressing supported
     char     model[41];    // Model string
 } ide_device_t;
 
+// Physical Region Descriptor (bus master DMA)
+typedef struct __attribute__((packed)) {
+    uint32_t addr;         // Physical address of the region
+    uint16_t count;        // Byte count (0 = 64K)
+    uint16_t flags;        // Bit 15: end of table
+} ide_prd_t;
+
+// Scatter list entry for DMA transfers
+typedef struct {
+    uint32_t addr;         // Physical address
+    uint32_t length;       // Length in bytes (even)
+} ide_sg_t;
+
+// Request operations
+#define IDE_OP_READ          0
+#define IDE_OP_WRITE         1
+#define IDE_OP_FLUSH         2
+#define IDE_OP_PACKET        3      // ATAPI command with data in
+
+// Request status
+#define IDE_REQ_QUEUED       0
+#define IDE_REQ_ACTIVE       1
+#define IDE_REQ_DONE         2
+#define IDE_REQ_ERROR        3
+
+// Channel state machine
+#define IDE_STATE_IDLE       0
+#define IDE_STATE_PIO_READ   1
+#define IDE_STATE_PIO_WRITE  2
+#define IDE_STATE_DMA        3
+#define IDE_STATE_NODATA     4
+#define IDE_STATE_PACKET     5      // ATAPI PIO data phase
+
+// Asynchronous request, queued per channel with ide_submit()
+typedef struct ide_request {
+    uint8_t  channel;      // 0 (Primary) or 1 (Secondary)
+    uint8_t  drive;        // 0 (Master) or 1 (Slave)
+    uint8_t  op;           // IDE_OP_*
+    volatile uint8_t status; // IDE_REQ_*
+    uint64_t lba;
+    uint32_t count;        // Sectors (ignored when sg is set)
+    const uint8_t* packet; // IDE_OP_PACKET: ATAPI_PACKET_SIZE command bytes
+    uint32_t length;       // IDE_OP_PACKET: bytes to read into buffer
+    uint8_t* buffer;       // Flat buffer, or NULL when sg is set
+    const ide_sg_t* sg;    // Scatter list (DMA only)
+    int      nsg;
+    void   (*complete)(struct ide_request* req); // Called from IRQ context
+    void*    private_data;
+    struct ide_request* next;
+} ide_request_t;
+
 // Function prototypes
 void init_ide(void);
 void ide_detect_devices(void);
-uint8_t ide_read_sector(uint8_t channel, uint8_t drive, uint32_t lba, uint8_t* buffer);
-uint8_t ide_write_sector(uint8_t channel, uint8_t drive, uint32_t lba, uint8_t* buffer);
+uint8_t ide_read_sector(uint8_t channel, uint8_t drive, uint64_t lba, uint8_t* buffer);
+uint8_t ide_write_sector(uint8_t channel, uint8_t drive, uint64_t lba, uint8_t* buffer);
+uint8_t ide_read_sectors(uint8_t channel, uint8_t drive, uint64_t lba, uint32_t count, uint8_t* buffer);
+uint8_t ide_write_sectors(uint8_t channel, uint8_t drive, uint64_t lba, uint32_t count, uint8_t* buffer);
+uint8_t ide_flush(uint8_t channel, uint8_t drive);
+void ide_submit(ide_request_t* req);
+uint8_t ide_wait(ide_request_t* req);
+uint8_t ide_transfer_sg(uint8_t channel, uint8_t drive, uint64_t lba,
+                        const ide_sg_t* sg, int nsg, int write);
+uint8_t ide_atapi_packet(uint8_t channel, uint8_t drive, const uint8_t* packet,
+                         uint8_t* buffer, uint32_t length);
 void ide_print_devices(void);
 int ide_get_device_count(void);
 ide_device_t* ide_get_device(int index);
@@ -0,0 +1,85 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include "kernel.h"
+
+// 8259A PIC ports
+#define PIC1_COMMAND         0x20
+#define PIC1_DATA            0x21
+#define PIC2_COMMAND         0xA0
+#define PIC2_DATA            0xA1
+
+// PIC commands
+#define PIC_CMD_INIT         0x11   // ICW1: initialize, ICW4 needed
+#define PIC_CMD_EOI          0x20
+#define PIC_CMD_READ_ISR     0x0B
+
+// IDT vector of IRQ 0 after remapping (vectors 0-31 belong to CPU exceptions)
+#define IRQ_VECTOR_BASE      0x20
+#define IRQ_LINES            16
+#define IRQ_MAX_SHARED       4      // Handlers per line (PCI INTx lines are shared)
+
+// Local APIC. It receives message signalled interrupts; the PIC keeps
+// delivering INTx lines through LINT0 (virtual wire mode).
+#define LAPIC_BASE_MSR       0x1B
+#define LAPIC_BASE_ENABLE    0x800
+#define LAPIC_REG_ID         0x020
+#define LAPIC_REG_TPR        0x080
+#define LAPIC_REG_EOI        0x0B0
+#define LAPIC_REG_SVR        0x0F0
+#define LAPIC_REG_LVT_LINT0  0x350
+#define LAPIC_REG_LVT_LINT1  0x360
+#define LAPIC_SVR_ENABLE     0x100
+#define LAPIC_LVT_EXTINT     0x700
+#define LAPIC_LVT_NMI        0x400
+
+// Message signalled interrupts get their own vectors, one per source, so
+// they are never shared and need only a local APIC EOI
+#define MSI_VECTOR_BASE      0x30
+#define MSI_VECTORS          32
+#define IRQ_SPURIOUS_VECTOR  0xFF
+#define MSI_ADDRESS_BASE     0xFEE00000 // Destination APIC ID in bits 19:12
+#define IRQ_MAX_CPUS         1      // HueOS runs on the boot CPU only
+
+// Well-known ISA IRQ lines
+#define IRQ_TIMER            0
+#define IRQ_CASCADE          2
+#define IRQ_ATA_PRIMARY      14
+#define IRQ_ATA_SECONDARY    15
+
+typedef void (*irq_handler_t)(uint8_t irq);
+typedef void (*msi_handler_t)(void* data);
+
+// Function prototypes
+void init_irq(void);
+void irq_install_handler(uint8_t irq, irq_handler_t handler);
+void irq_uninstall_handler(uint8_t irq, irq_handler_t handler);
+void irq_dispatch(uint32_t irq);
+int irq_in_handler(void);
+int msi_supported(void);
+int msi_alloc_vector(msi_handler_t handler, void* data);
+void msi_free_vector(uint8_t vector);
+void msi_compose(uint8_t vector, uint8_t cpu, uint32_t* address, uint32_t* data);
+void msi_dispatch(uint32_t vector);
+
+// Disable interrupts and return the previous EFLAGS
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    asm volatile ("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Restore the interrupt flag saved by irq_save()
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200)
+        asm volatile ("sti" : : : "memory");
+}
+
+// Atomically enable interrupts and halt until the next one arrives, then
+// disable interrupts again. The STI shadow guarantees no interrupt can slip
+// in between the caller's condition check and the HLT.
+static inline void irq_wait(void) {
+    asm volatile ("sti; hlt; cli" : : : "memory");
+}
+
+#endif
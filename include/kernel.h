@@ -60,10 +60,18 @@ struct multiboot_mmap_entry {
 void kernel_main(uint32_t magic, struct multiboot_info* mbi);
 void init_gdt(void);
 void init_idt(void);
+void init_irq(void);
+void init_timer(void);
 void init_memory(struct multiboot_info* mbi);
 void init_hyperv(void);
 void init_serial(void);
+void init_pci(void);
 void init_ide(void);
+void init_blkdev(void);
+void blk_print_devices(void);
+void blk_dump_stats(void);
+void init_bcache(void);
+void bcache_periodic(void);
 void init_hwinfo(void);
 void init_vesa(const char* cmdline);
 void init_vesa_with_mbi(const char* cmdline, struct multiboot_info* mbi);
@@ -84,14 +92,33 @@ void terminal_set_dimensions(size_t width, size_t height);
 void terminal_get_dimensions(size_t* width, size_t* height);
 void serial_write(const char* data);
 void serial_writechar(char c);
+void serial_write_hex(uint32_t value);
 void ide_detect_devices(void);
 void ide_print_devices(void);
+void init_ahci(void);
+void ahci_print_devices(void);
+void init_nvme(void);
+void nvme_print_devices(void);
+void init_virtio_blk(void);
+void virtio_blk_print_devices(void);
 void init_scsi(void);
 void scsi_scan_devices(void);
 void scsi_print_devices(void);
+void init_raid(const char* cmdline);
+void bench_run_cmdline(const char* cmdline);
 void print_detailed_hardware_info(void);
 void print_memory_map(struct multiboot_info* mbi);
 
+// Kernel heap and memory helpers
+void* kmalloc(size_t size);
+void* kmalloc_aligned(size_t size, size_t align);
+uint32_t allocate_frame(void);
+void* memset(void* dest, int value, size_t count);
+void* memcpy(void* dest, const void* src, size_t count);
+int memcmp(const void* a, const void* b, size_t count);
+int strcmp(const char* a, const char* b);
+void format_number(uint32_t value, char* str);
+
 // Global verbose mode flag
 extern int kernel_verbose_mode;
 
@@ -126,6 +153,40 @@ static inline uint32_t inl(uint16_t port) {
     return ret;
 }
 
+// String port I/O: move count words between a port and memory
+static inline void insw(uint16_t port, void* buffer, uint32_t count) {
+    asm volatile ("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* buffer, uint32_t count) {
+    asm volatile ("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+// Memory-mapped I/O (paging is off, so physical addresses are used directly)
+static inline uint8_t mmio_read8(uintptr_t addr) {
+    return *(volatile uint8_t*)addr;
+}
+
+static inline void mmio_write8(uintptr_t addr, uint8_t val) {
+    *(volatile uint8_t*)addr = val;
+}
+
+static inline uint16_t mmio_read16(uintptr_t addr) {
+    return *(volatile uint16_t*)addr;
+}
+
+static inline void mmio_write16(uintptr_t addr, uint16_t val) {
+    *(volatile uint16_t*)addr = val;
+}
+
+static inline uint32_t mmio_read32(uintptr_t addr) {
+    return *(volatile uint32_t*)addr;
+}
+
+static inline void mmio_write32(uintptr_t addr, uint32_t val) {
+    *(volatile uint32_t*)addr = val;
+}
+
 // Memory management
 #define PAGE_SIZE 4096
 #define KERNEL_VIRTUAL_BASE 0xC0000000
@@ -0,0 +1,134 @@
+#ifndef NVME_H
+#define NVME_H
+
+#include "kernel.h"
+
+// PCI class of an NVMe controller: Mass Storage / NVM / NVMe
+#define NVME_PCI_CLASS          0x01
+#define NVME_PCI_SUBCLASS       0x08
+#define NVME_PCI_PROGIF         0x02
+
+// Controller registers (offsets from BAR0)
+#define NVME_REG_CAP            0x00    // 64-bit
+#define NVME_REG_VS             0x08
+#define NVME_REG_INTMS          0x0C
+#define NVME_REG_INTMC          0x10
+#define NVME_REG_CC             0x14
+#define NVME_REG_CSTS           0x1C
+#define NVME_REG_AQA            0x24
+#define NVME_REG_ASQ            0x28    // 64-bit
+#define NVME_REG_ACQ            0x30    // 64-bit
+#define NVME_REG_DOORBELL       0x1000
+
+// CC bits
+#define NVME_CC_EN              (1u << 0)
+#define NVME_CC_IOSQES          (6u << 16)  // 64-byte submission entries
+#define NVME_CC_IOCQES          (4u << 20)  // 16-byte completion entries
+
+// CSTS bits
+#define NVME_CSTS_RDY           (1u << 0)
+#define NVME_CSTS_CFS           (1u << 1)
+
+// Admin commands
+#define NVME_ADMIN_CREATE_SQ    0x01
+#define NVME_ADMIN_CREATE_CQ    0x05
+#define NVME_ADMIN_IDENTIFY     0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+// Feature identifiers
+#define NVME_FEAT_NUM_QUEUES    0x07
+
+// I/O commands
+#define NVME_CMD_FLUSH          0x00
+#define NVME_CMD_WRITE          0x01
+#define NVME_CMD_READ           0x02
+
+// Read/write CDW12 bits
+#define NVME_RW_FUA             (1u << 30)
+
+// Driver limits
+#define NVME_ADMIN_QUEUE_DEPTH  32
+#define NVME_IO_QUEUE_DEPTH     64      // Reduced to CAP.MQES + 1 if smaller
+#define NVME_MAX_CPUS           1       // HueOS runs on the boot CPU only
+#define NVME_MAX_DEVICES        4
+#define NVME_PRP_ENTRIES        (PAGE_SIZE / 8)
+#define NVME_TIMEOUT_MS         5000
+
+// Request operations
+#define NVME_OP_READ            0
+#define NVME_OP_WRITE           1
+#define NVME_OP_FLUSH           2
+
+// Request flags
+#define NVME_REQ_FUA            0x01
+
+// Request status
+#define NVME_REQ_QUEUED         0
+#define NVME_REQ_ACTIVE         1
+#define NVME_REQ_DONE           2
+#define NVME_REQ_ERROR          3
+
+// Submission queue entry
+typedef struct __attribute__((packed)) {
+    uint32_t cdw0;              // Opcode [7:0], command identifier [31:16]
+    uint32_t nsid;
+    uint32_t cdw2;
+    uint32_t cdw3;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} nvme_sqe_t;
+
+// Completion queue entry
+typedef struct __attribute__((packed)) {
+    uint32_t dw0;
+    uint32_t dw1;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    volatile uint16_t status;   // Bit 0: phase tag
+} nvme_cqe_t;
+
+// Asynchronous request
+typedef struct nvme_request {
+    uint8_t  device;            // Index into the NVMe namespace table
+    uint8_t  op;                // NVME_OP_*
+    uint8_t  flags;             // NVME_REQ_FUA
+    volatile uint8_t status;    // NVME_REQ_*
+    uint64_t lba;               // In namespace blocks
+    uint32_t count;             // Blocks
+    uint8_t* buffer;            // Physically contiguous buffer
+    void   (*complete)(struct nvme_request* req); // Called from IRQ context
+    void*    private_data;
+    struct nvme_request* next;
+} nvme_request_t;
+
+// Namespace exposed as a disk
+typedef struct {
+    uint32_t nsid;
+    uint32_t block_size;        // Bytes per logical block
+    uint64_t size;              // Size in logical blocks
+    uint32_t max_blocks;        // Largest transfer in blocks
+    char     model[41];
+} nvme_device_t;
+
+// Function prototypes
+void init_nvme(void);
+void nvme_print_devices(void);
+int nvme_get_device_count(void);
+nvme_device_t* nvme_get_device(int index);
+void nvme_queue_request(nvme_request_t* req);
+void nvme_commit(void);
+void nvme_submit(nvme_request_t* req);
+uint8_t nvme_wait(nvme_request_t* req);
+uint8_t nvme_read_blocks(uint8_t device, uint64_t lba, uint32_t count, uint8_t* buffer);
+uint8_t nvme_write_blocks(uint8_t device, uint64_t lba, uint32_t count, uint8_t* buffer);
+uint8_t nvme_flush(uint8_t device);
+
+#endif
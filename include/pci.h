@@ -0,0 +1,119 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include "kernel.h"
+
+// Configuration space registers
+#define PCI_REG_VENDOR_ID           0x00    // 16-bit; device ID at 0x02
+#define PCI_REG_COMMAND             0x04    // 16-bit
+#define PCI_REG_STATUS              0x06    // 16-bit
+#define PCI_REG_CLASS_REV           0x08    // Class, subclass, prog IF, revision
+#define PCI_REG_HEADER_TYPE         0x0E
+#define PCI_REG_BAR0                0x10
+#define PCI_REG_SECONDARY_BUS       0x19    // Type 1 (bridge) header
+#define PCI_REG_SUBSYSTEM           0x2C    // Vendor, ID; type 0 header
+#define PCI_REG_CAP_PTR             0x34
+#define PCI_REG_INTERRUPT_LINE      0x3C
+#define PCI_REG_EXT_CAP             0x100   // First PCIe extended capability
+
+#define PCI_CONFIG_SPACE_SIZE       256
+#define PCI_EXT_CONFIG_SPACE_SIZE   4096    // PCIe, reachable through ECAM
+
+#define PCI_HEADER_TYPE_MASK        0x7F
+#define PCI_HEADER_MULTIFUNCTION    0x80
+#define PCI_HEADER_BRIDGE           0x01
+
+#define PCI_COMMAND_IO              0x0001
+#define PCI_COMMAND_MEMORY          0x0002
+#define PCI_COMMAND_MASTER          0x0004
+#define PCI_COMMAND_INTX_DISABLE    0x0400
+#define PCI_STATUS_CAP_LIST         0x0010
+
+// Capability IDs
+#define PCI_CAP_ID_MSI              0x05
+#define PCI_CAP_ID_VENDOR           0x09
+#define PCI_CAP_ID_EXP              0x10    // PCI Express
+#define PCI_CAP_ID_MSIX             0x11
+
+// MSI capability (offsets from the capability)
+#define PCI_MSI_CONTROL             0x02    // 16-bit
+#define PCI_MSI_ADDRESS             0x04
+#define PCI_MSI_DATA_32             0x08    // 16-bit, 32-bit address format
+#define PCI_MSI_DATA_64             0x0C    // 16-bit, 64-bit address format
+#define PCI_MSI_CTRL_ENABLE         0x0001
+#define PCI_MSI_CTRL_MME_MASK       0x0070  // Messages enabled (log2)
+#define PCI_MSI_CTRL_64BIT          0x0080
+
+// MSI-X capability and table
+#define PCI_MSIX_CONTROL            0x02    // 16-bit
+#define PCI_MSIX_TABLE              0x04    // Offset | BAR indicator
+#define PCI_MSIX_CTRL_SIZE_MASK     0x07FF  // Table entries - 1
+#define PCI_MSIX_CTRL_MASKALL       0x4000
+#define PCI_MSIX_CTRL_ENABLE        0x8000
+#define PCI_MSIX_ENTRY_SIZE         16
+#define PCI_MSIX_ENTRY_ADDR_LO      0x00
+#define PCI_MSIX_ENTRY_ADDR_HI      0x04
+#define PCI_MSIX_ENTRY_DATA         0x08
+#define PCI_MSIX_ENTRY_CTRL         0x0C
+#define PCI_MSIX_ENTRY_MASKED       0x0001
+
+// Enumeration limits
+#define PCI_MAX_DEVICES             64
+#define PCI_MAX_CAPS                16      // Capabilities remembered per function
+#define PCI_ANY_ID                  0xFFFF
+
+// One function found by init_pci(). Everything a driver needs to match
+// and map it is read once at boot.
+typedef struct {
+    uint8_t  bus;
+    uint8_t  slot;
+    uint8_t  func;
+    uint8_t  header_type;           // Without the multifunction bit
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint16_t subsystem_vendor;      // Type 0 header only
+    uint16_t subsystem_id;
+    uint8_t  class_code;
+    uint8_t  subclass;
+    uint8_t  prog_if;
+    uint8_t  revision;
+    uint8_t  irq;                   // INTx line from firmware
+    uint8_t  secondary_bus;         // Bridges only
+    uint32_t bar[6];                // Raw BAR values; bridges have two
+    uint16_t config_size;           // PCI_EXT_CONFIG_SPACE_SIZE with ECAM
+    uint8_t  ncaps;
+    uint8_t  cap_id[PCI_MAX_CAPS];
+    uint8_t  cap_offset[PCI_MAX_CAPS];
+} pci_device_t;
+
+// MSI-X state of one function
+typedef struct {
+    pci_device_t* dev;
+    uint8_t   cap;                  // Capability offset
+    uintptr_t table;                // Mapped vector table
+    uint16_t  size;                 // Table entries
+} pci_msix_t;
+
+// Function prototypes
+uint32_t pci_config_read32(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset);
+uint16_t pci_config_read16(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset);
+uint8_t pci_config_read8(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset);
+void pci_config_write32(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint32_t value);
+void pci_config_write16(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint16_t value);
+void init_pci(void);
+int pci_device_count(void);
+pci_device_t* pci_get_device(int index);
+pci_device_t* pci_find_class(uint8_t class_code, uint8_t subclass, pci_device_t* from);
+pci_device_t* pci_find_id(uint16_t vendor_id, uint16_t device_id, pci_device_t* from);
+uint8_t pci_find_capability(pci_device_t* dev, uint8_t id);
+uint16_t pci_find_ext_capability(pci_device_t* dev, uint16_t id);
+uint32_t pci_bar_memory(pci_device_t* dev, int bar);
+uint16_t pci_bar_io(pci_device_t* dev, int bar);
+void pci_enable_device(pci_device_t* dev, uint16_t command);
+int pci_enable_msi(pci_device_t* dev, uint8_t vector, uint8_t cpu);
+int pci_msix_init(pci_msix_t* msix, pci_device_t* dev);
+void pci_msix_set_vector(pci_msix_t* msix, uint16_t entry, uint8_t vector, uint8_t cpu);
+void pci_msix_enable(pci_msix_t* msix);
+void pci_msix_disable(pci_msix_t* msix);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef RAID_H
+#define RAID_H
+
+#include "kernel.h"
+#include "blkdev.h"
+
+// RAID levels
+#define RAID_LEVEL_0            0       // Striping
+#define RAID_LEVEL_1            1       // Mirroring
+
+// Limits
+#define RAID_MAX_ARRAYS         2
+#define RAID_MAX_MEMBERS        4
+#define RAID_MAX_PIECES         8       // Member bios per array request
+#define RAID_QUEUE_DEPTH        4       // Array requests in flight
+#define RAID_DEFAULT_CHUNK_KB   64
+
+// Member requests set aside per array: one per member bio in flight, plus
+// one for a failed request that is still held while its read is retried
+#define RAID_RESERVE            (RAID_QUEUE_DEPTH * RAID_MAX_PIECES + 1)
+
+// One array request being served by its members
+typedef struct {
+    blk_request_t* req;         // NULL while the slot is free
+    uint32_t pending;           // Member bios not yet completed
+    uint8_t  error;
+    uint8_t  npieces;
+    uint8_t  member[RAID_MAX_PIECES];
+    uint8_t  tries[RAID_MAX_PIECES];    // Mirrors tried by a RAID-1 read
+    bio_t    bios[RAID_MAX_PIECES];
+} raid_io_t;
+
+// Striped or mirrored set of block devices, registered as md<n>
+typedef struct raid_array {
+    blkdev_t* dev;
+    uint8_t   level;            // RAID_LEVEL_*
+    uint8_t   nmembers;
+    uint8_t   active;           // Members not failed
+    uint8_t   chunk_shift;      // log2 of the chunk size in blocks
+    blkdev_t* members[RAID_MAX_MEMBERS];
+    uint8_t   failed[RAID_MAX_MEMBERS];
+    uint32_t  inflight[RAID_MAX_MEMBERS];   // Member bios outstanding
+    uint64_t  head[RAID_MAX_MEMBERS];       // Where the last bio ended
+    raid_io_t io[RAID_QUEUE_DEPTH];
+    blk_reserve_t reserve;      // Requests for member bios
+} raid_array_t;
+
+// Function prototypes
+void init_raid(const char* cmdline);
+blkdev_t* raid_create(uint8_t level, blkdev_t** members, int count, uint32_t chunk_kb);
+
+#endif
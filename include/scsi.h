@@ -29,8 +29,15 @@
 #define SCSI_CMD_READ_10            0x28
 #define SCSI_CMD_WRITE_10           0x2A
 #define SCSI_CMD_VERIFY_10          0x2F
+#define SCSI_CMD_SYNC_CACHE_10      0x35
 #define SCSI_CMD_READ_16            0x88
 #define SCSI_CMD_WRITE_16           0x8A
+#define SCSI_CMD_SERVICE_IN_16      0x9E    // Service action 0x10: READ CAPACITY (16)
+#define SCSI_SAI_READ_CAPACITY_16   0x10
+#define SCSI_CMD_REPORT_LUNS        0xA0
+
+// LUN bits of CDB byte 1 (SCSI-2); reserved for LUNs above 7
+#define SCSI_CDB_LUN(lun)           ((uint8_t)((lun) < 8 ? (lun) << 5 : 0))
 
 // BusLogic PCI IDs
 #define BUSLOGIC_VENDOR_ID          0x104B
@@ -44,50 +51,217 @@
 // Controller Types
 #define SCSI_CONTROLLER_BUSLOGIC    0x01
 #define SCSI_CONTROLLER_LSI_LOGIC   0x02
-
-// BusLogic Mailbox Commands
-#define BUSLOGIC_MBOX_CMD_FREE      0x00
-#define BUSLOGIC_MBOX_CMD_START     0x01
-#define BUSLOGIC_MBOX_CMD_ABORT     0x02
-
-// BusLogic Status Codes
-#define BUSLOGIC_STATUS_FREE        0x00
-#define BUSLOGIC_STATUS_SUCCESS     0x01
-#define BUSLOGIC_STATUS_ABORTED     0x02
-#define BUSLOGIC_STATUS_NOT_FOUND   0x03
-#define BUSLOGIC_STATUS_INVALID     0x04
+#define SCSI_CONTROLLER_VIRTIO      0x03
 
 // BusLogic Registers (I/O Port Offsets)
-#define BUSLOGIC_REG_CONTROL        0x00
-#define BUSLOGIC_REG_STATUS         0x00
-#define BUSLOGIC_REG_COMMAND        0x01
-#define BUSLOGIC_REG_DATA_IN        0x01
+#define BUSLOGIC_REG_CONTROL        0x00    // Write
+#define BUSLOGIC_REG_STATUS         0x00    // Read
+#define BUSLOGIC_REG_COMMAND        0x01    // Write: command and parameter bytes
+#define BUSLOGIC_REG_DATA_IN        0x01    // Read: reply bytes
 #define BUSLOGIC_REG_INTERRUPT      0x02
 #define BUSLOGIC_REG_GEOMETRY       0x03
 
+// Control Register Bits
+#define BUSLOGIC_CTRL_BUS_RESET     0x10
+#define BUSLOGIC_CTRL_INT_RESET     0x20
+#define BUSLOGIC_CTRL_SOFT_RESET    0x40
+#define BUSLOGIC_CTRL_HARD_RESET    0x80
+
 // Status Register Bits
 #define BUSLOGIC_STATUS_CMD_INVALID 0x01
-#define BUSLOGIC_STATUS_RESERVED    0x02
-#define BUSLOGIC_STATUS_CMD_PARAM   0x04
-#define BUSLOGIC_STATUS_HOST_READY  0x08
-#define BUSLOGIC_STATUS_INIT_REQ    0x10
-#define BUSLOGIC_STATUS_DIAG_FAIL   0x20
-#define BUSLOGIC_STATUS_DIAG_ACTIVE 0x40
-#define BUSLOGIC_STATUS_HARD_RESET  0x80
-
-// Control Register Commands
-#define BUSLOGIC_CTRL_HARD_RESET    0x40
-#define BUSLOGIC_CTRL_SOFT_RESET    0x80
+#define BUSLOGIC_STATUS_DATA_READY  0x04    // Reply byte waiting in DATA_IN
+#define BUSLOGIC_STATUS_PARAM_BUSY  0x08    // Command/parameter register full
+#define BUSLOGIC_STATUS_HOST_READY  0x10
+#define BUSLOGIC_STATUS_INIT_REQ    0x20    // Mailboxes not initialized
+#define BUSLOGIC_STATUS_DIAG_FAIL   0x40
+#define BUSLOGIC_STATUS_DIAG_ACTIVE 0x80
+
+// Interrupt Register Bits
+#define BUSLOGIC_INT_MBIN_LOADED    0x01    // Incoming mailbox filled
+#define BUSLOGIC_INT_MBOUT_AVAIL    0x02
+#define BUSLOGIC_INT_CMD_COMPLETE   0x04    // Host adapter command finished
+#define BUSLOGIC_INT_BUS_RESET      0x08
+#define BUSLOGIC_INT_VALID          0x80
 
 // Host Adapter Commands
-#define BUSLOGIC_CMD_INQUIRY        0x04
-#define BUSLOGIC_CMD_INITIALIZE_MBX 0x01
-#define BUSLOGIC_CMD_START_SCSI     0x02
-#define BUSLOGIC_CMD_EXECUTE_SCSI   0x81
+#define BUSLOGIC_CMD_START_MBOX     0x02    // Scan the outgoing mailboxes
+#define BUSLOGIC_CMD_INQUIRY        0x04    // Board ID and firmware version
+#define BUSLOGIC_CMD_INQUIRE_CONFIG 0x0B    // DMA channel, IRQ, host SCSI ID
+#define BUSLOGIC_CMD_INIT_EXT_MBOX  0x81    // Mailbox rings with 32-bit addresses
+#define BUSLOGIC_CMD_STRICT_RR      0x8F    // Scan outgoing mailboxes in order
+
+// Outgoing Mailbox Action Codes
+#define BUSLOGIC_MBOX_CMD_FREE      0x00
+#define BUSLOGIC_MBOX_CMD_START     0x01
+#define BUSLOGIC_MBOX_CMD_ABORT     0x02
+
+// Incoming Mailbox Completion Codes
+#define BUSLOGIC_MBIN_FREE          0x00
+#define BUSLOGIC_MBIN_SUCCESS       0x01
+#define BUSLOGIC_MBIN_ABORTED       0x02
+#define BUSLOGIC_MBIN_NOT_FOUND     0x03
+#define BUSLOGIC_MBIN_ERROR         0x04    // See the CCB host and target status
+
+// CCB Opcodes
+#define BUSLOGIC_CCB_INITIATOR      0x03    // Single buffer, residual returned
+#define BUSLOGIC_CCB_INITIATOR_SG   0x04    // Scatter-gather, residual returned
+
+// CCB Address Control Bits
+#define BUSLOGIC_CCB_DIR_IN         0x08    // Target to host
+#define BUSLOGIC_CCB_DIR_OUT        0x10    // Host to target
+#define BUSLOGIC_CCB_DIR_NONE       0x18
+#define BUSLOGIC_CCB_TAG_ENABLE     0x20    // Simple queue tag
+
+// CCB Host Adapter Status
+#define BUSLOGIC_HOST_OK            0x00
+#define BUSLOGIC_HOST_SEL_TIMEOUT   0x11    // No device at this target
+#define BUSLOGIC_HOST_DATA_RUN      0x12    // Data underrun or overrun
+
+// BusLogic Limits
+#define BUSLOGIC_MAILBOXES          32      // Outgoing and incoming mailboxes
+#define BUSLOGIC_CCBS               BUSLOGIC_MAILBOXES
+#define BUSLOGIC_CDB_MAX            12
+#define BUSLOGIC_MAX_SG             64      // Scatter-gather entries per CCB
+#define BUSLOGIC_POLLS_PER_MS       1000    // Status reads, about 1 us each on ISA
+
+// LSI 53C895A Registers (offsets from BAR0 I/O space)
+#define LSI_REG_SCNTL0              0x00
+#define LSI_REG_SCNTL1              0x01
+#define LSI_REG_SCNTL2              0x02
+#define LSI_REG_SCNTL3              0x03
+#define LSI_REG_SCID                0x04
+#define LSI_REG_SSID                0x0A    // ID of the reselecting target
+#define LSI_REG_DSTAT               0x0C    // DMA interrupt status; read clears
+#define LSI_REG_DSA                 0x10    // Base for table indirect addressing
+#define LSI_REG_ISTAT               0x14
+#define LSI_REG_CTEST2              0x1A    // Read clears ISTAT SIGP
+#define LSI_REG_CTEST3              0x1B
+#define LSI_REG_TEMP                0x1C    // RETURN address
+#define LSI_REG_DBC                 0x24    // Bytes left in the current move
+#define LSI_REG_DSP                 0x2C    // SCRIPTS pointer; writing starts
+#define LSI_REG_DSPS                0x30    // INT instruction code
+#define LSI_REG_SCRATCHA            0x34
+#define LSI_REG_DMODE               0x38
+#define LSI_REG_DIEN                0x39
+#define LSI_REG_DCNTL               0x3B
+#define LSI_REG_SIEN0               0x40
+#define LSI_REG_SIEN1               0x41
+#define LSI_REG_SIST0               0x42    // SCSI interrupt status; read clears
+#define LSI_REG_SIST1               0x43
+#define LSI_REG_STIME0              0x48
+#define LSI_REG_RESPID0             0x4A
+#define LSI_REG_RESPID1             0x4B
+#define LSI_REG_STEST3              0x4F
+
+// LSI ISTAT bits
+#define LSI_ISTAT_DIP               0x01    // DMA interrupt pending
+#define LSI_ISTAT_SIP               0x02    // SCSI interrupt pending
+#define LSI_ISTAT_INTF              0x04    // INTFLY; write 1 to clear
+#define LSI_ISTAT_SIGP              0x20    // Signal the SCRIPTS processor
+#define LSI_ISTAT_SRST              0x40    // Software reset
+
+// LSI DSTAT bits
+#define LSI_DSTAT_IID               0x01    // Illegal instruction
+#define LSI_DSTAT_SIR               0x04    // SCRIPTS INT instruction
+#define LSI_DSTAT_ABRT              0x10
+#define LSI_DSTAT_BF                0x20    // Bus fault
+#define LSI_DSTAT_MDPE              0x40    // Master data parity error
+
+// LSI SIST0/SIST1 bits
+#define LSI_SIST0_PAR               0x01
+#define LSI_SIST0_RST               0x02    // SCSI bus reset
+#define LSI_SIST0_UDC               0x04    // Unexpected disconnect
+#define LSI_SIST0_SGE               0x08    // SCSI gross error
+#define LSI_SIST0_MA                0x80    // Phase mismatch
+#define LSI_SIST1_STO               0x04    // Selection timeout
+
+// LSI miscellaneous register bits
+#define LSI_SCNTL1_RST              0x08    // Assert SCSI RST
+#define LSI_SCNTL1_CON              0x10    // Connected
+#define LSI_SCID_RRE                0x40    // Respond to reselection
+#define LSI_CTEST3_CLF              0x04    // Clear DMA FIFO
+#define LSI_STEST3_CSF              0x02    // Clear SCSI FIFO
+
+// LSI SCRIPTS instruction words. Block moves take a table offset from
+// DSA in the low 24 bits, register moves a register in bits 22-16.
+#define LSI_PHASE_DATA_OUT          0
+#define LSI_PHASE_DATA_IN           1
+#define LSI_PHASE_COMMAND           2
+#define LSI_PHASE_STATUS            3
+#define LSI_PHASE_MSG_OUT           6
+#define LSI_PHASE_MSG_IN            7
+#define LSI_SCR_MOVE_TBL(phase)     (0x18000000 | ((uint32_t)(phase) << 24))
+#define LSI_SCR_SELECT_ATN_TBL      0x43000000
+#define LSI_SCR_WAIT_DISC           0x48000000
+#define LSI_SCR_WAIT_RESEL          0x50000000
+#define LSI_SCR_CLEAR_ACK           0x60000040
+#define LSI_SCR_CLEAR_CARRY         0x60000400
+#define LSI_SCR_SFBR_TO_REG(reg, op, data) (0x68000000 | (op) | ((uint32_t)(reg) << 16) | ((uint32_t)(data) << 8))
+#define LSI_SCR_REG_TO_SFBR(reg)    (0x72000000 | ((uint32_t)(reg) << 16))
+#define LSI_SCR_REG_REG(reg, op, data) (0x78000000 | (op) | ((uint32_t)(reg) << 16) | ((uint32_t)(data) << 8))
+#define LSI_SCR_OP_LOAD             0x00000000
+#define LSI_SCR_OP_SHL              0x01000000
+#define LSI_SCR_OP_OR               0x02000000
+#define LSI_SCR_OP_AND              0x04000000
+#define LSI_SCR_OP_ADD              0x06000000
+#define LSI_SCR_JUMP                0x80080000
+#define LSI_SCR_JUMP_PHASE(phase)   (0x800B0000 | ((uint32_t)(phase) << 24))
+#define LSI_SCR_JUMP_DATA(data)     (0x800C0000 | (uint32_t)(data))  // If SFBR == data
+#define LSI_SCR_RETURN              0x90080000  // Jump to TEMP
+#define LSI_SCR_INT                 0x98080000
+#define LSI_SCR_INTFLY              0x98180000  // Interrupt and keep running
+#define LSI_SCR_LOAD_ABS(reg, n)    (0xE1000000 | ((uint32_t)(reg) << 16) | (n))
+#define LSI_SCR_LOAD_REL(reg, n)    (0xF1000000 | ((uint32_t)(reg) << 16) | (n))
+#define LSI_SCR_STORE_ABS(reg, n)   (0xE0000000 | ((uint32_t)(reg) << 16) | (n))
+#define LSI_SCR_STORE_REL(reg, n)   (0xF0000000 | ((uint32_t)(reg) << 16) | (n))
+
+// LSI SCRIPTS INT codes (DSPS)
+#define LSI_INT_BAD_PHASE           1       // Phase the SCRIPTS do not handle
+#define LSI_INT_BAD_RESEL           2       // Reselected by a target with no command
+#define LSI_INT_OVERRUN             3       // Target moved more data than asked
+
+// LSI host status (scsi_request_t.host_status)
+#define LSI_HOST_OK                 0x00
+#define LSI_HOST_SEL_TIMEOUT        0x11    // No device at this target
+#define LSI_HOST_ERROR              0x20    // Protocol error, bus was reset
+
+// LSI Limits
+#define LSI_MAX_TARGETS             16
+#define LSI_COMMANDS                32      // Command blocks and start queue slots
+#define LSI_CDB_MAX                 16
+#define LSI_MAX_SG                  64      // Table entries per command
+#define LSI_SCRIPT_RAM_SIZE         4096    // On-chip SCRIPTS RAM
+
+// Request Data Direction
+#define SCSI_DIR_NONE               0
+#define SCSI_DIR_IN                 1
+#define SCSI_DIR_OUT                2
+
+// Request Status
+#define SCSI_REQ_QUEUED             0
+#define SCSI_REQ_ACTIVE             1
+#define SCSI_REQ_DONE               2
+#define SCSI_REQ_ERROR              3
+
+// SCSI Status Byte
+#define SCSI_STATUS_GOOD            0x00
+#define SCSI_STATUS_CHECK_CONDITION 0x02
+#define SCSI_STATUS_BUSY            0x08
+
+// Sense Keys
+#define SCSI_SENSE_UNIT_ATTENTION   0x06
+
+#define SCSI_SENSE_LENGTH           18
+#define SCSI_MAX_SEGMENTS           64      // Largest scatter list of a request
+#define SCSI_TIMEOUT_MS             10000
+#define SCSI_SCAN_TIMEOUT_MS        1000    // Poll or reset a scan command after this
 
 // Maximum devices
 #define SCSI_MAX_DEVICES            16
 #define SCSI_MAX_CONTROLLERS        4
+#define SCSI_MAX_TARGETS            16      // Wide bus; targets scanned per controller
+#define SCSI_SCAN_LUNS              16      // REPORT LUNS entries read per target
+#define SCSI_SCAN_PROBES            48      // LUN 0 of every target plus other LUNs
 
 // SCSI Device Structure
 typedef struct {
@@ -95,8 +269,11 @@ typedef struct {
     uint8_t target;             // SCSI target ID (0-15)
     uint8_t lun;                // Logical Unit Number
     uint8_t type;               // Device type (disk, cdrom, etc.)
-    uint32_t block_count;       // Total number of blocks
+    uint8_t tagged;             // Supports tagged command queuing
+    uint64_t block_count;       // Total number of blocks
     uint32_t block_size;        // Size of each block in bytes
+    uint32_t max_blocks;        // Largest transfer in blocks
+    uint8_t queue_depth;        // Commands worth keeping in flight
     char vendor[9];             // Vendor ID (8 chars + null)
     char product[17];           // Product ID (16 chars + null)
     char revision[5];           // Revision (4 chars + null)
@@ -108,27 +285,113 @@ typedef struct {
     uint16_t io_base;           // Base I/O port
     uint32_t mmio_base;         // Memory-mapped I/O base (if used)
     uint8_t irq;                // IRQ number
+    uint8_t host_id;            // Controller's own SCSI ID
+    uint8_t max_cdb;            // Longest CDB the controller accepts
+    uint16_t max_sg;            // Scatter-gather entries per command
+    uint8_t queue_depth;        // Commands in flight across all targets
+    uint8_t lun_depth;          // Tagged commands in flight per LUN
+    uint8_t max_lun;            // Highest LUN the controller can address
     uint8_t device_count;       // Number of devices on this controller
 } scsi_controller_t;
 
 // Command Control Block (CCB) for BusLogic
 typedef struct __attribute__((packed)) {
     uint8_t opcode;             // Operation code
-    uint8_t address_control;    // Address and control
+    uint8_t address_control;    // Data direction, tag enable
     uint8_t cdb_length;         // CDB length
     uint8_t sense_length;       // Request sense length
-    uint32_t data_length;       // Data transfer length
+    uint32_t data_length;       // Data transfer length; residual on completion
     uint32_t data_pointer;      // Data buffer pointer
-    uint32_t reserved1;
+    uint8_t reserved1[2];
     uint8_t host_status;        // Host adapter status
     uint8_t target_status;      // Target device status
     uint8_t target_id;          // Target ID
     uint8_t lun;                // Logical unit
-    uint8_t cdb[12];            // Command Descriptor Block
+    uint8_t cdb[BUSLOGIC_CDB_MAX]; // Command Descriptor Block
     uint8_t reserved2[6];
     uint32_t sense_pointer;     // Sense data pointer
 } buslogic_ccb_t;
 
+// BusLogic scatter-gather entry
+typedef struct __attribute__((packed)) {
+    uint32_t length;            // Bytes
+    uint32_t addr;              // Physical address
+} buslogic_sg_t;
+
+// BusLogic outgoing mailbox: hands a CCB to the adapter
+typedef struct __attribute__((packed)) {
+    uint32_t ccb;               // Physical address of the CCB
+    uint8_t reserved[3];
+    volatile uint8_t action;    // BUSLOGIC_MBOX_CMD_*
+} buslogic_outbox_t;
+
+// BusLogic incoming mailbox: reports a finished CCB
+typedef struct __attribute__((packed)) {
+    uint32_t ccb;               // Physical address of the CCB
+    uint8_t host_status;
+    uint8_t target_status;
+    uint8_t reserved;
+    volatile uint8_t completion; // BUSLOGIC_MBIN_*
+} buslogic_inbox_t;
+
+// LSI table indirect entry: what a SCRIPTS block move transfers
+typedef struct __attribute__((packed)) {
+    uint32_t count;             // Bytes (24 bits)
+    uint32_t addr;              // Physical address
+} lsi_table_t;
+
+// LSI command block. DSA points here while the SCRIPTS run the command,
+// so every table below is addressed relative to it.
+typedef struct __attribute__((packed)) {
+    uint32_t select;            // SCNTL3, target ID, SXFER for SELECT
+    volatile uint8_t done;      // Set by the SCRIPTS after COMMAND COMPLETE
+    uint8_t reserved1[3];
+    lsi_table_t msg_out;        // IDENTIFY
+    lsi_table_t command;        // CDB
+    lsi_table_t status;         // Status byte
+    lsi_table_t msg_in;         // One message byte
+    uint32_t data_in;           // SCRIPTS address of the next data-in move
+    uint32_t data_out;          // SCRIPTS address of the next data-out move
+    lsi_table_t data[LSI_MAX_SG]; // A list of n entries uses the last n
+    uint8_t msg_in_byte[4];     // Loaded into SCRATCHA to test the message
+    uint8_t identify;
+    uint8_t status_byte;
+    uint8_t reserved2[2];
+    uint8_t cdb[LSI_CDB_MAX];
+    uint8_t sense[SCSI_SENSE_LENGTH];
+    uint8_t reserved3[6];
+} lsi_cmd_t;
+
+// Scatter list entry of a request
+typedef struct {
+    uint32_t addr;              // Physical address
+    uint32_t length;            // Bytes
+} scsi_sg_t;
+
+// Asynchronous SCSI command
+typedef struct scsi_request {
+    uint8_t  controller;        // Index into the controller table
+    uint8_t  target;
+    uint8_t  lun;
+    uint8_t  direction;         // SCSI_DIR_*
+    uint8_t  cdb[16];
+    uint8_t  cdb_length;
+    uint8_t  tagged;            // Send with a simple queue tag
+    uint8_t  host_status;       // Controller-specific, on completion
+    uint8_t  target_status;     // SCSI status byte, on completion
+    volatile uint8_t status;    // SCSI_REQ_*
+    uint32_t submitted;         // timer_ticks() at scsi_submit()
+    uint8_t* buffer;            // Physically contiguous; used when nsg is 0
+    scsi_sg_t* sg;              // Scatter list, or NULL
+    uint16_t nsg;
+    uint32_t length;            // Bytes, over the whole scatter list
+    uint32_t residual;          // Bytes not transferred
+    uint8_t  sense[SCSI_SENSE_LENGTH]; // Valid after CHECK CONDITION
+    void   (*complete)(struct scsi_request* req); // Called from IRQ context
+    void*    private_data;
+    struct scsi_request* next;
+} scsi_request_t;
+
 // SCSI Inquiry Response
 typedef struct __attribute__((packed)) {
     uint8_t peripheral_type;    // Device type
@@ -150,15 +413,26 @@ typedef struct __attribute__((packed)) {
     uint32_t block_size;        // Block size in bytes
 } scsi_capacity_t;
 
+// SCSI Read Capacity (16) Response
+typedef struct __attribute__((packed)) {
+    uint32_t last_lba_high;     // Last logical block address, big-endian
+    uint32_t last_lba_low;
+    uint32_t block_size;        // Block size in bytes
+    uint8_t reserved[20];
+} scsi_capacity16_t;
+
 // Function prototypes
 void init_scsi(void);
 void scsi_scan_devices(void);
 void scsi_print_devices(void);
 int scsi_get_device_count(void);
 scsi_device_t* scsi_get_device(int index);
-uint8_t scsi_read_sector(uint8_t device_id, uint32_t lba, uint8_t* buffer);
-uint8_t scsi_write_sector(uint8_t device_id, uint32_t lba, uint8_t* buffer);
-int scsi_read_blocks(uint8_t device_id, uint32_t lba, uint16_t count, uint8_t* buffer);
-int scsi_write_blocks(uint8_t device_id, uint32_t lba, uint16_t count, uint8_t* buffer);
+void scsi_submit(scsi_request_t* req);
+uint8_t scsi_wait(scsi_request_t* req);
+uint8_t scsi_read_sector(uint8_t device_id, uint64_t lba, uint8_t* buffer);
+uint8_t scsi_write_sector(uint8_t device_id, uint64_t lba, uint8_t* buffer);
+int scsi_read_blocks(uint8_t device_id, uint64_t lba, uint32_t count, uint8_t* buffer);
+int scsi_write_blocks(uint8_t device_id, uint64_t lba, uint32_t count, uint8_t* buffer);
+uint8_t scsi_sync_cache(uint8_t device_id);
 
 #endif
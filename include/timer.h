@@ -0,0 +1,26 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "kernel.h"
+
+// 8253/8254 PIT ports
+#define PIT_CHANNEL0         0x40
+#define PIT_CHANNEL2         0x42
+#define PIT_COMMAND          0x43
+#define PIT_GATE             0x61     // Bit 0: channel 2 gate, bit 5: its output
+
+#define PIT_BASE_FREQUENCY   1193182
+#define TIMER_HZ             1000     // One tick per millisecond
+
+// Give up on TSC calibration after this many reads of PIT_GATE (about
+// 1 s at ISA timing, 100 times the 10 ms one-shot)
+#define PIT_CALIBRATE_POLLS  1000000
+
+// Function prototypes
+void init_timer(void);
+uint32_t timer_ticks(void);
+void timer_sleep(uint32_t ms);
+uint32_t timer_cycles(void);
+uint32_t timer_cycles_to_us(uint32_t cycles);
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include "kernel.h"
+#include "pci.h"
+#include "irq.h"
+
+// virtio over PCI (modern, virtio 1.0 transport)
+#define VIRTIO_PCI_VENDOR           0x1AF4
+#define VIRTIO_PCI_MODERN_BASE      0x1040  // Modern device id = 0x1040 + virtio id
+#define VIRTIO_PCI_LEGACY_BASE      0x1000  // Transitional device ids start here
+
+// virtio device ids
+#define VIRTIO_ID_BLOCK             2
+#define VIRTIO_ID_SCSI              8
+
+// Types of the vendor-specific (PCI_CAP_ID_VENDOR) capabilities that
+// describe the configuration structures
+#define VIRTIO_PCI_CAP_COMMON_CFG   1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG   2
+#define VIRTIO_PCI_CAP_ISR_CFG      3
+#define VIRTIO_PCI_CAP_DEVICE_CFG   4
+
+// Common configuration structure offsets
+#define VIRTIO_COMMON_DFSELECT      0x00    // 32-bit
+#define VIRTIO_COMMON_DF            0x04    // 32-bit
+#define VIRTIO_COMMON_GFSELECT      0x08    // 32-bit
+#define VIRTIO_COMMON_GF            0x0C    // 32-bit
+#define VIRTIO_COMMON_MSIX          0x10    // 16-bit
+#define VIRTIO_COMMON_NUMQ          0x12    // 16-bit
+#define VIRTIO_COMMON_STATUS        0x14    // 8-bit
+#define VIRTIO_COMMON_CFGGEN        0x15    // 8-bit
+#define VIRTIO_COMMON_Q_SELECT      0x16    // 16-bit
+#define VIRTIO_COMMON_Q_SIZE        0x18    // 16-bit
+#define VIRTIO_COMMON_Q_MSIX        0x1A    // 16-bit
+#define VIRTIO_COMMON_Q_ENABLE      0x1C    // 16-bit
+#define VIRTIO_COMMON_Q_NOFF        0x1E    // 16-bit
+#define VIRTIO_COMMON_Q_DESCLO      0x20
+#define VIRTIO_COMMON_Q_DESCHI      0x24
+#define VIRTIO_COMMON_Q_AVAILLO     0x28
+#define VIRTIO_COMMON_Q_AVAILHI     0x2C
+#define VIRTIO_COMMON_Q_USEDLO      0x30
+#define VIRTIO_COMMON_Q_USEDHI      0x34
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE   0x01
+#define VIRTIO_STATUS_DRIVER        0x02
+#define VIRTIO_STATUS_DRIVER_OK     0x04
+#define VIRTIO_STATUS_FEATURES_OK   0x08
+#define VIRTIO_STATUS_FAILED        0x80
+
+// ISR status bits (reading the ISR register clears it)
+#define VIRTIO_ISR_QUEUE            0x01
+#define VIRTIO_ISR_CONFIG           0x02
+
+// MSI-X vector register value for "no interrupt"
+#define VIRTIO_MSI_NO_VECTOR        0xFFFF
+
+// Transport feature bits
+#define VIRTIO_F_INDIRECT_DESC      28
+#define VIRTIO_F_EVENT_IDX          29
+#define VIRTIO_F_VERSION_1          32
+
+// Descriptor flags
+#define VIRTQ_DESC_F_NEXT           1
+#define VIRTQ_DESC_F_WRITE          2       // Device writes (vs. reads) the buffer
+#define VIRTQ_DESC_F_INDIRECT       4
+
+// Ring flags
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  1
+#define VIRTQ_USED_F_NO_NOTIFY      1
+
+// Driver limits
+#define VIRTIO_QUEUE_MAX            128     // Ring entries per queue
+#define VIRTIO_MAX_INDIRECT         64      // Descriptors per indirect table
+#define VIRTIO_MAX_QUEUES           4       // Virtqueues per device
+
+// Split virtqueue layout
+typedef struct __attribute__((packed)) {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} virtq_desc_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t flags;
+    volatile uint16_t idx;
+    uint16_t ring[];                // Followed by used_event
+} virtq_avail_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t id;
+    uint32_t len;
+} virtq_used_elem_t;
+
+typedef struct __attribute__((packed)) {
+    volatile uint16_t flags;
+    volatile uint16_t idx;
+    virtq_used_elem_t ring[];       // Followed by avail_event
+} virtq_used_t;
+
+// Physically contiguous buffer segment
+typedef struct {
+    uint32_t addr;
+    uint32_t length;
+} virtio_sg_t;
+
+// PCI function with its configuration structures mapped
+typedef struct {
+    pci_device_t* pci;
+    uint8_t   irq;                  // INTx line
+    uint16_t  device_id;            // virtio device id (VIRTIO_ID_*)
+    uintptr_t common_cfg;
+    uintptr_t notify_base;
+    uint32_t  notify_mult;
+    uintptr_t isr_cfg;
+    uintptr_t device_cfg;
+    uint32_t  features[2];          // Negotiated feature bits 0-31, 32-63
+    pci_msix_t msix;
+    uint8_t   msix_enabled;         // Queues signal through MSI-X, not INTx
+} virtio_device_t;
+
+// Split virtqueue state
+typedef struct {
+    virtio_device_t* dev;
+    uint16_t index;
+    uint16_t size;
+    virtq_desc_t* desc;
+    virtq_avail_t* avail;
+    virtq_used_t* used;
+    uintptr_t notify_addr;
+    uint16_t free_head;             // Free descriptors are chained through next
+    uint16_t num_free;
+    uint16_t last_used;             // Next used ring entry to reap
+    uint16_t kicked_idx;            // avail->idx at the last notification
+    uint8_t  indirect;              // VIRTIO_F_INDIRECT_DESC negotiated
+    uint8_t  event_idx;             // VIRTIO_F_EVENT_IDX negotiated
+    uint8_t  vector;                // MSI vector, 0 when the queue uses INTx
+    virtq_desc_t* indirect_tables;  // VIRTIO_MAX_INDIRECT entries per head
+    void* tokens[VIRTIO_QUEUE_MAX]; // Caller cookie, by head descriptor
+} virtqueue_t;
+
+// Function prototypes
+int virtio_pci_find(uint16_t virtio_id, virtio_device_t* devs, int max);
+int virtio_negotiate(virtio_device_t* dev, uint32_t wanted_lo, uint32_t wanted_hi);
+void virtio_driver_ok(virtio_device_t* dev);
+int virtio_has_feature(virtio_device_t* dev, uint32_t bit);
+uint8_t virtio_read_isr(virtio_device_t* dev);
+uint16_t virtio_num_queues(virtio_device_t* dev);
+int virtq_init(virtio_device_t* dev, virtqueue_t* vq, uint16_t index);
+int virtq_add(virtqueue_t* vq, virtio_sg_t* sg, int out, int in, void* token);
+void virtq_kick(virtqueue_t* vq);
+void* virtq_get(virtqueue_t* vq, uint32_t* len);
+int virtio_msix_enable(virtio_device_t* dev);
+void virtio_msix_disable(virtio_device_t* dev);
+int virtq_set_vector(virtqueue_t* vq, msi_handler_t handler, void* data, uint8_t cpu);
+void virtq_clear_vector(virtqueue_t* vq);
+
+#endif
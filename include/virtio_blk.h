@@ -0,0 +1,95 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include "virtio.h"
+
+// Block device feature bits
+#define VIRTIO_BLK_F_SIZE_MAX       1
+#define VIRTIO_BLK_F_SEG_MAX        2
+#define VIRTIO_BLK_F_BLK_SIZE       6
+#define VIRTIO_BLK_F_FLUSH          9
+#define VIRTIO_BLK_F_MQ             12
+
+// Device configuration offsets
+#define VIRTIO_BLK_CFG_CAPACITY     0x00    // 64-bit, in 512-byte sectors
+#define VIRTIO_BLK_CFG_SIZE_MAX     0x08
+#define VIRTIO_BLK_CFG_SEG_MAX      0x0C
+#define VIRTIO_BLK_CFG_BLK_SIZE     0x14
+#define VIRTIO_BLK_CFG_NUM_QUEUES   0x22    // 16-bit
+
+// Request types
+#define VIRTIO_BLK_T_IN             0
+#define VIRTIO_BLK_T_OUT            1
+#define VIRTIO_BLK_T_FLUSH          4
+
+// Request completion status written by the device
+#define VIRTIO_BLK_S_OK             0
+#define VIRTIO_BLK_S_IOERR          1
+#define VIRTIO_BLK_S_UNSUPP         2
+
+// Driver limits
+#define VIRTIO_BLK_MAX_DEVICES      4
+#define VIRTIO_BLK_MAX_CPUS         1       // HueOS runs on the boot CPU only
+#define VIRTIO_BLK_MAX_SEGS         (VIRTIO_MAX_INDIRECT - 2)
+#define VIRTIO_BLK_TIMEOUT_MS       5000
+
+// Request operations
+#define VIRTIO_BLK_OP_READ          0
+#define VIRTIO_BLK_OP_WRITE         1
+#define VIRTIO_BLK_OP_FLUSH         2
+
+// Request status
+#define VIRTIO_BLK_REQ_QUEUED       0
+#define VIRTIO_BLK_REQ_ACTIVE       1
+#define VIRTIO_BLK_REQ_DONE         2
+#define VIRTIO_BLK_REQ_ERROR        3
+
+// Request header read by the device
+typedef struct __attribute__((packed)) {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} virtio_blk_outhdr_t;
+
+// Asynchronous request. The header and status byte live in the request
+// itself, so it must stay in place until completion.
+typedef struct virtio_blk_request {
+    uint8_t  device;            // Index into the virtio-blk device table
+    uint8_t  op;                // VIRTIO_BLK_OP_*
+    volatile uint8_t status;    // VIRTIO_BLK_REQ_*
+    uint64_t lba;               // 512-byte sectors
+    uint32_t count;             // Sectors
+    uint8_t* buffer;            // Used when nsg is 0
+    virtio_sg_t* sg;            // Scatter-gather list covering count sectors
+    uint32_t nsg;
+    void   (*complete)(struct virtio_blk_request* req); // Called from IRQ context
+    void*    private_data;
+    struct virtio_blk_request* next;
+    virtio_blk_outhdr_t hdr;
+    volatile uint8_t result;    // VIRTIO_BLK_S_* from the device
+} virtio_blk_request_t;
+
+// Disk exposed by a virtio-blk function
+typedef struct {
+    uint64_t size;              // 512-byte sectors
+    uint32_t block_size;        // Preferred I/O size
+    uint32_t seg_max;           // Data segments per request
+    uint32_t size_max;          // Bytes per segment (0 = no limit)
+    uint8_t  flush;             // VIRTIO_BLK_F_FLUSH negotiated
+    uint8_t  queues;            // Virtqueues in use
+} virtio_blk_device_t;
+
+// Function prototypes
+void init_virtio_blk(void);
+void virtio_blk_print_devices(void);
+int virtio_blk_get_device_count(void);
+virtio_blk_device_t* virtio_blk_get_device(int index);
+void virtio_blk_queue_request(virtio_blk_request_t* req);
+void virtio_blk_commit(uint8_t device);
+void virtio_blk_submit(virtio_blk_request_t* req);
+uint8_t virtio_blk_wait(virtio_blk_request_t* req);
+uint8_t virtio_blk_read_sectors(uint8_t device, uint64_t lba, uint32_t count, uint8_t* buffer);
+uint8_t virtio_blk_write_sectors(uint8_t device, uint64_t lba, uint32_t count, uint8_t* buffer);
+uint8_t virtio_blk_flush(uint8_t device);
+
+#endif
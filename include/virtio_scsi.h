@@ -0,0 +1,112 @@
+#ifndef VIRTIO_SCSI_H
+#define VIRTIO_SCSI_H
+
+#include "virtio.h"
+#include "scsi.h"
+
+// SCSI host feature bits
+#define VIRTIO_SCSI_F_INOUT         0
+#define VIRTIO_SCSI_F_HOTPLUG       1       // Events for added/removed LUNs
+#define VIRTIO_SCSI_F_CHANGE        2       // Events for parameter changes
+
+// Device configuration offsets
+#define VIRTIO_SCSI_CFG_NUM_QUEUES  0x00    // Request queues
+#define VIRTIO_SCSI_CFG_SEG_MAX     0x04
+#define VIRTIO_SCSI_CFG_MAX_SECTORS 0x08
+#define VIRTIO_SCSI_CFG_CMD_PER_LUN 0x0C
+#define VIRTIO_SCSI_CFG_SENSE_SIZE  0x14    // Writable
+#define VIRTIO_SCSI_CFG_CDB_SIZE    0x18    // Writable
+#define VIRTIO_SCSI_CFG_MAX_TARGET  0x1E    // 16-bit
+
+// Virtqueue indexes
+#define VIRTIO_SCSI_QUEUE_CONTROL   0
+#define VIRTIO_SCSI_QUEUE_EVENT     1
+#define VIRTIO_SCSI_QUEUE_REQUEST   2       // First request queue
+
+// Command response codes (scsi_request_t.host_status)
+#define VIRTIO_SCSI_S_OK            0
+#define VIRTIO_SCSI_S_OVERRUN       1
+#define VIRTIO_SCSI_S_ABORTED       2
+#define VIRTIO_SCSI_S_BAD_TARGET    3       // No device at this target
+#define VIRTIO_SCSI_S_RESET         4
+#define VIRTIO_SCSI_S_BUSY          5
+#define VIRTIO_SCSI_S_TRANSPORT_FAILURE 6
+#define VIRTIO_SCSI_S_TARGET_FAILURE 7
+#define VIRTIO_SCSI_S_NEXUS_FAILURE 8
+#define VIRTIO_SCSI_S_FAILURE       9
+#define VIRTIO_SCSI_S_FUNCTION_SUCCEEDED 10
+#define VIRTIO_SCSI_S_FUNCTION_REJECTED 11
+
+// Task attributes
+#define VIRTIO_SCSI_S_SIMPLE        0
+
+// Control queue requests
+#define VIRTIO_SCSI_T_TMF           0
+#define VIRTIO_SCSI_T_TMF_LOGICAL_UNIT_RESET 5
+
+// Events
+#define VIRTIO_SCSI_T_NO_EVENT      0
+#define VIRTIO_SCSI_T_TRANSPORT_RESET 1
+#define VIRTIO_SCSI_T_ASYNC_NOTIFY  2
+#define VIRTIO_SCSI_T_PARAM_CHANGE  3
+#define VIRTIO_SCSI_T_EVENTS_MISSED 0x80000000
+#define VIRTIO_SCSI_EVT_RESET_RESCAN  1     // LUN added
+#define VIRTIO_SCSI_EVT_RESET_REMOVED 2
+
+// Sizes written to the device configuration
+#define VIRTIO_SCSI_CDB_SIZE        32
+#define VIRTIO_SCSI_SENSE_SIZE      96
+
+// Driver limits
+#define VIRTIO_SCSI_MAX_CPUS        1       // HueOS runs on the boot CPU only
+#define VIRTIO_SCSI_MAX_SEGS        (VIRTIO_MAX_INDIRECT - 2)
+#define VIRTIO_SCSI_EVENTS          8       // Event buffers kept posted
+#define VIRTIO_SCSI_TMF_TIMEOUT_MS  1000
+
+// Command request header read by the device
+typedef struct __attribute__((packed)) {
+    uint8_t  lun[8];            // 1, target, 0x40 | LUN high, LUN low
+    uint64_t id;                // Task tag
+    uint8_t  task_attr;         // VIRTIO_SCSI_S_SIMPLE
+    uint8_t  prio;
+    uint8_t  crn;
+    uint8_t  cdb[VIRTIO_SCSI_CDB_SIZE];
+} virtio_scsi_cmd_req_t;
+
+// Command response written by the device
+typedef struct __attribute__((packed)) {
+    uint32_t sense_len;
+    uint32_t resid;
+    uint16_t status_qualifier;
+    uint8_t  status;            // SCSI status byte
+    uint8_t  response;          // VIRTIO_SCSI_S_*
+    uint8_t  sense[VIRTIO_SCSI_SENSE_SIZE];
+} virtio_scsi_cmd_resp_t;
+
+// Task management request on the control queue
+typedef struct __attribute__((packed)) {
+    uint32_t type;              // VIRTIO_SCSI_T_TMF
+    uint32_t subtype;
+    uint8_t  lun[8];
+    uint64_t id;
+} virtio_scsi_tmf_req_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t response;
+} virtio_scsi_tmf_resp_t;
+
+// Event written by the device into a posted buffer
+typedef struct __attribute__((packed)) {
+    uint32_t event;             // VIRTIO_SCSI_T_*, maybe with EVENTS_MISSED
+    uint8_t  lun[8];
+    uint32_t reason;
+} virtio_scsi_event_t;
+
+// Function prototypes. Controllers are indexes into the SCSI controller
+// table; init_scsi() registers virtio-scsi functions there.
+int virtio_scsi_init(int index, virtio_device_t* pci, scsi_controller_t* ctrl);
+void virtio_scsi_queue(int index, scsi_request_t* req);
+void virtio_scsi_interrupt(int index);
+void virtio_scsi_timeout(int index, scsi_request_t* req);
+
+#endif
@@ -0,0 +1,95 @@
+#include "acpi.h"
+
+#define ACPI_EBDA_SEGMENT_PTR   0x40E       // BDA word: EBDA segment
+#define ACPI_BIOS_ROM_START     0x000E0000
+#define ACPI_BIOS_ROM_END       0x00100000
+
+static acpi_rsdp_t* rsdp = NULL;
+static int rsdp_searched = 0;
+
+// Bytes of a valid table sum to zero
+static int acpi_checksum(const void* table, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)table;
+    uint8_t sum = 0;
+    
+    for (uint32_t i = 0; i < length; i++)
+        sum += bytes[i];
+    return sum == 0;
+}
+
+// The RSDP sits on a 16-byte boundary in the first KiB of the EBDA or in
+// the BIOS ROM area
+static acpi_rsdp_t* acpi_scan_rsdp(uint32_t start, uint32_t end) {
+    for (uint32_t addr = start; addr + 20 <= end; addr += 16) {
+        acpi_rsdp_t* candidate = (acpi_rsdp_t*)addr;
+        if (memcmp(candidate->signature, "RSD PTR ", 8) == 0 && acpi_checksum(candidate, 20))
+            return candidate;
+    }
+    return NULL;
+}
+
+static acpi_rsdp_t* acpi_get_rsdp(void) {
+    if (rsdp_searched)
+        return rsdp;
+    rsdp_searched = 1;
+    
+    // Hide the low address from GCC, which treats page 0 as a null
+    // dereference
+    uintptr_t bda = ACPI_EBDA_SEGMENT_PTR;
+    asm("" : "+r"(bda));
+    uint32_t ebda = (uint32_t)(*(volatile uint16_t*)bda) << 4;
+    if (ebda >= 0x80000 && ebda < 0xA0000)
+        rsdp = acpi_scan_rsdp(ebda, ebda + 1024);
+    if (!rsdp)
+        rsdp = acpi_scan_rsdp(ACPI_BIOS_ROM_START, ACPI_BIOS_ROM_END);
+    return rsdp;
+}
+
+static acpi_sdt_header_t* acpi_check_table(uint64_t address, const char* signature) {
+    if (address == 0 || (address >> 32) != 0)
+        return NULL;        // Not reachable without paging
+    
+    acpi_sdt_header_t* table = (acpi_sdt_header_t*)(uint32_t)address;
+    if (memcmp(table->signature, signature, 4) != 0)
+        return NULL;
+    if (!acpi_checksum(table, table->length))
+        return NULL;
+    return table;
+}
+
+// Find a system description table by its four-character signature through
+// the XSDT, or the RSDT on ACPI 1.0 firmware. Returns NULL if absent.
+acpi_sdt_header_t* acpi_find_table(const char* signature) {
+    acpi_rsdp_t* root = acpi_get_rsdp();
+    if (!root)
+        return NULL;
+    
+    if (root->revision >= 2 && root->xsdt_address) {
+        acpi_sdt_header_t* xsdt = acpi_check_table(root->xsdt_address, "XSDT");
+        if (xsdt) {
+            uint32_t count = (xsdt->length - sizeof(acpi_sdt_header_t)) / 8;
+            const uint8_t* entries = (const uint8_t*)(xsdt + 1);
+            for (uint32_t i = 0; i < count; i++) {
+                uint64_t address;
+                memcpy(&address, entries + i * 8, 8);     // Entries are unaligned
+                acpi_sdt_header_t* table = acpi_check_table(address, signature);
+                if (table)
+                    return table;
+            }
+            return NULL;
+        }
+    }
+    
+    acpi_sdt_header_t* rsdt = acpi_check_table(root->rsdt_address, "RSDT");
+    if (!rsdt)
+        return NULL;
+    
+    uint32_t count = (rsdt->length - sizeof(acpi_sdt_header_t)) / 4;
+    const uint32_t* entries = (const uint32_t*)(rsdt + 1);
+    for (uint32_t i = 0; i < count; i++) {
+        acpi_sdt_header_t* table = acpi_check_table(entries[i], signature);
+        if (table)
+            return table;
+    }
+    return NULL;
+}
@@ -0,0 +1,722 @@
+#include "ahci.h"
+#include "blkdev.h"
+#include "irq.h"
+#include "pci.h"
+#include "timer.h"
+#include "kernel.h"
+
+// Per-port driver state
+typedef struct {
+    ahci_cmd_header_t* cmd_list;        // 32 command headers, 1K aligned
+    uint8_t* fis;                       // Received FIS area, 256-byte aligned
+    ahci_cmd_table_t* tables;           // One command table per slot
+    ahci_request_t* slots[AHCI_MAX_SLOTS];
+    uint32_t busy;                      // Slots owned by the driver
+    uint8_t  noncq_active;              // A non-queued command is outstanding
+    uint8_t  device;                    // Index into devices[]
+    ahci_request_t* queue_head;         // Requests waiting for a slot
+    ahci_request_t* queue_tail;
+} ahci_port_state_t;
+
+static uintptr_t abar = 0;
+static uint8_t irq_line = 0;
+static pci_device_t* pci_dev = NULL;
+static uint32_t slot_count = 1;
+static int hba_ncq = 0;
+static ahci_port_state_t ports[AHCI_MAX_PORTS];
+static ahci_device_t devices[AHCI_MAX_DEVICES];
+static int device_count = 0;
+
+static void ahci_blk_register(void);
+
+// Register access
+static uint32_t ahci_read(uint32_t reg) {
+    return mmio_read32(abar + reg);
+}
+
+static void ahci_write(uint32_t reg, uint32_t value) {
+    mmio_write32(abar + reg, value);
+}
+
+static uint32_t port_read(uint8_t port, uint32_t reg) {
+    return mmio_read32(abar + AHCI_PORT_BASE + port * AHCI_PORT_SIZE + reg);
+}
+
+static void port_write(uint8_t port, uint32_t reg, uint32_t value) {
+    mmio_write32(abar + AHCI_PORT_BASE + port * AHCI_PORT_SIZE + reg, value);
+}
+
+// Wait for bits in a port register to clear. Bounded by a number of
+// reads, since recovery also runs from the interrupt handler. Returns 1
+// once they are clear.
+static int ahci_wait_clear(uint8_t port, uint32_t reg, uint32_t bits) {
+    for (uint32_t i = 0; i < AHCI_PORT_POLLS; i++) {
+        if (!(port_read(port, reg) & bits))
+            return 1;
+    }
+    return 0;
+}
+
+// Stop the command engine and FIS receive of a port
+static int ahci_stop_port(uint8_t port) {
+    uint32_t cmd = port_read(port, AHCI_PxCMD);
+    port_write(port, AHCI_PxCMD, cmd & ~AHCI_PxCMD_ST);
+    if (!ahci_wait_clear(port, AHCI_PxCMD, AHCI_PxCMD_CR))
+        return 0;
+    
+    cmd = port_read(port, AHCI_PxCMD);
+    port_write(port, AHCI_PxCMD, cmd & ~AHCI_PxCMD_FRE);
+    return ahci_wait_clear(port, AHCI_PxCMD, AHCI_PxCMD_FR);
+}
+
+// Reset the link with a COMRESET and wait for the device to come back
+static int ahci_comreset(uint8_t port) {
+    uint32_t sctl = port_read(port, AHCI_PxSCTL) & ~0x0Fu;
+    
+    port_write(port, AHCI_PxSCTL, sctl | AHCI_SCTL_DET_COMRESET);
+    for (uint32_t i = 0; i < AHCI_COMRESET_POLLS; i++)
+        port_read(port, AHCI_PxSSTS);
+    port_write(port, AHCI_PxSCTL, sctl);
+    
+    for (uint32_t i = 0; i < AHCI_PORT_POLLS; i++) {
+        if ((port_read(port, AHCI_PxSSTS) & AHCI_SSTS_DET_MASK) == AHCI_SSTS_DET_PRESENT) {
+            port_write(port, AHCI_PxSERR, 0xFFFFFFFF);
+            return ahci_wait_clear(port, AHCI_PxTFD, AHCI_TFD_BSY | AHCI_TFD_DRQ);
+        }
+    }
+    return 0;
+}
+
+// Start FIS receive and the command engine. A device left with BSY or
+// DRQ set by an error is cleared first with CLO, or with a COMRESET if
+// the HBA lacks CLO or it does not help. Returns 0 if the port is left
+// stopped.
+static int ahci_start_port(uint8_t port) {
+    if (!ahci_wait_clear(port, AHCI_PxCMD, AHCI_PxCMD_CR))
+        return 0;
+    
+    port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+    
+    if (port_read(port, AHCI_PxTFD) & (AHCI_TFD_BSY | AHCI_TFD_DRQ)) {
+        int clear = 0;
+        
+        if (ahci_read(AHCI_REG_CAP) & AHCI_CAP_SCLO) {
+            port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_CLO);
+            clear = ahci_wait_clear(port, AHCI_PxCMD, AHCI_PxCMD_CLO) &&
+                    ahci_wait_clear(port, AHCI_PxTFD, AHCI_TFD_BSY | AHCI_TFD_DRQ);
+        }
+        if (!clear && !ahci_comreset(port))
+            return 0;
+    }
+    
+    port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_ST);
+    return 1;
+}
+
+// Fill in the command header, FIS and PRDT of a slot
+static int ahci_build_command(uint8_t port, uint8_t slot, uint8_t command, uint64_t lba,
+                              uint32_t count, uint8_t* buffer, uint32_t bytes,
+                              int write, int ncq, int fua) {
+    ahci_cmd_header_t* hdr = &ports[port].cmd_list[slot];
+    ahci_cmd_table_t* tbl = &ports[port].tables[slot];
+    uint8_t* fis = tbl->cfis;
+    
+    memset(tbl, 0, sizeof(ahci_cmd_table_t));
+    
+    fis[0] = FIS_TYPE_REG_H2D;
+    fis[1] = 0x80;                          // Command register update
+    fis[2] = command;
+    fis[4] = (uint8_t)(lba & 0xFF);
+    fis[5] = (uint8_t)((lba >> 8) & 0xFF);
+    fis[6] = (uint8_t)((lba >> 16) & 0xFF);
+    fis[8] = (uint8_t)((lba >> 24) & 0xFF);
+    fis[9] = (uint8_t)((lba >> 32) & 0xFF);
+    fis[10] = (uint8_t)((lba >> 40) & 0xFF);
+    
+    if (ncq) {
+        // FPDMA QUEUED: sector count in FEATURES, tag in COUNT[7:3]
+        fis[3] = (uint8_t)(count & 0xFF);
+        fis[11] = (uint8_t)((count >> 8) & 0xFF);
+        fis[12] = (uint8_t)(slot << 3);
+        fis[7] = 0x40 | (fua ? 0x80 : 0);
+    } else {
+        fis[12] = (uint8_t)(count & 0xFF);
+        fis[13] = (uint8_t)((count >> 8) & 0xFF);
+        fis[7] = (command == AHCI_ATA_CMD_IDENTIFY) ? 0 : 0x40;
+    }
+    
+    // Physical region descriptors, at most 4MB each
+    int n = 0;
+    uint32_t addr = (uint32_t)buffer;
+    while (bytes > 0) {
+        uint32_t chunk = (bytes > AHCI_PRD_MAX_BYTES) ? AHCI_PRD_MAX_BYTES : bytes;
+        
+        if (n >= AHCI_PRDT_ENTRIES)
+            return 0;
+        
+        tbl->prdt[n].dba = addr;
+        tbl->prdt[n].dbau = 0;
+        tbl->prdt[n].dbc = chunk - 1;
+        n++;
+        
+        addr += chunk;
+        bytes -= chunk;
+    }
+    
+    hdr->flags = 5 | (write ? (1 << 6) : 0);   // CFL = 5 dwords
+    hdr->prdtl = (uint16_t)n;
+    hdr->prdbc = 0;
+    hdr->ctba = (uint32_t)tbl;
+    hdr->ctbau = 0;
+    
+    return 1;
+}
+
+// Issue a command on slot 0 and poll for completion; used before the
+// port's interrupts are enabled
+static int ahci_exec_polled(uint8_t port, uint8_t command, uint8_t* buffer, uint32_t bytes) {
+    if (!ahci_build_command(port, 0, command, 0, 0, buffer, bytes, 0, 0, 0))
+        return 0;
+    
+    port_write(port, AHCI_PxIS, 0xFFFFFFFF);
+    port_write(port, AHCI_PxCI, 1);
+    
+    uint32_t start = timer_ticks();
+    while (port_read(port, AHCI_PxCI) & 1) {
+        if (port_read(port, AHCI_PxIS) & AHCI_PxIS_TFES)
+            return 0;
+        if (timer_ticks() - start > AHCI_TIMEOUT_MS)
+            return 0;
+    }
+    
+    return !(port_read(port, AHCI_PxTFD) & 0x01);
+}
+
+// Allocate the command list, FIS area and command tables and start the port
+static int ahci_port_init(uint8_t port) {
+    ahci_port_state_t* p = &ports[port];
+    
+    if (!ahci_stop_port(port))
+        return 0;
+    
+    p->cmd_list = (ahci_cmd_header_t*)kmalloc_aligned(sizeof(ahci_cmd_header_t) * AHCI_MAX_SLOTS, 1024);
+    p->fis = (uint8_t*)kmalloc_aligned(256, 256);
+    p->tables = (ahci_cmd_table_t*)kmalloc_aligned(sizeof(ahci_cmd_table_t) * AHCI_MAX_SLOTS, 128);
+    if (!p->cmd_list || !p->fis || !p->tables)
+        return 0;
+    
+    memset(p->cmd_list, 0, sizeof(ahci_cmd_header_t) * AHCI_MAX_SLOTS);
+    memset(p->fis, 0, 256);
+    
+    p->busy = 0;
+    p->noncq_active = 0;
+    p->queue_head = NULL;
+    p->queue_tail = NULL;
+    for (int i = 0; i < AHCI_MAX_SLOTS; i++)
+        p->slots[i] = NULL;
+    
+    port_write(port, AHCI_PxCLB, (uint32_t)p->cmd_list);
+    port_write(port, AHCI_PxCLBU, 0);
+    port_write(port, AHCI_PxFB, (uint32_t)p->fis);
+    port_write(port, AHCI_PxFBU, 0);
+    
+    // Clear stale errors and interrupts
+    port_write(port, AHCI_PxSERR, 0xFFFFFFFF);
+    port_write(port, AHCI_PxIS, 0xFFFFFFFF);
+    port_write(port, AHCI_PxIE, 0);
+    
+    return ahci_start_port(port);
+}
+
+// IDENTIFY the disk on a port and record it in devices[]
+static int ahci_identify(uint8_t port) {
+    static uint16_t identify_buffer[256];
+    ahci_device_t* dev = &devices[device_count];
+    
+    if (!ahci_exec_polled(port, AHCI_ATA_CMD_IDENTIFY, (uint8_t*)identify_buffer, 512))
+        return 0;
+    
+    dev->port = port;
+    
+    // Model string (byte-swapped words 27-46)
+    for (int i = 0; i < 40; i += 2) {
+        dev->model[i] = (identify_buffer[27 + i / 2] >> 8) & 0xFF;
+        dev->model[i + 1] = identify_buffer[27 + i / 2] & 0xFF;
+    }
+    dev->model[40] = '\0';
+    for (int i = 39; i >= 0 && dev->model[i] == ' '; i--)
+        dev->model[i] = '\0';
+    
+    // Capacity: words 100-103 with LBA48, words 60-61 otherwise
+    if (identify_buffer[83] & (1 << 10))
+        dev->size = *((uint64_t*)(identify_buffer + 100));
+    else
+        dev->size = *((uint32_t*)(identify_buffer + 60));
+    
+    // NCQ: word 76 bit 8, queue depth - 1 in word 75 bits 4:0
+    dev->ncq = hba_ncq && (identify_buffer[76] & (1 << 8));
+    if (dev->ncq) {
+        uint32_t depth = (identify_buffer[75] & 0x1F) + 1;
+        dev->queue_depth = (uint8_t)((depth < slot_count) ? depth : slot_count);
+    } else {
+        dev->queue_depth = 1;
+    }
+    
+    // Word 217: nominal media rotation rate, 1 = solid state
+    dev->rotational = (identify_buffer[217] != 1);
+    
+    return 1;
+}
+
+// Finish the request in a slot
+static void ahci_complete_slot(uint8_t port, uint8_t slot, uint8_t error) {
+    ahci_port_state_t* p = &ports[port];
+    ahci_request_t* req = p->slots[slot];
+    
+    p->slots[slot] = NULL;
+    p->busy &= ~(1u << slot);
+    if (p->busy == 0)
+        p->noncq_active = 0;
+    
+    if (req) {
+        req->status = error ? AHCI_REQ_ERROR : AHCI_REQ_DONE;
+        if (req->complete)
+            req->complete(req);
+    }
+}
+
+// Move queued requests into free command slots. NCQ reads and writes
+// share the port up to the device's queue depth; flushes and non-NCQ
+// commands need the port to themselves. Called with interrupts disabled.
+static void ahci_dispatch(uint8_t port) {
+    ahci_port_state_t* p = &ports[port];
+    ahci_device_t* dev = &devices[p->device];
+    uint32_t ci_bits = 0;
+    uint32_t sact_bits = 0;
+    
+    while (p->queue_head && !p->noncq_active) {
+        ahci_request_t* req = p->queue_head;
+        int ncq = dev->ncq && req->op != AHCI_OP_FLUSH;
+        uint8_t slot = 0;
+        
+        if (ncq) {
+            // Find a free tag below the queue depth
+            while (slot < dev->queue_depth && (p->busy & (1u << slot)))
+                slot++;
+            if (slot >= dev->queue_depth)
+                break;
+        } else if (p->busy) {
+            break;
+        }
+        
+        p->queue_head = req->next;
+        if (!p->queue_head)
+            p->queue_tail = NULL;
+        req->next = NULL;
+        
+        int write = (req->op == AHCI_OP_WRITE);
+        int ok;
+        if (req->op == AHCI_OP_FLUSH) {
+            ok = ahci_build_command(port, slot, AHCI_ATA_CMD_FLUSH_EXT, 0, 0, NULL, 0, 0, 0, 0);
+        } else if (req->count == 0 || req->count > AHCI_MAX_SECTORS) {
+            ok = 0;
+        } else if (ncq) {
+            ok = ahci_build_command(port, slot,
+                                    write ? AHCI_ATA_CMD_WRITE_FPDMA_QUEUED : AHCI_ATA_CMD_READ_FPDMA_QUEUED,
+                                    req->lba, req->count, req->buffer, req->count * 512,
+                                    write, 1, req->flags & AHCI_REQ_FUA);
+        } else {
+            ok = ahci_build_command(port, slot,
+                                    write ? AHCI_ATA_CMD_WRITE_DMA_EXT : AHCI_ATA_CMD_READ_DMA_EXT,
+                                    req->lba, req->count, req->buffer, req->count * 512,
+                                    write, 0, 0);
+        }
+        
+        if (!ok) {
+            req->status = AHCI_REQ_ERROR;
+            if (req->complete)
+                req->complete(req);
+            continue;
+        }
+        
+        req->status = AHCI_REQ_ACTIVE;
+        p->slots[slot] = req;
+        p->busy |= (1u << slot);
+        if (ncq)
+            sact_bits |= (1u << slot);
+        else
+            p->noncq_active = 1;
+        ci_bits |= (1u << slot);
+    }
+    
+    // Issue everything collected above with one doorbell write each
+    if (sact_bits)
+        port_write(port, AHCI_PxSACT, sact_bits);
+    if (ci_bits)
+        port_write(port, AHCI_PxCI, ci_bits);
+}
+
+// Recover a port after an error: commands the device already finished
+// complete normally, the rest fail, and the port is restarted
+static void ahci_port_error(uint8_t port) {
+    ahci_port_state_t* p = &ports[port];
+    
+    serial_write("AHCI: port error, TFD=0x");
+    serial_write_hex(port_read(port, AHCI_PxTFD));
+    serial_write("\n");
+    
+    // Stopping the engine clears SACT and CI, so read them first
+    uint32_t outstanding = port_read(port, AHCI_PxSACT) | port_read(port, AHCI_PxCI);
+    
+    if (!ahci_stop_port(port))
+        serial_write("AHCI: port engine did not stop\n");
+    port_write(port, AHCI_PxSERR, 0xFFFFFFFF);
+    port_write(port, AHCI_PxIS, 0xFFFFFFFF);
+    
+    // Restart before completing: a completion may queue the next command
+    if (!ahci_start_port(port))
+        serial_write("AHCI: port did not restart\n");
+    
+    uint32_t busy = p->busy;
+    for (uint8_t slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+        if (busy & (1u << slot))
+            ahci_complete_slot(port, slot, (outstanding >> slot) & 1);
+    }
+}
+
+// Handle a port's interrupt: reap finished slots and refill the queue
+static void ahci_port_interrupt(uint8_t port) {
+    ahci_port_state_t* p = &ports[port];
+    uint32_t is = port_read(port, AHCI_PxIS);
+    port_write(port, AHCI_PxIS, is);
+    
+    if (is & AHCI_PxIS_ERROR) {
+        ahci_port_error(port);
+    } else {
+        // Slots still owned by the hardware have their SACT or CI bit set
+        uint32_t outstanding = port_read(port, AHCI_PxSACT) | port_read(port, AHCI_PxCI);
+        uint32_t done = p->busy & ~outstanding;
+        
+        for (uint8_t slot = 0; done; slot++) {
+            if (done & (1u << slot)) {
+                done &= ~(1u << slot);
+                ahci_complete_slot(port, slot, 0);
+            }
+        }
+    }
+    
+    ahci_dispatch(port);
+}
+
+// Shared PCI interrupt handler
+static void ahci_irq_handler(uint8_t irq) {
+    (void)irq;
+    
+    uint32_t is = ahci_read(AHCI_REG_IS);
+    if (is == 0)
+        return; // Not ours
+    
+    for (uint8_t port = 0; port < AHCI_MAX_PORTS; port++) {
+        if ((is & (1u << port)) && ports[port].cmd_list)
+            ahci_port_interrupt(port);
+    }
+    
+    ahci_write(AHCI_REG_IS, is);
+}
+
+// MSI handler. The message cannot come from another device, and the
+// local APIC EOI replaces the PIC sequence.
+static void ahci_msi_handler(void* data) {
+    (void)data;
+    ahci_irq_handler(irq_line);
+}
+
+// Signal completions by MSI when the HBA supports it. AHCI's multiple
+// message mode needs an aligned block of vectors, so all ports share one
+// message. Returns 0 if the HBA stays on INTx.
+static int ahci_setup_msi(void) {
+    int vector = msi_alloc_vector(ahci_msi_handler, NULL);
+    
+    if (vector < 0)
+        return 0;
+    if (!pci_enable_msi(pci_dev, (uint8_t)vector, 0)) {
+        msi_free_vector((uint8_t)vector);
+        return 0;
+    }
+    return 1;
+}
+
+void init_ahci(void) {
+    serial_write("Scanning for AHCI controllers...\n");
+    device_count = 0;
+    
+    pci_device_t* dev = NULL;
+    while (!abar && (dev = pci_find_class(AHCI_PCI_CLASS, AHCI_PCI_SUBCLASS, dev)) != NULL) {
+        if (dev->prog_if != AHCI_PCI_PROGIF)
+            continue;
+        
+        // ABAR is BAR5; enable memory decoding and bus mastering
+        abar = pci_bar_memory(dev, 5);
+        if (!abar)
+            continue;
+        pci_enable_device(dev, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+        irq_line = dev->irq;
+        pci_dev = dev;
+        
+        serial_write("Found AHCI controller: Vendor=0x");
+        serial_write_hex(dev->vendor_id);
+        serial_write(" ABAR=0x");
+        serial_write_hex(abar);
+        serial_write("\n");
+    }
+    
+    if (!abar) {
+        serial_write("No AHCI controller detected\n");
+        return;
+    }
+    
+    ahci_write(AHCI_REG_GHC, ahci_read(AHCI_REG_GHC) | AHCI_GHC_AE);
+    
+    uint32_t cap = ahci_read(AHCI_REG_CAP);
+    slot_count = ((cap >> AHCI_CAP_NCS_SHIFT) & AHCI_CAP_NCS_MASK) + 1;
+    hba_ncq = (cap & AHCI_CAP_SNCQ) ? 1 : 0;
+    uint32_t pi = ahci_read(AHCI_REG_PI);
+    
+    for (uint8_t port = 0; port < AHCI_MAX_PORTS; port++) {
+        if (!(pi & (1u << port)))
+            continue;
+        
+        // Only ports with an established link to an ATA disk
+        if ((port_read(port, AHCI_PxSSTS) & AHCI_SSTS_DET_MASK) != AHCI_SSTS_DET_PRESENT)
+            continue;
+        if (port_read(port, AHCI_PxSIG) != AHCI_SIG_ATA)
+            continue;
+        
+        if (device_count >= AHCI_MAX_DEVICES)
+            break;
+        
+        if (!ahci_port_init(port) || !ahci_identify(port)) {
+            serial_write("  AHCI port failed to initialize\n");
+            continue;
+        }
+        
+        ports[port].device = (uint8_t)device_count;
+        device_count++;
+        
+        // Completion interrupts: D2H register FIS, set device bits (NCQ), errors
+        port_write(port, AHCI_PxIS, 0xFFFFFFFF);
+        port_write(port, AHCI_PxIE, AHCI_PxIS_DHRS | AHCI_PxIS_SDBS | AHCI_PxIS_ERROR);
+    }
+    
+    if (device_count > 0) {
+        if (ahci_setup_msi())
+            serial_write("  AHCI interrupts use MSI\n");
+        else
+            irq_install_handler(irq_line, ahci_irq_handler);
+        ahci_write(AHCI_REG_IS, 0xFFFFFFFF);
+        ahci_write(AHCI_REG_GHC, ahci_read(AHCI_REG_GHC) | AHCI_GHC_IE);
+    }
+    
+    ahci_blk_register();
+    serial_write("AHCI initialization complete\n");
+}
+
+// Queue a request on its port. Returns immediately; completion is
+// signalled through req->status and req->complete.
+void ahci_submit(ahci_request_t* req) {
+    if (req->device >= device_count) {
+        req->status = AHCI_REQ_ERROR;
+        if (req->complete)
+            req->complete(req);
+        return;
+    }
+    
+    ahci_port_state_t* p = &ports[devices[req->device].port];
+    req->next = NULL;
+    req->status = AHCI_REQ_QUEUED;
+    
+    uint32_t flags = irq_save();
+    
+    if (p->queue_tail)
+        p->queue_tail->next = req;
+    else
+        p->queue_head = req;
+    p->queue_tail = req;
+    
+    ahci_dispatch(devices[req->device].port);
+    
+    irq_restore(flags);
+}
+
+// Sleep until a request finishes. A lost interrupt is recovered by
+// polling the port; a command stuck for twice the timeout fails the port.
+uint8_t ahci_wait(ahci_request_t* req) {
+    uint32_t start = timer_ticks();
+    uint32_t flags = irq_save();
+    
+    while (req->status == AHCI_REQ_QUEUED || req->status == AHCI_REQ_ACTIVE) {
+        uint32_t elapsed = timer_ticks() - start;
+        uint8_t port = devices[req->device].port;
+        
+        if (elapsed >= 2 * AHCI_TIMEOUT_MS) {
+            ahci_port_error(port);
+            ahci_dispatch(port);
+            start = timer_ticks();
+            continue;
+        }
+        if (elapsed >= AHCI_TIMEOUT_MS)
+            ahci_port_interrupt(port);
+        
+        irq_wait();
+    }
+    
+    irq_restore(flags);
+    return (req->status == AHCI_REQ_DONE) ? 0 : 1;
+}
+
+// Submit a request and sleep until it completes
+static uint8_t ahci_do_request(uint8_t device, uint8_t op, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    ahci_request_t req;
+    
+    req.device = device;
+    req.op = op;
+    req.flags = 0;
+    req.lba = lba;
+    req.count = count;
+    req.buffer = buffer;
+    req.complete = NULL;
+    req.private_data = NULL;
+    
+    ahci_submit(&req);
+    return ahci_wait(&req);
+}
+
+uint8_t ahci_read_sectors(uint8_t device, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    return ahci_do_request(device, AHCI_OP_READ, lba, count, buffer);
+}
+
+uint8_t ahci_write_sectors(uint8_t device, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    return ahci_do_request(device, AHCI_OP_WRITE, lba, count, buffer);
+}
+
+uint8_t ahci_flush(uint8_t device) {
+    return ahci_do_request(device, AHCI_OP_FLUSH, 0, 0, NULL);
+}
+
+// Block layer glue. Requests are keyed by block layer tag; each one is a
+// single contiguous buffer since the command table has few PRD entries.
+static ahci_request_t blk_native[BLK_REQUEST_POOL];
+
+static void ahci_blk_complete(ahci_request_t* req) {
+    blk_end_request((blk_request_t*)req->private_data, req->status != AHCI_REQ_DONE);
+}
+
+static void ahci_blk_submit(blkdev_t* bdev, blk_request_t* req) {
+    ahci_request_t* native = &blk_native[req->tag];
+    
+    native->device = (uint8_t)(uintptr_t)bdev->driver_data;
+    native->op = (req->op == BIO_FLUSH) ? AHCI_OP_FLUSH :
+                 (req->op == BIO_WRITE) ? AHCI_OP_WRITE : AHCI_OP_READ;
+    native->flags = (req->flags & BIO_FUA) ? AHCI_REQ_FUA : 0;
+    native->lba = req->sector;
+    native->count = req->count;
+    native->buffer = req->nsg ? (uint8_t*)req->sg[0].addr : NULL;
+    native->complete = ahci_blk_complete;
+    native->private_data = req;
+    
+    ahci_submit(native);
+}
+
+// A block layer waiter gave up after BLK_TIMEOUT_MS, twice the AHCI
+// timeout: reap a lost interrupt, and fail the port if commands are
+// still stuck, as ahci_wait() does
+static void ahci_blk_timeout(blkdev_t* bdev) {
+    uint8_t port = devices[(uintptr_t)bdev->driver_data].port;
+    
+    ahci_port_interrupt(port);
+    if (ports[port].busy) {
+        ahci_port_error(port);
+        ahci_dispatch(port);
+    }
+}
+
+static const blkdev_ops_t ahci_blk_ops = {
+    ahci_blk_submit,
+    NULL,
+    NULL,
+    ahci_blk_timeout,
+};
+
+// Register the SATA disks with the block layer as ahci0, ahci1, ...
+static void ahci_blk_register(void) {
+    for (int i = 0; i < device_count; i++) {
+        ahci_device_t* dev = &devices[i];
+        // FUA is only defined for the NCQ write command
+        uint32_t flags = (dev->rotational ? BLKDEV_ROTATIONAL : 0) | (dev->ncq ? BLKDEV_FUA : 0);
+        blkdev_t* bdev = blk_register("ahci", &ahci_blk_ops, (void*)(uintptr_t)i, 512, dev->size, flags);
+        if (!bdev)
+            return;
+        
+        bdev->max_sectors = AHCI_MAX_SECTORS;
+        bdev->max_segments = 1;
+        bdev->queue_depth = dev->queue_depth;
+    }
+}
+
+void ahci_print_devices(void) {
+    if (device_count == 0) {
+        return; // Don't print anything if no devices
+    }
+    
+    terminal_writestring("\nSATA Devices:\n");
+    terminal_writestring("=============\n");
+    serial_write("\nSATA Devices:\n");
+    
+    for (int i = 0; i < device_count; i++) {
+        ahci_device_t* dev = &devices[i];
+        char num_str[16];
+        
+        terminal_writestring("Device ");
+        terminal_putchar('0' + i);
+        terminal_writestring(": Port ");
+        format_number(dev->port, num_str);
+        terminal_writestring(num_str);
+        terminal_writestring(" - SATA HDD\n");
+        serial_write("  Type: SATA Hard Disk\n");
+        
+        terminal_writestring("  Model: ");
+        terminal_writestring(dev->model);
+        terminal_writestring("\n");
+        serial_write("  Model: ");
+        serial_write(dev->model);
+        serial_write("\n");
+        
+        format_number((uint32_t)(dev->size >> 11), num_str);
+        terminal_writestring("  Size: ");
+        terminal_writestring(num_str);
+        terminal_writestring(" MB\n");
+        serial_write("  Size: ");
+        serial_write(num_str);
+        serial_write(" MB\n");
+        
+        if (dev->ncq) {
+            format_number(dev->queue_depth, num_str);
+            terminal_writestring("  NCQ depth: ");
+            terminal_writestring(num_str);
+            terminal_writestring("\n");
+            serial_write("  NCQ depth: ");
+            serial_write(num_str);
+            serial_write("\n");
+        }
+    }
+}
+
+int ahci_get_device_count(void) {
+    return device_count;
+}
+
+ahci_device_t* ahci_get_device(int index) {
+    if (index < 0 || index >= device_count)
+        return NULL;
+    return &devices[index];
+}
@@ -0,0 +1,359 @@
+#include "bench.h"
+#include "irq.h"
+#include "timer.h"
+#include "kernel.h"
+
+// fio-like block benchmark run from the kernel command line. A job keeps
+// queue_depth bios in flight through the block layer, so the device queue,
+// scheduler and driver are measured as a consumer sees them. Write jobs
+// overwrite the device: point them at scratch disks only.
+
+static const char* pattern_names[4] = { "read", "write", "randread", "randwrite" };
+
+static uint8_t* bench_buffer = NULL;            // Allocated once, reused by every job
+static uint32_t latency[BENCH_LAT_BUCKETS];
+
+// One I/O slot
+typedef struct {
+    bio_t    bio;
+    uint32_t start;             // timer_cycles() at submission
+    uint32_t start_ticks;
+    uint32_t end;               // Stamped by the completion
+    uint32_t end_ticks;
+} bench_slot_t;
+
+static bench_slot_t slots[BENCH_MAX_QD];
+
+// 64-bit by 32-bit division by shift and subtract; the kernel is not
+// linked against libgcc
+static uint64_t bench_div64(uint64_t n, uint32_t d) {
+    uint64_t q = 0;
+    uint64_t r = 0;
+    
+    for (int i = 63; i >= 0; i--) {
+        r = (r << 1) | ((n >> i) & 1);
+        if (r >= d) {
+            r -= d;
+            q |= 1ULL << i;
+        }
+    }
+    return q;
+}
+
+static uint32_t bench_random(uint32_t* state) {
+    uint32_t x = *state;       // xorshift32
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int bench_latency_bucket(uint32_t us) {
+    if (us < (1U << BENCH_LAT_SUB_BITS))
+        return (int)us;
+    
+    int msb = 31 - __builtin_clz(us);
+    int shift = msb - BENCH_LAT_SUB_BITS;
+    return ((shift + 1) << BENCH_LAT_SUB_BITS) + (int)((us >> shift) & ((1U << BENCH_LAT_SUB_BITS) - 1));
+}
+
+// Largest latency that falls in a bucket
+static uint32_t bench_bucket_limit(int bucket) {
+    uint32_t sub = 1U << BENCH_LAT_SUB_BITS;
+    
+    if (bucket < (int)sub)
+        return (uint32_t)bucket;
+    
+    int shift = (bucket >> BENCH_LAT_SUB_BITS) - 1;
+    uint32_t base = sub + (bucket & (sub - 1));
+    return ((base + 1) << shift) - 1;
+}
+
+// Latency below which `permille` of the I/Os completed
+static uint32_t bench_percentile(uint32_t count, uint32_t permille) {
+    uint32_t rank = (uint32_t)bench_div64((uint64_t)count * permille + 999, 1000);
+    uint32_t seen = 0;
+    
+    for (int i = 0; i < BENCH_LAT_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen >= rank && seen > 0)
+            return bench_bucket_limit(i);
+    }
+    return 0;
+}
+
+static void bench_end_io(bio_t* bio) {
+    bench_slot_t* slot = (bench_slot_t*)bio->private_data;
+    
+    slot->end = timer_cycles();
+    slot->end_ticks = timer_ticks();
+}
+
+// Run a job to completion. Returns 0 if the job does not fit the device
+// or the limits.
+int bench_run(const bench_job_t* job, bench_result_t* result) {
+    blkdev_t* dev = job->dev;
+    uint32_t blocks = job->block_size / dev->block_size;
+    
+    memset(result, 0, sizeof(bench_result_t));
+    if (blocks == 0 || blocks * dev->block_size != job->block_size ||
+        (blocks & (blocks - 1)) != 0 || blocks > dev->max_sectors)
+        return 0;
+    if (job->queue_depth == 0 || job->queue_depth > BENCH_MAX_QD ||
+        job->queue_depth * job->block_size > BENCH_MAX_BUFFER)
+        return 0;
+    
+    uint32_t shift = 0;
+    while ((1U << shift) < blocks)
+        shift++;
+    uint64_t units64 = dev->size >> shift;
+    uint32_t units = units64 > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)units64;
+    if (units < job->queue_depth)
+        return 0;
+    
+    if (!bench_buffer) {
+        bench_buffer = (uint8_t*)kmalloc_aligned(BENCH_MAX_BUFFER, PAGE_SIZE);
+        if (!bench_buffer)
+            return 0;
+        for (uint32_t i = 0; i < BENCH_MAX_BUFFER; i++)
+            bench_buffer[i] = (uint8_t)(i * 7 + 1);
+    }
+    memset(latency, 0, sizeof(latency));
+    
+    int write = job->pattern == BENCH_WRITE || job->pattern == BENCH_RANDWRITE;
+    int random = job->pattern == BENCH_RANDREAD || job->pattern == BENCH_RANDWRITE;
+    uint32_t seed = 0x2545F491 ^ timer_ticks();
+    uint32_t next_unit = 0;
+    uint32_t duration = job->seconds * 1000;
+    uint32_t start = timer_ticks();
+    uint32_t max_us = 0;
+    uint32_t progress = start;          // Last completion, for stall recovery
+    int inflight = 0;
+    int stop = 0;
+    
+    uint32_t flags = irq_save();
+    for (;;) {
+        // Reap finished slots and refill them until the run time is up
+        for (uint32_t i = 0; i < job->queue_depth; i++) {
+            bench_slot_t* slot = &slots[i];
+            
+            if (slot->bio.private_data) {
+                if (slot->bio.status == BIO_PENDING)
+                    continue;
+                
+                uint32_t us = slot->start ? timer_cycles_to_us(slot->end - slot->start)
+                                          : (slot->end_ticks - slot->start_ticks) * 1000;
+                latency[bench_latency_bucket(us)]++;
+                if (us > max_us)
+                    max_us = us;
+                if (slot->bio.status == BIO_ERROR)
+                    result->errors++;
+                result->ios++;
+                slot->bio.private_data = NULL;
+                inflight--;
+                progress = timer_ticks();
+            }
+            
+            if (stop)
+                continue;
+            
+            uint32_t unit = random ? bench_random(&seed) % units : next_unit;
+            next_unit = (next_unit + 1 < units) ? next_unit + 1 : 0;
+            
+            slot->bio.sector = (uint64_t)unit << shift;
+            slot->bio.count = blocks;
+            slot->bio.buffer = bench_buffer + i * job->block_size;
+            slot->bio.op = write ? BIO_WRITE : BIO_READ;
+            slot->bio.flags = 0;
+            slot->bio.end_io = bench_end_io;
+            slot->bio.private_data = slot;
+            slot->start = timer_cycles();
+            slot->start_ticks = timer_ticks();
+            inflight++;
+            blk_submit_bio(dev, &slot->bio);
+        }
+        
+        if (!stop && timer_ticks() - start >= duration)
+            stop = 1;
+        if (stop && inflight == 0)
+            break;
+        if (timer_ticks() - progress >= BLK_TIMEOUT_MS) {
+            blk_timeout(dev);
+            progress = timer_ticks();
+        }
+        irq_wait();
+    }
+    irq_restore(flags);
+    
+    result->elapsed_ms = timer_ticks() - start;
+    if (result->elapsed_ms == 0)
+        result->elapsed_ms = 1;
+    result->iops = (uint32_t)bench_div64((uint64_t)result->ios * 1000, result->elapsed_ms);
+    result->kib_per_sec = (uint32_t)bench_div64(((uint64_t)result->ios * job->block_size * 1000) >> 10,
+                                                result->elapsed_ms);
+    result->p50_us = bench_percentile(result->ios, 500);
+    result->p99_us = bench_percentile(result->ios, 990);
+    result->p999_us = bench_percentile(result->ios, 999);
+    result->max_us = max_us;
+    return 1;
+}
+
+static void bench_field(const char* key, uint32_t value) {
+    char num_str[12];
+    
+    serial_write(" ");
+    serial_write(key);
+    serial_write("=");
+    format_number(value, num_str);
+    serial_write(num_str);
+}
+
+static void bench_report(const bench_job_t* job, const bench_result_t* result) {
+    char num_str[12];
+    
+    serial_write("bench blk dev=");
+    serial_write(job->dev->name);
+    serial_write(" rw=");
+    serial_write(pattern_names[job->pattern]);
+    bench_field("bs", job->block_size);
+    bench_field("qd", job->queue_depth);
+    bench_field("runtime_ms", result->elapsed_ms);
+    bench_field("ios", result->ios);
+    bench_field("errors", result->errors);
+    bench_field("iops", result->iops);
+    
+    // MB/s with one decimal
+    uint32_t tenths = (uint32_t)bench_div64((uint64_t)result->kib_per_sec * 10, 1024);
+    serial_write(" mbps=");
+    format_number(tenths / 10, num_str);
+    serial_write(num_str);
+    serial_write(".");
+    format_number(tenths % 10, num_str);
+    serial_write(num_str);
+    
+    bench_field("p50_us", result->p50_us);
+    bench_field("p99_us", result->p99_us);
+    bench_field("p999_us", result->p999_us);
+    bench_field("max_us", result->max_us);
+    serial_write("\n");
+}
+
+// Size such as 512, 4k or 1m
+static uint32_t bench_parse_size(const char** p) {
+    uint32_t value = 0;
+    
+    while (**p >= '0' && **p <= '9')
+        value = value * 10 + (uint32_t)(*(*p)++ - '0');
+    if (**p == 'k' || **p == 'K') {
+        value <<= 10;
+        (*p)++;
+    } else if (**p == 'm' || **p == 'M') {
+        value <<= 20;
+        (*p)++;
+    }
+    return value;
+}
+
+// Does the field at p, up to the next comma or space, equal word?
+static int bench_field_is(const char* p, const char* word) {
+    while (*word && *p == *word) {
+        p++;
+        word++;
+    }
+    return !*word && (*p == ',' || *p == ' ' || *p == '\0');
+}
+
+// Parse "blk:<dev>,<pattern>[,<size>][,qd<n>][,<seconds>s]" (after
+// "bench="). Returns 0 on a malformed job.
+static int bench_parse_job(const char* p, bench_job_t* job) {
+    char name[BLK_NAME_LEN];
+    int len = 0;
+    
+    job->dev = NULL;
+    job->pattern = BENCH_READ;
+    job->block_size = BENCH_DEFAULT_BS;
+    job->queue_depth = BENCH_DEFAULT_QD;
+    job->seconds = BENCH_DEFAULT_SECONDS;
+    
+    if (p[0] != 'b' || p[1] != 'l' || p[2] != 'k' || p[3] != ':')
+        return 0;
+    p += 4;
+    
+    while (*p && *p != ',' && *p != ' ') {
+        if (len < BLK_NAME_LEN - 1)
+            name[len++] = *p;
+        p++;
+    }
+    name[len] = '\0';
+    job->dev = blk_find_device(name);
+    if (!job->dev)
+        return 0;
+    
+    while (*p == ',') {
+        p++;
+        
+        int matched = 0;
+        for (uint8_t i = 0; i < 4; i++) {
+            if (bench_field_is(p, pattern_names[i])) {
+                job->pattern = i;
+                matched = 1;
+            }
+        }
+        
+        if (matched) {
+            while (*p && *p != ',' && *p != ' ')
+                p++;
+        } else if (p[0] == 'q' && p[1] == 'd') {
+            p += 2;
+            job->queue_depth = bench_parse_size(&p);
+        } else if (*p >= '0' && *p <= '9') {
+            uint32_t value = bench_parse_size(&p);
+            if (*p == 's') {
+                job->seconds = value;
+                p++;
+            } else {
+                job->block_size = value;
+            }
+        } else {
+            return 0;
+        }
+        
+        if (*p && *p != ',' && *p != ' ')
+            return 0;
+    }
+    return job->seconds > 0;
+}
+
+// Run every bench= job on the command line in order. With bench_exit,
+// power off through QEMU's isa-debug-exit afterwards.
+void bench_run_cmdline(const char* cmdline) {
+    const char* p = cmdline;
+    
+    if (!cmdline)
+        return;
+    
+    while (*p) {
+        if ((p == cmdline || p[-1] == ' ') && bench_field_is(p, "bench_exit")) {
+            serial_write("bench done\n");
+            outl(BENCH_DEBUG_EXIT_PORT, 0);
+        }
+        
+        if ((p == cmdline || p[-1] == ' ') &&
+            p[0] == 'b' && p[1] == 'e' && p[2] == 'n' && p[3] == 'c' && p[4] == 'h' && p[5] == '=') {
+            bench_job_t job;
+            bench_result_t result;
+            
+            if (!bench_parse_job(p + 6, &job)) {
+                serial_write("bench: bad job\n");
+            } else if (!bench_run(&job, &result)) {
+                serial_write("bench: job does not fit ");
+                serial_write(job.dev->name);
+                serial_write("\n");
+            } else {
+                bench_report(&job, &result);
+            }
+        }
+        p++;
+    }
+}
@@ -0,0 +1,804 @@
+#include "blkdev.h"
+#include "irq.h"
+#include "timer.h"
+#include "kernel.h"
+
+static blkdev_t devices[BLK_MAX_DEVICES];
+static int device_count = 0;
+
+// Request pool shared by all devices; free entries are chained through
+// fifo_next
+static blk_request_t request_pool[BLK_REQUEST_POOL];
+static blk_request_t* free_requests = NULL;
+
+static const elevator_ops_t* elevators[] = {
+    &elevator_noop,
+    &elevator_deadline,
+};
+
+// 64-bit number to decimal string, digit by digit without 64-bit division
+static void blk_format_number64(uint64_t value, char* str) {
+    uint64_t powers[20];
+    int pos = 0;
+    
+    powers[0] = 1;
+    for (int i = 1; i < 20; i++)
+        powers[i] = powers[i - 1] * 10;
+    
+    for (int i = 19; i >= 0; i--) {
+        char digit = '0';
+        while (value >= powers[i]) {
+            value -= powers[i];
+            digit++;
+        }
+        if (pos > 0 || digit != '0' || i == 0)
+            str[pos++] = digit;
+    }
+    str[pos] = '\0';
+}
+
+void init_blkdev(void) {
+    device_count = 0;
+    free_requests = NULL;
+    
+    for (int i = BLK_REQUEST_POOL - 1; i >= 0; i--) {
+        request_pool[i].tag = (uint16_t)i;
+        request_pool[i].fifo_next = free_requests;
+        free_requests = &request_pool[i];
+    }
+    
+    serial_write("Block layer initialized\n");
+}
+
+// Register a disk as <prefix><n>, numbered per prefix. Drivers adjust the
+// queue limits in the returned device before submitting I/O.
+blkdev_t* blk_register(const char* prefix, const blkdev_ops_t* ops, void* driver_data,
+                       uint32_t block_size, uint64_t size, uint32_t flags) {
+    if (device_count >= BLK_MAX_DEVICES)
+        return NULL;
+    
+    blkdev_t* dev = &devices[device_count];
+    memset(dev, 0, sizeof(blkdev_t));
+    
+    // Name: prefix followed by the number of devices already using it
+    int len = 0;
+    while (prefix[len] && len < BLK_NAME_LEN - 3) {
+        dev->name[len] = prefix[len];
+        len++;
+    }
+    dev->name[len] = '\0';
+    
+    int unit = 0;
+    for (int i = 0; i < device_count; i++) {
+        int j = 0;
+        while (j < len && devices[i].name[j] == dev->name[j])
+            j++;
+        if (j == len && devices[i].name[j] >= '0' && devices[i].name[j] <= '9')
+            unit++;
+    }
+    if (unit >= 10)
+        dev->name[len++] = '0' + unit / 10;
+    dev->name[len++] = '0' + unit % 10;
+    dev->name[len] = '\0';
+    
+    dev->ops = ops;
+    dev->driver_data = driver_data;
+    dev->flags = flags;
+    dev->block_size = block_size;
+    dev->size = size;
+    dev->max_sectors = 256;
+    dev->max_segments = 1;
+    dev->queue_depth = 1;
+    
+    // Seek-bound disks get deadline; flash and virtual disks gain nothing
+    // from sorting
+    dev->elevator = (flags & BLKDEV_ROTATIONAL) ? &elevator_deadline : &elevator_noop;
+    dev->elevator->init(dev);
+    
+    device_count++;
+    
+    serial_write("Block device ");
+    serial_write(dev->name);
+    serial_write(" registered (");
+    serial_write(dev->elevator->name);
+    serial_write(")\n");
+    return dev;
+}
+
+int blk_get_device_count(void) {
+    return device_count;
+}
+
+blkdev_t* blk_get_device(int index) {
+    if (index < 0 || index >= device_count)
+        return NULL;
+    return &devices[index];
+}
+
+blkdev_t* blk_find_device(const char* name) {
+    for (int i = 0; i < device_count; i++) {
+        if (strcmp(devices[i].name, name) == 0)
+            return &devices[i];
+    }
+    return NULL;
+}
+
+// Switch schedulers; only allowed while nothing is queued
+int blk_set_elevator(blkdev_t* dev, const char* name) {
+    for (uint32_t i = 0; i < sizeof(elevators) / sizeof(elevators[0]); i++) {
+        if (strcmp(elevators[i]->name, name) != 0)
+            continue;
+        
+        uint32_t flags = irq_save();
+        if (dev->queued) {
+            irq_restore(flags);
+            return 0;
+        }
+        dev->elevator = elevators[i];
+        memset(&dev->queue, 0, sizeof(elevator_queue_t));
+        dev->elevator->init(dev);
+        irq_restore(flags);
+        return 1;
+    }
+    return 0;
+}
+
+// Switch how waiters collect completions. Hybrid polling needs a driver
+// poll hook; without a TSC no service times are measured and it never
+// engages.
+int blk_set_poll_mode(blkdev_t* dev, uint8_t mode) {
+    if (mode != BLK_POLL_OFF && (mode != BLK_POLL_HYBRID || !dev->ops->poll))
+        return 0;
+    
+    dev->poll_mode = mode;
+    return 1;
+}
+
+void blk_reset_latency(blkdev_t* dev) {
+    uint32_t flags = irq_save();
+    memset(dev->latency, 0, sizeof(dev->latency));
+    dev->polled = 0;
+    irq_restore(flags);
+}
+
+// Log2 histogram bucket of a time in microseconds
+static int blk_latency_bucket(uint32_t us) {
+    int bucket = 0;
+    
+    while (bucket < BLK_LAT_BUCKETS - 1 && (us >> (bucket + 1)) != 0)
+        bucket++;
+    return bucket;
+}
+
+// Integrate busy time and queue depth up to now. Called just before
+// inflight changes, with interrupts disabled. Gaps of a second or more
+// overflow the cycle counter and are taken from the millisecond tick.
+static void blk_stats_advance(blkdev_t* dev) {
+    blk_stats_t* st = &dev->stats;
+    uint32_t cycles = timer_cycles();
+    uint32_t ticks = timer_ticks();
+    
+    if (dev->inflight > 0) {
+        uint32_t us = (ticks - st->last_ticks) * 1000;
+        if (cycles && ticks - st->last_ticks < 1000)
+            us = timer_cycles_to_us(cycles - st->last_cycles);
+        st->busy_us += us;
+        st->queue_us += (uint64_t)us * dev->inflight;
+    }
+    st->last_cycles = cycles;
+    st->last_ticks = ticks;
+}
+
+// Account a finished request: counters, and its service time (dispatch to
+// completion) for the histograms and the hybrid polling estimate
+static void blk_account(blkdev_t* dev, blk_request_t* req, int error) {
+    blk_stats_t* st = &dev->stats;
+    
+    // An emulated FUA write ends as the flush behind it
+    uint8_t op = (req->op == BIO_FLUSH && (req->flags & BIO_FUA)) ? BIO_WRITE : req->op;
+    
+    st->ios[op]++;
+    if (op != BIO_FLUSH)
+        st->sectors[op] += req->count;
+    if (error)
+        st->errors++;
+    
+    if (!req->start)
+        return;     // No TSC
+    
+    uint32_t us = timer_cycles_to_us(timer_cycles() - req->start);
+    int bucket = blk_latency_bucket(us);
+    st->latency[op][bucket]++;
+    dev->latency[dev->poll_mode][bucket]++;
+    
+    // Moving average weighting the new sample 1/8
+    dev->mean_us = dev->mean_us ? dev->mean_us - (dev->mean_us >> 3) + (us >> 3) : us;
+    if (dev->mean_us == 0)
+        dev->mean_us = 1;
+    
+    if (dev->polling)
+        dev->polled++;
+}
+
+// Whether bio can join a queued request without breaking the device's
+// size and scatter list limits
+int blk_can_merge(blkdev_t* dev, blk_request_t* req, bio_t* bio, int front) {
+    if (req->op != bio->op || req->flags != bio->flags || req->op == BIO_FLUSH)
+        return 0;
+    if (req->count + bio->count > dev->max_sectors)
+        return 0;
+    
+    uint32_t bytes = bio->count * dev->block_size;
+    uint32_t addr = (uint32_t)bio->buffer;
+    uint32_t max_segments = dev->max_segments < BLK_MAX_SEGMENTS ? dev->max_segments : BLK_MAX_SEGMENTS;
+    
+    if (front) {
+        if (bio->sector + bio->count != req->sector)
+            return 0;
+        if (addr + bytes == req->sg[0].addr)
+            return 1; // Extends the first segment
+    } else {
+        if (req->sector + req->count != bio->sector)
+            return 0;
+        blk_sg_t* last = &req->sg[req->nsg - 1];
+        if (last->addr + last->length == addr)
+            return 1; // Extends the last segment
+    }
+    
+    return req->nsg < max_segments;
+}
+
+static void blk_merge_bio(blkdev_t* dev, blk_request_t* req, bio_t* bio, int front) {
+    uint32_t bytes = bio->count * dev->block_size;
+    uint32_t addr = (uint32_t)bio->buffer;
+    
+    if (front) {
+        if (addr + bytes == req->sg[0].addr) {
+            req->sg[0].addr = addr;
+            req->sg[0].length += bytes;
+        } else {
+            for (uint32_t i = req->nsg; i > 0; i--)
+                req->sg[i] = req->sg[i - 1];
+            req->sg[0].addr = addr;
+            req->sg[0].length = bytes;
+            req->nsg++;
+        }
+        bio->next = req->bio_head;
+        req->bio_head = bio;
+        req->sector = bio->sector;
+    } else {
+        blk_sg_t* last = &req->sg[req->nsg - 1];
+        if (last->addr + last->length == addr) {
+            last->length += bytes;
+        } else {
+            req->sg[req->nsg].addr = addr;
+            req->sg[req->nsg].length = bytes;
+            req->nsg++;
+        }
+        req->bio_tail->next = bio;
+        req->bio_tail = bio;
+    }
+    
+    req->count += bio->count;
+}
+
+// Hand queued requests to the driver until it holds queue_depth of them,
+// then notify the hardware once. Called with interrupts disabled.
+static void blk_dispatch(blkdev_t* dev, int force) {
+    int issued = 0;
+    
+    if ((dev->plugged && !force) || dev->dispatching)
+        return;
+    dev->dispatching = 1;
+    
+    while (dev->inflight < dev->queue_depth) {
+        blk_request_t* req = dev->flush_head;
+        
+        if (req) {
+            dev->flush_head = req->fifo_next;
+            if (!dev->flush_head)
+                dev->flush_tail = NULL;
+        } else {
+            req = dev->elevator->dispatch(dev);
+            if (!req)
+                break;
+        }
+        
+        req->fifo_next = NULL;
+        req->start = timer_cycles();
+        blk_stats_advance(dev);
+        dev->queued--;
+        dev->inflight++;
+        if (dev->inflight > dev->stats.max_inflight)
+            dev->stats.max_inflight = dev->inflight;
+        dev->ops->submit(dev, req);
+        issued++;
+    }
+    
+    if (issued && dev->ops->commit)
+        dev->ops->commit(dev);
+    
+    dev->dispatching = 0;
+}
+
+static void blk_free_request(blk_request_t* req) {
+    if (req->reserve) {
+        req->fifo_next = req->reserve->free;
+        req->reserve->free = req;
+        return;
+    }
+    req->fifo_next = free_requests;
+    free_requests = req;
+}
+
+// Move `count` requests from the shared pool into a private reserve. Done
+// at setup, while the pool is idle. Returns 0 if too few are free.
+int blk_reserve_init(blk_reserve_t* reserve, uint32_t count) {
+    uint32_t flags = irq_save();
+    
+    reserve->free = NULL;
+    reserve->count = 0;
+    while (reserve->count < count && free_requests) {
+        blk_request_t* req = free_requests;
+        free_requests = req->fifo_next;
+        req->reserve = reserve;
+        req->fifo_next = reserve->free;
+        reserve->free = req;
+        reserve->count++;
+    }
+    irq_restore(flags);
+    
+    if (reserve->count < count) {
+        blk_reserve_release(reserve);
+        return 0;
+    }
+    return 1;
+}
+
+// Return an idle reserve's requests to the shared pool
+void blk_reserve_release(blk_reserve_t* reserve) {
+    uint32_t flags = irq_save();
+    
+    while (reserve->free) {
+        blk_request_t* req = reserve->free;
+        reserve->free = req->fifo_next;
+        req->reserve = NULL;
+        blk_free_request(req);
+    }
+    reserve->count = 0;
+    irq_restore(flags);
+}
+
+static void blk_end_bio(bio_t* bio, int error) {
+    bio->status = error ? BIO_ERROR : BIO_DONE;
+    if (bio->end_io)
+        bio->end_io(bio);
+}
+
+// Completion from the driver, usually in interrupt context. Ends every
+// bio in the request and dispatches more work.
+void blk_end_request(blk_request_t* req, int error) {
+    blkdev_t* dev = req->dev;
+    uint32_t flags = irq_save();
+    
+    // Emulate FUA on devices without it: the write is only complete once
+    // a cache flush behind it has finished
+    if (!error && req->op == BIO_WRITE && (req->flags & BIO_FUA) &&
+        !(dev->flags & BLKDEV_FUA)) {
+        req->op = BIO_FLUSH;
+        dev->ops->submit(dev, req);
+        if (dev->ops->commit)
+            dev->ops->commit(dev);
+        irq_restore(flags);
+        return;
+    }
+    
+    blk_account(dev, req, error);
+    
+    bio_t* bio = req->bio_head;
+    while (bio) {
+        bio_t* next = bio->next;
+        bio->next = NULL;
+        blk_end_bio(bio, error);
+        bio = next;
+    }
+    
+    blk_stats_advance(dev);
+    dev->inflight--;
+    blk_free_request(req);
+    blk_dispatch(dev, 0);
+    
+    irq_restore(flags);
+}
+
+static void blk_queue_bio(blkdev_t* dev, bio_t* bio, blk_reserve_t* reserve) {
+    bio->dev = dev;
+    bio->next = NULL;
+    bio->status = BIO_PENDING;
+    
+    if (bio->op != BIO_FLUSH &&
+        (bio->count == 0 || bio->count > dev->max_sectors ||
+         bio->sector + bio->count > dev->size)) {
+        blk_end_bio(bio, 1);
+        return;
+    }
+    
+    uint32_t flags = irq_save();
+    
+    if (bio->op != BIO_FLUSH) {
+        int front = 0;
+        blk_request_t* req = dev->elevator->find_merge(dev, bio, &front);
+        
+        if (req) {
+            dev->stats.merges[bio->op]++;
+            blk_merge_bio(dev, req, bio, front);
+            dev->elevator->merged(dev, req, front);
+            irq_restore(flags);
+            return;
+        }
+    }
+    
+    blk_request_t* req;
+    if (reserve) {
+        // Sized by the owner to cover everything it keeps in flight
+        req = reserve->free;
+        if (!req) {
+            irq_restore(flags);
+            blk_end_bio(bio, 1);
+            return;
+        }
+        reserve->free = req->fifo_next;
+    } else {
+        // Out of requests: push plugged queues out and wait for one to
+        // finish. An interrupt handler cannot wait for the completion it
+        // is itself holding up, so the bio fails instead.
+        while (!free_requests) {
+            if (irq_in_handler()) {
+                irq_restore(flags);
+                serial_write("BLK: request pool exhausted in interrupt context\n");
+                blk_end_bio(bio, 1);
+                return;
+            }
+            for (int i = 0; i < device_count; i++)
+                blk_dispatch(&devices[i], 1);
+            irq_wait();
+        }
+        req = free_requests;
+        free_requests = req->fifo_next;
+    }
+    
+    req->dev = dev;
+    req->op = bio->op;
+    req->flags = bio->flags;
+    req->sector = bio->sector;
+    req->count = bio->count;
+    req->bio_head = bio;
+    req->bio_tail = bio;
+    req->nsg = 0;
+    req->fifo_next = req->fifo_prev = NULL;
+    req->sort_next = req->sort_prev = NULL;
+    
+    if (bio->op == BIO_FLUSH) {
+        req->count = 0;
+        if (dev->flush_tail)
+            dev->flush_tail->fifo_next = req;
+        else
+            dev->flush_head = req;
+        dev->flush_tail = req;
+    } else {
+        req->sg[0].addr = (uint32_t)bio->buffer;
+        req->sg[0].length = bio->count * dev->block_size;
+        req->nsg = 1;
+        dev->elevator->add(dev, req);
+    }
+    dev->queued++;
+    
+    blk_dispatch(dev, 0);
+    irq_restore(flags);
+}
+
+// Queue a bio. It is merged into an adjacent queued request when the
+// limits allow, so small sequential I/Os from any consumer reach the
+// driver as one command. Completion is signalled through bio->status and
+// bio->end_io.
+void blk_submit_bio(blkdev_t* dev, bio_t* bio) {
+    blk_queue_bio(dev, bio, NULL);
+}
+
+// Queue a bio on a request from `reserve`; never waits, so it is safe in
+// completion context. The bio fails if the reserve is empty.
+void blk_submit_bio_reserved(blkdev_t* dev, bio_t* bio, blk_reserve_t* reserve) {
+    blk_queue_bio(dev, bio, reserve);
+}
+
+// Hybrid completion: a request on a fast device is polled for until it
+// has taken its expected service time plus half of it again, so a
+// typical completion is reaped without the interrupt and wakeup latency.
+// Slow completions fall back to the interrupt.
+static void blk_poll_bio(blkdev_t* dev, bio_t* bio) {
+    uint32_t mean = dev->mean_us;
+    
+    if (mean == 0 || mean > BLK_POLL_MAX_US)
+        return;
+    
+    uint32_t window = mean + mean / 2;
+    uint32_t start = timer_cycles();
+    
+    dev->polling = 1;
+    while (bio->status == BIO_PENDING &&
+           timer_cycles_to_us(timer_cycles() - start) < window)
+        dev->ops->poll(dev);
+    dev->polling = 0;
+}
+
+// Recover a device whose waiter has seen no progress for BLK_TIMEOUT_MS,
+// in case an interrupt was lost or a command is stuck. Called with
+// interrupts disabled.
+void blk_timeout(blkdev_t* dev) {
+    serial_write("blk: ");
+    serial_write(dev->name);
+    serial_write(": I/O timed out, recovering\n");
+    
+    if (dev->ops->timeout)
+        dev->ops->timeout(dev);
+    else if (dev->ops->poll)
+        dev->ops->poll(dev);
+}
+
+// Sleep until a bio completes. Every BLK_TIMEOUT_MS without completion
+// the driver is asked to recover it.
+uint8_t blk_wait_bio(bio_t* bio) {
+    uint32_t start = timer_ticks();
+    uint32_t flags = irq_save();
+    
+    if (bio->status == BIO_PENDING && bio->dev && bio->dev->poll_mode == BLK_POLL_HYBRID)
+        blk_poll_bio(bio->dev, bio);
+    
+    while (bio->status == BIO_PENDING) {
+        if (timer_ticks() - start >= BLK_TIMEOUT_MS) {
+            blk_timeout(bio->dev);
+            start = timer_ticks();
+            continue;
+        }
+        irq_wait();
+    }
+    
+    irq_restore(flags);
+    return (bio->status == BIO_DONE) ? 0 : 1;
+}
+
+// Hold requests in the queue so a burst can be merged and sorted before
+// the driver sees any of it
+void blk_plug(blkdev_t* dev) {
+    uint32_t flags = irq_save();
+    dev->plugged++;
+    irq_restore(flags);
+}
+
+void blk_unplug(blkdev_t* dev) {
+    uint32_t flags = irq_save();
+    if (dev->plugged && --dev->plugged == 0)
+        blk_dispatch(dev, 0);
+    irq_restore(flags);
+}
+
+// Synchronous transfer split into requests of at most max_sectors. The
+// pieces are queued under a plug and waited on together.
+static uint8_t blk_transfer(blkdev_t* dev, uint8_t op, uint8_t bio_flags, uint64_t sector,
+                            uint32_t count, uint8_t* buffer) {
+    bio_t bios[8];
+    uint8_t error = 0;
+    
+    while (count > 0 && !error) {
+        int n = 0;
+        
+        blk_plug(dev);
+        while (count > 0 && n < 8) {
+            uint32_t chunk = count > dev->max_sectors ? dev->max_sectors : count;
+            
+            bios[n].sector = sector;
+            bios[n].count = chunk;
+            bios[n].buffer = buffer;
+            bios[n].op = op;
+            bios[n].flags = bio_flags;
+            bios[n].end_io = NULL;
+            bios[n].private_data = NULL;
+            blk_submit_bio(dev, &bios[n]);
+            
+            sector += chunk;
+            count -= chunk;
+            buffer += chunk * dev->block_size;
+            n++;
+        }
+        blk_unplug(dev);
+        
+        for (int i = 0; i < n; i++)
+            error |= blk_wait_bio(&bios[i]);
+    }
+    
+    return error;
+}
+
+uint8_t blk_read(blkdev_t* dev, uint64_t sector, uint32_t count, void* buffer) {
+    return blk_transfer(dev, BIO_READ, 0, sector, count, (uint8_t*)buffer);
+}
+
+uint8_t blk_write(blkdev_t* dev, uint64_t sector, uint32_t count, const void* buffer) {
+    return blk_transfer(dev, BIO_WRITE, 0, sector, count, (uint8_t*)buffer);
+}
+
+// Write that is on stable media when it completes, without flushing the
+// rest of the device cache
+uint8_t blk_write_fua(blkdev_t* dev, uint64_t sector, uint32_t count, const void* buffer) {
+    return blk_transfer(dev, BIO_WRITE, BIO_FUA, sector, count, (uint8_t*)buffer);
+}
+
+// Flush the device's volatile write cache
+uint8_t blk_flush(blkdev_t* dev) {
+    bio_t bio;
+    
+    bio.sector = 0;
+    bio.count = 0;
+    bio.buffer = NULL;
+    bio.op = BIO_FLUSH;
+    bio.flags = 0;
+    bio.end_io = NULL;
+    bio.private_data = NULL;
+    
+    blk_submit_bio(dev, &bio);
+    return blk_wait_bio(&bio);
+}
+
+void blk_print_devices(void) {
+    if (device_count == 0) {
+        return; // Don't print anything if no devices
+    }
+    
+    terminal_writestring("\nBlock Devices:\n");
+    terminal_writestring("==============\n");
+    serial_write("\nBlock Devices:\n");
+    
+    for (int i = 0; i < device_count; i++) {
+        blkdev_t* dev = &devices[i];
+        char num_str[16];
+        
+        // Blocks to MB without 64-bit division
+        uint32_t shift = 0;
+        while ((1u << shift) < dev->block_size)
+            shift++;
+        uint32_t size_mb = (uint32_t)((dev->size << shift) >> 20);
+        format_number(size_mb, num_str);
+        
+        terminal_writestring(dev->name);
+        terminal_writestring(": ");
+        terminal_writestring(num_str);
+        terminal_writestring(" MB, scheduler ");
+        terminal_writestring(dev->elevator->name);
+        terminal_writestring("\n");
+        
+        serial_write("  ");
+        serial_write(dev->name);
+        serial_write(": ");
+        serial_write(num_str);
+        serial_write(" MB, scheduler ");
+        serial_write(dev->elevator->name);
+        if (dev->poll_mode == BLK_POLL_HYBRID)
+            serial_write(", hybrid polling");
+        serial_write("\n");
+    }
+}
+
+// Service time histograms (serial), one column per poll mode, so the two
+// modes can be compared on the same workload
+void blk_print_latency(blkdev_t* dev) {
+    char num_str[16];
+    
+    serial_write("Latency of ");
+    serial_write(dev->name);
+    serial_write(" (us: interrupt / hybrid), mean ");
+    format_number(dev->mean_us, num_str);
+    serial_write(num_str);
+    serial_write(" us, ");
+    format_number(dev->polled, num_str);
+    serial_write(num_str);
+    serial_write(" polled\n");
+    
+    for (int i = 0; i < BLK_LAT_BUCKETS; i++) {
+        if (!dev->latency[0][i] && !dev->latency[1][i])
+            continue;
+        
+        serial_write("  ");
+        format_number(i ? 1u << i : 0, num_str);
+        serial_write(num_str);
+        if (i < BLK_LAT_BUCKETS - 1) {
+            serial_write("-");
+            format_number((2u << i) - 1, num_str);
+            serial_write(num_str);
+        } else {
+            serial_write("+");
+        }
+        serial_write(": ");
+        format_number(dev->latency[0][i], num_str);
+        serial_write(num_str);
+        serial_write(" / ");
+        format_number(dev->latency[1][i], num_str);
+        serial_write(num_str);
+        serial_write("\n");
+    }
+}
+
+void blk_reset_stats(blkdev_t* dev) {
+    uint32_t flags = irq_save();
+    memset(&dev->stats, 0, sizeof(blk_stats_t));
+    dev->stats.last_cycles = timer_cycles();
+    dev->stats.last_ticks = timer_ticks();
+    irq_restore(flags);
+}
+
+static void blk_dump_field(const char* key, uint64_t value) {
+    char num_str[24];
+    
+    serial_write(" ");
+    serial_write(key);
+    serial_write("=");
+    blk_format_number64(value, num_str);
+    serial_write(num_str);
+}
+
+static void blk_dump_histogram(const char* key, const uint32_t* buckets) {
+    char num_str[16];
+    
+    serial_write(" ");
+    serial_write(key);
+    serial_write("=");
+    for (int i = 0; i < BLK_LAT_BUCKETS; i++) {
+        if (i)
+            serial_write(",");
+        format_number(buckets[i], num_str);
+        serial_write(num_str);
+    }
+}
+
+// One line per device on the serial port, for scripts:
+//   iostat dev=<name> rd_ios=<n> ... fl_lat=<b0>,<b1>,...
+// Histogram bucket n counts requests of [2^n, 2^(n+1)) microseconds,
+// bucket 0 also those under 1 us; the last is open-ended.
+void blk_dump_stats(void) {
+    static const char* keys[3][4] = {
+        { "rd_ios", "rd_sec", "rd_mrg", "rd_lat" },
+        { "wr_ios", "wr_sec", "wr_mrg", "wr_lat" },
+        { "fl_ios", NULL, NULL, "fl_lat" },
+    };
+    
+    for (int i = 0; i < device_count; i++) {
+        blkdev_t* dev = &devices[i];
+        blk_stats_t st;
+        
+        // Consistent snapshot, with busy time brought up to date
+        uint32_t flags = irq_save();
+        blk_stats_advance(dev);
+        st = dev->stats;
+        uint32_t inflight = dev->inflight;
+        uint32_t queued = dev->queued;
+        irq_restore(flags);
+        
+        serial_write("iostat dev=");
+        serial_write(dev->name);
+        for (int op = 0; op < 3; op++) {
+            blk_dump_field(keys[op][0], st.ios[op]);
+            if (op == BIO_FLUSH)
+                continue;
+            blk_dump_field(keys[op][1], st.sectors[op]);
+            blk_dump_field(keys[op][2], st.merges[op]);
+        }
+        blk_dump_field("errors", st.errors);
+        blk_dump_field("inflight", inflight);
+        blk_dump_field("queued", queued);
+        blk_dump_field("max_inflight", st.max_inflight);
+        blk_dump_field("busy_us", st.busy_us);
+        blk_dump_field("queue_us", st.queue_us);
+        for (int op = 0; op < 3; op++)
+            blk_dump_histogram(keys[op][3], st.latency[op]);
+        serial_write("\n");
+    }
+}
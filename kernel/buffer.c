@@ -0,0 +1,704 @@
+#include "buffer.h"
+#include "irq.h"
+#include "timer.h"
+#include "kernel.h"
+
+// Buffer cache above the block layer. Blocks are found through a hash on
+// (device, block) and evicted with the 2Q policy: blocks seen once wait
+// in A1in (FIFO) and only blocks referenced again reach Am (LRU), so a
+// large sequential scan cannot flush hot metadata out of the cache.
+//
+// Writes are delayed: bdwrite() only marks a block dirty. Dirty blocks are
+// written back in (device, LBA) order when they age, when too many pile
+// up, or on bcache_sync(), which also flushes the device cache.
+//
+// Reads detect sequential streams and prefetch ahead of them
+// asynchronously, so a sequential scan mostly finds its blocks cached.
+
+// Doubly linked queue, head = most recently used
+typedef struct {
+    buffer_t* head;
+    buffer_t* tail;
+    uint32_t  count;
+} bqueue_t;
+
+// A1out entry: the key of a block recently evicted from A1in
+typedef struct ghost {
+    blkdev_t* dev;
+    uint64_t  block;
+    uint8_t   used;
+    struct ghost* hash_next;
+} ghost_t;
+
+static buffer_t buffers[BCACHE_BUFFERS];
+static buffer_t* hash_table[BCACHE_HASH_SIZE];
+static bqueue_t queues[3];                      // Indexed by BQ_*
+
+static ghost_t ghosts[BCACHE_A1OUT_MAX];        // FIFO ring
+static ghost_t* ghost_hash[BCACHE_HASH_SIZE];
+static uint32_t ghost_next = 0;                 // Oldest entry, reused next
+
+static bcache_stats_t stats;
+static uint32_t writeback_count = 0;            // Blocks with B_WRITEBACK set
+static uint32_t last_writeback = 0;
+
+static bcache_ra_t ra_streams[BCACHE_RA_STREAMS];  // Streams seen by bread()
+static uint32_t ra_clock = 0;
+
+static uint32_t bcache_hash(blkdev_t* dev, uint64_t block) {
+    uint32_t key = (uint32_t)block ^ (uint32_t)(block >> 32) ^ ((uint32_t)dev >> 4);
+    return ((key * 2654435761u) >> 7) & (BCACHE_HASH_SIZE - 1);
+}
+
+static void queue_push(uint8_t q, buffer_t* buf) {
+    buf->queue = q;
+    buf->lru_prev = NULL;
+    buf->lru_next = queues[q].head;
+    if (queues[q].head)
+        queues[q].head->lru_prev = buf;
+    else
+        queues[q].tail = buf;
+    queues[q].head = buf;
+    queues[q].count++;
+}
+
+static void queue_remove(buffer_t* buf) {
+    bqueue_t* q = &queues[buf->queue];
+    
+    if (buf->lru_prev)
+        buf->lru_prev->lru_next = buf->lru_next;
+    else
+        q->head = buf->lru_next;
+    if (buf->lru_next)
+        buf->lru_next->lru_prev = buf->lru_prev;
+    else
+        q->tail = buf->lru_prev;
+    buf->lru_next = buf->lru_prev = NULL;
+    q->count--;
+}
+
+static buffer_t* hash_lookup(blkdev_t* dev, uint64_t block) {
+    for (buffer_t* buf = hash_table[bcache_hash(dev, block)]; buf; buf = buf->hash_next) {
+        if (buf->dev == dev && buf->block == block)
+            return buf;
+    }
+    return NULL;
+}
+
+static void hash_insert(buffer_t* buf) {
+    uint32_t h = bcache_hash(buf->dev, buf->block);
+    
+    buf->hash_prev = NULL;
+    buf->hash_next = hash_table[h];
+    if (hash_table[h])
+        hash_table[h]->hash_prev = buf;
+    hash_table[h] = buf;
+}
+
+static void hash_remove(buffer_t* buf) {
+    if (buf->hash_prev)
+        buf->hash_prev->hash_next = buf->hash_next;
+    else
+        hash_table[bcache_hash(buf->dev, buf->block)] = buf->hash_next;
+    if (buf->hash_next)
+        buf->hash_next->hash_prev = buf->hash_prev;
+    buf->hash_next = buf->hash_prev = NULL;
+}
+
+static void ghost_unlink(ghost_t* ghost) {
+    ghost_t** link = &ghost_hash[bcache_hash(ghost->dev, ghost->block)];
+    
+    while (*link && *link != ghost)
+        link = &(*link)->hash_next;
+    if (*link)
+        *link = ghost->hash_next;
+    ghost->hash_next = NULL;
+    ghost->used = 0;
+}
+
+// Remember a block leaving A1in, overwriting the oldest entry
+static void ghost_add(blkdev_t* dev, uint64_t block) {
+    ghost_t* ghost = &ghosts[ghost_next];
+    ghost_next = (ghost_next + 1) % BCACHE_A1OUT_MAX;
+    
+    if (ghost->used)
+        ghost_unlink(ghost);
+    
+    uint32_t h = bcache_hash(dev, block);
+    ghost->dev = dev;
+    ghost->block = block;
+    ghost->used = 1;
+    ghost->hash_next = ghost_hash[h];
+    ghost_hash[h] = ghost;
+}
+
+// Consume the A1out entry for a block; returns 1 if there was one
+static int ghost_take(blkdev_t* dev, uint64_t block) {
+    for (ghost_t* ghost = ghost_hash[bcache_hash(dev, block)]; ghost; ghost = ghost->hash_next) {
+        if (ghost->dev == dev && ghost->block == block) {
+            ghost_unlink(ghost);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Oldest unreferenced clean buffer of a queue
+static buffer_t* queue_victim(uint8_t q) {
+    for (buffer_t* buf = queues[q].tail; buf; buf = buf->lru_prev) {
+        if (buf->refcount == 0 && !(buf->flags & (B_DIRTY | B_WRITEBACK | B_READING)))
+            return buf;
+    }
+    return NULL;
+}
+
+void init_bcache(void) {
+    uint8_t* data = (uint8_t*)kmalloc_aligned(BCACHE_BUFFERS * BCACHE_BLOCK_SIZE, PAGE_SIZE);
+    
+    memset(queues, 0, sizeof(queues));
+    memset(hash_table, 0, sizeof(hash_table));
+    memset(ghost_hash, 0, sizeof(ghost_hash));
+    memset(ghosts, 0, sizeof(ghosts));
+    memset(&stats, 0, sizeof(stats));
+    ghost_next = 0;
+    memset(ra_streams, 0, sizeof(ra_streams));
+    writeback_count = 0;
+    last_writeback = timer_ticks();
+    ra_clock = 0;
+    
+    if (!data) {
+        serial_write("Buffer cache: out of memory\n");
+        return;
+    }
+    
+    for (int i = 0; i < BCACHE_BUFFERS; i++) {
+        buffer_t* buf = &buffers[i];
+        
+        memset(buf, 0, sizeof(buffer_t));
+        buf->data = data + i * BCACHE_BLOCK_SIZE;
+        queue_push(BQ_FREE, buf);
+    }
+    
+    serial_write("Buffer cache initialized\n");
+}
+
+// Find a buffer to reuse: a free one, else the oldest A1in block while
+// A1in is over its share, else the least recently used Am block
+static buffer_t* bcache_reclaim(void) {
+    buffer_t* victim = queues[BQ_FREE].tail;
+    
+    if (victim) {
+        queue_remove(victim);
+        return victim;
+    }
+    
+    if (queues[BQ_A1IN].count > BCACHE_A1IN_MAX)
+        victim = queue_victim(BQ_A1IN);
+    if (!victim)
+        victim = queue_victim(BQ_AM);
+    if (!victim)
+        victim = queue_victim(BQ_A1IN);
+    if (!victim)
+        return NULL;
+    
+    if (victim->queue == BQ_A1IN)
+        ghost_add(victim->dev, victim->block);
+    
+    hash_remove(victim);
+    queue_remove(victim);
+    stats.evictions++;
+    return victim;
+}
+
+// Give a block a buffer and put it on its queue and hash chain. A demand
+// miss on a block remembered in A1out goes to Am; prefetched blocks always
+// start in A1in and leave the A1out entry for their first real reference.
+// Returns NULL when every buffer is busy. Called with interrupts disabled.
+static buffer_t* bcache_insert(blkdev_t* dev, uint64_t block, int demand) {
+    buffer_t* buf = bcache_reclaim();
+    
+    if (!buf)
+        return NULL;
+    
+    buf->dev = dev;
+    buf->block = block;
+    buf->flags = 0;
+    buf->refcount = 0;
+    
+    if (demand && ghost_take(dev, block)) {
+        stats.ghost_hits++;
+        queue_push(BQ_AM, buf);
+    } else {
+        queue_push(BQ_A1IN, buf);
+    }
+    hash_insert(buf);
+    return buf;
+}
+
+// Writeback completion, in interrupt context
+static void bcache_write_done(bio_t* bio) {
+    buffer_t* buf = (buffer_t*)bio->private_data;
+    
+    buf->flags &= ~B_WRITEBACK;
+    writeback_count--;
+    
+    if (bio->status == BIO_DONE) {
+        stats.writebacks++;
+    } else if (!(buf->flags & B_DIRTY)) {
+        // Keep the data; it is retried with the next writeback
+        buf->flags |= B_DIRTY;
+        buf->dirtied = timer_ticks();
+        stats.dirty++;
+    }
+}
+
+// Start writing dirty blocks of a device (every device if NULL) that have
+// been dirty for at least min_age ms. Blocks go out in (device, LBA)
+// order under a plug, so the block layer merges neighbours into large
+// sequential writes.
+static void bcache_start_writeback(blkdev_t* dev, uint32_t min_age) {
+    static buffer_t* list[BCACHE_BUFFERS];
+    uint32_t now = timer_ticks();
+    int n = 0;
+    
+    uint32_t flags = irq_save();
+    for (int i = 0; i < BCACHE_BUFFERS; i++) {
+        buffer_t* buf = &buffers[i];
+        
+        if ((buf->flags & (B_DIRTY | B_WRITEBACK)) != B_DIRTY)
+            continue;
+        if ((dev && buf->dev != dev) || now - buf->dirtied < min_age)
+            continue;
+        
+        buf->flags = (buf->flags & ~B_DIRTY) | B_WRITEBACK;
+        stats.dirty--;
+        writeback_count++;
+        list[n++] = buf;
+    }
+    irq_restore(flags);
+    
+    // Insertion sort by device, then block
+    for (int i = 1; i < n; i++) {
+        buffer_t* buf = list[i];
+        int j = i - 1;
+        
+        while (j >= 0 && (list[j]->dev > buf->dev ||
+                          (list[j]->dev == buf->dev && list[j]->block > buf->block))) {
+            list[j + 1] = list[j];
+            j--;
+        }
+        list[j + 1] = buf;
+    }
+    
+    blkdev_t* plugged = NULL;
+    for (int i = 0; i < n; i++) {
+        buffer_t* buf = list[i];
+        
+        if (buf->dev != plugged) {
+            if (plugged)
+                blk_unplug(plugged);
+            plugged = buf->dev;
+            blk_plug(plugged);
+        }
+        
+        buf->bio.sector = buf->block;
+        buf->bio.count = 1;
+        buf->bio.buffer = buf->data;
+        buf->bio.op = BIO_WRITE;
+        buf->bio.flags = 0;
+        buf->bio.end_io = bcache_write_done;
+        buf->bio.private_data = buf;
+        blk_submit_bio(buf->dev, &buf->bio);
+    }
+    if (plugged)
+        blk_unplug(plugged);
+}
+
+// Sleep until no block of the device (any device if NULL) is being
+// written. A device that stalls for BLK_TIMEOUT_MS is asked to recover.
+static void bcache_wait_writeback(blkdev_t* dev) {
+    uint32_t start = timer_ticks();
+    uint32_t flags = irq_save();
+    
+    while (writeback_count) {
+        blkdev_t* busy = NULL;
+        
+        for (int i = 0; i < BCACHE_BUFFERS && !busy; i++) {
+            if ((buffers[i].flags & B_WRITEBACK) && (!dev || buffers[i].dev == dev))
+                busy = buffers[i].dev;
+        }
+        if (!busy)
+            break;
+        if (timer_ticks() - start >= BLK_TIMEOUT_MS) {
+            blk_timeout(busy);
+            start = timer_ticks();
+            continue;
+        }
+        irq_wait();
+    }
+    
+    irq_restore(flags);
+}
+
+// Sleep until the I/O given by mask (B_WRITEBACK, B_READING) on a buffer
+// finishes
+static void bcache_wait_buffer(buffer_t* buf, uint8_t mask) {
+    uint32_t start = timer_ticks();
+    uint32_t flags = irq_save();
+    
+    while (buf->flags & mask) {
+        if (timer_ticks() - start >= BLK_TIMEOUT_MS) {
+            blk_timeout(buf->dev);
+            start = timer_ticks();
+            continue;
+        }
+        irq_wait();
+    }
+    irq_restore(flags);
+}
+
+// Periodic writeback of aged dirty blocks; called from the idle loop and
+// opportunistically from bget()
+void bcache_periodic(void) {
+    uint32_t now = timer_ticks();
+    
+    if (now - last_writeback < BCACHE_WRITEBACK_INTERVAL_MS)
+        return;
+    last_writeback = now;
+    
+    if (stats.dirty)
+        bcache_start_writeback(NULL, BCACHE_DIRTY_EXPIRE_MS);
+}
+
+// Get a referenced buffer for a block without reading it. Callers that
+// overwrite the whole block use this and then bwrite().
+buffer_t* bget(blkdev_t* dev, uint64_t block) {
+    if (!dev || dev->block_size > BCACHE_BLOCK_SIZE || block >= dev->size)
+        return NULL;
+    
+    bcache_periodic();
+    
+    uint32_t flags = irq_save();
+    buffer_t* buf = hash_lookup(dev, block);
+    
+    if (buf) {
+        stats.hits++;
+        // A1in is FIFO: correlated re-references right after the first
+        // one do not count as reuse
+        if (buf->queue == BQ_AM) {
+            queue_remove(buf);
+            queue_push(BQ_AM, buf);
+        } else if ((buf->flags & B_READAHEAD) && ghost_take(dev, block)) {
+            // First demand reference of a prefetched block that A1out
+            // remembers: the reuse the prefetch hid
+            stats.ghost_hits++;
+            queue_remove(buf);
+            queue_push(BQ_AM, buf);
+        }
+        buf->refcount++;
+        irq_restore(flags);
+        
+        // A prefetch may still be filling it
+        bcache_wait_buffer(buf, B_READING);
+        return buf;
+    }
+    
+    stats.misses++;
+    buf = bcache_insert(dev, block, 1);
+    if (!buf) {
+        // Everything unreferenced is dirty: write it all back and retry
+        irq_restore(flags);
+        bcache_start_writeback(NULL, 0);
+        bcache_wait_writeback(NULL);
+        flags = irq_save();
+        buf = bcache_insert(dev, block, 1);
+    }
+    if (!buf) {
+        irq_restore(flags);
+        serial_write("Buffer cache: all buffers in use\n");
+        return NULL;
+    }
+    
+    buf->refcount = 1;
+    irq_restore(flags);
+    return buf;
+}
+
+// Read completion, in interrupt context
+static void bcache_read_done(bio_t* bio) {
+    buffer_t* buf = (buffer_t*)bio->private_data;
+    
+    if (bio->status == BIO_DONE)
+        buf->flags |= B_VALID;
+    buf->flags &= ~B_READING;
+}
+
+// Start an asynchronous read into a buffer
+static void bcache_submit_read(buffer_t* buf) {
+    buf->flags |= B_READING;
+    buf->bio.sector = buf->block;
+    buf->bio.count = 1;
+    buf->bio.buffer = buf->data;
+    buf->bio.op = BIO_READ;
+    buf->bio.flags = 0;
+    buf->bio.end_io = bcache_read_done;
+    buf->bio.private_data = buf;
+    blk_submit_bio(buf->dev, &buf->bio);
+}
+
+// Prefetch blocks [start, end) that are not cached yet. Prefetched blocks
+// are unreferenced and enter A1in, even when A1out remembers them. Stops early
+// rather than waiting for writeback when no clean buffer is left.
+static void bcache_prefetch(blkdev_t* dev, uint64_t start, uint64_t end) {
+    for (uint64_t block = start; block < end; block++) {
+        uint32_t flags = irq_save();
+        
+        if (hash_lookup(dev, block)) {
+            irq_restore(flags);
+            continue;
+        }
+        
+        buffer_t* buf = bcache_insert(dev, block, 0);
+        if (!buf) {
+            irq_restore(flags);
+            return;
+        }
+        buf->flags = B_READAHEAD;
+        stats.ra_blocks++;
+        irq_restore(flags);
+        
+        bcache_submit_read(buf);
+    }
+}
+
+// Advance a stream to a read of the given block and return the end of the
+// range to prefetch (0 for none). Sequential reads open a window and
+// double it on each refill; other reads halve it.
+static uint64_t ra_advance(blkdev_t* dev, bcache_ra_t* ra, uint64_t block, uint64_t* start) {
+    if (ra->dev != dev) {
+        ra->dev = dev;
+        ra->window = 0;
+        ra->next = ~0ULL;
+    }
+    
+    if (block != ra->next) {
+        ra->window >>= 1;
+        if (ra->window < BCACHE_RA_MIN)
+            ra->window = 0;
+        ra->ahead = block + 1;
+    } else if (!ra->window) {
+        ra->window = BCACHE_RA_MIN;
+        ra->ahead = block + 1;
+    }
+    ra->next = block + 1;
+    
+    if (!ra->window)
+        return 0;
+    if (ra->ahead < block + 1)
+        ra->ahead = block + 1;
+    
+    // Refill once less than half a window is left ahead of the reader
+    if (ra->ahead - (block + 1) > ra->window / 2)
+        return 0;
+    
+    uint64_t end = block + 1 + ra->window;
+    if (end > dev->size)
+        end = dev->size;
+    if (end <= ra->ahead)
+        return 0;
+    
+    *start = ra->ahead;
+    ra->ahead = end;
+    ra->window <<= 1;
+    if (ra->window > BCACHE_RA_MAX)
+        ra->window = BCACHE_RA_MAX;
+    return end;
+}
+
+void bcache_ra_init(bcache_ra_t* ra) {
+    memset(ra, 0, sizeof(bcache_ra_t));
+}
+
+// Stream of the device whose next expected block is this one, else the
+// least recently used slot
+static bcache_ra_t* ra_stream(blkdev_t* dev, uint64_t block) {
+    bcache_ra_t* lru = &ra_streams[0];
+    
+    for (int i = 0; i < BCACHE_RA_STREAMS; i++) {
+        bcache_ra_t* ra = &ra_streams[i];
+        
+        if (ra->dev == dev && ra->next == block) {
+            lru = ra;
+            break;
+        }
+        if (ra->used < lru->used)
+            lru = ra;
+    }
+    
+    // Recycled slot: a new stream starts unconfirmed
+    if (lru->dev != dev || lru->next != block) {
+        bcache_ra_init(lru);
+        lru->dev = dev;
+        lru->next = ~0ULL;
+    }
+    lru->used = ++ra_clock;
+    return lru;
+}
+
+// Get a referenced buffer holding the block's data, reading it from the
+// device on a miss. Returns NULL on I/O error. Prefetches ahead of the
+// caller's stream; callers reading several files keep one bcache_ra_t per
+// file.
+buffer_t* bread_ra(blkdev_t* dev, uint64_t block, bcache_ra_t* ra) {
+    buffer_t* buf = bget(dev, block);
+    
+    if (!buf)
+        return NULL;
+    
+    if (buf->flags & B_READAHEAD) {
+        buf->flags &= ~B_READAHEAD;
+        stats.ra_hits++;
+    }
+    
+    uint64_t start = 0;
+    uint64_t end = ra ? ra_advance(dev, ra, block, &start) : 0;
+    
+    if (buf->flags & B_VALID) {
+        if (end)
+            bcache_prefetch(dev, start, end);
+        return buf;
+    }
+    
+    // Miss: queue the demand read and the prefetch together so they merge
+    blk_plug(dev);
+    bcache_submit_read(buf);
+    if (end)
+        bcache_prefetch(dev, start, end);
+    blk_unplug(dev);
+    
+    bcache_wait_buffer(buf, B_READING);
+    if (!(buf->flags & B_VALID)) {
+        brelse(buf);
+        return NULL;
+    }
+    
+    return buf;
+}
+
+// Read a block through the cache, using the device's stream table for
+// readahead
+buffer_t* bread(blkdev_t* dev, uint64_t block) {
+    if (!dev)
+        return NULL;
+    return bread_ra(dev, block, ra_stream(dev, block));
+}
+
+// Write a buffer to the device now and wait for it
+static uint8_t bcache_write_sync(buffer_t* buf, int fua) {
+    bcache_wait_buffer(buf, B_WRITEBACK);
+    
+    uint8_t error = fua ? blk_write_fua(buf->dev, buf->block, 1, buf->data)
+                        : blk_write(buf->dev, buf->block, 1, buf->data);
+    
+    if (!error) {
+        uint32_t flags = irq_save();
+        if (buf->flags & B_DIRTY)
+            stats.dirty--;
+        buf->flags = (buf->flags | B_VALID) & ~B_DIRTY;
+        irq_restore(flags);
+    }
+    return error;
+}
+
+// Synchronous write; the data may still sit in the drive's cache
+uint8_t bwrite(buffer_t* buf) {
+    return bcache_write_sync(buf, 0);
+}
+
+// Synchronous write that is on stable media when it returns
+uint8_t bwrite_fua(buffer_t* buf) {
+    return bcache_write_sync(buf, 1);
+}
+
+// Delayed write: mark the block dirty and leave it to writeback
+void bdwrite(buffer_t* buf) {
+    uint32_t flags = irq_save();
+    
+    buf->flags |= B_VALID;
+    if (!(buf->flags & B_DIRTY)) {
+        buf->flags |= B_DIRTY;
+        buf->dirtied = timer_ticks();
+        stats.dirty++;
+    }
+    int over = stats.dirty >= BCACHE_DIRTY_HIGH;
+    
+    irq_restore(flags);
+    
+    if (over)
+        bcache_start_writeback(NULL, 0);
+}
+
+// Barrier: write every dirty block of a device (all devices if NULL),
+// wait for the writes and flush the device caches. Returns nonzero if
+// anything could not be made durable.
+uint8_t bcache_sync(blkdev_t* dev) {
+    uint8_t error = 0;
+    
+    bcache_start_writeback(dev, 0);
+    bcache_wait_writeback(dev);
+    
+    // Failed writebacks are dirty again
+    for (int i = 0; i < BCACHE_BUFFERS; i++) {
+        if ((buffers[i].flags & B_DIRTY) && (!dev || buffers[i].dev == dev))
+            error = 1;
+    }
+    
+    if (dev) {
+        error |= blk_flush(dev);
+    } else {
+        for (int i = 0; i < blk_get_device_count(); i++)
+            error |= blk_flush(blk_get_device(i));
+    }
+    
+    return error;
+}
+
+// Drop a reference from bread/bget. The block stays cached.
+void brelse(buffer_t* buf) {
+    uint32_t flags = irq_save();
+    if (buf->refcount > 0)
+        buf->refcount--;
+    irq_restore(flags);
+}
+
+// Forget every unreferenced clean block of a device, e.g. after it was
+// written behind the cache's back. Dirty blocks are kept.
+void bcache_invalidate(blkdev_t* dev) {
+    uint32_t flags = irq_save();
+    
+    for (int i = 0; i < BCACHE_BUFFERS; i++) {
+        buffer_t* buf = &buffers[i];
+        
+        if (buf->queue == BQ_FREE || buf->dev != dev || buf->refcount ||
+            (buf->flags & (B_DIRTY | B_WRITEBACK | B_READING)))
+            continue;
+        
+        hash_remove(buf);
+        queue_remove(buf);
+        buf->flags = 0;
+        queue_push(BQ_FREE, buf);
+    }
+    
+    for (int i = 0; i < BCACHE_A1OUT_MAX; i++) {
+        if (ghosts[i].used && ghosts[i].dev == dev)
+            ghost_unlink(&ghosts[i]);
+    }
+    
+    irq_restore(flags);
+}
+
+void bcache_get_stats(bcache_stats_t* out) {
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
@@ -0,0 +1,211 @@
+#include "blkdev.h"
+#include "timer.h"
+#include "kernel.h"
+
+// I/O schedulers for the block layer. Both are called with interrupts
+// disabled and only see requests that have not been dispatched yet.
+
+static void fifo_append(elevator_queue_t* q, int dir, blk_request_t* req) {
+    req->fifo_next = NULL;
+    req->fifo_prev = q->fifo_tail[dir];
+    if (q->fifo_tail[dir])
+        q->fifo_tail[dir]->fifo_next = req;
+    else
+        q->fifo_head[dir] = req;
+    q->fifo_tail[dir] = req;
+}
+
+static void fifo_remove(elevator_queue_t* q, int dir, blk_request_t* req) {
+    if (req->fifo_prev)
+        req->fifo_prev->fifo_next = req->fifo_next;
+    else
+        q->fifo_head[dir] = req->fifo_next;
+    if (req->fifo_next)
+        req->fifo_next->fifo_prev = req->fifo_prev;
+    else
+        q->fifo_tail[dir] = req->fifo_prev;
+    req->fifo_next = req->fifo_prev = NULL;
+}
+
+// Insert into the ascending sector list of a direction
+static void sort_insert(elevator_queue_t* q, int dir, blk_request_t* req) {
+    blk_request_t* prev = NULL;
+    blk_request_t* cur = q->sort_head[dir];
+    
+    while (cur && cur->sector < req->sector) {
+        prev = cur;
+        cur = cur->sort_next;
+    }
+    
+    req->sort_prev = prev;
+    req->sort_next = cur;
+    if (prev)
+        prev->sort_next = req;
+    else
+        q->sort_head[dir] = req;
+    if (cur)
+        cur->sort_prev = req;
+}
+
+static void sort_remove(elevator_queue_t* q, int dir, blk_request_t* req) {
+    if (req->sort_prev)
+        req->sort_prev->sort_next = req->sort_next;
+    else
+        q->sort_head[dir] = req->sort_next;
+    if (req->sort_next)
+        req->sort_next->sort_prev = req->sort_prev;
+    req->sort_next = req->sort_prev = NULL;
+}
+
+// Noop: one FIFO for everything, merging only
+
+static void noop_init(blkdev_t* dev) {
+    memset(&dev->queue, 0, sizeof(elevator_queue_t));
+}
+
+static blk_request_t* noop_find_merge(blkdev_t* dev, bio_t* bio, int* front) {
+    // Newest first: sequential streams merge with what they just queued
+    for (blk_request_t* req = dev->queue.fifo_tail[0]; req; req = req->fifo_prev) {
+        if (blk_can_merge(dev, req, bio, 0)) {
+            *front = 0;
+            return req;
+        }
+        if (blk_can_merge(dev, req, bio, 1)) {
+            *front = 1;
+            return req;
+        }
+    }
+    return NULL;
+}
+
+static void noop_add(blkdev_t* dev, blk_request_t* req) {
+    fifo_append(&dev->queue, 0, req);
+}
+
+static void noop_merged(blkdev_t* dev, blk_request_t* req, int front) {
+    (void)dev;
+    (void)req;
+    (void)front;
+}
+
+static blk_request_t* noop_dispatch(blkdev_t* dev) {
+    blk_request_t* req = dev->queue.fifo_head[0];
+    
+    if (req)
+        fifo_remove(&dev->queue, 0, req);
+    return req;
+}
+
+const elevator_ops_t elevator_noop = {
+    "noop",
+    noop_init,
+    noop_find_merge,
+    noop_add,
+    noop_merged,
+    noop_dispatch,
+};
+
+// Deadline: requests are served in ascending sector order in batches,
+// reads are preferred over writes, and each request carries an expiry
+// time after which it is served next regardless of position.
+
+static void deadline_init(blkdev_t* dev) {
+    memset(&dev->queue, 0, sizeof(elevator_queue_t));
+}
+
+static blk_request_t* deadline_find_merge(blkdev_t* dev, bio_t* bio, int* front) {
+    for (blk_request_t* req = dev->queue.sort_head[bio->op]; req; req = req->sort_next) {
+        if (req->sector > bio->sector + bio->count)
+            break; // Sorted: nothing further can be adjacent
+        if (blk_can_merge(dev, req, bio, 0)) {
+            *front = 0;
+            return req;
+        }
+        if (blk_can_merge(dev, req, bio, 1)) {
+            *front = 1;
+            return req;
+        }
+    }
+    return NULL;
+}
+
+static void deadline_add(blkdev_t* dev, blk_request_t* req) {
+    int dir = req->op;
+    
+    req->deadline = timer_ticks() +
+                    (dir == BIO_READ ? DEADLINE_READ_EXPIRE_MS : DEADLINE_WRITE_EXPIRE_MS);
+    sort_insert(&dev->queue, dir, req);
+    fifo_append(&dev->queue, dir, req);
+}
+
+static void deadline_merged(blkdev_t* dev, blk_request_t* req, int front) {
+    // A front merge lowered the start sector; restore the sort order
+    if (front) {
+        sort_remove(&dev->queue, req->op, req);
+        sort_insert(&dev->queue, req->op, req);
+    }
+}
+
+// First request at or after the given sector
+static blk_request_t* deadline_next_from(elevator_queue_t* q, int dir, uint64_t sector) {
+    blk_request_t* req = q->sort_head[dir];
+    
+    while (req && req->sector < sector)
+        req = req->sort_next;
+    return req;
+}
+
+static blk_request_t* deadline_dispatch(blkdev_t* dev) {
+    elevator_queue_t* q = &dev->queue;
+    blk_request_t* req = NULL;
+    
+    // Keep sweeping in the current direction until the batch is used up
+    if (q->batch < DEADLINE_FIFO_BATCH)
+        req = deadline_next_from(q, q->batch_dir, q->next_sector);
+    
+    if (!req) {
+        int dir;
+        
+        // Reads first, unless writes have been passed over too often
+        if (q->sort_head[BIO_READ] &&
+            !(q->sort_head[BIO_WRITE] && q->starved >= DEADLINE_WRITES_STARVED)) {
+            dir = BIO_READ;
+            if (q->sort_head[BIO_WRITE])
+                q->starved++;
+        } else if (q->sort_head[BIO_WRITE]) {
+            dir = BIO_WRITE;
+            q->starved = 0;
+        } else {
+            return NULL;
+        }
+        
+        // Start the batch at an expired request, otherwise continue the
+        // sweep from the head position, wrapping to the lowest sector
+        blk_request_t* oldest = q->fifo_head[dir];
+        if ((int32_t)(timer_ticks() - oldest->deadline) >= 0) {
+            req = oldest;
+        } else {
+            req = deadline_next_from(q, dir, q->next_sector);
+            if (!req)
+                req = q->sort_head[dir];
+        }
+        
+        q->batch_dir = (uint8_t)dir;
+        q->batch = 0;
+    }
+    
+    sort_remove(q, req->op, req);
+    fifo_remove(q, req->op, req);
+    q->batch++;
+    q->next_sector = req->sector + req->count;
+    return req;
+}
+
+const elevator_ops_t elevator_deadline = {
+    "deadline",
+    deadline_init,
+    deadline_find_merge,
+    deadline_add,
+    deadline_merged,
+    deadline_dispatch,
+};
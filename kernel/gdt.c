@@ -41,6 +41,11 @@ struct idt_ptr   idt_ptr;
 extern void gdt_flush(uint32_t);
 extern void idt_flush(uint32_t);
 
+// Hardware IRQ entry stubs (interrupt.asm)
+extern uint32_t irq_stub_table[16];
+extern uint32_t msi_stub_table[32];
+extern void spurious_stub(void);
+
 static void gdt_set_gate(int32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
     gdt_entries[num].base_low    = (base & 0xFFFF);
     gdt_entries[num].base_middle = (base >> 16) & 0xFF;
@@ -87,5 +92,17 @@ void init_idt(void) {
     // Set up exception handlers (basic)
     // In a full OS, you'd set up proper exception handlers here
     
+    // Hardware IRQs 0-15, remapped to vectors 0x20-0x2F by init_irq()
+    for (int i = 0; i < 16; i++) {
+        idt_set_gate(0x20 + i, irq_stub_table[i], 0x08, 0x8E);
+    }
+    
+    // Message signalled interrupts at 0x30-0x4F and the local APIC's
+    // spurious vector (see irq.h)
+    for (int i = 0; i < 32; i++) {
+        idt_set_gate(0x30 + i, msi_stub_table[i], 0x08, 0x8E);
+    }
+    idt_set_gate(0xFF, (uint32_t)spurious_stub, 0x08, 0x8E);
+    
     idt_flush((uint32_t)&idt_ptr);
 }
\ No newline at end of file
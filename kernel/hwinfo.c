@@ -1,4 +1,5 @@
 #include "hwinfo.h"
+#include "pci.h"
 #include "kernel.h"
 
 static cpu_info_t cpu_info;
@@ -160,81 +161,73 @@ void print_memory_map(struct multiboot_info* mbi) {
     terminal_writestring(" MB\n");
 }
 
-// PCI configuration space access
-#define PCI_CONFIG_ADDRESS 0xCF8
-#define PCI_CONFIG_DATA    0xCFC
-
-static uint32_t pci_read_config(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
-    uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | 
-                                   (func << 8) | (offset & 0xFC) | 
-                                   0x80000000);
-    outl(PCI_CONFIG_ADDRESS, address);
-    return inl(PCI_CONFIG_DATA);
-}
-
+// List the functions found by init_pci()
 void scan_pci_bus(void) {
     terminal_writestring("\nPCI Devices:\n");
     terminal_writestring("============\n");
     serial_write("\nPCI Devices:\n");
     
-    int device_count = 0;
+    int device_count = pci_device_count();
     
-    for (uint8_t bus = 0; bus < 8; bus++) {
-        for (uint8_t slot = 0; slot < 32; slot++) {
-            for (uint8_t func = 0; func < 8; func++) {
-                uint32_t vendor_device = pci_read_config(bus, slot, func, 0);
-                uint16_t vendor_id = vendor_device & 0xFFFF;
-                uint16_t device_id = (vendor_device >> 16) & 0xFFFF;
-                
-                if (vendor_id == 0xFFFF || vendor_id == 0x0000)
-                    continue;
-                
-                device_count++;
-                
-                // Get class code
-                uint32_t class_rev = pci_read_config(bus, slot, func, 0x08);
-                uint8_t class_code = (class_rev >> 24) & 0xFF;
-                uint8_t subclass = (class_rev >> 16) & 0xFF;
-                
-                terminal_writestring("  ");
-                terminal_putchar('0' + (bus / 10));
-                terminal_putchar('0' + (bus % 10));
-                terminal_writestring(":");
-                terminal_putchar('0' + (slot / 10));
-                terminal_putchar('0' + (slot % 10));
-                terminal_writestring(".");
-                terminal_putchar('0' + func);
-                terminal_writestring(" - ");
-                
-                // Device description
-                switch (class_code) {
-                    case 0x00: terminal_writestring("Unclassified"); break;
-                    case 0x01: terminal_writestring("Mass Storage"); break;
-                    case 0x02: terminal_writestring("Network"); break;
-                    case 0x03: terminal_writestring("Display"); break;
-                    case 0x04: terminal_writestring("Multimedia"); break;
-                    case 0x05: terminal_writestring("Memory"); break;
-                    case 0x06: terminal_writestring("Bridge"); break;
-                    case 0x07: terminal_writestring("Communication"); break;
-                    case 0x08: terminal_writestring("System"); break;
-                    case 0x09: terminal_writestring("Input"); break;
-                    case 0x0C: terminal_writestring("Serial Bus"); break;
-                    default: terminal_writestring("Other");
-                }
-                
-                if (class_code == 0x01) {
-                    switch (subclass) {
-                        case 0x01: terminal_writestring(" (IDE)"); break;
-                        case 0x05: terminal_writestring(" (ATA)"); break;
-                        case 0x06: terminal_writestring(" (SATA)"); break;
-                        case 0x07: terminal_writestring(" (SAS)"); break;
-                        case 0x08: terminal_writestring(" (NVMe)"); break;
-                    }
-                }
-                
-                terminal_writestring("\n");
+    for (int i = 0; i < device_count; i++) {
+        pci_device_t* dev = pci_get_device(i);
+        char num_str[12];
+        
+        // Bus numbers reach 255 behind bridges; keep two digits at least
+        terminal_writestring("  ");
+        if (dev->bus < 10)
+            terminal_putchar('0');
+        format_number(dev->bus, num_str);
+        terminal_writestring(num_str);
+        terminal_writestring(":");
+        terminal_putchar('0' + (dev->slot / 10));
+        terminal_putchar('0' + (dev->slot % 10));
+        terminal_writestring(".");
+        terminal_putchar('0' + dev->func);
+        terminal_writestring(" - ");
+        
+        // Device description
+        switch (dev->class_code) {
+            case 0x00: terminal_writestring("Unclassified"); break;
+            case 0x01: terminal_writestring("Mass Storage"); break;
+            case 0x02: terminal_writestring("Network"); break;
+            case 0x03: terminal_writestring("Display"); break;
+            case 0x04: terminal_writestring("Multimedia"); break;
+            case 0x05: terminal_writestring("Memory"); break;
+            case 0x06: terminal_writestring("Bridge"); break;
+            case 0x07: terminal_writestring("Communication"); break;
+            case 0x08: terminal_writestring("System"); break;
+            case 0x09: terminal_writestring("Input"); break;
+            case 0x0C: terminal_writestring("Serial Bus"); break;
+            default: terminal_writestring("Other");
+        }
+        
+        if (dev->class_code == 0x01) {
+            switch (dev->subclass) {
+                case 0x01: terminal_writestring(" (IDE)"); break;
+                case 0x05: terminal_writestring(" (ATA)"); break;
+                case 0x06: terminal_writestring(" (SATA)"); break;
+                case 0x07: terminal_writestring(" (SAS)"); break;
+                case 0x08: terminal_writestring(" (NVMe)"); break;
             }
         }
+        
+        // Bridges lead to the bus that was scanned behind them
+        if (dev->header_type == PCI_HEADER_BRIDGE) {
+            terminal_writestring(" -> bus ");
+            if (dev->secondary_bus < 10)
+                terminal_putchar('0');
+            format_number(dev->secondary_bus, num_str);
+            terminal_writestring(num_str);
+        }
+        
+        // Message signalled interrupt support
+        if (pci_find_capability(dev, PCI_CAP_ID_MSIX))
+            terminal_writestring(" [MSI-X]");
+        else if (pci_find_capability(dev, PCI_CAP_ID_MSI))
+            terminal_writestring(" [MSI]");
+        
+        terminal_writestring("\n");
     }
     
     if (device_count == 0) {
@@ -1,49 +1,85 @@
 #include "ide.h"
+#include "blkdev.h"
+#include "irq.h"
+#include "pci.h"
+#include "timer.h"
 #include "kernel.h"
 
 static ide_device_t ide_devices[4];
 static int device_count = 0;
 
-// Channel information
+// Channel information. Each channel runs its own request queue and state
+// machine, so the primary and secondary channels have commands in flight
+// at the same time.
 static struct {
     uint16_t base;
     uint16_t ctrl;
+    uint16_t bmide;                 // Bus master registers (0 = no DMA)
+    uint8_t  irq;
+    uint8_t  nien;                  // nIEN bit written to the control register
+    volatile uint8_t irq_pending;   // Set by the IRQ handler, cleared by the waiter
+    volatile uint8_t irq_status;    // Status register latched by the IRQ handler
+    
+    // Request queue and state of the active command
+    ide_request_t* queue_head;
+    ide_request_t* queue_tail;
+    ide_request_t* active;
+    uint8_t  state;                 // IDE_STATE_*
+    uint32_t started;               // Tick the active command was issued
+    uint32_t block;                 // PIO sectors per interrupt
+    uint32_t remaining;             // PIO sectors left to transfer
+    uint16_t* pio_buffer;           // PIO data position
+    uint32_t pio_bytes;             // ATAPI: room left in the buffer
+    uint8_t  packet[ATAPI_PACKET_SIZE]; // ATAPI command of the active request
 } channels[2] = {
-    {ATA_PRIMARY_IO, ATA_PRIMARY_CTRL},
-    {ATA_SECONDARY_IO, ATA_SECONDARY_CTRL}
+    {ATA_PRIMARY_IO, ATA_PRIMARY_CTRL, 0, IRQ_ATA_PRIMARY, ATA_CTRL_NIEN, 0, 0,
+     NULL, NULL, NULL, IDE_STATE_IDLE, 0, 0, 0, NULL, 0, {0}},
+    {ATA_SECONDARY_IO, ATA_SECONDARY_CTRL, 0, IRQ_ATA_SECONDARY, ATA_CTRL_NIEN, 0, 0,
+     NULL, NULL, NULL, IDE_STATE_IDLE, 0, 0, 0, NULL, 0, {0}}
 };
 
-// Read from IDE register
+static void ide_start_request(uint8_t channel);
+static void ide_channel_interrupt(uint8_t channel, uint8_t status);
+static void ide_blk_register(void);
+static void ide_atapi_capacity(ide_device_t* dev);
+
+// Physical Region Descriptor tables, one per channel. A table must not
+// cross a 64K boundary, which the size alignment guarantees.
+static ide_prd_t prd_tables[2][IDE_PRD_ENTRIES] __attribute__((aligned(IDE_PRD_ENTRIES * 8)));
+
+// Write to IDE register. Writing 0x08-0x0B loads the "previous" half of
+// the LBA48 task file through the same ports as 0x02-0x05.
+static void ide_write(uint8_t channel, uint8_t reg, uint8_t data) {
+    if (reg < 0x08)
+        outb(channels[channel].base + reg, data);
+    else if (reg < 0x0C)
+        outb(channels[channel].base + reg - 0x06, data);
+    else if (reg < 0x0E)
+        outb(channels[channel].ctrl + reg - 0x0C, data);
+    else if (reg < 0x16)
+        outb(channels[channel].base + reg - 0x0E, data);
+}
+
+// Read from IDE register. Registers 0x08-0x0B are the LBA48 high order
+// bytes, read back through the HOB bit of the control register.
 static uint8_t ide_read(uint8_t channel, uint8_t reg) {
-    uint8_t result;
+    uint8_t result = 0;
     if (reg > 0x07 && reg < 0x0C)
-        ide_read(channel, ATA_REG_CONTROL);
+        ide_write(channel, ATA_REG_CONTROL, ATA_CTRL_HOB | channels[channel].nien);
     
     if (reg < 0x08)
         result = inb(channels[channel].base + reg);
     else if (reg < 0x0C)
         result = inb(channels[channel].base + reg - 0x06);
     else if (reg < 0x0E)
-        result = inb(channels[channel].ctrl + reg - 0x0A);
+        result = inb(channels[channel].ctrl + reg - 0x0C);
     else if (reg < 0x16)
         result = inb(channels[channel].base + reg - 0x0E);
     
-    return result;
-}
-
-// Write to IDE register
-static void ide_write(uint8_t channel, uint8_t reg, uint8_t data) {
     if (reg > 0x07 && reg < 0x0C)
-        ide_write(channel, ATA_REG_CONTROL, 0x80 | channels[channel].ctrl);
+        ide_write(channel, ATA_REG_CONTROL, channels[channel].nien);
     
-    if (reg < 0x08)
-        outb(channels[channel].base + reg, data);
-    else if (reg < 0x0C)
-        outb(channels[channel].base + reg - 0x06, data);
-    else if (reg < 0x0E)
-        outb(channels[channel].ctrl + reg - 0x0A, data);
-    else if (reg < 0x16)
-        outb(channels[channel].base + reg - 0x0E, data);
+    return result;
 }
 
 // Read buffer from IDE
@@ -51,10 +87,19 @@ static void ide_read_buffer(uint8_t channel, uint8_t reg, uint16_t* buffer, uint
     if (reg > 0x07 && reg < 0x0C)
         ide_read(channel, ATA_REG_CONTROL);
     
-    if (reg < 0x08) {
-        for (uint32_t i = 0; i < count; i++)
-            buffer[i] = inw(channels[channel].base + reg);
+    if (reg < 0x08)
+        insw(channels[channel].base + reg, buffer, count);
+}
+
+// Wait for BSY to clear. Commands are also issued from IRQ14/IRQ15
+// context, where timer_ticks() stands still, so the wait is bounded by a
+// number of status reads. Returns 1 if the drive stayed busy.
+static int ide_wait_not_busy(uint8_t channel) {
+    for (uint32_t i = 0; i < IDE_BUSY_POLLS; i++) {
+        if (!(ide_read(channel, ATA_REG_STATUS) & ATA_SR_BSY))
+            return 0;
     }
+    return 1;
 }
 
 // Wait for IDE device
@@ -64,7 +109,8 @@ static uint8_t ide_polling(uint8_t channel, uint8_t advanced_check) {
         ide_read(channel, ATA_REG_ALTSTATUS);
     
     // Wait for BSY to be cleared
-    while (ide_read(channel, ATA_REG_STATUS) & ATA_SR_BSY);
+    if (ide_wait_not_busy(channel))
+        return 4; // Timeout
     
     if (advanced_check) {
         uint8_t state = ide_read(channel, ATA_REG_STATUS);
@@ -82,6 +128,58 @@ static uint8_t ide_polling(uint8_t channel, uint8_t advanced_check) {
     return 0; // No error
 }
 
+// IRQ14/IRQ15 handler: reading the status register acknowledges the
+// interrupt on the drive, then the channel's state machine moves on
+static void ide_irq_handler(uint8_t irq) {
+    uint8_t channel = (irq == IRQ_ATA_PRIMARY) ? 0 : 1;
+    
+    ide_channel_interrupt(channel, inb(channels[channel].base + ATA_REG_STATUS));
+}
+
+// Forget any stale interrupt before issuing a new command
+static void ide_irq_arm(uint8_t channel) {
+    channels[channel].irq_pending = 0;
+}
+
+// Sleep until an idle channel raises its IRQ; used for commands issued
+// outside the request queue during detection. A missed IRQ falls back to
+// reading status after IDE_IRQ_TIMEOUT_MS.
+static uint8_t ide_wait_irq(uint8_t channel, uint8_t need_drq) {
+    uint32_t start = timer_ticks();
+    uint32_t flags = irq_save();
+    uint8_t state;
+    
+    while (!channels[channel].irq_pending) {
+        if (timer_ticks() - start >= IDE_IRQ_TIMEOUT_MS)
+            break;
+        irq_wait();
+    }
+    
+    if (channels[channel].irq_pending) {
+        channels[channel].irq_pending = 0;
+        state = channels[channel].irq_status;
+    } else {
+        // No interrupt arrived: the drive may still be busy
+        irq_restore(flags);
+        if (ide_polling(channel, 0))
+            return 1;
+        state = ide_read(channel, ATA_REG_STATUS);
+        flags = irq_save();
+    }
+    irq_restore(flags);
+    
+    if (state & ATA_SR_ERR)
+        return 2; // Error
+    
+    if (state & ATA_SR_DF)
+        return 1; // Device fault
+    
+    if (need_drq && !(state & ATA_SR_DRQ))
+        return 3; // DRQ not set
+    
+    return 0; // No error
+}
+
 // String helper for model names
 static void ide_string_copy(char* dest, uint16_t* src, int length) {
     for (int i = 0; i < length; i += 2) {
@@ -99,15 +197,47 @@ static void ide_string_copy(char* dest, uint16_t* src, int length) {
     }
 }
 
+// Locate the PCI IDE function and its bus master I/O block (BAR4)
+static void ide_init_bmide(void) {
+    pci_device_t* dev = NULL;
+    
+    // Class 01h (Mass Storage), subclass 01h (IDE), bus master capable
+    while ((dev = pci_find_class(0x01, 0x01, dev)) != NULL) {
+        if (!(dev->prog_if & IDE_PROGIF_BUS_MASTER))
+            continue;
+        
+        uint16_t bmide = pci_bar_io(dev, 4);
+        if (bmide == 0)
+            continue; // Not an I/O BAR
+        
+        pci_enable_device(dev, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+        channels[0].bmide = bmide;
+        channels[1].bmide = bmide + 8;
+        
+        serial_write("IDE bus master DMA at I/O 0x");
+        serial_write_hex(bmide);
+        serial_write("\n");
+        return;
+    }
+    
+    serial_write("No bus master IDE function found, using PIO\n");
+}
+
 void init_ide(void) {
     serial_write("Initializing IDE controllers...\n");
     device_count = 0;
     
-    // Disable interrupts
-    ide_write(0, ATA_REG_CONTROL, 2);
-    ide_write(1, ATA_REG_CONTROL, 2);
+    // Enable interrupts: commands complete on IRQ14/IRQ15
+    for (uint8_t channel = 0; channel < 2; channel++) {
+        channels[channel].nien = 0;
+        channels[channel].irq_pending = 0;
+        irq_install_handler(channels[channel].irq, ide_irq_handler);
+        ide_write(channel, ATA_REG_CONTROL, channels[channel].nien);
+    }
+    
+    ide_init_bmide();
     
-    serial_write("IDE controllers initialized\n");
+    serial_write("IDE controllers initialized (IRQ 14/15)\n");
 }
 
 void ide_detect_devices(void) {
@@ -168,8 +298,17 @@ void ide_detect_devices(void) {
             ide_devices[device_count].capabilities = *((uint16_t*)(identify_buffer + 49));
             ide_devices[device_count].command_sets = *((uint32_t*)(identify_buffer + 82));
             
-            // Get size
+            // Bus master DMA needs both the drive (word 49 bit 8) and the controller
+            ide_devices[device_count].dma = ((identify_buffer[49] & (1 << 8)) &&
+                                             channels[channel].bmide != 0);
+            ide_devices[device_count].sector_size = (type == IDE_ATAPI) ? ATAPI_SECTOR_SIZE : 512;
+            
+            // Get size: words 100-103 for LBA48 drives, words 60-61 otherwise
+            ide_devices[device_count].lba48 = 0;
             if (ide_devices[device_count].command_sets & (1 << 26)) {
+                ide_devices[device_count].lba48 = 1;
+                ide_devices[device_count].size = *((uint64_t*)(identify_buffer + 100));
+            } else if (ide_devices[device_count].capabilities & (1 << 9)) {
                 ide_devices[device_count].size = *((uint32_t*)(identify_buffer + 60));
             } else {
                 ide_devices[device_count].size = 0;
@@ -178,92 +317,728 @@ void ide_detect_devices(void) {
             // Get model
             ide_string_copy(ide_devices[device_count].model, identify_buffer + 27, 40);
             
+            // Enable READ/WRITE MULTIPLE with the largest block the drive supports
+            ide_devices[device_count].multiple = 0;
+            if (type == IDE_ATA && (identify_buffer[47] & 0xFF) > 1) {
+                uint8_t block = identify_buffer[47] & 0xFF;
+                
+                ide_write(channel, ATA_REG_SECCOUNT0, block);
+                ide_irq_arm(channel);
+                ide_write(channel, ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+                
+                if (ide_wait_irq(channel, 0) == 0)
+                    ide_devices[device_count].multiple = block;
+            }
+            
             device_count++;
         }
     }
     
+    // ATAPI sizes come from the medium, not from IDENTIFY PACKET
+    for (int i = 0; i < device_count; i++) {
+        if (ide_devices[i].type == IDE_ATAPI)
+            ide_atapi_capacity(&ide_devices[i]);
+    }
+    
+    ide_blk_register();
     serial_write("IDE device detection complete\n");
 }
 
-uint8_t ide_read_sector(uint8_t channel, uint8_t drive, uint32_t lba, uint8_t* buffer) {
-    uint8_t lba_mode, lba_io[6];
-    
-    // LBA28 mode
-    lba_mode = 0;
-    lba_io[0] = (lba & 0x000000FF) >> 0;
-    lba_io[1] = (lba & 0x0000FF00) >> 8;
-    lba_io[2] = (lba & 0x00FF0000) >> 16;
-    lba_io[3] = 0;
-    lba_io[4] = 0;
-    lba_io[5] = 0;
-    
+// LBA48 is only used when the transfer does not fit LBA28, since it
+// costs four extra register writes
+static int ide_use_lba48(ide_device_t* dev, uint64_t lba, uint32_t count) {
+    return dev && dev->lba48 &&
+           (lba + count > IDE_LBA28_LIMIT || count > IDE_MAX_SECTORS);
+}
+
+// A transfer must end on the disk and, without LBA48, within LBA28 reach;
+// ide_setup_lba() would otherwise drop the high address bits and hit
+// another sector
+static int ide_range_ok(ide_device_t* dev, uint64_t lba, uint32_t count) {
+    if (lba + count > dev->size)
+        return 0;
+    return dev->lba48 || lba + count <= IDE_LBA28_LIMIT;
+}
+
+// Program the task file for a transfer of count sectors. A count of 256
+// (LBA28) or 65536 (LBA48) is encoded as zero. Returns 1 if the drive
+// stayed busy.
+static int ide_setup_lba(uint8_t channel, uint8_t drive, uint64_t lba, uint32_t count, int lba48) {
     // Wait for drive to be ready
-    while (ide_read(channel, ATA_REG_STATUS) & ATA_SR_BSY);
+    if (ide_wait_not_busy(channel))
+        return 1;
     
-    // Select drive
-    ide_write(channel, ATA_REG_HDDEVSEL, 0xE0 | (drive << 4) | ((lba >> 24) & 0x0F));
+    if (lba48) {
+        // Select drive, LBA mode; the address lives entirely in LBA0-5
+        ide_write(channel, ATA_REG_HDDEVSEL, 0x40 | (drive << 4));
+        
+        // High order bytes first
+        ide_write(channel, ATA_REG_SECCOUNT1, (uint8_t)((count >> 8) & 0xFF));
+        ide_write(channel, ATA_REG_LBA3, (uint8_t)((lba >> 24) & 0xFF));
+        ide_write(channel, ATA_REG_LBA4, (uint8_t)((lba >> 32) & 0xFF));
+        ide_write(channel, ATA_REG_LBA5, (uint8_t)((lba >> 40) & 0xFF));
+    } else {
+        // Select drive, LBA mode with address bits 24-27
+        ide_write(channel, ATA_REG_HDDEVSEL, 0xE0 | (drive << 4) | ((lba >> 24) & 0x0F));
+    }
     
     // Write parameters
-    ide_write(channel, ATA_REG_SECCOUNT0, 1);
-    ide_write(channel, ATA_REG_LBA0, lba_io[0]);
-    ide_write(channel, ATA_REG_LBA1, lba_io[1]);
-    ide_write(channel, ATA_REG_LBA2, lba_io[2]);
+    ide_write(channel, ATA_REG_SECCOUNT0, (uint8_t)(count & 0xFF));
+    ide_write(channel, ATA_REG_LBA0, (uint8_t)((lba >> 0) & 0xFF));
+    ide_write(channel, ATA_REG_LBA1, (uint8_t)((lba >> 8) & 0xFF));
+    ide_write(channel, ATA_REG_LBA2, (uint8_t)((lba >> 16) & 0xFF));
+    return 0;
+}
+
+// Find the device entry for a channel/drive pair
+static ide_device_t* ide_find_device(uint8_t channel, uint8_t drive) {
+    for (int i = 0; i < device_count; i++) {
+        if (ide_devices[i].channel == channel && ide_devices[i].drive == drive)
+            return &ide_devices[i];
+    }
+    return NULL;
+}
+
+// Build the channel's PRD table from a scatter list. Entries are split so
+// that no region crosses a 64K boundary. Returns the total byte count, or
+// 0 if the list does not fit or is misaligned.
+static uint32_t ide_build_prd(uint8_t channel, const ide_sg_t* sg, int nsg) {
+    ide_prd_t* prd = prd_tables[channel];
+    uint32_t total = 0;
+    int n = 0;
     
-    // Send command
-    ide_write(channel, ATA_REG_COMMAND, ATA_CMD_READ_PIO);
+    for (int i = 0; i < nsg; i++) {
+        uint32_t addr = sg[i].addr;
+        uint32_t length = sg[i].length;
+        
+        if ((addr & 1) || (length & 1))
+            return 0; // Regions must be word aligned
+        
+        while (length > 0) {
+            uint32_t chunk = 0x10000 - (addr & 0xFFFF);
+            if (chunk > length)
+                chunk = length;
+            
+            if (n >= IDE_PRD_ENTRIES)
+                return 0;
+            
+            prd[n].addr = addr;
+            prd[n].count = (uint16_t)(chunk & 0xFFFF); // 0 means 64K
+            prd[n].flags = 0;
+            n++;
+            
+            addr += chunk;
+            length -= chunk;
+            total += chunk;
+        }
+    }
+    
+    if (n == 0)
+        return 0;
     
-    // Poll
-    if (ide_polling(channel, 1))
-        return 1; // Error
+    prd[n - 1].flags = IDE_PRD_EOT;
+    return total;
+}
+
+// Finish the active request and start the next queued one. Called with
+// interrupts disabled; the completion callback may submit new requests.
+static void ide_complete_request(uint8_t channel, uint8_t error) {
+    ide_request_t* req = channels[channel].active;
     
-    // Read data
-    uint16_t* buf16 = (uint16_t*)buffer;
-    for (int i = 0; i < 256; i++)
-        buf16[i] = inw(channels[channel].base + ATA_REG_DATA);
+    channels[channel].active = NULL;
+    channels[channel].state = IDE_STATE_IDLE;
+    
+    if (req) {
+        req->status = error ? IDE_REQ_ERROR : IDE_REQ_DONE;
+        if (req->complete)
+            req->complete(req);
+    }
     
-    return 0; // Success
+    if (!channels[channel].active && channels[channel].queue_head)
+        ide_start_request(channel);
 }
 
-uint8_t ide_write_sector(uint8_t channel, uint8_t drive, uint32_t lba, uint8_t* buffer) {
-    uint8_t lba_io[6];
+// Issue an ATAPI request: PACKET, then the 12-byte command once the drive
+// asks for it. Reads become READ(12) of 2048-byte sectors. Data moves by
+// bus master DMA when the drive supports it; in PIO the drive interrupts
+// once per DRQ block of at most ATAPI_BYTE_COUNT_LIMIT bytes.
+static void ide_start_packet(uint8_t channel, ide_device_t* dev, ide_request_t* req) {
+    uint8_t* packet = channels[channel].packet;
+    uint32_t length;
     
-    // LBA28 mode
-    lba_io[0] = (lba & 0x000000FF) >> 0;
-    lba_io[1] = (lba & 0x0000FF00) >> 8;
-    lba_io[2] = (lba & 0x00FF0000) >> 16;
-    lba_io[3] = 0;
-    lba_io[4] = 0;
-    lba_io[5] = 0;
+    if (req->op == IDE_OP_FLUSH) {
+        ide_complete_request(channel, 0); // Nothing cached to write back
+        return;
+    }
+    if (req->op == IDE_OP_WRITE) {
+        ide_complete_request(channel, 1); // Read-only media
+        return;
+    }
+    
+    if (req->op == IDE_OP_PACKET) {
+        memcpy(packet, req->packet, ATAPI_PACKET_SIZE);
+        length = req->length;
+    } else {
+        uint32_t count = req->count;
+        
+        if (req->sg) {
+            count = 0;
+            for (int i = 0; i < req->nsg; i++)
+                count += req->sg[i].length / ATAPI_SECTOR_SIZE;
+        }
+        if (count == 0 || count > IDE_ATAPI_MAX_SECTORS || req->lba > 0xFFFFFFFF) {
+            ide_complete_request(channel, 1);
+            return;
+        }
+        
+        // READ(12): big-endian LBA in bytes 2-5, sector count in bytes 6-9
+        memset(packet, 0, ATAPI_PACKET_SIZE);
+        packet[0] = ATAPI_CMD_READ;
+        packet[2] = (uint8_t)(req->lba >> 24);
+        packet[3] = (uint8_t)(req->lba >> 16);
+        packet[4] = (uint8_t)(req->lba >> 8);
+        packet[5] = (uint8_t)req->lba;
+        packet[6] = (uint8_t)(count >> 24);
+        packet[7] = (uint8_t)(count >> 16);
+        packet[8] = (uint8_t)(count >> 8);
+        packet[9] = (uint8_t)count;
+        length = count * ATAPI_SECTOR_SIZE;
+    }
+    
+    uint16_t bmide = channels[channel].bmide;
+    int dma = dev->dma && bmide && req->op == IDE_OP_READ;
+    
+    if (dma) {
+        ide_sg_t flat = { (uint32_t)req->buffer, length };
+        uint32_t bytes = req->sg ? ide_build_prd(channel, req->sg, req->nsg)
+                                 : ide_build_prd(channel, &flat, 1);
+        
+        if (bytes != length) {
+            ide_complete_request(channel, 1);
+            return;
+        }
+        
+        outb(bmide + BMIDE_REG_COMMAND, 0);
+        outl(bmide + BMIDE_REG_PRDT, (uint32_t)prd_tables[channel]);
+        outb(bmide + BMIDE_REG_STATUS, inb(bmide + BMIDE_REG_STATUS) | BMIDE_SR_IRQ | BMIDE_SR_ERR);
+    } else if (req->sg) {
+        ide_complete_request(channel, 1); // PIO needs a flat buffer
+        return;
+    }
+    
+    // The byte count limit caps each PIO DRQ block and must be even
+    uint32_t limit = (length < ATAPI_BYTE_COUNT_LIMIT) ? ((length + 1) & ~1U) : ATAPI_BYTE_COUNT_LIMIT;
     
     // Wait for drive to be ready
-    while (ide_read(channel, ATA_REG_STATUS) & ATA_SR_BSY);
+    if (ide_wait_not_busy(channel)) {
+        ide_complete_request(channel, 1);
+        return;
+    }
     
-    // Select drive
-    ide_write(channel, ATA_REG_HDDEVSEL, 0xE0 | (drive << 4) | ((lba >> 24) & 0x0F));
+    ide_write(channel, ATA_REG_HDDEVSEL, 0xA0 | (req->drive << 4));
+    ide_write(channel, ATA_REG_FEATURES, dma ? ATAPI_FEATURE_DMA : 0);
+    ide_write(channel, ATA_REG_LBA1, (uint8_t)(limit & 0xFF));
+    ide_write(channel, ATA_REG_LBA2, (uint8_t)(limit >> 8));
     
-    // Write parameters
-    ide_write(channel, ATA_REG_SECCOUNT0, 1);
-    ide_write(channel, ATA_REG_LBA0, lba_io[0]);
-    ide_write(channel, ATA_REG_LBA1, lba_io[1]);
-    ide_write(channel, ATA_REG_LBA2, lba_io[2]);
+    channels[channel].pio_buffer = (uint16_t*)req->buffer;
+    channels[channel].pio_bytes = length;
+    channels[channel].state = dma ? IDE_STATE_DMA : IDE_STATE_PACKET;
+    ide_write(channel, ATA_REG_COMMAND, ATA_CMD_PACKET);
+    
+    // The command packet is requested without an interrupt
+    if (ide_polling(channel, 1)) {
+        ide_complete_request(channel, 1);
+        return;
+    }
+    outsw(channels[channel].base + ATA_REG_DATA, (uint16_t*)packet, ATAPI_PACKET_SIZE / 2);
     
-    // Send command
-    ide_write(channel, ATA_REG_COMMAND, ATA_CMD_WRITE_PIO);
+    if (dma)
+        outb(bmide + BMIDE_REG_COMMAND, BMIDE_CMD_READ | BMIDE_CMD_START);
+}
+
+// Issue the request at the head of the channel's queue. Called with
+// interrupts disabled and the channel idle.
+static void ide_start_request(uint8_t channel) {
+    ide_request_t* req = channels[channel].queue_head;
+    
+    channels[channel].queue_head = req->next;
+    if (!channels[channel].queue_head)
+        channels[channel].queue_tail = NULL;
+    req->next = NULL;
+    req->status = IDE_REQ_ACTIVE;
+    channels[channel].active = req;
+    channels[channel].started = timer_ticks();
+    
+    ide_device_t* dev = ide_find_device(channel, req->drive);
+    if (!dev || (req->op == IDE_OP_PACKET && dev->type != IDE_ATAPI)) {
+        ide_complete_request(channel, 1);
+        return;
+    }
     
-    // Poll
-    if (ide_polling(channel, 1))
-        return 1; // Error
+    if (dev->type == IDE_ATAPI) {
+        ide_start_packet(channel, dev, req);
+        return;
+    }
     
-    // Write data
-    uint16_t* buf16 = (uint16_t*)buffer;
-    for (int i = 0; i < 256; i++)
-        outw(channels[channel].base + ATA_REG_DATA, buf16[i]);
+    if (req->op == IDE_OP_FLUSH) {
+        // Wait for drive to be ready
+        if (ide_wait_not_busy(channel)) {
+            ide_complete_request(channel, 1);
+            return;
+        }
+        
+        ide_write(channel, ATA_REG_HDDEVSEL, 0xE0 | (req->drive << 4));
+        channels[channel].state = IDE_STATE_NODATA;
+        ide_write(channel, ATA_REG_COMMAND,
+                  dev->lba48 ? ATA_CMD_CACHE_FLUSH_EXT : ATA_CMD_CACHE_FLUSH);
+        return;
+    }
     
-    // Flush cache
-    ide_write(channel, ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
-    ide_polling(channel, 0);
+    int write = (req->op == IDE_OP_WRITE);
+    uint16_t bmide = channels[channel].bmide;
     
-    return 0; // Success
+    if (dev->dma && bmide) {
+        // Bus master DMA from the scatter list (or the flat buffer)
+        ide_sg_t flat = { (uint32_t)req->buffer, req->count * 512 };
+        uint32_t bytes = req->sg ? ide_build_prd(channel, req->sg, req->nsg)
+                                 : ide_build_prd(channel, &flat, 1);
+        uint32_t count = bytes / 512;
+        int lba48 = ide_use_lba48(dev, req->lba, count);
+        
+        if (bytes == 0 || (bytes % 512) != 0 || !ide_range_ok(dev, req->lba, count) ||
+            count > (lba48 ? IDE_MAX_SECTORS_LBA48 : IDE_MAX_SECTORS)) {
+            ide_complete_request(channel, 1);
+            return;
+        }
+        
+        // Stop any previous transfer, load the table and clear status
+        outb(bmide + BMIDE_REG_COMMAND, 0);
+        outl(bmide + BMIDE_REG_PRDT, (uint32_t)prd_tables[channel]);
+        outb(bmide + BMIDE_REG_STATUS, inb(bmide + BMIDE_REG_STATUS) | BMIDE_SR_IRQ | BMIDE_SR_ERR);
+        
+        if (ide_setup_lba(channel, req->drive, req->lba, count, lba48)) {
+            ide_complete_request(channel, 1);
+            return;
+        }
+        
+        channels[channel].state = IDE_STATE_DMA;
+        if (lba48)
+            ide_write(channel, ATA_REG_COMMAND, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+        else
+            ide_write(channel, ATA_REG_COMMAND, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+        
+        // Start the engine; "read" in the bus master sense means memory writes
+        outb(bmide + BMIDE_REG_COMMAND, (write ? 0 : BMIDE_CMD_READ) | BMIDE_CMD_START);
+        return;
+    }
+    
+    // PIO needs a flat buffer
+    int lba48 = ide_use_lba48(dev, req->lba, req->count);
+    if (req->sg || req->count == 0 || !ide_range_ok(dev, req->lba, req->count) ||
+        req->count > (lba48 ? IDE_MAX_SECTORS_LBA48 : IDE_MAX_SECTORS)) {
+        ide_complete_request(channel, 1);
+        return;
+    }
+    
+    // With multiple mode enabled the drive interrupts once per block of
+    // dev->multiple sectors instead of once per sector
+    uint32_t block = dev->multiple ? dev->multiple : 1;
+    uint8_t command;
+    if (write) {
+        if (block > 1)
+            command = lba48 ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE;
+        else
+            command = lba48 ? ATA_CMD_WRITE_PIO_EXT : ATA_CMD_WRITE_PIO;
+    } else {
+        if (block > 1)
+            command = lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE;
+        else
+            command = lba48 ? ATA_CMD_READ_PIO_EXT : ATA_CMD_READ_PIO;
+    }
+    
+    channels[channel].block = block;
+    channels[channel].remaining = req->count;
+    channels[channel].pio_buffer = (uint16_t*)req->buffer;
+    
+    if (ide_setup_lba(channel, req->drive, req->lba, req->count, lba48)) {
+        ide_complete_request(channel, 1);
+        return;
+    }
+    
+    channels[channel].state = write ? IDE_STATE_PIO_WRITE : IDE_STATE_PIO_READ;
+    ide_write(channel, ATA_REG_COMMAND, command);
+    
+    if (write) {
+        // The first data block is requested without an interrupt
+        if (ide_polling(channel, 1)) {
+            ide_complete_request(channel, 1);
+            return;
+        }
+        
+        uint32_t chunk = (block < req->count) ? block : req->count;
+        outsw(channels[channel].base + ATA_REG_DATA, channels[channel].pio_buffer, chunk * 256);
+        channels[channel].pio_buffer += chunk * 256;
+        channels[channel].remaining -= chunk;
+    }
+}
+
+// Advance the channel's state machine after an interrupt
+static void ide_channel_interrupt(uint8_t channel, uint8_t status) {
+    uint8_t error = (status & (ATA_SR_ERR | ATA_SR_DF)) ? 1 : 0;
+    uint32_t chunk;
+    
+    switch (channels[channel].state) {
+        case IDE_STATE_DMA: {
+            uint16_t bmide = channels[channel].bmide;
+            
+            // Stop the engine and check how the transfer ended
+            outb(bmide + BMIDE_REG_COMMAND, 0);
+            uint8_t bm_status = inb(bmide + BMIDE_REG_STATUS);
+            outb(bmide + BMIDE_REG_STATUS, bm_status | BMIDE_SR_IRQ | BMIDE_SR_ERR);
+            
+            ide_complete_request(channel, error || (bm_status & BMIDE_SR_ERR));
+            break;
+        }
+        
+        case IDE_STATE_PIO_READ:
+            if (error || !(status & ATA_SR_DRQ)) {
+                ide_complete_request(channel, 1);
+                break;
+            }
+            
+            chunk = channels[channel].remaining;
+            if (chunk > channels[channel].block)
+                chunk = channels[channel].block;
+            
+            insw(channels[channel].base + ATA_REG_DATA, channels[channel].pio_buffer, chunk * 256);
+            channels[channel].pio_buffer += chunk * 256;
+            channels[channel].remaining -= chunk;
+            
+            if (channels[channel].remaining == 0)
+                ide_complete_request(channel, 0);
+            break;
+        
+        case IDE_STATE_PIO_WRITE:
+            if (error) {
+                ide_complete_request(channel, 1);
+                break;
+            }
+            
+            if (channels[channel].remaining == 0) {
+                ide_complete_request(channel, 0);
+                break;
+            }
+            
+            chunk = channels[channel].remaining;
+            if (chunk > channels[channel].block)
+                chunk = channels[channel].block;
+            
+            outsw(channels[channel].base + ATA_REG_DATA, channels[channel].pio_buffer, chunk * 256);
+            channels[channel].pio_buffer += chunk * 256;
+            channels[channel].remaining -= chunk;
+            break;
+        
+        case IDE_STATE_NODATA:
+            ide_complete_request(channel, error);
+            break;
+        
+        case IDE_STATE_PACKET: {
+            if (status & ATA_SR_BSY)
+                break; // Early interrupt from the command phase
+            
+            if (error) {
+                ide_complete_request(channel, 1);
+                break;
+            }
+            
+            // DRQ clear: the command is over. A READ must have filled its buffer.
+            if (!(status & ATA_SR_DRQ)) {
+                ide_request_t* req = channels[channel].active;
+                ide_complete_request(channel, req && req->op == IDE_OP_READ &&
+                                              channels[channel].pio_bytes != 0);
+                break;
+            }
+            
+            // The drive reports the size of this DRQ block in LBA1/LBA2;
+            // whatever does not fit the buffer is drained
+            uint32_t words = ((ide_read(channel, ATA_REG_LBA1) |
+                               (ide_read(channel, ATA_REG_LBA2) << 8)) + 1) / 2;
+            uint32_t take = channels[channel].pio_bytes / 2;
+            if (take > words)
+                take = words;
+            
+            insw(channels[channel].base + ATA_REG_DATA, channels[channel].pio_buffer, take);
+            channels[channel].pio_buffer += take;
+            channels[channel].pio_bytes -= take * 2;
+            for (; take < words; take++)
+                inw(channels[channel].base + ATA_REG_DATA);
+            break;
+        }
+        
+        default:
+            // Not ours to process: latch it for ide_wait_irq()
+            channels[channel].irq_status = status;
+            channels[channel].irq_pending = 1;
+            break;
+    }
+}
+
+// Queue a request on its channel and start it if the channel is idle.
+// Returns immediately; completion is signalled through req->status and
+// req->complete (called from interrupt context).
+void ide_submit(ide_request_t* req) {
+    uint8_t channel = req->channel;
+    
+    if (channel > 1) {
+        req->status = IDE_REQ_ERROR;
+        if (req->complete)
+            req->complete(req);
+        return;
+    }
+    
+    req->next = NULL;
+    req->status = IDE_REQ_QUEUED;
+    
+    uint32_t flags = irq_save();
+    
+    if (channels[channel].queue_tail)
+        channels[channel].queue_tail->next = req;
+    else
+        channels[channel].queue_head = req;
+    channels[channel].queue_tail = req;
+    
+    if (!channels[channel].active)
+        ide_start_request(channel);
+    
+    irq_restore(flags);
+}
+
+// Recover a channel whose active command has had no interrupt for
+// IDE_IRQ_TIMEOUT_MS: a hung drive fails the request, otherwise the lost
+// interrupt is handled now. Returns 0 if nothing had timed out. Called
+// with interrupts disabled.
+static int ide_channel_timeout(uint8_t channel) {
+    if (!channels[channel].active ||
+        timer_ticks() - channels[channel].started < IDE_IRQ_TIMEOUT_MS)
+        return 0;
+    
+    uint8_t status = ide_read(channel, ATA_REG_ALTSTATUS);
+    
+    if (status & ATA_SR_BSY) {
+        // Drive is hung: abort the request
+        if (channels[channel].bmide)
+            outb(channels[channel].bmide + BMIDE_REG_COMMAND, 0);
+        ide_complete_request(channel, 1);
+    } else {
+        ide_channel_interrupt(channel, ide_read(channel, ATA_REG_STATUS));
+        channels[channel].started = timer_ticks();
+    }
+    return 1;
+}
+
+// Sleep until a submitted request finishes. Requests on the other channel
+// keep progressing from their own interrupts meanwhile. A lost interrupt
+// is recovered by reading status after IDE_IRQ_TIMEOUT_MS.
+uint8_t ide_wait(ide_request_t* req) {
+    uint32_t flags = irq_save();
+    
+    while (req->status == IDE_REQ_QUEUED || req->status == IDE_REQ_ACTIVE) {
+        if (req->status == IDE_REQ_ACTIVE && ide_channel_timeout(req->channel))
+            continue;
+        irq_wait();
+    }
+    
+    irq_restore(flags);
+    return (req->status == IDE_REQ_DONE) ? 0 : 1;
+}
+
+// Submit a request and sleep until it completes
+static uint8_t ide_do_request(uint8_t channel, uint8_t drive, uint8_t op, uint64_t lba,
+                              uint32_t count, uint8_t* buffer, const ide_sg_t* sg, int nsg) {
+    ide_request_t req;
+    
+    req.channel = channel;
+    req.drive = drive;
+    req.op = op;
+    req.lba = lba;
+    req.count = count;
+    req.packet = NULL;
+    req.length = 0;
+    req.buffer = buffer;
+    req.sg = sg;
+    req.nsg = nsg;
+    req.complete = NULL;
+    req.private_data = NULL;
+    
+    ide_submit(&req);
+    return ide_wait(&req);
+}
+
+// Transfer sectors between the drive and a scatter list with bus master
+// DMA. The CPU only programs the command; the controller moves the data
+// and raises IRQ14/IRQ15 once the whole transfer is done.
+uint8_t ide_transfer_sg(uint8_t channel, uint8_t drive, uint64_t lba,
+                        const ide_sg_t* sg, int nsg, int write) {
+    ide_device_t* dev = ide_find_device(channel, drive);
+    
+    if (!dev || !dev->dma || nsg <= 0)
+        return 1; // No DMA for this drive
+    
+    return ide_do_request(channel, drive, write ? IDE_OP_WRITE : IDE_OP_READ,
+                          lba, 0, NULL, sg, nsg);
+}
+
+// Read sectors using DMA when the drive supports it, PIO otherwise
+uint8_t ide_read_sectors(uint8_t channel, uint8_t drive, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    return ide_do_request(channel, drive, IDE_OP_READ, lba, count, buffer, NULL, 0);
+}
+
+// Write sectors using DMA when the drive supports it, PIO otherwise. Data
+// is only guaranteed to be on the medium after ide_flush().
+uint8_t ide_write_sectors(uint8_t channel, uint8_t drive, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    return ide_do_request(channel, drive, IDE_OP_WRITE, lba, count, buffer, NULL, 0);
+}
+
+uint8_t ide_read_sector(uint8_t channel, uint8_t drive, uint64_t lba, uint8_t* buffer) {
+    return ide_read_sectors(channel, drive, lba, 1, buffer);
+}
+
+uint8_t ide_write_sector(uint8_t channel, uint8_t drive, uint64_t lba, uint8_t* buffer) {
+    return ide_write_sectors(channel, drive, lba, 1, buffer);
+}
+
+// Flush the drive's write cache
+uint8_t ide_flush(uint8_t channel, uint8_t drive) {
+    return ide_do_request(channel, drive, IDE_OP_FLUSH, 0, 0, NULL, NULL, 0);
+}
+
+// Send an ATAPI command that reads up to length bytes into buffer, by PIO.
+// Returns 0 on success; an error includes CHECK CONDITION.
+uint8_t ide_atapi_packet(uint8_t channel, uint8_t drive, const uint8_t* packet,
+                         uint8_t* buffer, uint32_t length) {
+    ide_request_t req;
+    
+    req.channel = channel;
+    req.drive = drive;
+    req.op = IDE_OP_PACKET;
+    req.lba = 0;
+    req.count = 0;
+    req.packet = packet;
+    req.length = length;
+    req.buffer = buffer;
+    req.sg = NULL;
+    req.nsg = 0;
+    req.complete = NULL;
+    req.private_data = NULL;
+    
+    ide_submit(&req);
+    return ide_wait(&req);
+}
+
+// Read the medium's size with READ CAPACITY. The first command after the
+// medium changes fails with UNIT ATTENTION, so it is retried. Without a
+// medium the size stays 0 and the drive gets no block device.
+static void ide_atapi_capacity(ide_device_t* dev) {
+    uint8_t packet[ATAPI_PACKET_SIZE] = { ATAPI_CMD_READ_CAPACITY };
+    uint8_t data[8];
+    
+    dev->size = 0;
+    for (int tries = 0; tries < 3; tries++) {
+        if (ide_atapi_packet(dev->channel, dev->drive, packet, data, sizeof(data)) != 0)
+            continue;
+        
+        // Last LBA and block length, big-endian
+        uint32_t last = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+                        ((uint32_t)data[2] << 8) | data[3];
+        uint32_t block = ((uint32_t)data[4] << 24) | ((uint32_t)data[5] << 16) |
+                         ((uint32_t)data[6] << 8) | data[7];
+        
+        if (block == ATAPI_SECTOR_SIZE)
+            dev->size = (uint64_t)last + 1;
+        return;
+    }
+}
+
+// Block layer glue. A channel runs one command at a time, so each drive
+// takes one request and the rest wait in the elevator where they can
+// still be merged.
+static ide_request_t blk_native[4];
+static ide_sg_t blk_sg[4][BLK_MAX_SEGMENTS];
+
+static void ide_blk_complete(ide_request_t* req) {
+    blk_end_request((blk_request_t*)req->private_data, req->status != IDE_REQ_DONE);
+}
+
+static void ide_blk_submit(blkdev_t* bdev, blk_request_t* req) {
+    int index = (int)(uintptr_t)bdev->driver_data;
+    ide_device_t* dev = &ide_devices[index];
+    ide_request_t* native = &blk_native[index];
+    
+    native->channel = dev->channel;
+    native->drive = dev->drive;
+    native->lba = req->sector;
+    native->count = req->count;
+    native->packet = NULL;
+    native->length = 0;
+    native->buffer = NULL;
+    native->sg = NULL;
+    native->nsg = 0;
+    native->complete = ide_blk_complete;
+    native->private_data = req;
+    
+    if (req->op == BIO_FLUSH) {
+        native->op = IDE_OP_FLUSH;
+    } else {
+        native->op = (req->op == BIO_WRITE) ? IDE_OP_WRITE : IDE_OP_READ;
+        if (req->nsg == 1) {
+            native->buffer = (uint8_t*)req->sg[0].addr;
+        } else {
+            for (uint32_t i = 0; i < req->nsg; i++) {
+                blk_sg[index][i].addr = req->sg[i].addr;
+                blk_sg[index][i].length = req->sg[i].length;
+            }
+            native->sg = blk_sg[index];
+            native->nsg = req->nsg;
+        }
+    }
+    
+    ide_submit(native);
+}
+
+static void ide_blk_timeout(blkdev_t* bdev) {
+    int index = (int)(uintptr_t)bdev->driver_data;
+    ide_channel_timeout(ide_devices[index].channel);
+}
+
+static const blkdev_ops_t ide_blk_ops = {
+    ide_blk_submit,
+    NULL,
+    NULL,
+    ide_blk_timeout,
+};
+
+// Register the ATA disks with the block layer as ide0, ide1, ... and the
+// ATAPI drives holding a medium as cd0, cd1, ...
+static void ide_blk_register(void) {
+    for (int i = 0; i < device_count; i++) {
+        ide_device_t* dev = &ide_devices[i];
+        int atapi = (dev->type == IDE_ATAPI);
+        
+        if (atapi && dev->size == 0)
+            continue;
+        
+        blkdev_t* bdev = blk_register(atapi ? "cd" : "ide", &ide_blk_ops, (void*)(uintptr_t)i,
+                                      dev->sector_size, dev->size, BLKDEV_ROTATIONAL);
+        if (!bdev)
+            return;
+        
+        if (atapi)
+            bdev->max_sectors = IDE_ATAPI_MAX_SECTORS;
+        else
+            bdev->max_sectors = dev->lba48 ? IDE_MAX_SECTORS_LBA48 : IDE_MAX_SECTORS;
+        bdev->max_segments = dev->dma ? BLK_MAX_SEGMENTS : 1; // PIO needs a flat buffer
+        bdev->queue_depth = 1;
+    }
 }
 
 void ide_print_devices(void) {
@@ -313,11 +1088,12 @@ void ide_print_devices(void) {
         serial_write(dev->model);
         serial_write("\n");
         
-        // Size (for ATA only)
-        if (dev->type == IDE_ATA && dev->size > 0) {
+        // Size (ATAPI: of the medium)
+        if (dev->size > 0) {
             terminal_writestring("  Size: ");
             // Simple size display (in MB)
-            uint32_t size_mb = dev->size / 2048; // 512 byte sectors to MB
+            uint32_t size_mb = (uint32_t)(dev->type == IDE_ATA ? dev->size >> 11  // 512 byte sectors to MB
+                                                                : dev->size >> 9); // 2048 byte sectors to MB
             char size_str[16];
             int pos = 0;
             uint32_t temp = size_mb;
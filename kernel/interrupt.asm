@@ -0,0 +1,158 @@
+; Hardware interrupt entry stubs
+; Each stub pushes its IRQ number and jumps to a common path that saves
+; the general purpose registers and calls irq_dispatch() in irq.c.
+; MSI stubs push their vector and call msi_dispatch() instead.
+
+extern irq_dispatch
+extern msi_dispatch
+
+global irq_stub_table
+global msi_stub_table
+global spurious_stub
+
+%macro IRQ_STUB 1
+irq_stub_%1:
+    push dword %1     ; IRQ number for irq_dispatch
+    jmp irq_common
+%endmacro
+
+%macro MSI_STUB 1
+msi_stub_%1:
+    push dword %1     ; Vector for msi_dispatch
+    jmp msi_common
+%endmacro
+
+section .text
+
+IRQ_STUB 0
+IRQ_STUB 1
+IRQ_STUB 2
+IRQ_STUB 3
+IRQ_STUB 4
+IRQ_STUB 5
+IRQ_STUB 6
+IRQ_STUB 7
+IRQ_STUB 8
+IRQ_STUB 9
+IRQ_STUB 10
+IRQ_STUB 11
+IRQ_STUB 12
+IRQ_STUB 13
+IRQ_STUB 14
+IRQ_STUB 15
+
+irq_common:
+    pusha             ; Save eax, ecx, edx, ebx, esp, ebp, esi, edi
+    cld               ; C code expects the direction flag clear
+    mov eax, [esp+32] ; IRQ number pushed by the stub (above the 8 saved registers)
+    push eax
+    call irq_dispatch
+    add esp, 4
+    popa
+    add esp, 4        ; Drop the IRQ number
+    iret
+
+MSI_STUB 0x30
+MSI_STUB 0x31
+MSI_STUB 0x32
+MSI_STUB 0x33
+MSI_STUB 0x34
+MSI_STUB 0x35
+MSI_STUB 0x36
+MSI_STUB 0x37
+MSI_STUB 0x38
+MSI_STUB 0x39
+MSI_STUB 0x3A
+MSI_STUB 0x3B
+MSI_STUB 0x3C
+MSI_STUB 0x3D
+MSI_STUB 0x3E
+MSI_STUB 0x3F
+MSI_STUB 0x40
+MSI_STUB 0x41
+MSI_STUB 0x42
+MSI_STUB 0x43
+MSI_STUB 0x44
+MSI_STUB 0x45
+MSI_STUB 0x46
+MSI_STUB 0x47
+MSI_STUB 0x48
+MSI_STUB 0x49
+MSI_STUB 0x4A
+MSI_STUB 0x4B
+MSI_STUB 0x4C
+MSI_STUB 0x4D
+MSI_STUB 0x4E
+MSI_STUB 0x4F
+
+msi_common:
+    pusha
+    cld
+    mov eax, [esp+32] ; Vector pushed by the stub
+    push eax
+    call msi_dispatch
+    add esp, 4
+    popa
+    add esp, 4        ; Drop the vector
+    iret
+
+; Local APIC spurious interrupt: no EOI
+spurious_stub:
+    iret
+
+section .data
+align 4
+
+; Stub addresses, indexed by IRQ line, used by init_idt()
+irq_stub_table:
+    dd irq_stub_0
+    dd irq_stub_1
+    dd irq_stub_2
+    dd irq_stub_3
+    dd irq_stub_4
+    dd irq_stub_5
+    dd irq_stub_6
+    dd irq_stub_7
+    dd irq_stub_8
+    dd irq_stub_9
+    dd irq_stub_10
+    dd irq_stub_11
+    dd irq_stub_12
+    dd irq_stub_13
+    dd irq_stub_14
+    dd irq_stub_15
+
+; MSI stub addresses, indexed from MSI_VECTOR_BASE
+msi_stub_table:
+    dd msi_stub_0x30
+    dd msi_stub_0x31
+    dd msi_stub_0x32
+    dd msi_stub_0x33
+    dd msi_stub_0x34
+    dd msi_stub_0x35
+    dd msi_stub_0x36
+    dd msi_stub_0x37
+    dd msi_stub_0x38
+    dd msi_stub_0x39
+    dd msi_stub_0x3A
+    dd msi_stub_0x3B
+    dd msi_stub_0x3C
+    dd msi_stub_0x3D
+    dd msi_stub_0x3E
+    dd msi_stub_0x3F
+    dd msi_stub_0x40
+    dd msi_stub_0x41
+    dd msi_stub_0x42
+    dd msi_stub_0x43
+    dd msi_stub_0x44
+    dd msi_stub_0x45
+    dd msi_stub_0x46
+    dd msi_stub_0x47
+    dd msi_stub_0x48
+    dd msi_stub_0x49
+    dd msi_stub_0x4A
+    dd msi_stub_0x4B
+    dd msi_stub_0x4C
+    dd msi_stub_0x4D
+    dd msi_stub_0x4E
+    dd msi_stub_0x4F
@@ -0,0 +1,256 @@
+#include "irq.h"
+#include "kernel.h"
+
+// Handlers per line; every handler on a shared line is called and checks
+// its own device for pending work
+static irq_handler_t irq_handlers[IRQ_LINES][IRQ_MAX_SHARED];
+
+// Cached interrupt masks (bit set = line masked)
+static uint8_t pic1_mask = 0xFF;
+static uint8_t pic2_mask = 0xFF;
+
+// MSI vectors, indexed from MSI_VECTOR_BASE; NULL handler = free
+static msi_handler_t msi_handlers[MSI_VECTORS];
+static void* msi_data[MSI_VECTORS];
+
+// Interrupt handlers running; nonzero means completion context
+static volatile uint32_t handler_depth = 0;
+
+// Local APIC registers (0 = no APIC, MSI unavailable) and the APIC ID of
+// each CPU, used as the MSI destination
+static uintptr_t lapic_base = 0;
+static uint8_t cpu_apic_ids[IRQ_MAX_CPUS];
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    asm volatile("cpuid"
+                 : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                 : "a"(leaf));
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static void pic_write_masks(void) {
+    outb(PIC1_DATA, pic1_mask);
+    outb(PIC2_DATA, pic2_mask);
+}
+
+static void pic_set_masked(uint8_t irq, int masked) {
+    uint8_t bit = 1 << (irq & 7);
+    
+    if (irq < 8) {
+        if (masked)
+            pic1_mask |= bit;
+        else
+            pic1_mask &= ~bit;
+    } else {
+        if (masked)
+            pic2_mask |= bit;
+        else
+            pic2_mask &= ~bit;
+    }
+    pic_write_masks();
+}
+
+// Read the In-Service Register of both PICs (slave in the high byte)
+static uint16_t pic_read_isr(void) {
+    outb(PIC1_COMMAND, PIC_CMD_READ_ISR);
+    outb(PIC2_COMMAND, PIC_CMD_READ_ISR);
+    return (inb(PIC2_COMMAND) << 8) | inb(PIC1_COMMAND);
+}
+
+// Enable the boot CPU's local APIC so it accepts MSI writes. If firmware
+// left it software-disabled, its LVT entries were masked; LINT0 is set
+// back to ExtINT so PIC interrupts keep arriving.
+static void init_lapic(void) {
+    uint32_t eax, ebx, ecx, edx;
+    
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 9))) {
+        serial_write("No local APIC, MSI disabled\n");
+        return;
+    }
+    
+    uint64_t base = rdmsr(LAPIC_BASE_MSR);
+    if (!(base & LAPIC_BASE_ENABLE))
+        wrmsr(LAPIC_BASE_MSR, base | LAPIC_BASE_ENABLE);
+    lapic_base = (uintptr_t)(base & 0xFFFFF000);
+    
+    uint32_t svr = mmio_read32(lapic_base + LAPIC_REG_SVR);
+    if (!(svr & LAPIC_SVR_ENABLE)) {
+        mmio_write32(lapic_base + LAPIC_REG_LVT_LINT0, LAPIC_LVT_EXTINT);
+        mmio_write32(lapic_base + LAPIC_REG_LVT_LINT1, LAPIC_LVT_NMI);
+    }
+    mmio_write32(lapic_base + LAPIC_REG_SVR, LAPIC_SVR_ENABLE | IRQ_SPURIOUS_VECTOR);
+    mmio_write32(lapic_base + LAPIC_REG_TPR, 0);
+    
+    cpu_apic_ids[0] = mmio_read32(lapic_base + LAPIC_REG_ID) >> 24;
+    for (int i = 0; i < MSI_VECTORS; i++) {
+        msi_handlers[i] = NULL;
+        msi_data[i] = NULL;
+    }
+    
+    serial_write("Local APIC at 0x");
+    serial_write_hex(lapic_base);
+    serial_write(", MSI vectors 0x30-0x4F\n");
+}
+
+void init_irq(void) {
+    serial_write("Remapping PIC to vectors 0x20-0x2F...\n");
+    
+    // ICW1: start initialization sequence
+    outb(PIC1_COMMAND, PIC_CMD_INIT);
+    outb(PIC2_COMMAND, PIC_CMD_INIT);
+    
+    // ICW2: vector offsets
+    outb(PIC1_DATA, IRQ_VECTOR_BASE);
+    outb(PIC2_DATA, IRQ_VECTOR_BASE + 8);
+    
+    // ICW3: slave PIC on IRQ2 of the master
+    outb(PIC1_DATA, 1 << IRQ_CASCADE);
+    outb(PIC2_DATA, IRQ_CASCADE);
+    
+    // ICW4: 8086 mode
+    outb(PIC1_DATA, 0x01);
+    outb(PIC2_DATA, 0x01);
+    
+    // Mask everything except the cascade line; drivers unmask their own IRQs
+    for (int i = 0; i < IRQ_LINES; i++) {
+        for (int j = 0; j < IRQ_MAX_SHARED; j++)
+            irq_handlers[i][j] = NULL;
+    }
+    pic1_mask = 0xFF & ~(1 << IRQ_CASCADE);
+    pic2_mask = 0xFF;
+    pic_write_masks();
+    
+    serial_write("PIC initialized\n");
+    init_lapic();
+}
+
+void irq_install_handler(uint8_t irq, irq_handler_t handler) {
+    if (irq >= IRQ_LINES)
+        return;
+    
+    uint32_t flags = irq_save();
+    for (int i = 0; i < IRQ_MAX_SHARED; i++) {
+        if (irq_handlers[irq][i] == handler)
+            break; // Already installed
+        if (irq_handlers[irq][i] == NULL) {
+            irq_handlers[irq][i] = handler;
+            break;
+        }
+    }
+    pic_set_masked(irq, 0);
+    irq_restore(flags);
+}
+
+void irq_uninstall_handler(uint8_t irq, irq_handler_t handler) {
+    if (irq >= IRQ_LINES || irq == IRQ_CASCADE)
+        return;
+    
+    uint32_t flags = irq_save();
+    int remaining = 0;
+    for (int i = 0; i < IRQ_MAX_SHARED; i++) {
+        if (irq_handlers[irq][i] == handler)
+            irq_handlers[irq][i] = NULL;
+        else if (irq_handlers[irq][i])
+            remaining++;
+    }
+    if (remaining == 0)
+        pic_set_masked(irq, 1);
+    irq_restore(flags);
+}
+
+// Called from irq_common in interrupt.asm with interrupts disabled
+void irq_dispatch(uint32_t irq) {
+    // IRQ 7 and 15 may be spurious; the ISR bit tells us if it was real
+    if (irq == 7 || irq == 15) {
+        if (!(pic_read_isr() & (1 << irq))) {
+            // A spurious IRQ from the slave still needs an EOI on the master
+            if (irq == 15)
+                outb(PIC1_COMMAND, PIC_CMD_EOI);
+            return;
+        }
+    }
+    
+    handler_depth++;
+    for (int i = 0; i < IRQ_MAX_SHARED; i++) {
+        if (irq_handlers[irq][i])
+            irq_handlers[irq][i]((uint8_t)irq);
+    }
+    handler_depth--;
+    
+    if (irq >= 8)
+        outb(PIC2_COMMAND, PIC_CMD_EOI);
+    outb(PIC1_COMMAND, PIC_CMD_EOI);
+}
+
+// Is an interrupt handler running? Code called from it must not wait
+// for other interrupts.
+int irq_in_handler(void) {
+    return handler_depth != 0;
+}
+
+int msi_supported(void) {
+    return lapic_base != 0;
+}
+
+// Reserve a vector for one interrupt source. Returns the vector, or -1 if
+// MSI is unavailable or every vector is taken.
+int msi_alloc_vector(msi_handler_t handler, void* data) {
+    if (!lapic_base || !handler)
+        return -1;
+    
+    uint32_t flags = irq_save();
+    for (int i = 0; i < MSI_VECTORS; i++) {
+        if (msi_handlers[i] == NULL) {
+            msi_handlers[i] = handler;
+            msi_data[i] = data;
+            irq_restore(flags);
+            return MSI_VECTOR_BASE + i;
+        }
+    }
+    irq_restore(flags);
+    return -1;
+}
+
+void msi_free_vector(uint8_t vector) {
+    if (vector < MSI_VECTOR_BASE || vector >= MSI_VECTOR_BASE + MSI_VECTORS)
+        return;
+    
+    uint32_t flags = irq_save();
+    msi_handlers[vector - MSI_VECTOR_BASE] = NULL;
+    msi_data[vector - MSI_VECTOR_BASE] = NULL;
+    irq_restore(flags);
+}
+
+// Message address and data that deliver `vector` to `cpu`: fixed delivery,
+// edge triggered, physical destination. CPUs that are not running fall
+// back to the boot CPU.
+void msi_compose(uint8_t vector, uint8_t cpu, uint32_t* address, uint32_t* data) {
+    if (cpu >= IRQ_MAX_CPUS)
+        cpu = 0;
+    *address = MSI_ADDRESS_BASE | ((uint32_t)cpu_apic_ids[cpu] << 12);
+    *data = vector;
+}
+
+// Called from msi_common in interrupt.asm with interrupts disabled. MSIs
+// are edge triggered and never shared: call the one handler and signal
+// the end of interrupt to the local APIC.
+void msi_dispatch(uint32_t vector) {
+    uint32_t i = vector - MSI_VECTOR_BASE;
+    
+    handler_depth++;
+    if (i < MSI_VECTORS && msi_handlers[i])
+        msi_handlers[i](msi_data[i]);
+    handler_depth--;
+    
+    mmio_write32(lapic_base + LAPIC_REG_EOI, 0);
+}
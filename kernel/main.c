@@ -2,15 +2,6 @@
 
 int kernel_verbose_mode = 0;
 
-// Simple string comparison
-static int strcmp(const char* s1, const char* s2) {
-    while (*s1 && (*s1 == *s2)) {
-        s1++;
-        s2++;
-    }
-    return *(unsigned char*)s1 - *(unsigned char*)s2;
-}
-
 // Simple string search
 static int strstr_check(const char* haystack, const char* needle) {
     if (!haystack || !needle) return 0;
@@ -90,6 +81,15 @@ void kernel_main(uint32_t magic, struct multiboot_info* mbi) {
     terminal_writestring("IDT initialized\n");
     serial_write("IDT initialized\n");
     
+    // Remap the PIC, start the system timer and enable interrupts
+    terminal_writestring("Initializing interrupts...\n");
+    serial_write("Initializing interrupts...\n");
+    init_irq();
+    init_timer();
+    asm volatile ("sti");
+    terminal_writestring("Interrupts enabled\n");
+    serial_write("Interrupts enabled\n");
+    
     // Initialize memory management
     serial_write("Initializing memory...\n");
     init_memory(mbi);
@@ -100,20 +100,42 @@ void kernel_main(uint32_t magic, struct multiboot_info* mbi) {
     init_hyperv();
     serial_write("Hyper-V initialization complete\n");
     
+    // Enumerate PCI once; drivers look their functions up in the table
+    init_pci();
+    
     // Initialize hardware info
     serial_write("Detecting hardware...\n");
     init_hwinfo();
     
+    // Initialize the block layer before any disk driver registers
+    init_blkdev();
+    init_bcache();
+    
     // Initialize IDE controller
     serial_write("Initializing IDE...\n");
     init_ide();
     ide_detect_devices();
     
+    // Initialize AHCI (SATA) controller
+    serial_write("Initializing AHCI...\n");
+    init_ahci();
+    
+    // Initialize NVMe controller
+    serial_write("Initializing NVMe...\n");
+    init_nvme();
+    
+    // Initialize virtio block devices
+    serial_write("Initializing virtio-blk...\n");
+    init_virtio_blk();
+    
     // Initialize SCSI controller
     serial_write("Initializing SCSI...\n");
     init_scsi();
     scsi_scan_devices();
     
+    // Assemble software RAID arrays named on the command line
+    init_raid((mbi->flags & 0x04) ? (const char*)mbi->cmdline : NULL);
+    
     // Print system information
     terminal_writestring("\nSystem Information:\n");
     terminal_writestring("==================\n");
@@ -137,6 +159,18 @@ void kernel_main(uint32_t magic, struct multiboot_info* mbi) {
     // Display IDE devices
     ide_print_devices();
     
+    // Display SATA devices
+    ahci_print_devices();
+    
+    // Display NVMe devices
+    nvme_print_devices();
+    
+    // Display virtio block devices
+    virtio_blk_print_devices();
+    
+    // Display registered block devices
+    blk_print_devices();
+    
     // Display SCSI devices
     scsi_print_devices();
     
@@ -144,8 +178,12 @@ void kernel_main(uint32_t magic, struct multiboot_info* mbi) {
     if (kernel_verbose_mode) {
         print_detailed_hardware_info();
         print_memory_map(mbi);
+        blk_dump_stats();
     }
     
+    // Run block benchmarks requested with bench=
+    bench_run_cmdline((mbi->flags & 0x04) ? (const char*)mbi->cmdline : NULL);
+    
     terminal_writestring("\nHueOS kernel initialization complete!\n");
     terminal_writestring("Kernel is now running...\n");
     serial_write("\nHueOS kernel initialization complete!\n");
@@ -154,6 +192,7 @@ void kernel_main(uint32_t magic, struct multiboot_info* mbi) {
     // Main kernel loop
     while (1) {
         // In a real OS, this would be the scheduler
+        bcache_periodic(); // Write back aged dirty blocks
         asm volatile ("hlt"); // Halt until next interrupt
     }
 }
\ No newline at end of file
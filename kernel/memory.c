@@ -1,11 +1,17 @@
 #include "kernel.h"
 
+// End of the kernel image, from linker.ld
+extern uint8_t kernel_end[];
+
 static uint32_t memory_end;
 static uint32_t placement_address = 0x100000; // Start at 1MB
 
 void init_memory(struct multiboot_info* mbi) {
     terminal_writestring("Initializing memory management...\n");
     
+    // The kernel is loaded at 1MB; allocate above its image
+    placement_address = ((uint32_t)kernel_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    
     // Check if memory map is available
     if (mbi->flags & 0x40) {
         terminal_writestring("Memory map available\n");
@@ -58,4 +64,12 @@ void* kmalloc(size_t size) {
     }
     
     return ret;
+}
+
+// Aligned allocation for DMA structures (align must be a power of two)
+void* kmalloc_aligned(size_t size, size_t align) {
+    if (size == 0) return 0;
+    
+    placement_address = (placement_address + align - 1) & ~(align - 1);
+    return kmalloc(size);
 }
\ No newline at end of file
@@ -0,0 +1,713 @@
+#include "nvme.h"
+#include "blkdev.h"
+#include "irq.h"
+#include "pci.h"
+#include "timer.h"
+#include "kernel.h"
+
+// Submission/completion queue pair
+typedef struct {
+    uint16_t qid;
+    uint16_t depth;
+    nvme_sqe_t* sq;
+    nvme_cqe_t* cq;
+    uint16_t sq_tail;                   // Next free submission entry
+    uint16_t sq_committed;              // Tail last written to the doorbell
+    uint16_t cq_head;
+    uint8_t  phase;                     // Expected phase tag of new entries
+    uintptr_t sq_doorbell;
+    uintptr_t cq_doorbell;
+    nvme_request_t* reqs[NVME_IO_QUEUE_DEPTH];  // Outstanding, by command id
+    uint64_t* prp_lists[NVME_IO_QUEUE_DEPTH];   // PRP list page per command id
+    uint32_t inflight;
+    nvme_request_t* wait_head;          // Requests waiting for a command id
+    nvme_request_t* wait_tail;
+    uint8_t  vector;                    // MSI-X vector, 0 when on INTx
+} nvme_queue_t;
+
+static uintptr_t regs = 0;
+static uint32_t doorbell_stride = 4;
+static uint8_t irq_line = 0;
+static pci_device_t* pci_dev = NULL;
+static pci_msix_t msix;                 // Entry n serves completion queue n
+static int msix_enabled = 0;
+static uint32_t max_transfer = 0;       // Bytes, from MDTS (0 = no limit)
+static uint16_t io_depth = NVME_IO_QUEUE_DEPTH; // Entries per I/O queue, within CAP.MQES
+static char controller_model[41];
+
+static nvme_queue_t admin_queue;
+static nvme_queue_t io_queues[NVME_MAX_CPUS];
+static int io_queue_count = 0;
+
+static nvme_device_t devices[NVME_MAX_DEVICES];
+static int device_count = 0;
+
+static void nvme_blk_register(void);
+
+// The queue pair owned by the executing CPU. Every CPU submits to and
+// completes from its own pair, so the I/O path never needs a lock shared
+// between CPUs; disabling local interrupts is enough.
+static nvme_queue_t* nvme_cpu_queue(void) {
+    return &io_queues[0]; // Only the boot CPU runs HueOS
+}
+
+// Allocate queue memory and compute the doorbell addresses
+static int nvme_alloc_queue(nvme_queue_t* q, uint16_t qid, uint16_t depth) {
+    q->qid = qid;
+    q->depth = depth;
+    q->sq = (nvme_sqe_t*)kmalloc_aligned(sizeof(nvme_sqe_t) * depth, PAGE_SIZE);
+    q->cq = (nvme_cqe_t*)kmalloc_aligned(sizeof(nvme_cqe_t) * depth, PAGE_SIZE);
+    if (!q->sq || !q->cq)
+        return 0;
+    
+    memset(q->sq, 0, sizeof(nvme_sqe_t) * depth);
+    memset(q->cq, 0, sizeof(nvme_cqe_t) * depth);
+    
+    q->sq_tail = 0;
+    q->sq_committed = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+    q->sq_doorbell = regs + NVME_REG_DOORBELL + (2 * qid) * doorbell_stride;
+    q->cq_doorbell = regs + NVME_REG_DOORBELL + (2 * qid + 1) * doorbell_stride;
+    q->inflight = 0;
+    q->wait_head = NULL;
+    q->wait_tail = NULL;
+    
+    for (int i = 0; i < NVME_IO_QUEUE_DEPTH; i++) {
+        q->reqs[i] = NULL;
+        q->prp_lists[i] = NULL;
+    }
+    
+    return 1;
+}
+
+// Run an admin command synchronously
+static int nvme_admin_command(nvme_sqe_t* cmd, uint32_t* result) {
+    nvme_queue_t* q = &admin_queue;
+    
+    cmd->cdw0 = (cmd->cdw0 & 0xFF) | ((uint32_t)q->sq_tail << 16);
+    memcpy(&q->sq[q->sq_tail], cmd, sizeof(nvme_sqe_t));
+    q->sq_tail = (q->sq_tail + 1) % q->depth;
+    mmio_write32(q->sq_doorbell, q->sq_tail);
+    
+    uint32_t start = timer_ticks();
+    while ((q->cq[q->cq_head].status & 1) != q->phase) {
+        if (timer_ticks() - start > NVME_TIMEOUT_MS)
+            return 0;
+    }
+    
+    nvme_cqe_t* cqe = &q->cq[q->cq_head];
+    uint16_t status = cqe->status >> 1;
+    if (result)
+        *result = cqe->dw0;
+    
+    q->cq_head = (q->cq_head + 1) % q->depth;
+    if (q->cq_head == 0)
+        q->phase ^= 1;
+    mmio_write32(q->cq_doorbell, q->cq_head);
+    
+    return status == 0;
+}
+
+// Fill in PRP1/PRP2 for a buffer, using the command's PRP list page when
+// the transfer spans more than two pages
+static void nvme_build_prps(nvme_queue_t* q, uint16_t cid, nvme_sqe_t* cmd, uint32_t addr, uint32_t bytes) {
+    uint32_t first = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+    
+    cmd->prp1 = addr;
+    cmd->prp2 = 0;
+    if (bytes <= first)
+        return;
+    
+    uint32_t next = addr + first;
+    uint32_t remaining = bytes - first;
+    if (remaining <= PAGE_SIZE) {
+        cmd->prp2 = next;
+        return;
+    }
+    
+    uint64_t* list = q->prp_lists[cid];
+    int n = 0;
+    while (remaining > 0 && n < NVME_PRP_ENTRIES) {
+        list[n++] = next;
+        next += PAGE_SIZE;
+        remaining = (remaining > PAGE_SIZE) ? remaining - PAGE_SIZE : 0;
+    }
+    cmd->prp2 = (uint32_t)list;
+}
+
+// Write a request into the submission queue without ringing the
+// doorbell. Returns 0 when no command id is free.
+static int nvme_issue(nvme_queue_t* q, nvme_request_t* req) {
+    if (q->inflight >= (uint32_t)(q->depth - 1))
+        return 0;
+    
+    uint16_t cid = 0;
+    while (q->reqs[cid])
+        cid++;
+    
+    nvme_device_t* dev = &devices[req->device];
+    nvme_sqe_t* cmd = &q->sq[q->sq_tail];
+    memset(cmd, 0, sizeof(nvme_sqe_t));
+    cmd->nsid = dev->nsid;
+    
+    if (req->op == NVME_OP_FLUSH) {
+        cmd->cdw0 = NVME_CMD_FLUSH | ((uint32_t)cid << 16);
+    } else {
+        cmd->cdw0 = (req->op == NVME_OP_WRITE ? NVME_CMD_WRITE : NVME_CMD_READ) |
+                    ((uint32_t)cid << 16);
+        nvme_build_prps(q, cid, cmd, (uint32_t)req->buffer, req->count * dev->block_size);
+        cmd->cdw10 = (uint32_t)(req->lba & 0xFFFFFFFF);
+        cmd->cdw11 = (uint32_t)(req->lba >> 32);
+        cmd->cdw12 = (req->count - 1) | ((req->flags & NVME_REQ_FUA) ? NVME_RW_FUA : 0);
+    }
+    
+    q->reqs[cid] = req;
+    q->inflight++;
+    req->status = NVME_REQ_ACTIVE;
+    q->sq_tail = (q->sq_tail + 1) % q->depth;
+    return 1;
+}
+
+// Move waiting requests into free command ids
+static void nvme_issue_waiting(nvme_queue_t* q) {
+    while (q->wait_head) {
+        nvme_request_t* req = q->wait_head;
+        
+        if (!nvme_issue(q, req))
+            break;
+        
+        q->wait_head = req->next;
+        if (!q->wait_head)
+            q->wait_tail = NULL;
+        req->next = NULL;
+    }
+}
+
+// Ring the submission doorbell once for everything queued since the last
+// commit, so a burst of requests costs a single MMIO write
+static void nvme_commit_queue(nvme_queue_t* q) {
+    if (q->sq_tail != q->sq_committed) {
+        mmio_write32(q->sq_doorbell, q->sq_tail);
+        q->sq_committed = q->sq_tail;
+    }
+}
+
+// Reap completions; the CQ head doorbell is written once per batch
+static int nvme_process_cq(nvme_queue_t* q) {
+    int processed = 0;
+    
+    while ((q->cq[q->cq_head].status & 1) == q->phase) {
+        nvme_cqe_t* cqe = &q->cq[q->cq_head];
+        uint16_t cid = cqe->cid;
+        uint16_t status = cqe->status >> 1;
+        
+        q->cq_head = (q->cq_head + 1) % q->depth;
+        if (q->cq_head == 0)
+            q->phase ^= 1;
+        processed++;
+        
+        if (cid >= NVME_IO_QUEUE_DEPTH || !q->reqs[cid])
+            continue;
+        
+        nvme_request_t* req = q->reqs[cid];
+        q->reqs[cid] = NULL;
+        q->inflight--;
+        
+        req->status = status ? NVME_REQ_ERROR : NVME_REQ_DONE;
+        if (req->complete)
+            req->complete(req);
+    }
+    
+    if (processed) {
+        mmio_write32(q->cq_doorbell, q->cq_head);
+        nvme_issue_waiting(q);
+        nvme_commit_queue(q);
+    }
+    
+    return processed;
+}
+
+// MSI-X handler of one completion queue
+static void nvme_msi_handler(void* data) {
+    nvme_process_cq((nvme_queue_t*)data);
+}
+
+// Shared PCI interrupt handler
+static void nvme_irq_handler(uint8_t irq) {
+    (void)irq;
+    
+    for (int i = 0; i < io_queue_count; i++)
+        nvme_process_cq(&io_queues[i]);
+}
+
+// Fail everything outstanding after a fatal controller status
+static void nvme_fail_queue(nvme_queue_t* q) {
+    for (int cid = 0; cid < NVME_IO_QUEUE_DEPTH; cid++) {
+        nvme_request_t* req = q->reqs[cid];
+        if (!req)
+            continue;
+        q->reqs[cid] = NULL;
+        q->inflight--;
+        req->status = NVME_REQ_ERROR;
+        if (req->complete)
+            req->complete(req);
+    }
+    
+    while (q->wait_head) {
+        nvme_request_t* req = q->wait_head;
+        q->wait_head = req->next;
+        req->status = NVME_REQ_ERROR;
+        if (req->complete)
+            req->complete(req);
+    }
+    q->wait_tail = NULL;
+}
+
+static int nvme_wait_ready(int ready, uint32_t timeout_ms) {
+    uint32_t start = timer_ticks();
+    
+    while (((mmio_read32(regs + NVME_REG_CSTS) & NVME_CSTS_RDY) ? 1 : 0) != ready) {
+        if (timer_ticks() - start > timeout_ms)
+            return 0;
+    }
+    return 1;
+}
+
+// Create the I/O completion and submission queue of a queue pair
+static int nvme_create_io_queue(nvme_queue_t* q, uint16_t qid) {
+    nvme_sqe_t cmd;
+    
+    if (!nvme_alloc_queue(q, qid, io_depth))
+        return 0;
+    
+    for (int i = 0; i < io_depth; i++) {
+        q->prp_lists[i] = (uint64_t*)kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+        if (!q->prp_lists[i])
+            return 0;
+    }
+    
+    // Completion queue: physically contiguous, interrupts enabled on its
+    // own MSI-X entry, or on vector 0 (INTx)
+    uint32_t iv = q->vector ? qid : 0;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = (uint32_t)q->cq;
+    cmd.cdw10 = ((uint32_t)(q->depth - 1) << 16) | qid;
+    cmd.cdw11 = (iv << 16) | (1u << 1) | (1u << 0);
+    if (!nvme_admin_command(&cmd, NULL))
+        return 0;
+    
+    // Submission queue bound to the completion queue with the same id
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1 = (uint32_t)q->sq;
+    cmd.cdw10 = ((uint32_t)(q->depth - 1) << 16) | qid;
+    cmd.cdw11 = ((uint32_t)qid << 16) | (1u << 0);
+    if (!nvme_admin_command(&cmd, NULL))
+        return 0;
+    
+    return 1;
+}
+
+// Identify the controller and active namespaces
+static void nvme_identify(void) {
+    uint8_t* data = (uint8_t*)kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+    nvme_sqe_t cmd;
+    
+    if (!data)
+        return;
+    
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_IDENTIFY;
+    cmd.prp1 = (uint32_t)data;
+    cmd.cdw10 = 1; // CNS 1: controller
+    if (!nvme_admin_command(&cmd, NULL))
+        return;
+    
+    // Model number: bytes 24-63, space padded
+    for (int i = 0; i < 40; i++)
+        controller_model[i] = data[24 + i];
+    controller_model[40] = '\0';
+    for (int i = 39; i >= 0 && controller_model[i] == ' '; i--)
+        controller_model[i] = '\0';
+    
+    // Maximum data transfer size in units of the minimum page size
+    uint8_t mdts = data[77];
+    max_transfer = (mdts && mdts < 20) ? (PAGE_SIZE << mdts) : 0;
+    
+    uint32_t nn = *((uint32_t*)(data + 516));
+    for (uint32_t nsid = 1; nsid <= nn && device_count < NVME_MAX_DEVICES; nsid++) {
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.cdw0 = NVME_ADMIN_IDENTIFY;
+        cmd.nsid = nsid;
+        cmd.prp1 = (uint32_t)data;
+        cmd.cdw10 = 0; // CNS 0: namespace
+        if (!nvme_admin_command(&cmd, NULL))
+            continue;
+        
+        uint64_t nsze = *((uint64_t*)(data + 0));
+        if (nsze == 0)
+            continue; // Inactive namespace
+        
+        uint8_t format = data[26] & 0x0F;
+        uint32_t lbaf = *((uint32_t*)(data + 128 + format * 4));
+        uint8_t lbads = (lbaf >> 16) & 0xFF;
+        
+        nvme_device_t* dev = &devices[device_count];
+        dev->nsid = nsid;
+        dev->size = nsze;
+        dev->block_size = 1u << lbads;
+        
+        // Limited by MDTS and by what one PRP list page can describe
+        uint32_t limit = NVME_PRP_ENTRIES * PAGE_SIZE;
+        if (max_transfer && max_transfer < limit)
+            limit = max_transfer;
+        dev->max_blocks = limit >> lbads;
+        
+        memcpy(dev->model, controller_model, sizeof(dev->model));
+        device_count++;
+    }
+}
+
+// One MSI-X entry and vector per I/O completion queue, delivered to the
+// CPU that owns the queue. Entry 0 belongs to the admin queue, which is
+// polled. Returns 0 if the controller stays on INTx.
+static int nvme_setup_msix(uint32_t pairs) {
+    if (!pci_msix_init(&msix, pci_dev) || msix.size <= pairs)
+        return 0;
+    
+    for (uint32_t i = 0; i < pairs; i++) {
+        int vector = msi_alloc_vector(nvme_msi_handler, &io_queues[i]);
+        
+        if (vector < 0) {
+            while (i-- > 0) {
+                msi_free_vector(io_queues[i].vector);
+                io_queues[i].vector = 0;
+            }
+            return 0;
+        }
+        io_queues[i].vector = (uint8_t)vector;
+        pci_msix_set_vector(&msix, (uint16_t)(i + 1), (uint8_t)vector, (uint8_t)i);
+    }
+    
+    pci_msix_enable(&msix);
+    return 1;
+}
+
+void init_nvme(void) {
+    uint8_t found = 0;
+    
+    serial_write("Scanning for NVMe controllers...\n");
+    device_count = 0;
+    io_queue_count = 0;
+    
+    pci_device_t* dev = NULL;
+    while (!found && (dev = pci_find_class(NVME_PCI_CLASS, NVME_PCI_SUBCLASS, dev)) != NULL) {
+        if (dev->prog_if != NVME_PCI_PROGIF)
+            continue;
+        
+        // BAR0/BAR1 form a 64-bit memory BAR; HueOS needs it below 4GB
+        regs = pci_bar_memory(dev, 0);
+        if (!regs) {
+            serial_write("  NVMe BAR above 4GB, skipping\n");
+            continue;
+        }
+        
+        pci_enable_device(dev, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+        irq_line = dev->irq;
+        pci_dev = dev;
+        found = 1;
+        
+        serial_write("Found NVMe controller: Vendor=0x");
+        serial_write_hex(dev->vendor_id);
+        serial_write(" BAR0=0x");
+        serial_write_hex(regs);
+        serial_write("\n");
+    }
+    
+    if (!found) {
+        serial_write("No NVMe controller detected\n");
+        return;
+    }
+    
+    uint32_t cap_lo = mmio_read32(regs + NVME_REG_CAP);
+    uint32_t cap_hi = mmio_read32(regs + NVME_REG_CAP + 4);
+    uint32_t timeout_ms = ((cap_lo >> 24) & 0xFF) * 500;
+    uint32_t mqes = (cap_lo & 0xFFFF) + 1;
+    doorbell_stride = 4u << (cap_hi & 0x0F);
+    
+    // Reset the controller
+    mmio_write32(regs + NVME_REG_CC, 0);
+    if (!nvme_wait_ready(0, timeout_ms)) {
+        serial_write("  NVMe controller did not disable\n");
+        return;
+    }
+    
+    // Admin queue pair
+    uint16_t admin_depth = (mqes < NVME_ADMIN_QUEUE_DEPTH) ? mqes : NVME_ADMIN_QUEUE_DEPTH;
+    io_depth = (mqes < NVME_IO_QUEUE_DEPTH) ? mqes : NVME_IO_QUEUE_DEPTH;
+    if (!nvme_alloc_queue(&admin_queue, 0, admin_depth))
+        return;
+    
+    mmio_write32(regs + NVME_REG_AQA, ((uint32_t)(admin_depth - 1) << 16) | (admin_depth - 1));
+    mmio_write32(regs + NVME_REG_ASQ, (uint32_t)admin_queue.sq);
+    mmio_write32(regs + NVME_REG_ASQ + 4, 0);
+    mmio_write32(regs + NVME_REG_ACQ, (uint32_t)admin_queue.cq);
+    mmio_write32(regs + NVME_REG_ACQ + 4, 0);
+    
+    // 4K pages, NVM command set, 64/16-byte queue entries
+    mmio_write32(regs + NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    if (!nvme_wait_ready(1, timeout_ms)) {
+        serial_write("  NVMe controller did not become ready\n");
+        return;
+    }
+    
+    nvme_identify();
+    
+    // One I/O queue pair per CPU, as many as the controller grants
+    nvme_sqe_t cmd;
+    uint32_t granted = 0;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cdw0 = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd.cdw11 = ((uint32_t)(NVME_MAX_CPUS - 1) << 16) | (NVME_MAX_CPUS - 1);
+    if (nvme_admin_command(&cmd, &granted)) {
+        uint32_t nsq = (granted & 0xFFFF) + 1;
+        uint32_t ncq = (granted >> 16) + 1;
+        uint32_t pairs = (nsq < ncq) ? nsq : ncq;
+        if (pairs > NVME_MAX_CPUS)
+            pairs = NVME_MAX_CPUS;
+        
+        msix_enabled = nvme_setup_msix(pairs);
+        for (uint32_t i = 0; i < pairs; i++) {
+            if (!nvme_create_io_queue(&io_queues[i], (uint16_t)(i + 1)))
+                break;
+            io_queue_count++;
+        }
+    }
+    
+    if (io_queue_count == 0) {
+        serial_write("  Failed to create NVMe I/O queues\n");
+        device_count = 0;
+        return;
+    }
+    
+    // INTMS/INTMC must not be touched once MSI-X is configured
+    if (msix_enabled) {
+        serial_write("  NVMe completions use MSI-X\n");
+    } else {
+        irq_install_handler(irq_line, nvme_irq_handler);
+        mmio_write32(regs + NVME_REG_INTMC, 0xFFFFFFFF);
+    }
+    
+    nvme_blk_register();
+    serial_write("NVMe initialization complete\n");
+}
+
+// Place a request in the executing CPU's submission queue. The doorbell
+// is not rung until nvme_commit(), so callers can batch a burst.
+void nvme_queue_request(nvme_request_t* req) {
+    if (req->device >= device_count || io_queue_count == 0 ||
+        (req->op != NVME_OP_FLUSH &&
+         (req->count == 0 || req->count > devices[req->device].max_blocks))) {
+        req->status = NVME_REQ_ERROR;
+        if (req->complete)
+            req->complete(req);
+        return;
+    }
+    
+    nvme_queue_t* q = nvme_cpu_queue();
+    req->next = NULL;
+    req->status = NVME_REQ_QUEUED;
+    
+    uint32_t flags = irq_save();
+    
+    if (q->wait_head || !nvme_issue(q, req)) {
+        if (q->wait_tail)
+            q->wait_tail->next = req;
+        else
+            q->wait_head = req;
+        q->wait_tail = req;
+    }
+    
+    irq_restore(flags);
+}
+
+// Ring the executing CPU's submission doorbell
+void nvme_commit(void) {
+    if (io_queue_count == 0)
+        return;
+    
+    uint32_t flags = irq_save();
+    nvme_commit_queue(nvme_cpu_queue());
+    irq_restore(flags);
+}
+
+void nvme_submit(nvme_request_t* req) {
+    nvme_queue_request(req);
+    nvme_commit();
+}
+
+// Sleep until a request finishes. Completions are also polled after the
+// timeout in case an interrupt was lost; a fatal controller status fails
+// everything outstanding.
+uint8_t nvme_wait(nvme_request_t* req) {
+    uint32_t start = timer_ticks();
+    uint32_t flags = irq_save();
+    
+    while (req->status == NVME_REQ_QUEUED || req->status == NVME_REQ_ACTIVE) {
+        if (timer_ticks() - start >= NVME_TIMEOUT_MS) {
+            nvme_queue_t* q = nvme_cpu_queue();
+            
+            nvme_process_cq(q);
+            if (mmio_read32(regs + NVME_REG_CSTS) & NVME_CSTS_CFS) {
+                serial_write("NVMe: controller fatal status\n");
+                nvme_fail_queue(q);
+            }
+            start = timer_ticks();
+            continue;
+        }
+        
+        irq_wait();
+    }
+    
+    irq_restore(flags);
+    return (req->status == NVME_REQ_DONE) ? 0 : 1;
+}
+
+// Submit a request and sleep until it completes
+static uint8_t nvme_do_request(uint8_t device, uint8_t op, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    nvme_request_t req;
+    
+    req.device = device;
+    req.op = op;
+    req.flags = 0;
+    req.lba = lba;
+    req.count = count;
+    req.buffer = buffer;
+    req.complete = NULL;
+    req.private_data = NULL;
+    
+    nvme_submit(&req);
+    return nvme_wait(&req);
+}
+
+uint8_t nvme_read_blocks(uint8_t device, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    return nvme_do_request(device, NVME_OP_READ, lba, count, buffer);
+}
+
+uint8_t nvme_write_blocks(uint8_t device, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    return nvme_do_request(device, NVME_OP_WRITE, lba, count, buffer);
+}
+
+uint8_t nvme_flush(uint8_t device) {
+    return nvme_do_request(device, NVME_OP_FLUSH, 0, 0, NULL);
+}
+
+// Block layer glue. Dispatch batches are queued without a doorbell and
+// committed once through the commit hook.
+static nvme_request_t blk_native[BLK_REQUEST_POOL];
+
+static void nvme_blk_complete(nvme_request_t* req) {
+    blk_end_request((blk_request_t*)req->private_data, req->status != NVME_REQ_DONE);
+}
+
+static void nvme_blk_submit(blkdev_t* bdev, blk_request_t* req) {
+    nvme_request_t* native = &blk_native[req->tag];
+    
+    native->device = (uint8_t)(uintptr_t)bdev->driver_data;
+    native->op = (req->op == BIO_FLUSH) ? NVME_OP_FLUSH :
+                 (req->op == BIO_WRITE) ? NVME_OP_WRITE : NVME_OP_READ;
+    native->flags = (req->flags & BIO_FUA) ? NVME_REQ_FUA : 0;
+    native->lba = req->sector;
+    native->count = req->count;
+    native->buffer = req->nsg ? (uint8_t*)req->sg[0].addr : NULL;
+    native->complete = nvme_blk_complete;
+    native->private_data = req;
+    
+    nvme_queue_request(native);
+}
+
+static void nvme_blk_commit(blkdev_t* bdev) {
+    (void)bdev;
+    nvme_commit();
+}
+
+// Hybrid polling: reap this CPU's completion queue
+static int nvme_blk_poll(blkdev_t* bdev) {
+    (void)bdev;
+    return nvme_process_cq(nvme_cpu_queue());
+}
+
+static const blkdev_ops_t nvme_blk_ops = {
+    nvme_blk_submit,
+    nvme_blk_commit,
+    nvme_blk_poll,
+    NULL,                       // Lost completions are reaped by poll
+};
+
+// Register the namespaces with the block layer as nvme0, nvme1, ...
+static void nvme_blk_register(void) {
+    for (int i = 0; i < device_count; i++) {
+        nvme_device_t* dev = &devices[i];
+        blkdev_t* bdev = blk_register("nvme", &nvme_blk_ops, (void*)(uintptr_t)i,
+                                      dev->block_size, dev->size, BLKDEV_FUA);
+        if (!bdev)
+            return;
+        
+        bdev->max_sectors = dev->max_blocks;
+        bdev->max_segments = 1; // PRPs need page-aligned interior segments
+        bdev->queue_depth = io_depth / 2;
+    }
+}
+
+void nvme_print_devices(void) {
+    if (device_count == 0) {
+        return; // Don't print anything if no devices
+    }
+    
+    terminal_writestring("\nNVMe Devices:\n");
+    terminal_writestring("=============\n");
+    serial_write("\nNVMe Devices:\n");
+    
+    for (int i = 0; i < device_count; i++) {
+        nvme_device_t* dev = &devices[i];
+        char num_str[16];
+        
+        terminal_writestring("Device ");
+        terminal_putchar('0' + i);
+        terminal_writestring(": Namespace ");
+        format_number(dev->nsid, num_str);
+        terminal_writestring(num_str);
+        terminal_writestring(" - NVMe SSD\n");
+        serial_write("  Type: NVMe Namespace\n");
+        
+        terminal_writestring("  Model: ");
+        terminal_writestring(dev->model);
+        terminal_writestring("\n");
+        serial_write("  Model: ");
+        serial_write(dev->model);
+        serial_write("\n");
+        
+        // Blocks to MB without 64-bit division
+        uint32_t size_mb = (uint32_t)((dev->size * dev->block_size) >> 20);
+        format_number(size_mb, num_str);
+        terminal_writestring("  Size: ");
+        terminal_writestring(num_str);
+        terminal_writestring(" MB\n");
+        serial_write("  Size: ");
+        serial_write(num_str);
+        serial_write(" MB\n");
+    }
+}
+
+int nvme_get_device_count(void) {
+    return device_count;
+}
+
+nvme_device_t* nvme_get_device(int index) {
+    if (index < 0 || index >= device_count)
+        return NULL;
+    return &devices[index];
+}
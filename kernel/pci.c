@@ -0,0 +1,456 @@
+#include "pci.h"
+#include "acpi.h"
+#include "irq.h"
+#include "kernel.h"
+
+// Configuration mechanism #1
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+// Every function found at boot. Drivers match against this table instead
+// of probing configuration space, where each access traps under a
+// hypervisor.
+static pci_device_t devices[PCI_MAX_DEVICES];
+static int device_count = 0;
+static uint8_t bus_scanned[32];         // Bitmap: guards against bridge loops
+
+// Memory-mapped configuration (ECAM) for segment 0, from the ACPI MCFG
+// table. Each access is a single load or store, needs no lock and reaches
+// the full 4 KiB of extended configuration space.
+static uintptr_t ecam_base = 0;
+static uint8_t ecam_start_bus = 0;
+static uint8_t ecam_end_bus = 0;
+
+// ECAM address of a register, or 0 if the bus is not covered. The MCFG
+// base address maps bus 0 even when the range starts at a later bus.
+static inline uintptr_t pci_ecam_address(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset) {
+    if (!ecam_base || bus < ecam_start_bus || bus > ecam_end_bus)
+        return 0;
+    return ecam_base + ((uint32_t)bus << 20) +
+           ((uint32_t)slot << 15) + ((uint32_t)func << 12) + (offset & 0xFFF);
+}
+
+// Mechanism #1 is an address write followed by a data access; keep an
+// interrupt handler from slipping its own pair in between
+static uint32_t pci_config_select(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset) {
+    uint32_t flags = irq_save();
+    uint32_t address = (uint32_t)((bus << 16) | (slot << 11) |
+                                   (func << 8) | (offset & 0xFC) |
+                                   0x80000000);
+    outl(PCI_CONFIG_ADDRESS, address);
+    return flags;
+}
+
+// Reads beyond the first 256 bytes without ECAM return all ones, like a
+// missing function
+uint32_t pci_config_read32(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset) {
+    uintptr_t ecam = pci_ecam_address(bus, slot, func, offset & ~3);
+    if (ecam)
+        return *(volatile uint32_t*)ecam;
+    if (offset >= PCI_CONFIG_SPACE_SIZE)
+        return 0xFFFFFFFF;
+    
+    uint32_t flags = pci_config_select(bus, slot, func, offset);
+    uint32_t value = inl(PCI_CONFIG_DATA);
+    irq_restore(flags);
+    return value;
+}
+
+uint16_t pci_config_read16(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset) {
+    uintptr_t ecam = pci_ecam_address(bus, slot, func, offset & ~1);
+    if (ecam)
+        return *(volatile uint16_t*)ecam;
+    if (offset >= PCI_CONFIG_SPACE_SIZE)
+        return 0xFFFF;
+    
+    uint32_t flags = pci_config_select(bus, slot, func, offset);
+    uint16_t value = inw(PCI_CONFIG_DATA + (offset & 2));
+    irq_restore(flags);
+    return value;
+}
+
+uint8_t pci_config_read8(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset) {
+    uintptr_t ecam = pci_ecam_address(bus, slot, func, offset);
+    if (ecam)
+        return *(volatile uint8_t*)ecam;
+    if (offset >= PCI_CONFIG_SPACE_SIZE)
+        return 0xFF;
+    
+    uint32_t flags = pci_config_select(bus, slot, func, offset);
+    uint8_t value = inb(PCI_CONFIG_DATA + (offset & 3));
+    irq_restore(flags);
+    return value;
+}
+
+void pci_config_write32(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint32_t value) {
+    uintptr_t ecam = pci_ecam_address(bus, slot, func, offset & ~3);
+    if (ecam) {
+        *(volatile uint32_t*)ecam = value;
+        return;
+    }
+    if (offset >= PCI_CONFIG_SPACE_SIZE)
+        return;
+    
+    uint32_t flags = pci_config_select(bus, slot, func, offset);
+    outl(PCI_CONFIG_DATA, value);
+    irq_restore(flags);
+}
+
+// 16-bit write, so neighbouring registers (e.g. status next to command)
+// are left alone
+void pci_config_write16(uint8_t bus, uint8_t slot, uint8_t func, uint16_t offset, uint16_t value) {
+    uintptr_t ecam = pci_ecam_address(bus, slot, func, offset & ~1);
+    if (ecam) {
+        *(volatile uint16_t*)ecam = value;
+        return;
+    }
+    if (offset >= PCI_CONFIG_SPACE_SIZE)
+        return;
+    
+    uint32_t flags = pci_config_select(bus, slot, func, offset);
+    outw(PCI_CONFIG_DATA + (offset & 2), value);
+    irq_restore(flags);
+}
+
+static void pci_scan_bus(uint8_t bus);
+
+// Remember the capability list so drivers never walk it themselves
+static void pci_read_capabilities(pci_device_t* dev) {
+    dev->ncaps = 0;
+    if (!(pci_config_read16(dev->bus, dev->slot, dev->func, PCI_REG_STATUS) & PCI_STATUS_CAP_LIST))
+        return;
+    
+    uint8_t ptr = pci_config_read8(dev->bus, dev->slot, dev->func, PCI_REG_CAP_PTR) & 0xFC;
+    int guard = 48; // Bounds a malformed, looping list
+    
+    while (ptr && guard-- > 0 && dev->ncaps < PCI_MAX_CAPS) {
+        uint16_t header = pci_config_read16(dev->bus, dev->slot, dev->func, ptr);
+        dev->cap_id[dev->ncaps] = header & 0xFF;
+        dev->cap_offset[dev->ncaps] = ptr;
+        dev->ncaps++;
+        ptr = (header >> 8) & 0xFC;
+    }
+}
+
+// Record one present function; a bridge's secondary bus is scanned
+// before the walk continues
+static void pci_add_function(uint8_t bus, uint8_t slot, uint8_t func, uint32_t id) {
+    if (device_count >= PCI_MAX_DEVICES)
+        return;
+    
+    pci_device_t* dev = &devices[device_count++];
+    memset(dev, 0, sizeof(pci_device_t));
+    dev->bus = bus;
+    dev->slot = slot;
+    dev->func = func;
+    dev->vendor_id = id & 0xFFFF;
+    dev->device_id = id >> 16;
+    
+    uint32_t class_rev = pci_config_read32(bus, slot, func, PCI_REG_CLASS_REV);
+    dev->class_code = class_rev >> 24;
+    dev->subclass = (class_rev >> 16) & 0xFF;
+    dev->prog_if = (class_rev >> 8) & 0xFF;
+    dev->revision = class_rev & 0xFF;
+    dev->header_type = pci_config_read8(bus, slot, func, PCI_REG_HEADER_TYPE) & PCI_HEADER_TYPE_MASK;
+    dev->irq = pci_config_read8(bus, slot, func, PCI_REG_INTERRUPT_LINE);
+    
+    int bars = 0;
+    if (dev->header_type == 0) {
+        uint32_t subsystem = pci_config_read32(bus, slot, func, PCI_REG_SUBSYSTEM);
+        dev->subsystem_vendor = subsystem & 0xFFFF;
+        dev->subsystem_id = subsystem >> 16;
+        bars = 6;
+    } else if (dev->header_type == PCI_HEADER_BRIDGE) {
+        dev->secondary_bus = pci_config_read8(bus, slot, func, PCI_REG_SECONDARY_BUS);
+        bars = 2;
+    }
+    for (int i = 0; i < bars; i++)
+        dev->bar[i] = pci_config_read32(bus, slot, func, PCI_REG_BAR0 + i * 4);
+    
+    pci_read_capabilities(dev);
+    dev->config_size = PCI_CONFIG_SPACE_SIZE;
+    if (pci_ecam_address(bus, slot, func, 0) && pci_find_capability(dev, PCI_CAP_ID_EXP))
+        dev->config_size = PCI_EXT_CONFIG_SPACE_SIZE;
+    
+    if (dev->header_type == PCI_HEADER_BRIDGE && dev->secondary_bus != 0)
+        pci_scan_bus(dev->secondary_bus);
+}
+
+// Function 0 answers for the slot; the others are probed only when its
+// header has the multifunction bit
+static void pci_scan_slot(uint8_t bus, uint8_t slot) {
+    uint32_t id = pci_config_read32(bus, slot, 0, PCI_REG_VENDOR_ID);
+    if ((id & 0xFFFF) == 0xFFFF)
+        return;
+    
+    pci_add_function(bus, slot, 0, id);
+    if (!(pci_config_read8(bus, slot, 0, PCI_REG_HEADER_TYPE) & PCI_HEADER_MULTIFUNCTION))
+        return;
+    
+    for (uint8_t func = 1; func < 8; func++) {
+        id = pci_config_read32(bus, slot, func, PCI_REG_VENDOR_ID);
+        if ((id & 0xFFFF) != 0xFFFF)
+            pci_add_function(bus, slot, func, id);
+    }
+}
+
+static void pci_scan_bus(uint8_t bus) {
+    if (bus_scanned[bus >> 3] & (1 << (bus & 7)))
+        return;
+    bus_scanned[bus >> 3] |= 1 << (bus & 7);
+    
+    for (uint8_t slot = 0; slot < 32; slot++)
+        pci_scan_slot(bus, slot);
+}
+
+// Use the MCFG entry for segment 0, if the firmware provides one. HueOS
+// runs without paging, so the window is addressed directly; windows above
+// 4GB are ignored.
+static void pci_init_ecam(void) {
+    acpi_mcfg_t* mcfg = (acpi_mcfg_t*)acpi_find_table("MCFG");
+    if (!mcfg)
+        return;
+    
+    uint32_t count = (mcfg->header.length - sizeof(acpi_mcfg_t)) / sizeof(acpi_mcfg_allocation_t);
+    acpi_mcfg_allocation_t* alloc = (acpi_mcfg_allocation_t*)(mcfg + 1);
+    for (uint32_t i = 0; i < count; i++, alloc++) {
+        if (alloc->segment != 0 || (alloc->base_address >> 32) != 0)
+            continue;
+        if (alloc->start_bus > alloc->end_bus)
+            continue;
+        
+        ecam_start_bus = alloc->start_bus;
+        ecam_end_bus = alloc->end_bus;
+        ecam_base = (uint32_t)alloc->base_address;
+        
+        char bus_str[12];
+        serial_write("PCI: ECAM at ");
+        serial_write_hex(ecam_base);
+        serial_write(", buses ");
+        format_number(ecam_start_bus, bus_str);
+        serial_write(bus_str);
+        serial_write("-");
+        format_number(ecam_end_bus, bus_str);
+        serial_write(bus_str);
+        serial_write("\n");
+        return;
+    }
+}
+
+// Enumerate every reachable function once, following PCI-to-PCI bridges.
+// A multifunction host bridge at 00:00 means several root buses, one per
+// function.
+void init_pci(void) {
+    device_count = 0;
+    memset(bus_scanned, 0, sizeof(bus_scanned));
+    pci_init_ecam();
+    
+    if (pci_config_read8(0, 0, 0, PCI_REG_HEADER_TYPE) & PCI_HEADER_MULTIFUNCTION) {
+        for (uint8_t func = 0; func < 8; func++) {
+            if ((pci_config_read32(0, 0, func, PCI_REG_VENDOR_ID) & 0xFFFF) != 0xFFFF)
+                pci_scan_bus(func);
+        }
+    } else {
+        pci_scan_bus(0);
+    }
+    
+    char count_str[12];
+    format_number(device_count, count_str);
+    serial_write("PCI: ");
+    serial_write(count_str);
+    serial_write(" functions\n");
+}
+
+int pci_device_count(void) {
+    return device_count;
+}
+
+pci_device_t* pci_get_device(int index) {
+    if (index < 0 || index >= device_count)
+        return NULL;
+    return &devices[index];
+}
+
+// Next function after `from` (NULL: the first) with the given class and
+// subclass
+pci_device_t* pci_find_class(uint8_t class_code, uint8_t subclass, pci_device_t* from) {
+    int i = from ? (int)(from - devices) + 1 : 0;
+    
+    for (; i < device_count; i++) {
+        if (devices[i].class_code == class_code && devices[i].subclass == subclass)
+            return &devices[i];
+    }
+    return NULL;
+}
+
+// Next function after `from` (NULL: the first) with the given IDs;
+// PCI_ANY_ID matches any device ID
+pci_device_t* pci_find_id(uint16_t vendor_id, uint16_t device_id, pci_device_t* from) {
+    int i = from ? (int)(from - devices) + 1 : 0;
+    
+    for (; i < device_count; i++) {
+        if (devices[i].vendor_id == vendor_id &&
+            (device_id == PCI_ANY_ID || devices[i].device_id == device_id))
+            return &devices[i];
+    }
+    return NULL;
+}
+
+// Offset of the first capability with the given ID, or 0
+uint8_t pci_find_capability(pci_device_t* dev, uint8_t id) {
+    for (int i = 0; i < dev->ncaps; i++) {
+        if (dev->cap_id[i] == id)
+            return dev->cap_offset[i];
+    }
+    return 0;
+}
+
+// Offset of the first extended capability (PCIe, offset 0x100 and up)
+// with the given ID, or 0. Needs ECAM; without it the list reads as empty.
+uint16_t pci_find_ext_capability(pci_device_t* dev, uint16_t id) {
+    uint16_t offset = PCI_REG_EXT_CAP;
+    
+    if (dev->config_size <= PCI_CONFIG_SPACE_SIZE)
+        return 0;
+    
+    for (int guard = 0; guard < 128 && offset >= PCI_REG_EXT_CAP; guard++) {
+        uint32_t header = pci_config_read32(dev->bus, dev->slot, dev->func, offset);
+        if (header == 0 || header == 0xFFFFFFFF)
+            return 0;
+        if ((header & 0xFFFF) == id)
+            return offset;
+        offset = (header >> 20) & 0xFFC;
+    }
+    return 0;
+}
+
+// Address of a memory BAR, or 0 for I/O BARs and 64-bit BARs above 4GB
+uint32_t pci_bar_memory(pci_device_t* dev, int bar) {
+    if (bar < 0 || bar > 5)
+        return 0;
+    
+    uint32_t low = dev->bar[bar];
+    if (low & 0x01)
+        return 0;
+    if ((low & 0x06) == 0x04 && (bar == 5 || dev->bar[bar + 1] != 0))
+        return 0;
+    return low & 0xFFFFFFF0;
+}
+
+// Port of an I/O BAR, or 0 for memory BARs
+uint16_t pci_bar_io(pci_device_t* dev, int bar) {
+    if (bar < 0 || bar > 5 || !(dev->bar[bar] & 0x01))
+        return 0;
+    return (uint16_t)(dev->bar[bar] & 0xFFFC);
+}
+
+// Turn on decoding and bus mastering (PCI_COMMAND_* bits)
+void pci_enable_device(pci_device_t* dev, uint16_t command) {
+    uint16_t current = pci_config_read16(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND);
+    if ((current & command) != command)
+        pci_config_write16(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND, current | command);
+}
+
+// Stop the function from asserting its INTx line once it signals by message
+static void pci_disable_intx(pci_device_t* dev) {
+    uint16_t command = pci_config_read16(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND);
+    pci_config_write16(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND, command | PCI_COMMAND_INTX_DISABLE);
+}
+
+// Route the function's single MSI message to `vector` on `cpu`. Returns 0
+// if the function has no MSI capability.
+int pci_enable_msi(pci_device_t* dev, uint8_t vector, uint8_t cpu) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSI);
+    uint32_t address, data;
+    
+    if (!cap)
+        return 0;
+    
+    msi_compose(vector, cpu, &address, &data);
+    
+    uint16_t control = pci_config_read16(dev->bus, dev->slot, dev->func, cap + PCI_MSI_CONTROL);
+    control &= ~(PCI_MSI_CTRL_ENABLE | PCI_MSI_CTRL_MME_MASK); // One message
+    pci_config_write16(dev->bus, dev->slot, dev->func, cap + PCI_MSI_CONTROL, control);
+    
+    pci_config_write32(dev->bus, dev->slot, dev->func, cap + PCI_MSI_ADDRESS, address);
+    if (control & PCI_MSI_CTRL_64BIT) {
+        pci_config_write32(dev->bus, dev->slot, dev->func, cap + PCI_MSI_ADDRESS + 4, 0);
+        pci_config_write16(dev->bus, dev->slot, dev->func, cap + PCI_MSI_DATA_64, (uint16_t)data);
+    } else {
+        pci_config_write16(dev->bus, dev->slot, dev->func, cap + PCI_MSI_DATA_32, (uint16_t)data);
+    }
+    
+    pci_disable_intx(dev);
+    pci_config_write16(dev->bus, dev->slot, dev->func, cap + PCI_MSI_CONTROL, control | PCI_MSI_CTRL_ENABLE);
+    return 1;
+}
+
+// Locate and map the MSI-X vector table and mask every entry. The table
+// must be in a memory BAR below 4GB. Returns 0 if MSI-X is unusable.
+int pci_msix_init(pci_msix_t* msix, pci_device_t* dev) {
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+    
+    memset(msix, 0, sizeof(pci_msix_t));
+    if (!cap || !msi_supported())
+        return 0;
+    
+    uint32_t table = pci_config_read32(dev->bus, dev->slot, dev->func, cap + PCI_MSIX_TABLE);
+    uint32_t base = pci_bar_memory(dev, table & 0x07);
+    if (!base)
+        return 0;
+    
+    msix->dev = dev;
+    msix->cap = cap;
+    msix->table = base + (table & 0xFFFFFFF8);
+    msix->size = (pci_config_read16(dev->bus, dev->slot, dev->func, cap + PCI_MSIX_CONTROL) &
+                  PCI_MSIX_CTRL_SIZE_MASK) + 1;
+    
+    pci_enable_device(dev, PCI_COMMAND_MEMORY);
+    for (uint16_t i = 0; i < msix->size; i++) {
+        uintptr_t entry = msix->table + i * PCI_MSIX_ENTRY_SIZE;
+        mmio_write32(entry + PCI_MSIX_ENTRY_CTRL, PCI_MSIX_ENTRY_MASKED);
+    }
+    return 1;
+}
+
+// Point one table entry at `vector` on `cpu` and unmask it. Each queue of
+// a multi-queue device gets its own entry, steered to the CPU that owns it.
+void pci_msix_set_vector(pci_msix_t* msix, uint16_t entry, uint8_t vector, uint8_t cpu) {
+    uint32_t address, data;
+    
+    if (entry >= msix->size)
+        return;
+    
+    msi_compose(vector, cpu, &address, &data);
+    uintptr_t e = msix->table + entry * PCI_MSIX_ENTRY_SIZE;
+    mmio_write32(e + PCI_MSIX_ENTRY_CTRL, PCI_MSIX_ENTRY_MASKED);
+    mmio_write32(e + PCI_MSIX_ENTRY_ADDR_LO, address);
+    mmio_write32(e + PCI_MSIX_ENTRY_ADDR_HI, 0);
+    mmio_write32(e + PCI_MSIX_ENTRY_DATA, data);
+    mmio_write32(e + PCI_MSIX_ENTRY_CTRL, 0);
+}
+
+// Switch the function from INTx to MSI-X. Entries that were never set
+// stay masked.
+void pci_msix_enable(pci_msix_t* msix) {
+    pci_device_t* dev = msix->dev;
+    
+    pci_disable_intx(dev);
+    uint16_t control = pci_config_read16(dev->bus, dev->slot, dev->func, msix->cap + PCI_MSIX_CONTROL);
+    control &= ~PCI_MSIX_CTRL_MASKALL;
+    pci_config_write16(dev->bus, dev->slot, dev->func, msix->cap + PCI_MSIX_CONTROL,
+                       control | PCI_MSIX_CTRL_ENABLE);
+}
+
+// Return the function to INTx, e.g. when the device refused a vector
+void pci_msix_disable(pci_msix_t* msix) {
+    pci_device_t* dev = msix->dev;
+    
+    uint16_t control = pci_config_read16(dev->bus, dev->slot, dev->func, msix->cap + PCI_MSIX_CONTROL);
+    pci_config_write16(dev->bus, dev->slot, dev->func, msix->cap + PCI_MSIX_CONTROL,
+                       control & ~PCI_MSIX_CTRL_ENABLE);
+    
+    uint16_t command = pci_config_read16(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND);
+    pci_config_write16(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND,
+                       command & ~PCI_COMMAND_INTX_DISABLE);
+}
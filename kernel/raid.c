@@ -0,0 +1,366 @@
+#include "raid.h"
+#include "irq.h"
+#include "kernel.h"
+
+// Software RAID over registered block devices. An array is a block device
+// of its own: the block layer queues and merges its requests, and
+// raid_submit() cuts each one into member bios that run on all members at
+// once, each through the member's own queue and scheduler.
+//
+// Member bios are submitted from completion context, where nothing can
+// wait for a free request, so each array takes its member requests from a
+// reserve of RAID_RESERVE requests set aside when it is created.
+
+static raid_array_t arrays[RAID_MAX_ARRAYS];
+static int array_count = 0;
+
+static const blkdev_ops_t raid_blk_ops;
+
+// Mirror to read a range from: the one with the fewest bios outstanding,
+// then the one whose last I/O ended closest, to keep seeks short
+static int raid1_pick(raid_array_t* array, uint64_t sector) {
+    int best = -1;
+    uint64_t best_distance = 0;
+    
+    for (int m = 0; m < array->nmembers; m++) {
+        if (array->failed[m])
+            continue;
+        
+        uint64_t head = array->head[m];
+        uint64_t distance = head > sector ? head - sector : sector - head;
+        if (best < 0 || array->inflight[m] < array->inflight[best] ||
+            (array->inflight[m] == array->inflight[best] && distance < best_distance)) {
+            best = m;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+static void raid_add_piece(raid_array_t* array, raid_io_t* io, int member, uint64_t sector,
+                           uint32_t count, uint32_t addr) {
+    bio_t* bio = &io->bios[io->npieces];
+    
+    bio->sector = sector;
+    bio->count = count;
+    bio->buffer = (uint8_t*)addr;
+    bio->op = io->req->op;
+    bio->flags = io->req->flags;
+    bio->private_data = io;
+    io->member[io->npieces] = (uint8_t)member;
+    io->tries[io->npieces] = 1;
+    io->npieces++;
+    
+    array->inflight[member]++;
+    if (count)
+        array->head[member] = sector + count;
+}
+
+static void raid_fail_member(raid_array_t* array, int member) {
+    if (array->failed[member])
+        return;
+    
+    array->failed[member] = 1;
+    array->active--;
+    serial_write("RAID: ");
+    serial_write(array->dev->name);
+    serial_write(": member ");
+    serial_write(array->members[member]->name);
+    serial_write(" failed, array degraded\n");
+}
+
+static void raid_end_bio(bio_t* bio) {
+    raid_io_t* io = (raid_io_t*)bio->private_data;
+    raid_array_t* array = (raid_array_t*)io->req->dev->driver_data;
+    int piece = (int)(bio - io->bios);
+    int member = io->member[piece];
+    
+    array->inflight[member]--;
+    
+    if (bio->status == BIO_ERROR) {
+        if (array->level == RAID_LEVEL_0) {
+            io->error = 1;
+        } else if (bio->op == BIO_READ) {
+            // Read the same range from the next mirror that is still up
+            for (int i = 1; i < array->nmembers && io->tries[piece] < array->active; i++) {
+                int next = (member + i) % array->nmembers;
+                if (array->failed[next])
+                    continue;
+                
+                io->member[piece] = (uint8_t)next;
+                io->tries[piece]++;
+                array->inflight[next]++;
+                blk_submit_bio_reserved(array->members[next], bio, &array->reserve);
+                return;
+            }
+            io->error = 1;
+        } else {
+            // Writes and flushes keep going on the other mirrors
+            raid_fail_member(array, member);
+        }
+    }
+    
+    if (--io->pending == 0) {
+        blk_request_t* req = io->req;
+        int error = io->error || array->active == 0;
+        
+        io->req = NULL;
+        blk_end_request(req, error);
+    }
+}
+
+// Cut a request into member bios. Reads and striped writes are cut at
+// chunk boundaries, so a large read is spread over every mirror too;
+// mirrored writes go whole to each member.
+static void raid_submit(blkdev_t* dev, blk_request_t* req) {
+    raid_array_t* array = (raid_array_t*)dev->driver_data;
+    raid_io_t* io = NULL;
+    
+    for (int i = 0; i < RAID_QUEUE_DEPTH; i++) {
+        if (!array->io[i].req) {
+            io = &array->io[i];
+            break;
+        }
+    }
+    if (!io || array->active == 0) {
+        blk_end_request(req, 1);
+        return;
+    }
+    
+    io->req = req;
+    io->error = 0;
+    io->npieces = 0;
+    
+    if (req->op == BIO_FLUSH) {
+        for (int m = 0; m < array->nmembers; m++) {
+            if (!array->failed[m])
+                raid_add_piece(array, io, m, 0, 0, 0);
+        }
+    } else if (array->level == RAID_LEVEL_1 && req->op == BIO_WRITE) {
+        uint64_t sector = req->sector;
+        for (uint32_t s = 0; s < req->nsg; s++) {
+            uint32_t count = req->sg[s].length / dev->block_size;
+            for (int m = 0; m < array->nmembers; m++) {
+                if (!array->failed[m])
+                    raid_add_piece(array, io, m, sector, count, req->sg[s].addr);
+            }
+            sector += count;
+        }
+    } else {
+        uint32_t chunk = 1U << array->chunk_shift;
+        uint64_t sector = req->sector;
+        
+        for (uint32_t s = 0; s < req->nsg; s++) {
+            uint32_t addr = req->sg[s].addr;
+            uint32_t left = req->sg[s].length / dev->block_size;
+            
+            while (left > 0) {
+                uint32_t offset = (uint32_t)sector & (chunk - 1);
+                uint32_t count = chunk - offset;
+                if (count > left)
+                    count = left;
+                
+                if (array->level == RAID_LEVEL_0) {
+                    // Chunk n lives on member n % members, in its stripe n / members
+                    uint32_t stripe = (uint32_t)(sector >> array->chunk_shift);
+                    uint64_t member_sector = ((uint64_t)(stripe / array->nmembers) << array->chunk_shift) | offset;
+                    raid_add_piece(array, io, stripe % array->nmembers, member_sector, count, addr);
+                } else {
+                    raid_add_piece(array, io, raid1_pick(array, sector), sector, count, addr);
+                }
+                
+                sector += count;
+                addr += count * dev->block_size;
+                left -= count;
+            }
+        }
+    }
+    
+    // Plug the members so pieces that end up adjacent on one member are
+    // merged into a single command
+    io->pending = io->npieces;
+    for (int m = 0; m < array->nmembers; m++)
+        blk_plug(array->members[m]);
+    for (int i = 0; i < io->npieces; i++) {
+        io->bios[i].end_io = raid_end_bio;
+        blk_submit_bio_reserved(array->members[io->member[i]], &io->bios[i], &array->reserve);
+    }
+    for (int m = 0; m < array->nmembers; m++)
+        blk_unplug(array->members[m]);
+}
+
+// Member bios are what is stuck; let each member's driver recover them
+static void raid_timeout(blkdev_t* dev) {
+    raid_array_t* array = (raid_array_t*)dev->driver_data;
+    
+    for (int m = 0; m < array->nmembers; m++) {
+        if (array->inflight[m])
+            blk_timeout(array->members[m]);
+    }
+}
+
+static const blkdev_ops_t raid_blk_ops = {
+    .submit = raid_submit,
+    .commit = NULL,
+    .poll = NULL,
+    .timeout = raid_timeout,
+};
+
+// Build an array over existing block devices and register it as md<n>.
+// Members must share a block size. The chunk size (KiB) is rounded down
+// to a power of two that no member's request limit splits.
+blkdev_t* raid_create(uint8_t level, blkdev_t** members, int count, uint32_t chunk_kb) {
+    if (array_count >= RAID_MAX_ARRAYS || count < 2 || count > RAID_MAX_MEMBERS ||
+        level > RAID_LEVEL_1)
+        return NULL;
+    
+    uint32_t block_size = members[0]->block_size;
+    uint64_t member_size = members[0]->size;
+    uint32_t member_max = members[0]->max_sectors;
+    uint32_t flags = BLKDEV_FUA;
+    
+    for (int i = 0; i < count; i++) {
+        if (!members[i] || members[i]->ops == &raid_blk_ops ||
+            members[i]->block_size != block_size)
+            return NULL;
+        for (int j = 0; j < i; j++) {
+            if (members[j] == members[i])
+                return NULL;
+        }
+        if (members[i]->size < member_size)
+            member_size = members[i]->size;
+        if (members[i]->max_sectors < member_max)
+            member_max = members[i]->max_sectors;
+        if (!(members[i]->flags & BLKDEV_FUA))
+            flags = 0;
+    }
+    
+    uint32_t chunk_blocks = (chunk_kb * 1024) / block_size;
+    if (chunk_blocks > member_max)
+        chunk_blocks = member_max;
+    uint8_t shift = 0;
+    while ((2U << shift) <= chunk_blocks)
+        shift++;
+    
+    uint64_t size = member_size;
+    if (level == RAID_LEVEL_0)
+        size = ((member_size >> shift) << shift) * count;
+    if (size == 0)
+        return NULL;
+    
+    raid_array_t* array = &arrays[array_count];
+    memset(array, 0, sizeof(raid_array_t));
+    array->level = level;
+    array->nmembers = (uint8_t)count;
+    array->active = (uint8_t)count;
+    array->chunk_shift = shift;
+    for (int i = 0; i < count; i++)
+        array->members[i] = members[i];
+    
+    if (!blk_reserve_init(&array->reserve, RAID_RESERVE))
+        return NULL;
+    
+    blkdev_t* dev = blk_register("md", &raid_blk_ops, array, block_size, size, flags);
+    if (!dev) {
+        blk_reserve_release(&array->reserve);
+        return NULL;
+    }
+    array->dev = dev;
+    array_count++;
+    
+    // A request spanning c chunks over s segments becomes at most
+    // c + s - 1 pieces; a mirrored write becomes s per member
+    uint32_t segments = (level == RAID_LEVEL_0) ? RAID_MAX_PIECES / 2 : RAID_MAX_PIECES / count;
+    dev->max_segments = segments;
+    dev->max_sectors = (RAID_MAX_PIECES - segments) << shift;
+    if (level == RAID_LEVEL_1 && dev->max_sectors > member_max)
+        dev->max_sectors = member_max;
+    dev->queue_depth = RAID_QUEUE_DEPTH;
+    
+    char num_str[12];
+    serial_write("RAID: ");
+    serial_write(dev->name);
+    serial_write(level == RAID_LEVEL_0 ? " RAID-0 over" : " RAID-1 over");
+    for (int i = 0; i < count; i++) {
+        serial_write(" ");
+        serial_write(members[i]->name);
+    }
+    serial_write(", ");
+    format_number(((1U << shift) * block_size) / 1024, num_str);
+    serial_write(num_str);
+    serial_write(" KiB chunks\n");
+    return dev;
+}
+
+// Value of `key` on the command line (key=value, space separated), or NULL
+static const char* raid_option(const char* cmdline, const char* key, const char* from) {
+    const char* p = from ? from : cmdline;
+    
+    while (*p) {
+        if (p == cmdline || p[-1] == ' ') {
+            int i = 0;
+            while (key[i] && p[i] == key[i])
+                i++;
+            if (!key[i])
+                return p + i;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+// Arrays from the command line: raid0=<dev>,<dev>[,...] and
+// raid1=<dev>,<dev>[,...], with raidchunk=<KiB> for the chunk size.
+// Members are block device names such as ide0 or scsi1.
+void init_raid(const char* cmdline) {
+    static const char* keys[2] = { "raid0=", "raid1=" };
+    uint32_t chunk_kb = RAID_DEFAULT_CHUNK_KB;
+    
+    array_count = 0;
+    if (!cmdline)
+        return;
+    
+    const char* value = raid_option(cmdline, "raidchunk=", NULL);
+    if (value && *value >= '0' && *value <= '9') {
+        chunk_kb = 0;
+        while (*value >= '0' && *value <= '9')
+            chunk_kb = chunk_kb * 10 + (*value++ - '0');
+    }
+    if (chunk_kb == 0)
+        chunk_kb = RAID_DEFAULT_CHUNK_KB;
+    
+    for (uint8_t level = RAID_LEVEL_0; level <= RAID_LEVEL_1; level++) {
+        value = NULL;
+        while ((value = raid_option(cmdline, keys[level], value)) != NULL) {
+            blkdev_t* members[RAID_MAX_MEMBERS];
+            int count = 0;
+            int valid = 1;
+            
+            while (*value && *value != ' ') {
+                char name[BLK_NAME_LEN];
+                int len = 0;
+                while (*value && *value != ' ' && *value != ',') {
+                    if (len < BLK_NAME_LEN - 1)
+                        name[len++] = *value;
+                    value++;
+                }
+                name[len] = '\0';
+                if (*value == ',')
+                    value++;
+                
+                blkdev_t* member = blk_find_device(name);
+                if (!member || count >= RAID_MAX_MEMBERS) {
+                    serial_write("RAID: unusable member ");
+                    serial_write(name);
+                    serial_write("\n");
+                    valid = 0;
+                    continue;
+                }
+                members[count++] = member;
+            }
+            
+            if (valid && !raid_create(level, members, count, chunk_kb))
+                serial_write("RAID: cannot build array\n");
+        }
+    }
+}
@@ -1,7 +1,92 @@
 #include "scsi.h"
+#include "virtio_scsi.h"
+#include "irq.h"
+#include "timer.h"
+#include "blkdev.h"
 #include "kernel.h"
 
+// BusLogic CCB with the driver's bookkeeping. The CCB must stay first:
+// incoming mailboxes report the CCB address.
+typedef struct {
+    buslogic_ccb_t ccb;
+    buslogic_sg_t sg[BUSLOGIC_MAX_SG];
+    uint8_t sense[SCSI_SENSE_LENGTH];
+    scsi_request_t* req;        // NULL when free
+    uint8_t aborting;           // Abort mailbox sent after a timeout
+} buslogic_slot_t;
+
+// Per-controller BusLogic state
+typedef struct {
+    buslogic_outbox_t* out;     // BUSLOGIC_MAILBOXES outgoing, then incoming
+    buslogic_inbox_t* in;
+    buslogic_slot_t* slots;     // BUSLOGIC_CCBS
+    uint8_t out_next;           // Next outgoing mailbox to fill
+    uint8_t in_next;            // Next incoming mailbox to check
+    uint8_t active;             // CCBs handed to the adapter
+    scsi_request_t* wait_head;  // Requests waiting for a CCB or mailbox
+    scsi_request_t* wait_tail;
+} buslogic_t;
+
+// LSI command slot bookkeeping; the command block itself is lsi_t.cmds[i]
+typedef struct {
+    scsi_request_t* req;        // NULL when free
+    uint8_t sensing;            // Running REQUEST SENSE after CHECK CONDITION
+    uint8_t target_status;      // Status of the original command while sensing
+    uint32_t residual;          // Residual of the original command while sensing
+    scsi_request_t stand_in;    // Completed instead of a request failed on timeout
+} lsi_slot_t;
+
+// LSI host memory shared with the SCRIPTS. It is 256-byte aligned, so the
+// start queue and the nexus table each sit within one 256-byte page and
+// the SCRIPTS can index them by changing only the low address byte.
+typedef struct {
+    volatile uint32_t queue[LSI_COMMANDS][2]; // Start queue: {command block, valid}
+    volatile uint32_t nexus[LSI_MAX_TARGETS]; // Command block of each target
+    uint32_t reserved[64 - LSI_MAX_TARGETS];
+    volatile uint32_t start_pos;    // Start queue slot the SCRIPTS check next
+    volatile uint32_t current;      // Command block being selected
+    uint32_t nexus_base;            // Address of nexus[]
+    uint32_t data_in_done;          // SCRIPTS address past the data-in moves
+    uint32_t data_out_done;
+} lsi_shared_t;
+
+// Offsets of the SCRIPTS entry points
+typedef struct {
+    uint32_t sched;             // Start the next queued command
+    uint32_t phase;             // Dispatch on the current bus phase
+    uint32_t do_data_in;
+    uint32_t do_data_out;
+    uint32_t data_in;           // LSI_MAX_SG data-in moves
+    uint32_t data_in_done;
+    uint32_t data_out;
+    uint32_t data_out_done;
+    uint32_t status;
+    uint32_t msg_in;
+    uint32_t complete;
+    uint32_t disconnect;
+    uint32_t idle;              // Wait for a reselection or SIGP
+    uint32_t resel;
+    uint32_t sigp;
+    uint32_t orphan;            // Data phase for a target without a command
+    uint32_t size;
+} lsi_labels_t;
+
+// Per-controller LSI 53C895A state
+typedef struct {
+    lsi_shared_t* shared;
+    lsi_cmd_t* cmds;            // LSI_COMMANDS, then the orphan block
+    lsi_slot_t slots[LSI_COMMANDS];
+    uint32_t script;            // Bus address the SCRIPTS run from
+    lsi_labels_t label;
+    uint8_t queue_tail;         // Next start queue slot to fill
+    uint16_t busy;              // Targets with a command in flight
+    scsi_request_t* wait_head;  // Requests waiting for a slot or their target
+    scsi_request_t* wait_tail;
+} lsi_t;
+
 static scsi_controller_t controllers[SCSI_MAX_CONTROLLERS];
+static buslogic_t buslogic[SCSI_MAX_CONTROLLERS];
+static lsi_t lsi[SCSI_MAX_CONTROLLERS];
 static int controller_count = 0;
 static scsi_device_t scsi_devices[SCSI_MAX_DEVICES];
 static int device_count = 0;
@@ -14,10 +99,6 @@ static uint32_t swap32(uint32_t val) {
            ((val << 24) & 0xFF000000);
 }
 
-static uint16_t swap16(uint16_t val) {
-    return ((val >> 8) & 0xFF) | ((val << 8) & 0xFF00);
-}
-
 // Helper: String copy with trimming
 static void scsi_string_copy(char* dest, const char* src, int length) {
     int i;
@@ -35,111 +116,1157 @@ static void scsi_string_copy(char* dest, const char* src, int length) {
     }
 }
 
-// PCI Configuration Space Access
-static uint32_t pci_read_config_dword(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
-    uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xFC) | 0x80000000);
-    outl(0xCF8, address);
-    return inl(0xCFC);
+// Fail a request that never reached (or was taken back from) the hardware
+static void scsi_fail_request(scsi_request_t* req) {
+    req->status = SCSI_REQ_ERROR;
+    if (req->complete)
+        req->complete(req);
 }
 
-static uint16_t pci_read_config_word(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
-    uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xFC) | 0x80000000);
-    outl(0xCF8, address);
-    return (uint16_t)((inl(0xCFC) >> ((offset & 2) * 8)) & 0xFFFF);
+// Take a request off a controller's wait list
+static void scsi_unlink(scsi_request_t** head, scsi_request_t** tail, scsi_request_t* req) {
+    scsi_request_t* prev = NULL;
+    
+    for (scsi_request_t* r = *head; r; prev = r, r = r->next) {
+        if (r != req)
+            continue;
+        
+        if (prev)
+            prev->next = r->next;
+        else
+            *head = r->next;
+        if (*tail == r)
+            *tail = prev;
+        return;
+    }
 }
 
-static uint8_t pci_read_config_byte(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
-    uint32_t address = (uint32_t)((bus << 16) | (slot << 11) | (func << 8) | (offset & 0xFC) | 0x80000000);
-    outl(0xCF8, address);
-    return (uint8_t)((inl(0xCFC) >> ((offset & 3) * 8)) & 0xFF);
+// BusLogic: Wait until the status register has all bits of mask set and
+// none of clear set. The wait is counted in status reads, so it also
+// runs out when an adapter is reset with interrupts disabled.
+static int buslogic_wait_status(uint16_t io_base, uint8_t mask, uint8_t clear, uint32_t timeout_ms) {
+    for (uint32_t i = 0; i < timeout_ms * BUSLOGIC_POLLS_PER_MS; i++) {
+        uint8_t status = inb(io_base + BUSLOGIC_REG_STATUS);
+        if ((status & mask) == mask && !(status & clear))
+            return 1;
+    }
+    return 0;
 }
 
-// BusLogic: Wait for adapter ready
-static int buslogic_wait_ready(uint16_t io_base) {
-    for (int i = 0; i < 10000; i++) {
-        uint8_t status = inb(io_base + BUSLOGIC_REG_STATUS);
-        if (status & BUSLOGIC_STATUS_HOST_READY) {
-            return 1; // Ready
+// BusLogic: Run a host adapter command through the command/parameter
+// register and collect its reply. Polled; used during initialization
+// only. Returns the number of reply bytes, or -1 on failure.
+static int buslogic_command(uint16_t io_base, uint8_t cmd, const uint8_t* params, int nparams,
+                            uint8_t* reply, int nreply) {
+    if (!buslogic_wait_status(io_base, BUSLOGIC_STATUS_HOST_READY, BUSLOGIC_STATUS_PARAM_BUSY, 100))
+        return -1;
+    
+    outb(io_base + BUSLOGIC_REG_COMMAND, cmd);
+    
+    for (int i = 0; i < nparams; i++) {
+        if (!buslogic_wait_status(io_base, 0, BUSLOGIC_STATUS_PARAM_BUSY, 100))
+            return -1;
+        if (inb(io_base + BUSLOGIC_REG_STATUS) & BUSLOGIC_STATUS_CMD_INVALID)
+            break;
+        outb(io_base + BUSLOGIC_REG_COMMAND, params[i]);
+    }
+    
+    // Reply bytes arrive until the command complete interrupt is raised
+    int count = 0;
+    uint32_t polls = 0;
+    while (!(inb(io_base + BUSLOGIC_REG_INTERRUPT) & BUSLOGIC_INT_CMD_COMPLETE)) {
+        if (inb(io_base + BUSLOGIC_REG_STATUS) & BUSLOGIC_STATUS_DATA_READY) {
+            uint8_t byte = inb(io_base + BUSLOGIC_REG_DATA_IN);
+            if (count < nreply)
+                reply[count] = byte;
+            count++;
         }
-        // Small delay
-        for (volatile int j = 0; j < 100; j++);
+        if (++polls > 100 * BUSLOGIC_POLLS_PER_MS)
+            return -1;
     }
-    return 0; // Timeout
+    
+    uint8_t status = inb(io_base + BUSLOGIC_REG_STATUS);
+    outb(io_base + BUSLOGIC_REG_CONTROL, BUSLOGIC_CTRL_INT_RESET);
+    
+    if (status & BUSLOGIC_STATUS_CMD_INVALID)
+        return -1;
+    return count;
 }
 
-// BusLogic: Send command
-static int buslogic_send_command(uint16_t io_base, uint8_t cmd) {
-    if (!buslogic_wait_ready(io_base)) {
+// BusLogic: Hard reset and wait for the power-on diagnostics
+static int buslogic_reset(uint16_t io_base) {
+    outb(io_base + BUSLOGIC_REG_CONTROL, BUSLOGIC_CTRL_HARD_RESET);
+    
+    // Diagnostics may finish before we look, so DIAG_ACTIVE is optional
+    buslogic_wait_status(io_base, BUSLOGIC_STATUS_DIAG_ACTIVE, 0, 100);
+    if (!buslogic_wait_status(io_base, 0, BUSLOGIC_STATUS_DIAG_ACTIVE, 5000))
         return 0;
-    }
-    outb(io_base + BUSLOGIC_REG_COMMAND, cmd);
-    return 1;
+    if (!buslogic_wait_status(io_base, BUSLOGIC_STATUS_HOST_READY, 0, 5000))
+        return 0;
+    
+    return !(inb(io_base + BUSLOGIC_REG_STATUS) & BUSLOGIC_STATUS_DIAG_FAIL);
 }
 
-// BusLogic: Read data
-static uint8_t buslogic_read_data(uint16_t io_base) {
-    buslogic_wait_ready(io_base);
-    return inb(io_base + BUSLOGIC_REG_DATA_IN);
+// BusLogic: Empty the mailbox rings and the CCB pool and hand the rings
+// to the adapter, after initialization or a reset
+static int buslogic_setup_mailboxes(int index) {
+    buslogic_t* bl = &buslogic[index];
+    uint16_t io_base = controllers[index].io_base;
+    
+    memset(bl->out, 0, sizeof(buslogic_outbox_t) * BUSLOGIC_MAILBOXES +
+                       sizeof(buslogic_inbox_t) * BUSLOGIC_MAILBOXES);
+    memset(bl->slots, 0, sizeof(buslogic_slot_t) * BUSLOGIC_CCBS);
+    bl->out_next = 0;
+    bl->in_next = 0;
+    bl->active = 0;
+    
+    // Fill mailboxes strictly in order; older firmware scans them all
+    // anyway, so a failure here is harmless
+    uint8_t rr = 1;
+    buslogic_command(io_base, BUSLOGIC_CMD_STRICT_RR, &rr, 1, NULL, 0);
+    
+    uint32_t addr = (uint32_t)bl->out;
+    uint8_t params[5] = {
+        BUSLOGIC_MAILBOXES,
+        (uint8_t)addr, (uint8_t)(addr >> 8), (uint8_t)(addr >> 16), (uint8_t)(addr >> 24)
+    };
+    return buslogic_command(io_base, BUSLOGIC_CMD_INIT_EXT_MBOX, params, 5, NULL, 0) >= 0;
 }
 
-// BusLogic: Write data
-static int buslogic_write_data(uint16_t io_base, uint8_t data) {
-    if (!buslogic_wait_ready(io_base)) {
+// BusLogic: Initialize controller: reset, identify and set up the
+// mailbox rings and CCB pool
+static int buslogic_init(int index, uint16_t io_base) {
+    buslogic_t* bl = &buslogic[index];
+    uint8_t reply[4];
+    
+    serial_write("Initializing BusLogic controller at I/O 0x");
+    serial_write_hex(io_base);
+    serial_write("\n");
+    
+    if (!buslogic_reset(io_base)) {
+        serial_write("  Controller failed diagnostics\n");
         return 0;
     }
-    outb(io_base + BUSLOGIC_REG_COMMAND, data);
+    
+    if (buslogic_command(io_base, BUSLOGIC_CMD_INQUIRY, NULL, 0, reply, 4) == 4) {
+        char ver[4] = { (char)reply[2], '.', (char)reply[3], '\0' };
+        serial_write("  Firmware ");
+        serial_write(ver);
+        serial_write("\n");
+    }
+    
+    controllers[index].max_cdb = BUSLOGIC_CDB_MAX;
+    controllers[index].max_sg = BUSLOGIC_MAX_SG;
+    controllers[index].queue_depth = BUSLOGIC_CCBS;
+    controllers[index].lun_depth = BUSLOGIC_CCBS / 2;
+    controllers[index].max_lun = 7;
+    controllers[index].host_id = 7;
+    if (buslogic_command(io_base, BUSLOGIC_CMD_INQUIRE_CONFIG, NULL, 0, reply, 3) == 3)
+        controllers[index].host_id = reply[2] & 0x0F;
+    
+    bl->out = (buslogic_outbox_t*)kmalloc_aligned(sizeof(buslogic_outbox_t) * BUSLOGIC_MAILBOXES +
+                                                  sizeof(buslogic_inbox_t) * BUSLOGIC_MAILBOXES, 16);
+    bl->slots = (buslogic_slot_t*)kmalloc_aligned(sizeof(buslogic_slot_t) * BUSLOGIC_CCBS, 16);
+    if (!bl->out || !bl->slots) {
+        serial_write("  Out of memory\n");
+        return 0;
+    }
+    bl->in = (buslogic_inbox_t*)(bl->out + BUSLOGIC_MAILBOXES);
+    bl->wait_head = bl->wait_tail = NULL;
+    
+    if (!buslogic_setup_mailboxes(index)) {
+        serial_write("  Mailbox initialization failed\n");
+        return 0;
+    }
+    
+    serial_write("  BusLogic controller initialized\n");
     return 1;
 }
 
-// BusLogic: Soft reset
-static void buslogic_soft_reset(uint16_t io_base) {
-    outb(io_base + BUSLOGIC_REG_CONTROL, BUSLOGIC_CTRL_SOFT_RESET);
+// BusLogic: Hand a request to the adapter if a CCB and the next outgoing
+// mailbox are free. Called with interrupts disabled.
+static int buslogic_start(int index, scsi_request_t* req) {
+    buslogic_t* bl = &buslogic[index];
+    buslogic_outbox_t* mbox = &bl->out[bl->out_next];
+    buslogic_slot_t* slot = NULL;
     
-    // Wait for reset to complete
-    for (volatile int i = 0; i < 10000; i++);
+    if (bl->active >= BUSLOGIC_CCBS || mbox->action != BUSLOGIC_MBOX_CMD_FREE)
+        return 0;
     
-    buslogic_wait_ready(io_base);
+    for (int i = 0; i < BUSLOGIC_CCBS; i++) {
+        if (!bl->slots[i].req) {
+            slot = &bl->slots[i];
+            break;
+        }
+    }
+    if (!slot)
+        return 0;
+    
+    buslogic_ccb_t* ccb = &slot->ccb;
+    memset(ccb, 0, sizeof(buslogic_ccb_t));
+    ccb->opcode = BUSLOGIC_CCB_INITIATOR;
+    if (req->direction == SCSI_DIR_IN)
+        ccb->address_control = BUSLOGIC_CCB_DIR_IN;
+    else if (req->direction == SCSI_DIR_OUT)
+        ccb->address_control = BUSLOGIC_CCB_DIR_OUT;
+    else
+        ccb->address_control = BUSLOGIC_CCB_DIR_NONE;
+    if (req->tagged)
+        ccb->address_control |= BUSLOGIC_CCB_TAG_ENABLE;
+    ccb->cdb_length = req->cdb_length;
+    ccb->sense_length = SCSI_SENSE_LENGTH;
+    if (req->nsg) {
+        ccb->opcode = BUSLOGIC_CCB_INITIATOR_SG;
+        for (uint16_t i = 0; i < req->nsg; i++) {
+            slot->sg[i].length = req->sg[i].length;
+            slot->sg[i].addr = req->sg[i].addr;
+        }
+        ccb->data_length = req->nsg * sizeof(buslogic_sg_t);
+        ccb->data_pointer = (uint32_t)slot->sg;
+    } else {
+        ccb->data_length = req->length;
+        ccb->data_pointer = (uint32_t)req->buffer;
+    }
+    ccb->target_id = req->target;
+    ccb->lun = req->lun & 0x1F;
+    memcpy(ccb->cdb, req->cdb, req->cdb_length);
+    ccb->sense_pointer = (uint32_t)slot->sense;
+    
+    slot->req = req;
+    req->status = SCSI_REQ_ACTIVE;
+    bl->active++;
+    
+    // The action code hands the mailbox over, so it is written last
+    mbox->ccb = (uint32_t)ccb;
+    asm volatile ("" : : : "memory");
+    mbox->action = BUSLOGIC_MBOX_CMD_START;
+    bl->out_next = (bl->out_next + 1) % BUSLOGIC_MAILBOXES;
+    
+    outb(controllers[index].io_base + BUSLOGIC_REG_COMMAND, BUSLOGIC_CMD_START_MBOX);
+    return 1;
 }
 
-// BusLogic: Initialize controller
-static int buslogic_init(uint16_t io_base) {
-    serial_write("Initializing BusLogic controller at I/O 0x");
+// BusLogic: Start waiting requests while CCBs and mailboxes last
+static void buslogic_start_waiting(int index) {
+    buslogic_t* bl = &buslogic[index];
+    
+    while (bl->wait_head && buslogic_start(index, bl->wait_head)) {
+        bl->wait_head = bl->wait_head->next;
+        if (!bl->wait_head)
+            bl->wait_tail = NULL;
+    }
+}
+
+// BusLogic: Queue a request; it waits in order if the adapter is full
+static void buslogic_queue(int index, scsi_request_t* req) {
+    buslogic_t* bl = &buslogic[index];
+    
+    req->next = NULL;
+    if (bl->wait_tail)
+        bl->wait_tail->next = req;
+    else
+        bl->wait_head = req;
+    bl->wait_tail = req;
+    
+    buslogic_start_waiting(index);
+}
+
+// BusLogic: Complete every CCB reported in the incoming mailboxes
+static void buslogic_process_inbox(int index) {
+    buslogic_t* bl = &buslogic[index];
+    
+    while (bl->in[bl->in_next].completion != BUSLOGIC_MBIN_FREE) {
+        buslogic_inbox_t* mbox = &bl->in[bl->in_next];
+        uint8_t code = mbox->completion;
+        uint32_t offset = mbox->ccb - (uint32_t)bl->slots;
+        
+        mbox->completion = BUSLOGIC_MBIN_FREE;
+        bl->in_next = (bl->in_next + 1) % BUSLOGIC_MAILBOXES;
+        
+        // An abort that found nothing: the CCB is reported on its own
+        if (code == BUSLOGIC_MBIN_NOT_FOUND || offset >= sizeof(buslogic_slot_t) * BUSLOGIC_CCBS)
+            continue;
+        buslogic_slot_t* slot = &bl->slots[offset / sizeof(buslogic_slot_t)];
+        scsi_request_t* req = slot->req;
+        if (!req)
+            continue;
+        
+        req->host_status = slot->ccb.host_status;
+        req->target_status = slot->ccb.target_status;
+        req->residual = slot->ccb.data_length;
+        
+        // Short transfers (underrun) are fine; the residual tells how short
+        int ok = (code == BUSLOGIC_MBIN_SUCCESS) ||
+                 (code == BUSLOGIC_MBIN_ERROR &&
+                  (req->host_status == BUSLOGIC_HOST_OK || req->host_status == BUSLOGIC_HOST_DATA_RUN) &&
+                  req->target_status == SCSI_STATUS_GOOD);
+        if (code == BUSLOGIC_MBIN_SUCCESS)
+            req->residual = 0;
+        if (req->target_status == SCSI_STATUS_CHECK_CONDITION)
+            memcpy(req->sense, slot->sense, SCSI_SENSE_LENGTH);
+        
+        slot->req = NULL;
+        slot->aborting = 0;
+        bl->active--;
+        req->status = ok ? SCSI_REQ_DONE : SCSI_REQ_ERROR;
+        if (req->complete)
+            req->complete(req);
+    }
+    
+    buslogic_start_waiting(index);
+}
+
+// BusLogic: Hard reset the adapter, which takes back every CCB, and fail
+// the requests it held. Waiting requests then start on the fresh rings.
+static void buslogic_recover(int index) {
+    buslogic_t* bl = &buslogic[index];
+    scsi_request_t* failed[BUSLOGIC_CCBS];
+    int count = 0;
+    
+    serial_write("SCSI: BusLogic adapter not answering, resetting it\n");
+    for (int i = 0; i < BUSLOGIC_CCBS; i++) {
+        if (bl->slots[i].req)
+            failed[count++] = bl->slots[i].req;
+    }
+    
+    int ok = buslogic_reset(controllers[index].io_base) && buslogic_setup_mailboxes(index);
+    if (!ok) {
+        serial_write("SCSI: BusLogic adapter reset failed\n");
+        memset(bl->slots, 0, sizeof(buslogic_slot_t) * BUSLOGIC_CCBS);
+        bl->active = 0;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        failed[i]->host_status = 0;
+        failed[i]->target_status = 0;
+        scsi_fail_request(failed[i]);
+    }
+    if (ok)
+        buslogic_start_waiting(index);
+}
+
+// BusLogic: Recover a request that timed out. A waiting request is
+// unlinked and fails. A started one gets an abort mailbox and stays
+// pending until the adapter returns its CCB, since the adapter may still
+// transfer data into the buffer until then. If no mailbox is free, or
+// the CCB is still out at the next timeout, the adapter is reset.
+static void buslogic_abort(int index, scsi_request_t* req) {
+    buslogic_t* bl = &buslogic[index];
+    
+    if (req->status == SCSI_REQ_QUEUED) {
+        scsi_unlink(&bl->wait_head, &bl->wait_tail, req);
+        scsi_fail_request(req);
+        return;
+    }
+    
+    for (int i = 0; i < BUSLOGIC_CCBS; i++) {
+        buslogic_slot_t* slot = &bl->slots[i];
+        buslogic_outbox_t* mbox = &bl->out[bl->out_next];
+        
+        if (slot->req != req)
+            continue;
+        
+        if (slot->aborting || mbox->action != BUSLOGIC_MBOX_CMD_FREE) {
+            buslogic_recover(index);
+            return;
+        }
+        
+        mbox->ccb = (uint32_t)&slot->ccb;
+        asm volatile ("" : : : "memory");
+        mbox->action = BUSLOGIC_MBOX_CMD_ABORT;
+        bl->out_next = (bl->out_next + 1) % BUSLOGIC_MAILBOXES;
+        outb(controllers[index].io_base + BUSLOGIC_REG_COMMAND, BUSLOGIC_CMD_START_MBOX);
+        slot->aborting = 1;
+        return;
+    }
+}
+
+// LSI: Asynchronous SCSI clock divisor (SCNTL3) for the 40 MHz input clock
+#define LSI_SCNTL3_ASYNC 0x03
+
+// LSI: Assemble the SCRIPTS for bus address base. With code NULL only the
+// labels are placed; forward references use the labels of an earlier pass.
+// Returns the size in bytes.
+//
+// The SCRIPTS take commands from the start queue in host memory, select
+// the target, and run every phase up to COMMAND COMPLETE without the CPU.
+// Targets may disconnect; a reselecting target finds its command block
+// through the nexus table. Completion sets cmd->done and raises INTFLY,
+// which interrupts the CPU while the SCRIPTS carry on.
+static uint32_t lsi_build_script(uint32_t* code, uint32_t base, lsi_labels_t* l, lsi_shared_t* sh) {
+    uint32_t n = 0;
+
+#define EMIT(insn, arg) do { \
+        if (code) { code[n / 4] = (insn); code[n / 4 + 1] = (arg); } \
+        n += 8; \
+    } while (0)
+#define ADDR(label) (base + l->label)
+#define SHARED(field) ((uint32_t)&sh->field)
+#define CMD(field) ((uint32_t)__builtin_offsetof(lsi_cmd_t, field))
+    
+    // Scheduler: peek at the next start queue slot
+    l->sched = n;
+    EMIT(LSI_SCR_LOAD_ABS(LSI_REG_DSA, 4), SHARED(start_pos));
+    EMIT(LSI_SCR_LOAD_REL(LSI_REG_SCRATCHA, 4), 4);
+    EMIT(LSI_SCR_REG_TO_SFBR(LSI_REG_SCRATCHA), 0);
+    EMIT(LSI_SCR_JUMP_DATA(0), ADDR(idle));
+    EMIT(LSI_SCR_LOAD_REL(LSI_REG_SCRATCHA, 4), 0);
+    EMIT(LSI_SCR_STORE_ABS(LSI_REG_SCRATCHA, 4), SHARED(current));
+    EMIT(LSI_SCR_LOAD_ABS(LSI_REG_DSA, 4), SHARED(current));
+    
+    // Losing arbitration to a reselecting target jumps to resel and
+    // leaves the command queued
+    EMIT(LSI_SCR_SELECT_ATN_TBL | CMD(select), ADDR(resel));
+    
+    // Selected: consume the slot and advance, wrapping within the page
+    EMIT(LSI_SCR_LOAD_ABS(LSI_REG_DSA, 4), SHARED(start_pos));
+    EMIT(LSI_SCR_REG_REG(LSI_REG_SCRATCHA, LSI_SCR_OP_LOAD, 0), 0);
+    EMIT(LSI_SCR_STORE_REL(LSI_REG_SCRATCHA, 1), 4);
+    EMIT(LSI_SCR_REG_REG(LSI_REG_DSA, LSI_SCR_OP_ADD, 8), 0);
+    EMIT(LSI_SCR_STORE_ABS(LSI_REG_DSA, 4), SHARED(start_pos));
+    EMIT(LSI_SCR_LOAD_ABS(LSI_REG_DSA, 4), SHARED(current));
+    EMIT(LSI_SCR_MOVE_TBL(LSI_PHASE_MSG_OUT), CMD(msg_out));
+    EMIT(LSI_SCR_MOVE_TBL(LSI_PHASE_COMMAND), CMD(command));
+    
+    // Whatever the target asks for next
+    l->phase = n;
+    EMIT(LSI_SCR_JUMP_PHASE(LSI_PHASE_DATA_IN), ADDR(do_data_in));
+    EMIT(LSI_SCR_JUMP_PHASE(LSI_PHASE_DATA_OUT), ADDR(do_data_out));
+    EMIT(LSI_SCR_JUMP_PHASE(LSI_PHASE_STATUS), ADDR(status));
+    EMIT(LSI_SCR_JUMP_PHASE(LSI_PHASE_MSG_IN), ADDR(msg_in));
+    EMIT(LSI_SCR_INT, LSI_INT_BAD_PHASE);
+    
+    // Data: continue at the command's data pointer
+    l->do_data_in = n;
+    EMIT(LSI_SCR_LOAD_REL(LSI_REG_TEMP, 4), CMD(data_in));
+    EMIT(LSI_SCR_RETURN, 0);
+    l->do_data_out = n;
+    EMIT(LSI_SCR_LOAD_REL(LSI_REG_TEMP, 4), CMD(data_out));
+    EMIT(LSI_SCR_RETURN, 0);
+    
+    // One move per table entry. A phase mismatch stops the SCRIPTS in the
+    // middle; the CPU then moves the data pointer (lsi_phase_mismatch).
+    l->data_in = n;
+    for (uint32_t i = 0; i < LSI_MAX_SG; i++)
+        EMIT(LSI_SCR_MOVE_TBL(LSI_PHASE_DATA_IN), CMD(data) + i * sizeof(lsi_table_t));
+    EMIT(LSI_SCR_LOAD_ABS(LSI_REG_SCRATCHA, 4), SHARED(data_in_done));
+    EMIT(LSI_SCR_STORE_REL(LSI_REG_SCRATCHA, 4), CMD(data_in));
+    EMIT(LSI_SCR_JUMP, ADDR(phase));
+    l->data_in_done = n;
+    EMIT(LSI_SCR_INT, LSI_INT_OVERRUN);
+    
+    l->data_out = n;
+    for (uint32_t i = 0; i < LSI_MAX_SG; i++)
+        EMIT(LSI_SCR_MOVE_TBL(LSI_PHASE_DATA_OUT), CMD(data) + i * sizeof(lsi_table_t));
+    EMIT(LSI_SCR_LOAD_ABS(LSI_REG_SCRATCHA, 4), SHARED(data_out_done));
+    EMIT(LSI_SCR_STORE_REL(LSI_REG_SCRATCHA, 4), CMD(data_out));
+    EMIT(LSI_SCR_JUMP, ADDR(phase));
+    l->data_out_done = n;
+    EMIT(LSI_SCR_INT, LSI_INT_OVERRUN);
+    
+    l->status = n;
+    EMIT(LSI_SCR_MOVE_TBL(LSI_PHASE_STATUS), CMD(status));
+    EMIT(LSI_SCR_JUMP, ADDR(phase));
+    
+    // Messages. SAVE DATA POINTER and RESTORE POINTERS need no work: the
+    // data pointers only move with completed transfers. Other messages
+    // are acknowledged and ignored.
+    l->msg_in = n;
+    EMIT(LSI_SCR_MOVE_TBL(LSI_PHASE_MSG_IN), CMD(msg_in));
+    EMIT(LSI_SCR_LOAD_REL(LSI_REG_SCRATCHA, 4), CMD(msg_in_byte));
+    EMIT(LSI_SCR_REG_TO_SFBR(LSI_REG_SCRATCHA), 0);
+    EMIT(LSI_SCR_JUMP_DATA(0x00), ADDR(complete));   // COMMAND COMPLETE
+    EMIT(LSI_SCR_JUMP_DATA(0x04), ADDR(disconnect)); // DISCONNECT
+    EMIT(LSI_SCR_CLEAR_ACK, 0);
+    EMIT(LSI_SCR_JUMP, ADDR(phase));
+    
+    // Clearing SCNTL2 SDU tells the chip the disconnect is expected
+    l->complete = n;
+    EMIT(LSI_SCR_REG_REG(LSI_REG_SCNTL2, LSI_SCR_OP_AND, 0x7F), 0);
+    EMIT(LSI_SCR_CLEAR_ACK, 0);
+    EMIT(LSI_SCR_WAIT_DISC, 0);
+    EMIT(LSI_SCR_REG_REG(LSI_REG_SCRATCHA, LSI_SCR_OP_LOAD, 1), 0);
+    EMIT(LSI_SCR_STORE_REL(LSI_REG_SCRATCHA, 1), CMD(done));
+    EMIT(LSI_SCR_INTFLY, 0);
+    EMIT(LSI_SCR_JUMP, ADDR(sched));
+    
+    l->disconnect = n;
+    EMIT(LSI_SCR_REG_REG(LSI_REG_SCNTL2, LSI_SCR_OP_AND, 0x7F), 0);
+    EMIT(LSI_SCR_CLEAR_ACK, 0);
+    EMIT(LSI_SCR_WAIT_DISC, 0);
+    EMIT(LSI_SCR_JUMP, ADDR(sched));
+    
+    // Idle until a target reselects or the CPU sets SIGP
+    l->idle = n;
+    EMIT(LSI_SCR_WAIT_RESEL, ADDR(sigp));
+    
+    // Reselected: DSA = nexus[SSID & 0x0F], then take the IDENTIFY
+    l->resel = n;
+    EMIT(LSI_SCR_REG_TO_SFBR(LSI_REG_SSID), 0);
+    EMIT(LSI_SCR_SFBR_TO_REG(LSI_REG_SCRATCHA, LSI_SCR_OP_AND, 0x0F), 0);
+    EMIT(LSI_SCR_CLEAR_CARRY, 0);
+    EMIT(LSI_SCR_REG_REG(LSI_REG_SCRATCHA, LSI_SCR_OP_SHL, 0), 0);
+    EMIT(LSI_SCR_REG_REG(LSI_REG_SCRATCHA, LSI_SCR_OP_SHL, 0), 0);
+    EMIT(LSI_SCR_LOAD_ABS(LSI_REG_DSA, 4), SHARED(nexus_base));
+    EMIT(LSI_SCR_REG_TO_SFBR(LSI_REG_SCRATCHA), 0);
+    EMIT(LSI_SCR_SFBR_TO_REG(LSI_REG_DSA, LSI_SCR_OP_OR, 0), 0);
+    EMIT(LSI_SCR_LOAD_REL(LSI_REG_DSA, 4), 0);
+    EMIT(LSI_SCR_MOVE_TBL(LSI_PHASE_MSG_IN), CMD(msg_in));
+    EMIT(LSI_SCR_CLEAR_ACK, 0);
+    EMIT(LSI_SCR_JUMP, ADDR(phase));
+    
+    // Reading CTEST2 clears SIGP
+    l->sigp = n;
+    EMIT(LSI_SCR_REG_TO_SFBR(LSI_REG_CTEST2), 0);
+    EMIT(LSI_SCR_JUMP, ADDR(sched));
+    
+    l->orphan = n;
+    EMIT(LSI_SCR_INT, LSI_INT_BAD_RESEL);
+
+#undef EMIT
+#undef ADDR
+#undef SHARED
+#undef CMD
+    
+    l->size = n;
+    return n;
+}
+
+// LSI: Point the fixed tables of a command block at its own buffers
+static void lsi_init_cmd(lsi_cmd_t* cmd) {
+    memset(cmd, 0, sizeof(lsi_cmd_t));
+    cmd->msg_out.count = 1;
+    cmd->msg_out.addr = (uint32_t)&cmd->identify;
+    cmd->command.addr = (uint32_t)cmd->cdb;
+    cmd->status.count = 1;
+    cmd->status.addr = (uint32_t)&cmd->status_byte;
+    cmd->msg_in.count = 1;
+    cmd->msg_in.addr = (uint32_t)cmd->msg_in_byte;
+}
+
+// LSI: Assemble the SCRIPTS and copy them into the on-chip SCRIPTS RAM.
+// Without usable RAM they run from host memory instead.
+static int lsi_load_script(int index, uint32_t ram) {
+    lsi_t* c = &lsi[index];
+    uint32_t size = lsi_build_script(NULL, 0, &c->label, c->shared);
+    uint32_t* code = (uint32_t*)kmalloc_aligned(size, 8);
+    
+    if (!code)
+        return 0;
+    
+    if (ram && size <= LSI_SCRIPT_RAM_SIZE) {
+        lsi_build_script(code, ram, &c->label, c->shared);
+        for (uint32_t i = 0; i < size / 4; i++)
+            mmio_write32(ram + i * 4, code[i]);
+        if (mmio_read32(ram) == code[0] && mmio_read32(ram + size - 4) == code[size / 4 - 1]) {
+            c->script = ram;
+            serial_write("  SCRIPTS loaded into on-chip RAM at 0x");
+            serial_write_hex(ram);
+            serial_write("\n");
+            return 1;
+        }
+    }
+    
+    lsi_build_script(code, (uint32_t)code, &c->label, c->shared);
+    c->script = (uint32_t)code;
+    serial_write("  SCRIPTS run from host memory\n");
+    return 1;
+}
+
+// LSI: Initialize controller: reset the chip, load the SCRIPTS and start
+// them in the scheduler, where they idle until a command is queued
+static int lsi_init(int index, uint16_t io_base, uint32_t ram) {
+    lsi_t* c = &lsi[index];
+    scsi_controller_t* ctrl = &controllers[index];
+    
+    serial_write("Initializing LSI 53C895A controller at I/O 0x");
     serial_write_hex(io_base);
     serial_write("\n");
     
-    // Soft reset
-    buslogic_soft_reset(io_base);
+    outb(io_base + LSI_REG_ISTAT, LSI_ISTAT_SRST);
+    for (int i = 0; i < 100; i++)
+        inb(io_base + LSI_REG_ISTAT);
+    outb(io_base + LSI_REG_ISTAT, 0);
+    
+    ctrl->host_id = 7;
+    ctrl->max_cdb = LSI_CDB_MAX;
+    ctrl->max_sg = LSI_MAX_SG;
+    ctrl->queue_depth = LSI_COMMANDS;
+    ctrl->lun_depth = 1; // The SCRIPTS run one command per target
+    ctrl->max_lun = 7;   // IDENTIFY carries three LUN bits
     
-    // Check if controller is present and responding
-    if (!buslogic_wait_ready(io_base)) {
-        serial_write("  Controller not ready\n");
+    c->shared = (lsi_shared_t*)kmalloc_aligned(sizeof(lsi_shared_t), 256);
+    c->cmds = (lsi_cmd_t*)kmalloc_aligned(sizeof(lsi_cmd_t) * (LSI_COMMANDS + 1), 16);
+    if (!c->shared || !c->cmds || !lsi_load_script(index, ram)) {
+        serial_write("  Out of memory\n");
         return 0;
     }
     
-    serial_write("  BusLogic controller initialized\n");
+    memset(c->shared, 0, sizeof(lsi_shared_t));
+    memset(c->slots, 0, sizeof(c->slots));
+    for (int i = 0; i <= LSI_COMMANDS; i++)
+        lsi_init_cmd(&c->cmds[i]);
+    
+    // A target reselecting without a command gets the orphan block, whose
+    // data pointers raise LSI_INT_BAD_RESEL
+    lsi_cmd_t* orphan = &c->cmds[LSI_COMMANDS];
+    orphan->data_in = c->script + c->label.orphan;
+    orphan->data_out = c->script + c->label.orphan;
+    for (int t = 0; t < LSI_MAX_TARGETS; t++)
+        c->shared->nexus[t] = (uint32_t)orphan;
+    
+    c->shared->start_pos = (uint32_t)c->shared->queue;
+    c->shared->nexus_base = (uint32_t)c->shared->nexus;
+    c->shared->data_in_done = c->script + c->label.data_in_done;
+    c->shared->data_out_done = c->script + c->label.data_out_done;
+    c->queue_tail = 0;
+    c->busy = 0;
+    c->wait_head = c->wait_tail = NULL;
+    
+    // Full arbitration, parity checking, ATN on parity errors
+    outb(io_base + LSI_REG_SCNTL0, 0xCA);
+    outb(io_base + LSI_REG_SCNTL1, 0);
+    outb(io_base + LSI_REG_SCNTL3, LSI_SCNTL3_ASYNC);
+    outb(io_base + LSI_REG_SCID, LSI_SCID_RRE | ctrl->host_id);
+    outb(io_base + LSI_REG_RESPID0, (uint8_t)(1 << ctrl->host_id));
+    outb(io_base + LSI_REG_RESPID1, (uint8_t)((1 << ctrl->host_id) >> 8));
+    outb(io_base + LSI_REG_STIME0, 0x0C);   // 256 ms selection timeout
+    outb(io_base + LSI_REG_DIEN, LSI_DSTAT_MDPE | LSI_DSTAT_BF | LSI_DSTAT_ABRT |
+                                 LSI_DSTAT_SIR | LSI_DSTAT_IID);
+    outb(io_base + LSI_REG_SIEN0, LSI_SIST0_MA | LSI_SIST0_SGE | LSI_SIST0_UDC | LSI_SIST0_PAR);
+    outb(io_base + LSI_REG_SIEN1, LSI_SIST1_STO);
+    inb(io_base + LSI_REG_DSTAT);
+    inb(io_base + LSI_REG_SIST0);
+    inb(io_base + LSI_REG_SIST1);
+    
+    outl(io_base + LSI_REG_DSP, c->script + c->label.sched);
+    
+    serial_write("  LSI controller initialized\n");
     return 1;
 }
 
-// SCSI: Execute a simple command (no data transfer)
-static int scsi_execute_simple_command(uint8_t controller_id, uint8_t target, uint8_t lun, 
-                                       uint8_t* cdb, uint8_t cdb_len) {
-    if (controller_id >= controller_count) {
+// LSI: Fill a command block. Data of n entries occupies the last n table
+// entries, and the data pointer starts at the move for the first of them.
+static void lsi_prepare(lsi_t* c, lsi_cmd_t* cmd, uint8_t target, uint8_t lun,
+                        const uint8_t* cdb, uint8_t cdb_length, uint8_t direction,
+                        const scsi_sg_t* sg, uint16_t nsg, uint8_t* buffer, uint32_t length) {
+    cmd->select = ((uint32_t)LSI_SCNTL3_ASYNC << 24) | ((uint32_t)target << 16);
+    cmd->done = 0;
+    cmd->identify = 0xC0 | (lun & 0x07);    // IDENTIFY, disconnects allowed
+    memcpy(cmd->cdb, cdb, cdb_length);
+    cmd->command.count = cdb_length;
+    cmd->status_byte = 0xFF;
+    
+    uint16_t n = nsg ? nsg : (length ? 1 : 0);
+    lsi_table_t* t = &cmd->data[LSI_MAX_SG - n];
+    if (nsg) {
+        for (uint16_t i = 0; i < nsg; i++) {
+            t[i].count = sg[i].length;
+            t[i].addr = sg[i].addr;
+        }
+    } else if (n) {
+        t->count = length;
+        t->addr = (uint32_t)buffer;
+    }
+    
+    uint32_t first = (uint32_t)(LSI_MAX_SG - n) * sizeof(uint32_t) * 2;
+    cmd->data_in = c->script + c->label.data_in_done;
+    cmd->data_out = c->script + c->label.data_out_done;
+    if (direction == SCSI_DIR_IN)
+        cmd->data_in = c->script + c->label.data_in + first;
+    else if (direction == SCSI_DIR_OUT)
+        cmd->data_out = c->script + c->label.data_out + first;
+}
+
+// LSI: Publish a command block in the start queue and wake the SCRIPTS.
+// Called with interrupts disabled.
+static void lsi_enqueue(int index, int slot, uint8_t target) {
+    lsi_t* c = &lsi[index];
+    volatile uint32_t* q = c->shared->queue[c->queue_tail];
+    
+    c->shared->nexus[target] = (uint32_t)&c->cmds[slot];
+    q[0] = (uint32_t)&c->cmds[slot];
+    asm volatile ("" : : : "memory");
+    q[1] = 1;
+    c->queue_tail = (c->queue_tail + 1) % LSI_COMMANDS;
+    
+    outb(controllers[index].io_base + LSI_REG_ISTAT, LSI_ISTAT_SIGP);
+}
+
+// LSI: Start a request if a command block is free and its target has no
+// command in flight. Reselection finds commands by target, so each
+// target runs one command at a time. Called with interrupts disabled.
+static int lsi_start(int index, scsi_request_t* req) {
+    lsi_t* c = &lsi[index];
+    int slot = -1;
+    
+    if (c->busy & (1 << req->target))
         return 0;
+    for (int i = 0; i < LSI_COMMANDS; i++) {
+        if (!c->slots[i].req) {
+            slot = i;
+            break;
+        }
     }
+    if (slot < 0)
+        return 0;
     
-    scsi_controller_t* ctrl = &controllers[controller_id];
+    lsi_prepare(c, &c->cmds[slot], req->target, req->lun, req->cdb, req->cdb_length,
+                req->direction, req->sg, req->nsg, req->buffer, req->length);
+    c->slots[slot].req = req;
+    c->slots[slot].sensing = 0;
+    c->busy |= 1 << req->target;
+    req->status = SCSI_REQ_ACTIVE;
     
-    if (ctrl->type == SCSI_CONTROLLER_BUSLOGIC) {
-        // For simple commands, we'll use polling mode
-        // In a full implementation, this would set up a CCB and use mailboxes
+    lsi_enqueue(index, slot, req->target);
+    return 1;
+}
+
+// LSI: Start waiting requests. Requests for a busy target are skipped and
+// keep their order.
+static void lsi_start_waiting(int index) {
+    lsi_t* c = &lsi[index];
+    scsi_request_t* prev = NULL;
+    scsi_request_t* req = c->wait_head;
+    
+    while (req) {
+        scsi_request_t* next = req->next;
         
-        // This is a simplified version - real implementation would need:
-        // 1. Allocate CCB
-        // 2. Set up mailboxes
-        // 3. Submit command
-        // 4. Wait for completion
+        if (lsi_start(index, req)) {
+            if (prev)
+                prev->next = next;
+            else
+                c->wait_head = next;
+            if (c->wait_tail == req)
+                c->wait_tail = prev;
+        } else {
+            prev = req;
+        }
+        req = next;
+    }
+}
+
+// LSI: Queue a request
+static void lsi_queue(int index, scsi_request_t* req) {
+    lsi_t* c = &lsi[index];
+    
+    req->next = NULL;
+    if (c->wait_tail)
+        c->wait_tail->next = req;
+    else
+        c->wait_head = req;
+    c->wait_tail = req;
+    
+    lsi_start_waiting(index);
+}
+
+// LSI: Slot of a command block address, or -1
+static int lsi_find_slot(lsi_t* c, uint32_t addr) {
+    uint32_t offset = addr - (uint32_t)c->cmds;
+    
+    if (offset >= sizeof(lsi_cmd_t) * LSI_COMMANDS || offset % sizeof(lsi_cmd_t))
+        return -1;
+    return c->slots[offset / sizeof(lsi_cmd_t)].req ? (int)(offset / sizeof(lsi_cmd_t)) : -1;
+}
+
+// LSI: Bytes a command did not transfer: the table entries from its data
+// pointer on
+static uint32_t lsi_residual(lsi_t* c, lsi_cmd_t* cmd, uint8_t direction) {
+    uint32_t start;
+    uint32_t ptr;
+    uint32_t residual = 0;
+    
+    if (direction == SCSI_DIR_IN) {
+        start = c->script + c->label.data_in;
+        ptr = cmd->data_in;
+    } else if (direction == SCSI_DIR_OUT) {
+        start = c->script + c->label.data_out;
+        ptr = cmd->data_out;
+    } else {
+        return 0;
+    }
+    
+    for (uint32_t i = (ptr - start) >> 3; i < LSI_MAX_SG; i++)
+        residual += cmd->data[i].count;
+    return residual;
+}
+
+// LSI: Free a slot and report its request
+static void lsi_finish(int index, int slot, uint8_t ok) {
+    lsi_t* c = &lsi[index];
+    scsi_request_t* req = c->slots[slot].req;
+    
+    c->slots[slot].req = NULL;
+    c->busy &= ~(1 << req->target);
+    c->shared->nexus[req->target] = (uint32_t)&c->cmds[LSI_COMMANDS];
+    
+    req->status = ok ? SCSI_REQ_DONE : SCSI_REQ_ERROR;
+    if (req->complete)
+        req->complete(req);
+}
+
+// LSI: Handle a command that reached COMMAND COMPLETE. The chip has no
+// autosense, so CHECK CONDITION is followed by a REQUEST SENSE in the
+// same slot before the request completes.
+static void lsi_complete(int index, int slot) {
+    lsi_t* c = &lsi[index];
+    lsi_slot_t* s = &c->slots[slot];
+    lsi_cmd_t* cmd = &c->cmds[slot];
+    scsi_request_t* req = s->req;
+    
+    req->host_status = LSI_HOST_OK;
+    if (s->sensing) {
+        memcpy(req->sense, cmd->sense, SCSI_SENSE_LENGTH);
+        req->target_status = s->target_status;
+        req->residual = s->residual;
+        lsi_finish(index, slot, 0);
+        return;
+    }
+    
+    req->target_status = cmd->status_byte;
+    req->residual = lsi_residual(c, cmd, req->direction);
+    if (cmd->status_byte == SCSI_STATUS_CHECK_CONDITION) {
+        uint8_t cdb[6] = { SCSI_CMD_REQUEST_SENSE, (uint8_t)((req->lun & 0x07) << 5), 0, 0,
+                           SCSI_SENSE_LENGTH, 0 };
         
-        return 1; // Assume success for now
+        s->sensing = 1;
+        s->target_status = cmd->status_byte;
+        s->residual = req->residual;
+        memset(cmd->sense, 0, SCSI_SENSE_LENGTH);
+        lsi_prepare(c, cmd, req->target, req->lun, cdb, 6, SCSI_DIR_IN,
+                    NULL, 0, cmd->sense, SCSI_SENSE_LENGTH);
+        lsi_enqueue(index, slot, req->target);
+        return;
+    }
+    
+    lsi_finish(index, slot, cmd->status_byte == SCSI_STATUS_GOOD);
+}
+
+// LSI: Fail the command in a slot
+static void lsi_fail(int index, int slot, uint8_t host_status) {
+    scsi_request_t* req = lsi[index].slots[slot].req;
+    
+    req->host_status = host_status;
+    req->target_status = 0;
+    lsi_finish(index, slot, 0);
+}
+
+// LSI: Phase mismatch inside the data moves: the target disconnected or
+// moved on early. Advance the data pointer past what was transferred so
+// the command resumes (or reports its residual) from there. Returns 0 if
+// the SCRIPTS stopped anywhere else.
+static int lsi_phase_mismatch(int index, int slot, uint32_t dsp) {
+    lsi_t* c = &lsi[index];
+    lsi_cmd_t* cmd = &c->cmds[slot];
+    uint32_t offset = dsp - c->script;
+    uint32_t start;
+    
+    // DSP has moved past the interrupted move
+    if (offset > c->label.data_in && offset <= c->label.data_in + LSI_MAX_SG * 8)
+        start = c->label.data_in;
+    else if (offset > c->label.data_out && offset <= c->label.data_out + LSI_MAX_SG * 8)
+        start = c->label.data_out;
+    else
+        return 0;
+    
+    uint32_t i = ((offset - start) >> 3) - 1;
+    uint32_t left = inl(controllers[index].io_base + LSI_REG_DBC) & 0xFFFFFF;
+    lsi_table_t* t = &cmd->data[i];
+    
+    t->addr += t->count - left;
+    t->count = left;
+    if (!left)
+        i++;
+    if (start == c->label.data_in)
+        cmd->data_in = c->script + start + (i << 3);
+    else
+        cmd->data_out = c->script + start + (i << 3);
+    return 1;
+}
+
+// LSI: Reset the SCSI bus. Every command that left the start queue is
+// lost with it; commands still queued run after the reset.
+static void lsi_bus_reset(int index) {
+    lsi_t* c = &lsi[index];
+    uint16_t io_base = controllers[index].io_base;
+    
+    outb(io_base + LSI_REG_SCNTL1, LSI_SCNTL1_RST);
+    for (int i = 0; i < 100; i++)
+        inb(io_base + LSI_REG_ISTAT);   // Hold RST for at least 25 us
+    outb(io_base + LSI_REG_SCNTL1, 0);
+    inb(io_base + LSI_REG_SIST0);
+    inb(io_base + LSI_REG_SIST1);
+    
+    for (int i = 0; i < LSI_COMMANDS; i++) {
+        if (!c->slots[i].req)
+            continue;
+        
+        int queued = 0;
+        for (int q = 0; q < LSI_COMMANDS; q++) {
+            if (c->shared->queue[q][1] && c->shared->queue[q][0] == (uint32_t)&c->cmds[i])
+                queued = 1;
+        }
+        if (!queued)
+            lsi_fail(index, i, LSI_HOST_ERROR);
+    }
+}
+
+// LSI: Give up on a request that timed out. A waiting request is
+// unlinked. A started command is lost with a bus reset, which fails every
+// command that left the start queue. A command still in the start queue
+// cannot be taken out without stalling the entries behind it, so its
+// block becomes a TEST UNIT READY without data that completes a stand-in,
+// and the request fails now.
+static void lsi_abort(int index, scsi_request_t* req) {
+    lsi_t* c = &lsi[index];
+    
+    if (req->status == SCSI_REQ_QUEUED) {
+        scsi_unlink(&c->wait_head, &c->wait_tail, req);
+        scsi_fail_request(req);
+        return;
+    }
+    
+    lsi_bus_reset(index);
+    
+    for (int i = 0; i < LSI_COMMANDS && req->status == SCSI_REQ_ACTIVE; i++) {
+        lsi_slot_t* s = &c->slots[i];
+        uint8_t cdb[6] = { SCSI_CMD_TEST_UNIT_READY, 0, 0, 0, 0, 0 };
+        
+        if (s->req != req)
+            continue;
+        
+        memset(&s->stand_in, 0, sizeof(scsi_request_t));
+        s->stand_in.controller = (uint8_t)index;
+        s->stand_in.target = req->target;
+        s->stand_in.lun = req->lun;
+        s->stand_in.direction = SCSI_DIR_NONE;
+        s->stand_in.status = SCSI_REQ_ACTIVE;
+        lsi_prepare(c, &c->cmds[i], req->target, req->lun, cdb, 6, SCSI_DIR_NONE, NULL, 0, NULL, 0);
+        s->req = &s->stand_in;
+        s->sensing = 0;
+        
+        req->host_status = LSI_HOST_ERROR;
+        req->target_status = 0;
+        scsi_fail_request(req);
+    }
+    
+    lsi_start_waiting(index);
+}
+
+// LSI: The SCRIPTS stopped with an error. Recover and restart them.
+static void lsi_error(int index, uint8_t dstat, uint8_t sist0, uint8_t sist1) {
+    lsi_t* c = &lsi[index];
+    uint16_t io_base = controllers[index].io_base;
+    uint32_t dsp = inl(io_base + LSI_REG_DSP);
+    int slot = lsi_find_slot(c, inl(io_base + LSI_REG_DSA));
+    
+    // Drop whatever the interrupted transfer left in the FIFOs
+    outb(io_base + LSI_REG_CTEST3, inb(io_base + LSI_REG_CTEST3) | LSI_CTEST3_CLF);
+    outb(io_base + LSI_REG_STEST3, inb(io_base + LSI_REG_STEST3) | LSI_STEST3_CSF);
+    
+    if (sist1 & LSI_SIST1_STO) {
+        // Nobody answered: the command is still at the head of the queue
+        volatile uint32_t* q = (volatile uint32_t*)c->shared->start_pos;
+        
+        slot = lsi_find_slot(c, c->shared->current);
+        if (q[1] && q[0] == c->shared->current) {
+            q[1] = 0;
+            c->shared->start_pos = (c->shared->start_pos & ~0xFFu) |
+                                   ((c->shared->start_pos + 8) & 0xFF);
+        }
+        if (slot >= 0)
+            lsi_fail(index, slot, LSI_HOST_SEL_TIMEOUT);
+        outl(io_base + LSI_REG_DSP, c->script + c->label.sched);
+        return;
+    }
+    
+    if (sist0 == LSI_SIST0_MA && !dstat && slot >= 0 && lsi_phase_mismatch(index, slot, dsp)) {
+        outl(io_base + LSI_REG_DSP, c->script + c->label.phase);
+        return;
+    }
+    
+    serial_write("LSI: SCRIPTS error DSTAT=0x");
+    serial_write_hex(dstat);
+    serial_write(" SIST0=0x");
+    serial_write_hex(sist0);
+    serial_write(" SIST1=0x");
+    serial_write_hex(sist1);
+    if (dstat & LSI_DSTAT_SIR) {
+        serial_write(" INT=");
+        serial_write_hex(inl(io_base + LSI_REG_DSPS));
+    }
+    serial_write(", resetting bus\n");
+    
+    lsi_bus_reset(index);
+    outl(io_base + LSI_REG_DSP, c->script + c->label.sched);
+}
+
+// LSI: Service the chip: completions signalled by INTFLY, then errors
+// that stopped the SCRIPTS
+static void lsi_interrupt(int index) {
+    lsi_t* c = &lsi[index];
+    uint16_t io_base = controllers[index].io_base;
+    uint8_t istat = inb(io_base + LSI_REG_ISTAT);
+    
+    if (istat & LSI_ISTAT_INTF) {
+        // Acknowledge before the scan, keeping a SIGP not yet seen
+        outb(io_base + LSI_REG_ISTAT, (istat & LSI_ISTAT_SIGP) | LSI_ISTAT_INTF);
+        for (int i = 0; i < LSI_COMMANDS; i++) {
+            if (c->slots[i].req && c->cmds[i].done)
+                lsi_complete(index, i);
+        }
+    }
+    
+    if (istat & (LSI_ISTAT_SIP | LSI_ISTAT_DIP)) {
+        uint8_t dstat = 0;
+        uint8_t sist0 = 0;
+        uint8_t sist1 = 0;
+        
+        if (istat & LSI_ISTAT_DIP)
+            dstat = inb(io_base + LSI_REG_DSTAT);
+        if (istat & LSI_ISTAT_SIP) {
+            sist0 = inb(io_base + LSI_REG_SIST0);
+            sist1 = inb(io_base + LSI_REG_SIST1);
+        }
+        lsi_error(index, dstat, sist0, sist1);
+    }
+    
+    lsi_start_waiting(index);
+}
+
+// BusLogic: Acknowledge the adapter and complete finished CCBs
+static void buslogic_interrupt(int index) {
+    uint16_t io_base = controllers[index].io_base;
+    uint8_t status = inb(io_base + BUSLOGIC_REG_INTERRUPT);
+    
+    if (!(status & BUSLOGIC_INT_VALID))
+        return;
+    
+    // Acknowledge first: a CCB finishing during the scan raises a
+    // new interrupt instead of being missed
+    outb(io_base + BUSLOGIC_REG_CONTROL, BUSLOGIC_CTRL_INT_RESET);
+    if (status & BUSLOGIC_INT_MBIN_LOADED)
+        buslogic_process_inbox(index);
+}
+
+// Interrupt handler, shared by all controllers on the line
+static void scsi_irq_handler(uint8_t irq) {
+    for (int i = 0; i < controller_count; i++) {
+        if (controllers[i].irq != irq)
+            continue;
+        
+        if (controllers[i].type == SCSI_CONTROLLER_BUSLOGIC)
+            buslogic_interrupt(i);
+        else if (controllers[i].type == SCSI_CONTROLLER_LSI_LOGIC)
+            lsi_interrupt(i);
+        else if (controllers[i].type == SCSI_CONTROLLER_VIRTIO)
+            virtio_scsi_interrupt(i);
+    }
+}
+
+// Queue a request on its controller. Returns immediately; completion is
+// signalled through req->status and req->complete.
+void scsi_submit(scsi_request_t* req) {
+    req->status = SCSI_REQ_QUEUED;
+    req->submitted = timer_ticks();
+    req->host_status = 0;
+    req->target_status = 0;
+    req->residual = req->length;
+    
+    if (req->controller >= controller_count ||
+        req->cdb_length > controllers[req->controller].max_cdb ||
+        req->nsg > controllers[req->controller].max_sg) {
+        req->status = SCSI_REQ_ERROR;
+        if (req->complete)
+            req->complete(req);
+        return;
+    }
+    
+    uint32_t flags = irq_save();
+    if (controllers[req->controller].type == SCSI_CONTROLLER_LSI_LOGIC)
+        lsi_queue(req->controller, req);
+    else if (controllers[req->controller].type == SCSI_CONTROLLER_VIRTIO)
+        virtio_scsi_queue(req->controller, req);
+    else
+        buslogic_queue(req->controller, req);
+    irq_restore(flags);
+}
+
+// A request is overdue. The controller is polled in case an interrupt
+// was lost. A BusLogic or LSI request still pending is then aborted and
+// fails; virtio-scsi resets the LUN, which makes the device return the
+// request. Called with interrupts disabled.
+static void scsi_request_timeout(scsi_request_t* req) {
+    uint8_t type = controllers[req->controller].type;
+    
+    if (type == SCSI_CONTROLLER_VIRTIO) {
+        serial_write("SCSI: command timeout, resetting LUN\n");
+        virtio_scsi_timeout(req->controller, req);
+        return;
+    }
+    
+    if (type == SCSI_CONTROLLER_LSI_LOGIC)
+        lsi_interrupt(req->controller);
+    else
+        buslogic_process_inbox(req->controller);
+    
+    if (req->status == SCSI_REQ_QUEUED || req->status == SCSI_REQ_ACTIVE) {
+        serial_write("SCSI: command timeout, aborting\n");
+        if (type == SCSI_CONTROLLER_LSI_LOGIC)
+            lsi_abort(req->controller, req);
+        else
+            buslogic_abort(req->controller, req);
+    }
+}
+
+// Sleep until a request finishes, recovering it once timeout_ms has passed
+static uint8_t scsi_wait_timeout(scsi_request_t* req, uint32_t timeout_ms) {
+    uint32_t start = timer_ticks();
+    uint32_t flags = irq_save();
+    
+    while (req->status == SCSI_REQ_QUEUED || req->status == SCSI_REQ_ACTIVE) {
+        if (timer_ticks() - start >= timeout_ms) {
+            scsi_request_timeout(req);
+            start = timer_ticks();
+            continue;
+        }
+        
+        irq_wait();
+    }
+    
+    irq_restore(flags);
+    return (req->status == SCSI_REQ_DONE) ? 0 : 1;
+}
+
+uint8_t scsi_wait(scsi_request_t* req) {
+    return scsi_wait_timeout(req, SCSI_TIMEOUT_MS);
+}
+
+// SCSI: Execute a command and wait for it. A pending unit attention
+// (e.g. after the bus reset) is reported once per target, so the
+// command is retried. Returns 1 on success.
+static int scsi_execute_command(uint8_t controller_id, uint8_t target, uint8_t lun,
+                                const uint8_t* cdb, uint8_t cdb_len, uint8_t direction,
+                                void* buffer, uint32_t length) {
+    scsi_request_t req;
+    
+    memset(&req, 0, sizeof(req));
+    req.controller = controller_id;
+    req.target = target;
+    req.lun = lun;
+    req.direction = direction;
+    memcpy(req.cdb, cdb, cdb_len);
+    req.cdb_length = cdb_len;
+    req.buffer = (uint8_t*)buffer;
+    req.length = length;
+    
+    for (int attempt = 0; attempt < 3; attempt++) {
+        scsi_submit(&req);
+        if (scsi_wait(&req) == 0)
+            return 1;
+        if (req.target_status != SCSI_STATUS_CHECK_CONDITION ||
+            (req.sense[2] & 0x0F) != SCSI_SENSE_UNIT_ATTENTION)
+            break;
     }
     
     return 0;
@@ -149,40 +1276,33 @@ static int scsi_execute_simple_command(uint8_t controller_id, uint8_t target, ui
 static int scsi_inquiry(uint8_t controller_id, uint8_t target, uint8_t lun, scsi_inquiry_t* inquiry) {
     uint8_t cdb[6] = {0};
     cdb[0] = SCSI_CMD_INQUIRY;
-    cdb[1] = (lun << 5);
+    cdb[1] = SCSI_CDB_LUN(lun);
     cdb[4] = sizeof(scsi_inquiry_t); // Allocation length
     
-    // For now, return simulated data for testing
-    // Full implementation would execute the command via CCB
-    
-    inquiry->peripheral_type = SCSI_TYPE_DISK;
-    inquiry->rmb = 0;
-    inquiry->version = 2; // SCSI-2
-    inquiry->response_format = 2;
-    inquiry->additional_length = 31;
-    
-    // Simulated vendor/product info
-    scsi_string_copy((char*)inquiry->vendor, "QEMU    ", 8);
-    scsi_string_copy((char*)inquiry->product, "HARDDISK        ", 16);
-    scsi_string_copy((char*)inquiry->revision, "2.5+", 4);
-    
-    return 1;
+    memset(inquiry, 0, sizeof(scsi_inquiry_t));
+    return scsi_execute_command(controller_id, target, lun, cdb, sizeof(cdb), SCSI_DIR_IN,
+                                inquiry, sizeof(scsi_inquiry_t));
 }
 
 // SCSI: Send READ CAPACITY command
 static int scsi_read_capacity(uint8_t controller_id, uint8_t target, uint8_t lun, scsi_capacity_t* capacity) {
     uint8_t cdb[10] = {0};
     cdb[0] = SCSI_CMD_READ_CAPACITY_10;
-    cdb[1] = (lun << 5);
-    
-    // For now, return simulated data
-    // Full implementation would execute via CCB
+    cdb[1] = SCSI_CDB_LUN(lun);
     
-    // Simulate a 100MB disk
-    capacity->last_lba = swap32(204799); // 100MB = 204800 sectors - 1
-    capacity->block_size = swap32(512);
+    return scsi_execute_command(controller_id, target, lun, cdb, sizeof(cdb), SCSI_DIR_IN,
+                                capacity, sizeof(scsi_capacity_t));
+}
+
+// SCSI: Send READ CAPACITY (16), for disks of 2^32 blocks or more
+static int scsi_read_capacity16(uint8_t controller_id, uint8_t target, uint8_t lun, scsi_capacity16_t* capacity) {
+    uint8_t cdb[16] = {0};
+    cdb[0] = SCSI_CMD_SERVICE_IN_16;
+    cdb[1] = SCSI_SAI_READ_CAPACITY_16;
+    cdb[13] = sizeof(scsi_capacity16_t); // Allocation length
     
-    return 1;
+    return scsi_execute_command(controller_id, target, lun, cdb, sizeof(cdb), SCSI_DIR_IN,
+                                capacity, sizeof(scsi_capacity16_t));
 }
 
 // Scan for SCSI controllers via PCI
@@ -191,66 +1311,94 @@ void init_scsi(void) {
     controller_count = 0;
     device_count = 0;
     
-    // Scan PCI bus for SCSI controllers
-    for (uint16_t bus = 0; bus < 256; bus++) {
-        for (uint8_t slot = 0; slot < 32; slot++) {
-            uint16_t vendor_id = pci_read_config_word(bus, slot, 0, 0x00);
-            
-            if (vendor_id == 0xFFFF || vendor_id == 0x0000) {
-                continue; // No device
-            }
+    // SCSI controllers: class 01h, subclass 00h. virtio-scsi functions
+    // are set up through the virtio transport below.
+    pci_device_t* pci = NULL;
+    while ((pci = pci_find_class(0x01, 0x00, pci)) != NULL) {
+        if (pci->vendor_id == VIRTIO_PCI_VENDOR)
+            continue;
+        
+        serial_write("Found SCSI controller: Vendor=0x");
+        serial_write_hex(pci->vendor_id);
+        serial_write(" Device=0x");
+        serial_write_hex(pci->device_id);
+        serial_write("\n");
+        
+        // Get I/O base address (BAR0)
+        uint16_t io_base = pci_bar_io(pci, 0);
+        if (io_base == 0) {
+            serial_write("  Invalid I/O base address\n");
+            continue;
+        }
+        
+        // Identify controller type
+        if (pci->vendor_id == BUSLOGIC_VENDOR_ID && pci->device_id == BUSLOGIC_DEVICE_ID) {
+            serial_write("  Type: BusLogic BT-958\n");
             
-            uint16_t device_id = pci_read_config_word(bus, slot, 0, 0x02);
-            uint8_t class_code = pci_read_config_byte(bus, slot, 0, 0x0B);
-            uint8_t subclass = pci_read_config_byte(bus, slot, 0, 0x0A);
+            // Enable I/O decoding and bus mastering for mailbox DMA
+            pci_enable_device(pci, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
             
-            // Check for SCSI controller (Class 01h, Subclass 00h)
-            if (class_code == 0x01 && subclass == 0x00) {
-                serial_write("Found SCSI controller: Vendor=0x");
-                serial_write_hex(vendor_id);
-                serial_write(" Device=0x");
-                serial_write_hex(device_id);
-                serial_write("\n");
+            if (controller_count < SCSI_MAX_CONTROLLERS) {
+                scsi_controller_t* ctrl = &controllers[controller_count];
                 
-                // Get I/O base address (BAR0)
-                uint32_t bar0 = pci_read_config_dword(bus, slot, 0, 0x10);
-                uint16_t io_base = (uint16_t)(bar0 & 0xFFFFFFF0);
+                ctrl->type = SCSI_CONTROLLER_BUSLOGIC;
+                ctrl->io_base = io_base;
+                ctrl->mmio_base = 0;
+                ctrl->irq = pci->irq;
+                ctrl->device_count = 0;
                 
-                if (io_base == 0) {
-                    serial_write("  Invalid I/O base address\n");
-                    continue;
+                if (buslogic_init(controller_count, io_base)) {
+                    if (ctrl->irq > 0 && ctrl->irq < IRQ_LINES)
+                        irq_install_handler(ctrl->irq, scsi_irq_handler);
+                    controller_count++;
                 }
+            }
+        } else if (pci->vendor_id == LSI_VENDOR_ID && pci->device_id == LSI_53C895A_DEVICE_ID) {
+            serial_write("  Type: LSI Logic 53C895A\n");
+            
+            // Enable I/O and memory decoding (SCRIPTS RAM) and bus
+            // mastering for the SCRIPTS processor
+            pci_enable_device(pci, PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+            
+            // BAR2: on-chip SCRIPTS RAM
+            uint32_t ram = pci_bar_memory(pci, 2);
+            
+            if (controller_count < SCSI_MAX_CONTROLLERS) {
+                scsi_controller_t* ctrl = &controllers[controller_count];
                 
-                // Identify controller type
-                uint8_t ctrl_type = 0;
-                if (vendor_id == BUSLOGIC_VENDOR_ID && device_id == BUSLOGIC_DEVICE_ID) {
-                    ctrl_type = SCSI_CONTROLLER_BUSLOGIC;
-                    serial_write("  Type: BusLogic BT-958\n");
-                    
-                    if (buslogic_init(io_base)) {
-                        if (controller_count < SCSI_MAX_CONTROLLERS) {
-                            controllers[controller_count].type = ctrl_type;
-                            controllers[controller_count].io_base = io_base;
-                            controllers[controller_count].mmio_base = 0;
-                            controllers[controller_count].irq = pci_read_config_byte(bus, slot, 0, 0x3C);
-                            controllers[controller_count].device_count = 0;
-                            controller_count++;
-                        }
-                    }
-                } else if (vendor_id == LSI_VENDOR_ID) {
-                    if (device_id == LSI_53C895A_DEVICE_ID || device_id == LSI_53C1030_DEVICE_ID) {
-                        ctrl_type = SCSI_CONTROLLER_LSI_LOGIC;
-                        serial_write("  Type: LSI Logic\n");
-                        serial_write("  Note: LSI Logic not yet fully supported\n");
-                    }
+                ctrl->type = SCSI_CONTROLLER_LSI_LOGIC;
+                ctrl->io_base = io_base;
+                ctrl->mmio_base = ram;
+                ctrl->irq = pci->irq;
+                ctrl->device_count = 0;
+                
+                if (lsi_init(controller_count, io_base, ram)) {
+                    if (ctrl->irq > 0 && ctrl->irq < IRQ_LINES)
+                        irq_install_handler(ctrl->irq, scsi_irq_handler);
+                    controller_count++;
                 }
             }
+        } else if (pci->vendor_id == LSI_VENDOR_ID && pci->device_id == LSI_53C1030_DEVICE_ID) {
+            serial_write("  Type: LSI Logic 53C1030\n");
+            serial_write("  Note: Fusion-MPT controllers are not supported\n");
         }
+    }
+    
+    virtio_device_t vdevs[SCSI_MAX_CONTROLLERS];
+    int vcount = virtio_pci_find(VIRTIO_ID_SCSI, vdevs, SCSI_MAX_CONTROLLERS);
+    for (int i = 0; i < vcount && controller_count < SCSI_MAX_CONTROLLERS; i++) {
+        scsi_controller_t* ctrl = &controllers[controller_count];
         
-        // Optimize: skip buses without devices
-        if (bus == 0 && controller_count == 0) {
-            // Check a few more buses before giving up
-            if (bus > 3) break;
+        ctrl->type = SCSI_CONTROLLER_VIRTIO;
+        ctrl->io_base = 0;
+        ctrl->mmio_base = (uint32_t)vdevs[i].common_cfg;
+        ctrl->irq = vdevs[i].irq;
+        ctrl->device_count = 0;
+        
+        if (virtio_scsi_init(controller_count, &vdevs[i], ctrl)) {
+            if (ctrl->irq > 0 && ctrl->irq < IRQ_LINES)
+                irq_install_handler(ctrl->irq, scsi_irq_handler);
+            controller_count++;
         }
     }
     
@@ -266,6 +1414,421 @@ void init_scsi(void) {
     }
 }
 
+// Transfer limits of a disk. A buffer of n bytes spans at most
+// n / PAGE_SIZE + 1 pages, so one scatter-gather entry is kept spare for
+// buffers that do not start on a page boundary.
+static void scsi_set_limits(scsi_device_t* dev) {
+    scsi_controller_t* ctrl = &controllers[dev->controller_id];
+    
+    dev->max_blocks = 0;
+    if (dev->block_size >= 512 && dev->block_size <= PAGE_SIZE) {
+        dev->max_blocks = ((uint32_t)(ctrl->max_sg - 1) * PAGE_SIZE) / dev->block_size;
+        if (dev->max_blocks > 0xFFFF)
+            dev->max_blocks = 0xFFFF; // READ/WRITE (10) transfer length
+    }
+    
+    // Untagged commands are serialized by the target anyway
+    dev->queue_depth = dev->tagged ? ctrl->lun_depth : 1;
+}
+
+// Scatter list of a buffer: one entry per page fragment, with physically
+// adjacent fragments coalesced. Paging is off, so virtual addresses are
+// physical. Returns the entry count, or 0 if the list does not fit.
+static uint16_t scsi_build_sg(uint8_t* buffer, uint32_t length, scsi_sg_t* sg, uint16_t max) {
+    uint32_t addr = (uint32_t)buffer;
+    uint16_t n = 0;
+    
+    while (length > 0) {
+        uint32_t frag = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+        if (frag > length)
+            frag = length;
+        
+        if (n > 0 && sg[n - 1].addr + sg[n - 1].length == addr) {
+            sg[n - 1].length += frag;
+        } else {
+            if (n == max)
+                return 0;
+            sg[n].addr = addr;
+            sg[n].length = frag;
+            n++;
+        }
+        
+        addr += frag;
+        length -= frag;
+    }
+    
+    return n;
+}
+
+// Address a request at a disk
+static void scsi_build_request(scsi_request_t* req, scsi_device_t* dev, uint8_t direction, uint32_t length) {
+    memset(req->cdb, 0, sizeof(req->cdb));
+    req->controller = dev->controller_id;
+    req->target = dev->target;
+    req->lun = dev->lun;
+    req->direction = direction;
+    req->tagged = dev->tagged;
+    req->length = length;
+    req->buffer = NULL;
+    req->sg = NULL;
+    req->nsg = 0;
+}
+
+// READ/WRITE request: the 10-byte CDB while LBA and length fit, the
+// 16-byte one beyond 2^32 blocks. Returns 0 if the controller cannot
+// take the CDB needed.
+static int scsi_build_rw(scsi_request_t* req, scsi_device_t* dev, int write, uint64_t lba, uint32_t count) {
+    scsi_build_request(req, dev, write ? SCSI_DIR_OUT : SCSI_DIR_IN, count * dev->block_size);
+    
+    if (lba + count <= 0x100000000ULL && count <= 0xFFFF) {
+        req->cdb[0] = write ? SCSI_CMD_WRITE_10 : SCSI_CMD_READ_10;
+        req->cdb[2] = (uint8_t)(lba >> 24);
+        req->cdb[3] = (uint8_t)(lba >> 16);
+        req->cdb[4] = (uint8_t)(lba >> 8);
+        req->cdb[5] = (uint8_t)lba;
+        req->cdb[7] = (uint8_t)(count >> 8);
+        req->cdb[8] = (uint8_t)count;
+        req->cdb_length = 10;
+    } else {
+        req->cdb[0] = write ? SCSI_CMD_WRITE_16 : SCSI_CMD_READ_16;
+        for (int i = 0; i < 8; i++)
+            req->cdb[2 + i] = (uint8_t)(lba >> (56 - 8 * i));
+        req->cdb[10] = (uint8_t)(count >> 24);
+        req->cdb[11] = (uint8_t)(count >> 16);
+        req->cdb[12] = (uint8_t)(count >> 8);
+        req->cdb[13] = (uint8_t)count;
+        req->cdb_length = 16;
+    }
+    
+    return req->cdb_length <= controllers[dev->controller_id].max_cdb;
+}
+
+// SYNCHRONIZE CACHE request covering the whole disk
+static void scsi_build_sync(scsi_request_t* req, scsi_device_t* dev) {
+    scsi_build_request(req, dev, SCSI_DIR_NONE, 0);
+    req->cdb[0] = SCSI_CMD_SYNC_CACHE_10;
+    req->cdb_length = 10;
+}
+
+// Block layer glue. Scatter lists are passed to the adapter as they are,
+// so merged requests need no bounce buffer.
+static scsi_request_t blk_native[BLK_REQUEST_POOL];
+static scsi_sg_t blk_sg[BLK_REQUEST_POOL][BLK_MAX_SEGMENTS];
+
+static void scsi_blk_complete(scsi_request_t* req) {
+    blk_end_request((blk_request_t*)req->private_data, req->status != SCSI_REQ_DONE);
+}
+
+static void scsi_blk_submit(blkdev_t* bdev, blk_request_t* req) {
+    scsi_device_t* dev = &scsi_devices[(uintptr_t)bdev->driver_data];
+    scsi_request_t* native = &blk_native[req->tag];
+    
+    if (req->op == BIO_FLUSH) {
+        scsi_build_sync(native, dev);
+    } else {
+        if (!scsi_build_rw(native, dev, req->op == BIO_WRITE, req->sector, req->count)) {
+            blk_end_request(req, 1);
+            return;
+        }
+        for (uint32_t i = 0; i < req->nsg; i++) {
+            blk_sg[req->tag][i].addr = req->sg[i].addr;
+            blk_sg[req->tag][i].length = req->sg[i].length;
+        }
+        native->sg = blk_sg[req->tag];
+        native->nsg = (uint16_t)req->nsg;
+    }
+    native->complete = scsi_blk_complete;
+    native->private_data = req;
+    
+    scsi_submit(native);
+}
+
+// A block layer waiter saw no progress for BLK_TIMEOUT_MS: recover the
+// disk's requests that have been outstanding for SCSI_TIMEOUT_MS
+static void scsi_blk_timeout(blkdev_t* bdev) {
+    for (int tag = 0; tag < BLK_REQUEST_POOL; tag++) {
+        scsi_request_t* native = &blk_native[tag];
+        
+        if (native->status != SCSI_REQ_QUEUED && native->status != SCSI_REQ_ACTIVE)
+            continue;
+        if (((blk_request_t*)native->private_data)->dev != bdev ||
+            timer_ticks() - native->submitted < SCSI_TIMEOUT_MS)
+            continue;
+        scsi_request_timeout(native);
+    }
+}
+
+static const blkdev_ops_t scsi_blk_ops = {
+    scsi_blk_submit,
+    NULL,                       // Each CCB is started as it is queued
+    NULL,
+    scsi_blk_timeout,
+};
+
+// Register the disks with the block layer as scsi0, scsi1, ...
+static void scsi_blk_register(void) {
+    for (int i = 0; i < device_count; i++) {
+        scsi_device_t* dev = &scsi_devices[i];
+        
+        if (dev->type != SCSI_TYPE_DISK || dev->block_count == 0 || dev->max_blocks == 0)
+            continue;
+        
+        // Paravirtual disks are backed by host storage with no seek cost
+        uint32_t flags = BLKDEV_ROTATIONAL;
+        if (controllers[dev->controller_id].type == SCSI_CONTROLLER_VIRTIO)
+            flags = 0;
+        
+        blkdev_t* bdev = blk_register("scsi", &scsi_blk_ops, (void*)(uintptr_t)i,
+                                      dev->block_size, dev->block_count, flags);
+        if (!bdev)
+            return;
+        
+        bdev->max_sectors = dev->max_blocks;
+        bdev->max_segments = controllers[dev->controller_id].max_sg;
+        bdev->queue_depth = dev->queue_depth;
+    }
+}
+
+// INQUIRY data of a LUN that is present and supported: peripheral
+// qualifier 0 and a known device type
+static int scsi_lun_present(const scsi_inquiry_t* inquiry) {
+    return (inquiry->peripheral_type >> 5) == 0 &&
+           (inquiry->peripheral_type & 0x1F) != 0x1F;
+}
+
+// Add a LUN found by the scan to the device table and size it
+static void scsi_add_device(uint8_t ctrl, uint8_t target, uint8_t lun, const scsi_inquiry_t* inquiry) {
+    if (device_count >= SCSI_MAX_DEVICES)
+        return;
+    
+    scsi_device_t* dev = &scsi_devices[device_count];
+    
+    memset(dev, 0, sizeof(scsi_device_t));
+    dev->controller_id = ctrl;
+    dev->target = target;
+    dev->lun = lun;
+    dev->type = inquiry->peripheral_type & 0x1F;
+    dev->tagged = (inquiry->flags3 & 0x02) ? 1 : 0; // CmdQue
+    
+    scsi_string_copy(dev->vendor, (char*)inquiry->vendor, 8);
+    scsi_string_copy(dev->product, (char*)inquiry->product, 16);
+    scsi_string_copy(dev->revision, (char*)inquiry->revision, 4);
+    
+    // Get capacity for disk devices
+    if (dev->type == SCSI_TYPE_DISK) {
+        scsi_capacity_t capacity;
+        if (scsi_read_capacity(ctrl, target, lun, &capacity)) {
+            dev->block_count = (uint64_t)swap32(capacity.last_lba) + 1;
+            dev->block_size = swap32(capacity.block_size);
+        }
+        
+        // Last LBA saturated: the disk is larger than READ CAPACITY (10) can say
+        scsi_capacity16_t capacity16;
+        if (dev->block_count == 0x100000000ULL &&
+            controllers[ctrl].max_cdb >= 16 &&
+            scsi_read_capacity16(ctrl, target, lun, &capacity16)) {
+            dev->block_count = (((uint64_t)swap32(capacity16.last_lba_high) << 32) |
+                                swap32(capacity16.last_lba_low)) + 1;
+            dev->block_size = swap32(capacity16.block_size);
+        }
+        scsi_set_limits(dev);
+    }
+    
+    device_count++;
+    controllers[ctrl].device_count++;
+    
+    char num_str[4];
+    serial_write("  Found device at target ");
+    format_number(target, num_str);
+    serial_write(num_str);
+    if (lun != 0) {
+        serial_write(" LUN ");
+        format_number(lun, num_str);
+        serial_write(num_str);
+    }
+    serial_write(": ");
+    serial_write(dev->vendor);
+    serial_write(" ");
+    serial_write(dev->product);
+    serial_write("\n");
+}
+
+// One LUN being probed, and the buffers its scan commands use
+typedef struct {
+    uint8_t target;
+    uint8_t lun;
+    uint8_t answered;           // INQUIRY succeeded
+    scsi_request_t req;
+    scsi_inquiry_t inquiry;
+} scsi_probe_t;
+
+static scsi_probe_t scan_probe[SCSI_SCAN_PROBES];
+static scsi_request_t scan_report[SCSI_MAX_TARGETS];
+static uint8_t scan_luns[SCSI_MAX_TARGETS][8 + SCSI_SCAN_LUNS * 8];  // REPORT LUNS data
+
+static void scsi_prepare_scan(scsi_request_t* req, uint8_t ctrl, uint8_t target, uint8_t lun,
+                              void* buffer, uint32_t length) {
+    memset(req, 0, sizeof(scsi_request_t));
+    req->controller = ctrl;
+    req->target = target;
+    req->lun = lun;
+    req->direction = SCSI_DIR_IN;
+    req->buffer = (uint8_t*)buffer;
+    req->length = length;
+    memset(buffer, 0, length);
+}
+
+// Put every request of a batch in flight before waiting for any, so the
+// selection timeouts of absent targets overlap. The batch shares one
+// deadline: when it passes, every request still outstanding is recovered
+// at once.
+static void scsi_run_batch(scsi_request_t** reqs, int count) {
+    for (int i = 0; i < count; i++)
+        scsi_submit(reqs[i]);
+    
+    uint32_t start = timer_ticks();
+    uint32_t flags = irq_save();
+    
+    for (;;) {
+        int pending = 0;
+        for (int i = 0; i < count; i++) {
+            if (reqs[i]->status == SCSI_REQ_QUEUED || reqs[i]->status == SCSI_REQ_ACTIVE)
+                pending = 1;
+        }
+        if (!pending)
+            break;
+        
+        if (timer_ticks() - start >= SCSI_SCAN_TIMEOUT_MS) {
+            for (int i = 0; i < count; i++) {
+                if (reqs[i]->status == SCSI_REQ_QUEUED || reqs[i]->status == SCSI_REQ_ACTIVE)
+                    scsi_request_timeout(reqs[i]);
+            }
+            start = timer_ticks();
+            continue;
+        }
+        irq_wait();
+    }
+    
+    irq_restore(flags);
+}
+
+// INQUIRY every probe from `first` on; each probe's answered flag is set
+static void scsi_inquire_batch(uint8_t ctrl, int first, int count) {
+    scsi_request_t* reqs[SCSI_SCAN_PROBES];
+    int n = 0;
+    
+    for (int i = first; i < count; i++) {
+        scsi_probe_t* probe = &scan_probe[i];
+        scsi_prepare_scan(&probe->req, ctrl, probe->target, probe->lun,
+                          &probe->inquiry, sizeof(scsi_inquiry_t));
+        probe->req.cdb[0] = SCSI_CMD_INQUIRY;
+        probe->req.cdb[1] = SCSI_CDB_LUN(probe->lun);
+        probe->req.cdb[4] = sizeof(scsi_inquiry_t);
+        probe->req.cdb_length = 6;
+        reqs[n++] = &probe->req;
+    }
+    scsi_run_batch(reqs, n);
+    
+    for (int i = first; i < count; i++) {
+        scsi_probe_t* probe = &scan_probe[i];
+        probe->answered = probe->req.status == SCSI_REQ_DONE;
+        
+        // CHECK CONDITION means the target is there; INQUIRY does not
+        // report unit attentions, so retry once on its own
+        if (!probe->answered && probe->req.target_status == SCSI_STATUS_CHECK_CONDITION)
+            probe->answered = scsi_inquiry(ctrl, probe->target, probe->lun, &probe->inquiry);
+    }
+}
+
+// Scan one controller in three batches: INQUIRY of LUN 0 on every target,
+// REPORT LUNS on the targets that answered, then INQUIRY of the other
+// LUNs they list. Targets without REPORT LUNS (SCSI-2) get LUN 0 only.
+static void scsi_scan_controller(uint8_t ctrl) {
+    scsi_controller_t* c = &controllers[ctrl];
+    scsi_request_t* reqs[SCSI_MAX_TARGETS];
+    uint8_t report_target[SCSI_MAX_TARGETS];
+    int nprobes = 0;
+    int nreports = 0;
+    
+    for (uint8_t target = 0; target < SCSI_MAX_TARGETS; target++) {
+        if (target == c->host_id)
+            continue;
+        scan_probe[nprobes].target = target;
+        scan_probe[nprobes].lun = 0;
+        nprobes++;
+    }
+    scsi_inquire_batch(ctrl, 0, nprobes);
+    
+    // Any answer from LUN 0, even "no device here", means the target exists
+    for (int i = 0; i < nprobes; i++) {
+        if (!scan_probe[i].answered || c->max_lun == 0)
+            continue;
+        
+        uint8_t target = scan_probe[i].target;
+        scsi_request_t* req = &scan_report[nreports];
+        scsi_prepare_scan(req, ctrl, target, 0, scan_luns[nreports], sizeof(scan_luns[0]));
+        req->cdb[0] = SCSI_CMD_REPORT_LUNS;
+        req->cdb[8] = (uint8_t)(sizeof(scan_luns[0]) >> 8);  // Allocation length
+        req->cdb[9] = (uint8_t)sizeof(scan_luns[0]);
+        req->cdb_length = 12;
+        report_target[nreports] = target;
+        reqs[nreports++] = req;
+    }
+    scsi_run_batch(reqs, nreports);
+    
+    // Probe list in target, then LUN, order: LUN 0 of a target from the
+    // first batch, followed by the LUNs it reported
+    int first_lun = nprobes;
+    int count = nprobes;
+    for (int r = 0; r < nreports; r++) {
+        scsi_request_t* req = reqs[r];
+        if (req->status != SCSI_REQ_DONE)
+            continue;
+        
+        const uint8_t* data = scan_luns[r];
+        uint32_t entries = (((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+                            ((uint32_t)data[2] << 8) | data[3]) / 8;
+        if (entries > SCSI_SCAN_LUNS)
+            entries = SCSI_SCAN_LUNS;
+        
+        for (uint32_t e = 0; e < entries && count < SCSI_SCAN_PROBES; e++) {
+            const uint8_t* entry = data + 8 + e * 8;
+            uint16_t lun;
+            
+            // Single-level LUNs only: peripheral (bus 0) or flat space
+            if (entry[2] != 0 || entry[3] != 0)
+                continue;
+            if (entry[0] == 0)
+                lun = entry[1];
+            else if ((entry[0] >> 6) == 1)
+                lun = ((uint16_t)(entry[0] & 0x3F) << 8) | entry[1];
+            else
+                continue;
+            if (lun == 0 || lun > c->max_lun)
+                continue;
+            
+            scan_probe[count].target = report_target[r];
+            scan_probe[count].lun = (uint8_t)lun;
+            count++;
+        }
+    }
+    if (count > first_lun)
+        scsi_inquire_batch(ctrl, first_lun, count);
+    
+    for (int i = 0; i < nprobes; i++) {
+        scsi_probe_t* probe = &scan_probe[i];
+        if (probe->answered && scsi_lun_present(&probe->inquiry))
+            scsi_add_device(ctrl, probe->target, 0, &probe->inquiry);
+        
+        for (int j = first_lun; j < count; j++) {
+            scsi_probe_t* other = &scan_probe[j];
+            if (other->target == probe->target && other->answered &&
+                scsi_lun_present(&other->inquiry))
+                scsi_add_device(ctrl, other->target, other->lun, &other->inquiry);
+        }
+    }
+}
+
 // Scan for SCSI devices on all controllers
 void scsi_scan_devices(void) {
     serial_write("Scanning for SCSI devices...\n");
@@ -278,66 +1841,16 @@ void scsi_scan_devices(void) {
         serial_write(ctrl_str);
         serial_write("\n");
         
-        // Scan all possible targets (0-15)
-        for (uint8_t target = 0; target < 8; target++) {
-            for (uint8_t lun = 0; lun < 1; lun++) { // Usually just LUN 0
-                scsi_inquiry_t inquiry;
-                
-                if (scsi_inquiry(ctrl, target, lun, &inquiry)) {
-                    if (inquiry.peripheral_type != SCSI_TYPE_NO_DEVICE &&
-                        inquiry.peripheral_type != 0x7F) {
-                        
-                        // Found a device!
-                        if (device_count < SCSI_MAX_DEVICES) {
-                            scsi_device_t* dev = &scsi_devices[device_count];
-                            
-                            dev->controller_id = ctrl;
-                            dev->target = target;
-                            dev->lun = lun;
-                            dev->type = inquiry.peripheral_type;
-                            
-                            scsi_string_copy(dev->vendor, (char*)inquiry.vendor, 8);
-                            scsi_string_copy(dev->product, (char*)inquiry.product, 16);
-                            scsi_string_copy(dev->revision, (char*)inquiry.revision, 4);
-                            
-                            // Get capacity for disk devices
-                            if (inquiry.peripheral_type == SCSI_TYPE_DISK) {
-                                scsi_capacity_t capacity;
-                                if (scsi_read_capacity(ctrl, target, lun, &capacity)) {
-                                    dev->block_count = swap32(capacity.last_lba) + 1;
-                                    dev->block_size = swap32(capacity.block_size);
-                                }
-                            } else {
-                                dev->block_count = 0;
-                                dev->block_size = 0;
-                            }
-                            
-                            device_count++;
-                            controllers[ctrl].device_count++;
-                            
-                            serial_write("  Found device at target ");
-                            char target_str[4];
-                            target_str[0] = '0' + target;
-                            target_str[1] = '\0';
-                            serial_write(target_str);
-                            serial_write(": ");
-                            serial_write(dev->vendor);
-                            serial_write(" ");
-                            serial_write(dev->product);
-                            serial_write("\n");
-                        }
-                    }
-                }
-            }
-        }
+        scsi_scan_controller(ctrl);
     }
     
     serial_write("SCSI device scan complete. Found ");
     char count_str[4];
-    count_str[0] = '0' + device_count;
-    count_str[1] = '\0';
+    format_number(device_count, count_str);
     serial_write(count_str);
     serial_write(" device(s)\n");
+    
+    scsi_blk_register();
 }
 
 // Print detected SCSI devices
@@ -356,7 +1869,9 @@ void scsi_print_devices(void) {
         terminal_writestring("Device ");
         terminal_putchar('0' + i);
         terminal_writestring(": Target ");
-        terminal_putchar('0' + dev->target);
+        char target_str[4];
+        format_number(dev->target, target_str);
+        terminal_writestring(target_str);
         terminal_writestring(" - ");
         
         // Device type
@@ -399,7 +1914,7 @@ void scsi_print_devices(void) {
         
         // Size for disks
         if (dev->type == SCSI_TYPE_DISK && dev->block_count > 0) {
-            uint32_t size_mb = (dev->block_count * dev->block_size) / (1024 * 1024);
+            uint32_t size_mb = (uint32_t)((dev->block_count * dev->block_size) >> 20);
             
             terminal_writestring("  Size: ");
             char size_str[16];
@@ -425,7 +1940,7 @@ void scsi_print_devices(void) {
             terminal_writestring(" MB (");
             
             // Block count
-            temp = dev->block_count;
+            temp = (uint32_t)dev->block_count;
             pos = 0;
             if (temp == 0) {
                 size_str[pos++] = '0';
@@ -481,47 +1996,93 @@ scsi_device_t* scsi_get_device(int index) {
     return &scsi_devices[index];
 }
 
-// Read a single sector (simplified - would need CCB implementation)
-uint8_t scsi_read_sector(uint8_t device_id, uint32_t lba, uint8_t* buffer) {
-    if (device_id >= device_count) {
-        return 1; // Error
+// Read or write a buffer in chunks of the disk's largest transfer. Each
+// chunk's scatter list is built from the buffer's page fragments, so the
+// adapter transfers straight to and from it. Up to SCSI_RW_BATCH chunks
+// are in flight at once.
+#define SCSI_RW_BATCH 4
+
+static int scsi_rw_blocks(uint8_t device_id, int write, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    static scsi_request_t reqs[SCSI_RW_BATCH];
+    static scsi_sg_t sg[SCSI_RW_BATCH][SCSI_MAX_SEGMENTS];
+    
+    if (device_id >= device_count)
+        return -1;
+    
+    scsi_device_t* dev = &scsi_devices[device_id];
+    uint16_t max_sg = controllers[dev->controller_id].max_sg;
+    
+    if (dev->type != SCSI_TYPE_DISK || dev->max_blocks == 0 ||
+        lba + count > dev->block_count || max_sg > SCSI_MAX_SEGMENTS)
+        return -1;
+    
+    int error = 0;
+    while (count > 0 && !error) {
+        int n = 0;
+        
+        while (n < SCSI_RW_BATCH && count > 0) {
+            uint32_t chunk = (count < dev->max_blocks) ? count : dev->max_blocks;
+            scsi_request_t* req = &reqs[n];
+            
+            if (!scsi_build_rw(req, dev, write, lba, chunk)) {
+                error = 1;
+                break;
+            }
+            req->sg = sg[n];
+            req->nsg = scsi_build_sg(buffer, req->length, sg[n], max_sg);
+            if (req->nsg == 0) {
+                error = 1;
+                break;
+            }
+            req->complete = NULL;
+            req->private_data = NULL;
+            
+            scsi_submit(req);
+            n++;
+            lba += chunk;
+            count -= chunk;
+            buffer += req->length;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            if (scsi_wait(&reqs[i]))
+                error = 1;
+        }
     }
     
-    // This would need full CCB implementation
-    // For now, just return success
-    serial_write("SCSI read sector not yet fully implemented\n");
-    return 0; // Success (simulated)
+    return error ? -1 : 0;
 }
 
-// Write a single sector (simplified)
-uint8_t scsi_write_sector(uint8_t device_id, uint32_t lba, uint8_t* buffer) {
-    if (device_id >= device_count) {
-        return 1; // Error
-    }
-    
-    // This would need full CCB implementation
-    serial_write("SCSI write sector not yet fully implemented\n");
-    return 0; // Success (simulated)
+// Read a single block
+uint8_t scsi_read_sector(uint8_t device_id, uint64_t lba, uint8_t* buffer) {
+    return scsi_rw_blocks(device_id, 0, lba, 1, buffer) ? 1 : 0;
+}
+
+// Write a single block
+uint8_t scsi_write_sector(uint8_t device_id, uint64_t lba, uint8_t* buffer) {
+    return scsi_rw_blocks(device_id, 1, lba, 1, buffer) ? 1 : 0;
 }
 
 // Read multiple blocks
-int scsi_read_blocks(uint8_t device_id, uint32_t lba, uint16_t count, uint8_t* buffer) {
-    if (device_id >= device_count) {
-        return -1; // Error
-    }
-    
-    // Would iterate and read each block via scsi_read_sector
-    serial_write("SCSI read blocks not yet fully implemented\n");
-    return 0; // Success (simulated)
+int scsi_read_blocks(uint8_t device_id, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    return scsi_rw_blocks(device_id, 0, lba, count, buffer);
 }
 
 // Write multiple blocks
-int scsi_write_blocks(uint8_t device_id, uint32_t lba, uint16_t count, uint8_t* buffer) {
-    if (device_id >= device_count) {
-        return -1; // Error
-    }
+int scsi_write_blocks(uint8_t device_id, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    return scsi_rw_blocks(device_id, 1, lba, count, buffer);
+}
+
+// Flush the disk's write cache
+uint8_t scsi_sync_cache(uint8_t device_id) {
+    scsi_request_t req;
+    
+    if (device_id >= device_count)
+        return 1;
     
-    // Would iterate and write each block via scsi_write_sector
-    serial_write("SCSI write blocks not yet fully implemented\n");
-    return 0; // Success (simulated)
+    scsi_build_sync(&req, &scsi_devices[device_id]);
+    req.complete = NULL;
+    req.private_data = NULL;
+    scsi_submit(&req);
+    return scsi_wait(&req);
 }
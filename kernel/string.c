@@ -0,0 +1,57 @@
+#include "kernel.h"
+
+// Freestanding replacements for the C library memory routines. GCC may
+// also emit calls to these for structure copies and initialization.
+
+void* memset(void* dest, int value, size_t count) {
+    uint8_t* d = (uint8_t*)dest;
+    
+    asm volatile ("rep stosb" : "+D"(d), "+c"(count) : "a"(value) : "memory");
+    return dest;
+}
+
+void* memcpy(void* dest, const void* src, size_t count) {
+    void* d = dest;
+    
+    // Copy dwords, then the remaining bytes
+    size_t dwords = count >> 2;
+    size_t bytes = count & 3;
+    asm volatile ("rep movsl" : "+D"(d), "+S"(src), "+c"(dwords) : : "memory");
+    asm volatile ("rep movsb" : "+D"(d), "+S"(src), "+c"(bytes) : : "memory");
+    return dest;
+}
+
+int memcmp(const void* a, const void* b, size_t count) {
+    const uint8_t* p = (const uint8_t*)a;
+    const uint8_t* q = (const uint8_t*)b;
+    
+    for (size_t i = 0; i < count; i++) {
+        if (p[i] != q[i])
+            return p[i] - q[i];
+    }
+    return 0;
+}
+
+int strcmp(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+// Number to decimal string; str needs room for 11 bytes
+void format_number(uint32_t value, char* str) {
+    char digits[16];
+    int d = 0;
+    int pos = 0;
+    
+    do {
+        digits[d++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0);
+    
+    while (d > 0)
+        str[pos++] = digits[--d];
+    str[pos] = '\0';
+}
@@ -0,0 +1,89 @@
+#include "timer.h"
+#include "irq.h"
+#include "kernel.h"
+
+static volatile uint32_t ticks = 0;
+static uint32_t cycles_per_us = 0;      // TSC rate; 0 without a TSC
+
+static void timer_irq_handler(uint8_t irq) {
+    (void)irq;
+    ticks++;
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Measure the TSC against a 10 ms one-shot on PIT channel 2, which runs
+// without interrupts
+static void timer_calibrate_tsc(void) {
+    uint32_t eax, ebx, ecx, edx;
+    uint16_t count = PIT_BASE_FREQUENCY / 100;
+    
+    asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+    if (!(edx & (1 << 4)))
+        return;
+    
+    outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);  // Gate on, speaker off
+    outb(PIT_COMMAND, 0xB0);                         // Channel 2, lobyte/hibyte, mode 0
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, (count >> 8) & 0xFF);
+    
+    // 10 ms is about 10000 port reads; if the output never rises, leave
+    // cycles_per_us at 0 so intervals fall back to millisecond ticks
+    uint64_t start = rdtsc();
+    uint32_t polls = 0;
+    while (!(inb(PIT_GATE) & 0x20)) {
+        if (++polls >= PIT_CALIBRATE_POLLS) {
+            serial_write("TSC calibration failed, using millisecond ticks\n");
+            return;
+        }
+    }
+    uint32_t elapsed = (uint32_t)(rdtsc() - start);
+    
+    cycles_per_us = elapsed / 10000;
+}
+
+void init_timer(void) {
+    uint16_t divisor = PIT_BASE_FREQUENCY / TIMER_HZ;
+    
+    // Channel 0, lobyte/hibyte, mode 3 (square wave)
+    outb(PIT_COMMAND, 0x36);
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+    
+    irq_install_handler(IRQ_TIMER, timer_irq_handler);
+    serial_write("PIT timer running at 1000 Hz\n");
+    
+    timer_calibrate_tsc();
+}
+
+// Milliseconds since init_timer()
+uint32_t timer_ticks(void) {
+    return ticks;
+}
+
+// Sleep with the CPU halted between ticks
+void timer_sleep(uint32_t ms) {
+    uint32_t start = ticks;
+    uint32_t flags = irq_save();
+    
+    while (ticks - start < ms)
+        irq_wait();
+    
+    irq_restore(flags);
+}
+
+// Low 32 bits of the TSC, for timing intervals shorter than 2^32 cycles
+// (about a second). Always 0 without a TSC.
+uint32_t timer_cycles(void) {
+    if (!cycles_per_us)
+        return 0;
+    return (uint32_t)rdtsc();
+}
+
+uint32_t timer_cycles_to_us(uint32_t cycles) {
+    return cycles_per_us ? cycles / cycles_per_us : 0;
+}
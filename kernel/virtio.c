@@ -0,0 +1,407 @@
+#include "virtio.h"
+#include "kernel.h"
+
+// Full memory barrier. x86 only reorders stores after later loads, which
+// matters when checking the device's event index after publishing a ring
+// index; a locked instruction orders both and works on any i386.
+static inline void virtio_mb(void) {
+    asm volatile ("lock; addl $0, 0(%%esp)" : : : "memory");
+}
+
+// Compiler barrier: x86 keeps stores ordered with stores and loads with loads
+static inline void virtio_barrier(void) {
+    asm volatile ("" : : : "memory");
+}
+
+// Event index fields trail the rings (VIRTIO_F_EVENT_IDX)
+static inline volatile uint16_t* virtq_used_event(virtqueue_t* vq) {
+    return (volatile uint16_t*)((uint8_t*)vq->avail + 4 + 2 * vq->size);
+}
+
+static inline volatile uint16_t* virtq_avail_event(virtqueue_t* vq) {
+    return (volatile uint16_t*)((uint8_t*)vq->used + 4 + sizeof(virtq_used_elem_t) * vq->size);
+}
+
+// Read a field of the capability at `ptr`
+static uint32_t virtio_cap_read(virtio_device_t* dev, uint8_t ptr, uint8_t offset) {
+    return pci_config_read32(dev->pci->bus, dev->pci->slot, dev->pci->func, ptr + offset);
+}
+
+// Map the configuration structures described by the vendor-specific
+// capabilities; the structures must sit in memory BARs below 4GB
+static int virtio_map_capabilities(virtio_device_t* dev) {
+    pci_device_t* pci = dev->pci;
+    
+    for (int i = 0; i < pci->ncaps; i++) {
+        if (pci->cap_id[i] != PCI_CAP_ID_VENDOR)
+            continue;
+        
+        uint8_t ptr = pci->cap_offset[i];
+        uint8_t type = virtio_cap_read(dev, ptr, 0) >> 24;
+        uint8_t bar = virtio_cap_read(dev, ptr, 4) & 0xFF;
+        uint32_t offset = virtio_cap_read(dev, ptr, 8);
+        uintptr_t base = pci_bar_memory(pci, bar);
+        
+        if (!base)
+            continue;
+        
+        switch (type) {
+            case VIRTIO_PCI_CAP_COMMON_CFG:
+                if (!dev->common_cfg)
+                    dev->common_cfg = base + offset;
+                break;
+            case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                if (!dev->notify_base) {
+                    dev->notify_base = base + offset;
+                    dev->notify_mult = virtio_cap_read(dev, ptr, 16);
+                }
+                break;
+            case VIRTIO_PCI_CAP_ISR_CFG:
+                if (!dev->isr_cfg)
+                    dev->isr_cfg = base + offset;
+                break;
+            case VIRTIO_PCI_CAP_DEVICE_CFG:
+                if (!dev->device_cfg)
+                    dev->device_cfg = base + offset;
+                break;
+        }
+    }
+    
+    return dev->common_cfg && dev->notify_base && dev->isr_cfg;
+}
+
+// Find virtio PCI functions of the given type and map their configuration
+// structures. Returns the number found.
+int virtio_pci_find(uint16_t virtio_id, virtio_device_t* devs, int max) {
+    pci_device_t* pci = NULL;
+    int count = 0;
+    
+    while (count < max && (pci = pci_find_id(VIRTIO_PCI_VENDOR, PCI_ANY_ID, pci)) != NULL) {
+        // Modern ids encode the type; transitional ids carry it in the
+        // subsystem id
+        if (pci->device_id != VIRTIO_PCI_MODERN_BASE + virtio_id &&
+            !(pci->device_id >= VIRTIO_PCI_LEGACY_BASE && pci->device_id < VIRTIO_PCI_MODERN_BASE &&
+              pci->subsystem_id == virtio_id))
+            continue;
+        
+        virtio_device_t* dev = &devs[count];
+        memset(dev, 0, sizeof(virtio_device_t));
+        dev->pci = pci;
+        dev->device_id = virtio_id;
+        dev->irq = pci->irq;
+        
+        if (!virtio_map_capabilities(dev)) {
+            serial_write("  virtio device without modern interface, skipping\n");
+            continue;
+        }
+        
+        pci_enable_device(pci, PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+        count++;
+    }
+    
+    return count;
+}
+
+// Reset the device and negotiate features. Only features in the wanted
+// masks are accepted; VIRTIO_F_VERSION_1 is required.
+int virtio_negotiate(virtio_device_t* dev, uint32_t wanted_lo, uint32_t wanted_hi) {
+    uintptr_t common = dev->common_cfg;
+    
+    mmio_write8(common + VIRTIO_COMMON_STATUS, 0);
+    while (mmio_read8(common + VIRTIO_COMMON_STATUS) != 0)
+        ;
+    
+    mmio_write8(common + VIRTIO_COMMON_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    mmio_write8(common + VIRTIO_COMMON_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    
+    mmio_write32(common + VIRTIO_COMMON_DFSELECT, 0);
+    uint32_t offered_lo = mmio_read32(common + VIRTIO_COMMON_DF);
+    mmio_write32(common + VIRTIO_COMMON_DFSELECT, 1);
+    uint32_t offered_hi = mmio_read32(common + VIRTIO_COMMON_DF);
+    
+    dev->features[0] = offered_lo & wanted_lo;
+    dev->features[1] = offered_hi & (wanted_hi | (1u << (VIRTIO_F_VERSION_1 - 32)));
+    if (!(dev->features[1] & (1u << (VIRTIO_F_VERSION_1 - 32)))) {
+        mmio_write8(common + VIRTIO_COMMON_STATUS, VIRTIO_STATUS_FAILED);
+        return 0;
+    }
+    
+    mmio_write32(common + VIRTIO_COMMON_GFSELECT, 0);
+    mmio_write32(common + VIRTIO_COMMON_GF, dev->features[0]);
+    mmio_write32(common + VIRTIO_COMMON_GFSELECT, 1);
+    mmio_write32(common + VIRTIO_COMMON_GF, dev->features[1]);
+    
+    uint8_t status = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK;
+    mmio_write8(common + VIRTIO_COMMON_STATUS, status);
+    if (!(mmio_read8(common + VIRTIO_COMMON_STATUS) & VIRTIO_STATUS_FEATURES_OK)) {
+        mmio_write8(common + VIRTIO_COMMON_STATUS, VIRTIO_STATUS_FAILED);
+        return 0;
+    }
+    
+    return 1;
+}
+
+// Tell the device the driver is set up; queues become live
+void virtio_driver_ok(virtio_device_t* dev) {
+    uint8_t status = mmio_read8(dev->common_cfg + VIRTIO_COMMON_STATUS);
+    mmio_write8(dev->common_cfg + VIRTIO_COMMON_STATUS, status | VIRTIO_STATUS_DRIVER_OK);
+}
+
+int virtio_has_feature(virtio_device_t* dev, uint32_t bit) {
+    return (dev->features[bit >> 5] >> (bit & 31)) & 1;
+}
+
+// Reading the ISR status acknowledges the interrupt and deasserts INTx
+uint8_t virtio_read_isr(virtio_device_t* dev) {
+    return mmio_read8(dev->isr_cfg);
+}
+
+uint16_t virtio_num_queues(virtio_device_t* dev) {
+    return mmio_read16(dev->common_cfg + VIRTIO_COMMON_NUMQ);
+}
+
+// Allocate and enable a split virtqueue
+int virtq_init(virtio_device_t* dev, virtqueue_t* vq, uint16_t index) {
+    uintptr_t common = dev->common_cfg;
+    
+    mmio_write16(common + VIRTIO_COMMON_Q_SELECT, index);
+    uint16_t size = mmio_read16(common + VIRTIO_COMMON_Q_SIZE);
+    if (size == 0)
+        return 0;
+    if (size > VIRTIO_QUEUE_MAX)
+        size = VIRTIO_QUEUE_MAX;
+    
+    vq->dev = dev;
+    vq->index = index;
+    vq->size = size;
+    vq->indirect = virtio_has_feature(dev, VIRTIO_F_INDIRECT_DESC);
+    vq->event_idx = virtio_has_feature(dev, VIRTIO_F_EVENT_IDX);
+    
+    vq->desc = (virtq_desc_t*)kmalloc_aligned(sizeof(virtq_desc_t) * size, 16);
+    vq->avail = (virtq_avail_t*)kmalloc_aligned(6 + 2 * size, 4);
+    vq->used = (virtq_used_t*)kmalloc_aligned(6 + sizeof(virtq_used_elem_t) * size, 4);
+    if (!vq->desc || !vq->avail || !vq->used)
+        return 0;
+    
+    memset(vq->desc, 0, sizeof(virtq_desc_t) * size);
+    memset(vq->avail, 0, 6 + 2 * size);
+    memset(vq->used, 0, 6 + sizeof(virtq_used_elem_t) * size);
+    
+    // One indirect table per ring slot, indexed by head descriptor
+    vq->indirect_tables = NULL;
+    if (vq->indirect) {
+        vq->indirect_tables = (virtq_desc_t*)kmalloc_aligned(
+            sizeof(virtq_desc_t) * VIRTIO_MAX_INDIRECT * size, 16);
+        if (!vq->indirect_tables)
+            vq->indirect = 0;
+    }
+    
+    for (uint16_t i = 0; i < size; i++) {
+        vq->desc[i].next = i + 1;
+        vq->tokens[i] = NULL;
+    }
+    vq->free_head = 0;
+    vq->num_free = size;
+    vq->last_used = 0;
+    vq->kicked_idx = 0;
+    vq->vector = 0;
+    
+    mmio_write16(common + VIRTIO_COMMON_Q_SIZE, size);
+    mmio_write32(common + VIRTIO_COMMON_Q_DESCLO, (uint32_t)vq->desc);
+    mmio_write32(common + VIRTIO_COMMON_Q_DESCHI, 0);
+    mmio_write32(common + VIRTIO_COMMON_Q_AVAILLO, (uint32_t)vq->avail);
+    mmio_write32(common + VIRTIO_COMMON_Q_AVAILHI, 0);
+    mmio_write32(common + VIRTIO_COMMON_Q_USEDLO, (uint32_t)vq->used);
+    mmio_write32(common + VIRTIO_COMMON_Q_USEDHI, 0);
+    
+    uint16_t notify_off = mmio_read16(common + VIRTIO_COMMON_Q_NOFF);
+    vq->notify_addr = dev->notify_base + notify_off * dev->notify_mult;
+    
+    mmio_write16(common + VIRTIO_COMMON_Q_ENABLE, 1);
+    return 1;
+}
+
+// Add a buffer made of `out` device-readable segments followed by `in`
+// device-writable segments. Multi-segment buffers use one indirect table
+// so they occupy a single ring slot. The device is not notified until
+// virtq_kick(). Returns 0 if the ring is full.
+int virtq_add(virtqueue_t* vq, virtio_sg_t* sg, int out, int in, void* token) {
+    int total = out + in;
+    uint16_t head = vq->free_head;
+    
+    if (total == 0)
+        return 0;
+    
+    if (vq->indirect && total > 1 && total <= VIRTIO_MAX_INDIRECT) {
+        if (vq->num_free < 1)
+            return 0;
+        
+        virtq_desc_t* table = &vq->indirect_tables[head * VIRTIO_MAX_INDIRECT];
+        for (int i = 0; i < total; i++) {
+            table[i].addr = sg[i].addr;
+            table[i].len = sg[i].length;
+            table[i].flags = (i >= out) ? VIRTQ_DESC_F_WRITE : 0;
+            if (i < total - 1)
+                table[i].flags |= VIRTQ_DESC_F_NEXT;
+            table[i].next = i + 1;
+        }
+        
+        vq->desc[head].addr = (uint32_t)table;
+        vq->desc[head].len = total * sizeof(virtq_desc_t);
+        vq->desc[head].flags = VIRTQ_DESC_F_INDIRECT;
+        vq->free_head = vq->desc[head].next;
+        vq->num_free--;
+    } else {
+        if (vq->num_free < total)
+            return 0;
+        
+        // The free list is already chained through next, so the chain
+        // simply follows it
+        uint16_t idx = head;
+        for (int i = 0; i < total; i++) {
+            vq->desc[idx].addr = sg[i].addr;
+            vq->desc[idx].len = sg[i].length;
+            vq->desc[idx].flags = (i >= out) ? VIRTQ_DESC_F_WRITE : 0;
+            if (i < total - 1)
+                vq->desc[idx].flags |= VIRTQ_DESC_F_NEXT;
+            idx = vq->desc[idx].next;
+        }
+        vq->free_head = idx;
+        vq->num_free -= total;
+    }
+    
+    vq->tokens[head] = token;
+    vq->avail->ring[vq->avail->idx & (vq->size - 1)] = head;
+    virtio_barrier();
+    vq->avail->idx++;
+    return 1;
+}
+
+// Notify the device of everything added since the last kick. With
+// VIRTIO_F_EVENT_IDX the device says which index it wants to hear about,
+// so a burst of requests costs at most one notification (one VM exit).
+void virtq_kick(virtqueue_t* vq) {
+    uint16_t new_idx = vq->avail->idx;
+    uint16_t old_idx = vq->kicked_idx;
+    int notify;
+    
+    if (new_idx == old_idx)
+        return;
+    vq->kicked_idx = new_idx;
+    
+    virtio_mb();
+    
+    if (vq->event_idx) {
+        uint16_t avail_event = *virtq_avail_event(vq);
+        notify = (uint16_t)(new_idx - avail_event - 1) < (uint16_t)(new_idx - old_idx);
+    } else {
+        notify = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+    
+    if (notify)
+        mmio_write16(vq->notify_addr, vq->index);
+}
+
+// Reap one used buffer and return its token, or NULL if none is pending
+void* virtq_get(virtqueue_t* vq, uint32_t* len) {
+    if (vq->last_used == vq->used->idx) {
+        if (!vq->event_idx)
+            return NULL;
+        
+        // Re-arm the interrupt, then look again: the device may have
+        // added a buffer before it saw the new used_event, and x86 can
+        // order the load above the store without a full barrier
+        *virtq_used_event(vq) = vq->last_used;
+        virtio_mb();
+        if (vq->last_used == vq->used->idx)
+            return NULL;
+    }
+    virtio_barrier();
+    
+    virtq_used_elem_t* elem = &vq->used->ring[vq->last_used & (vq->size - 1)];
+    uint16_t head = elem->id;
+    void* token = vq->tokens[head];
+    
+    if (len)
+        *len = elem->len;
+    
+    // Return the chain to the free list
+    uint16_t tail = head;
+    uint16_t count = 1;
+    while (vq->desc[tail].flags & VIRTQ_DESC_F_NEXT) {
+        tail = vq->desc[tail].next;
+        count++;
+    }
+    vq->desc[tail].next = vq->free_head;
+    vq->free_head = head;
+    vq->num_free += count;
+    vq->tokens[head] = NULL;
+    
+    vq->last_used++;
+    
+    // Ask for an interrupt on the next completion only
+    if (vq->event_idx)
+        *virtq_used_event(vq) = vq->last_used;
+    
+    return token;
+}
+
+// Switch the function to MSI-X before its queues are given vectors. The
+// configuration change interrupt is left off. Returns 0 if the function
+// has no usable MSI-X table; the driver then stays on INTx.
+int virtio_msix_enable(virtio_device_t* dev) {
+    if (!pci_msix_init(&dev->msix, dev->pci))
+        return 0;
+    
+    pci_msix_enable(&dev->msix);
+    mmio_write16(dev->common_cfg + VIRTIO_COMMON_MSIX, VIRTIO_MSI_NO_VECTOR);
+    dev->msix_enabled = 1;
+    return 1;
+}
+
+void virtio_msix_disable(virtio_device_t* dev) {
+    if (!dev->msix_enabled)
+        return;
+    pci_msix_disable(&dev->msix);
+    dev->msix_enabled = 0;
+}
+
+// Give a virtqueue its own MSI-X entry (the queue index) and vector,
+// delivered to `cpu`. With MSI-X the ISR status is not used, so the
+// handler goes straight to the used ring. Returns 0 if the device refused
+// the entry.
+int virtq_set_vector(virtqueue_t* vq, msi_handler_t handler, void* data, uint8_t cpu) {
+    virtio_device_t* dev = vq->dev;
+    uintptr_t common = dev->common_cfg;
+    
+    if (!dev->msix_enabled || vq->index >= dev->msix.size)
+        return 0;
+    
+    int vector = msi_alloc_vector(handler, data);
+    if (vector < 0)
+        return 0;
+    
+    pci_msix_set_vector(&dev->msix, vq->index, (uint8_t)vector, cpu);
+    mmio_write16(common + VIRTIO_COMMON_Q_SELECT, vq->index);
+    mmio_write16(common + VIRTIO_COMMON_Q_MSIX, vq->index);
+    if (mmio_read16(common + VIRTIO_COMMON_Q_MSIX) != vq->index) {
+        msi_free_vector((uint8_t)vector);
+        return 0;
+    }
+    
+    vq->vector = (uint8_t)vector;
+    return 1;
+}
+
+// Detach a virtqueue from its vector, e.g. before falling back to INTx
+void virtq_clear_vector(virtqueue_t* vq) {
+    uintptr_t common = vq->dev->common_cfg;
+    
+    if (!vq->vector)
+        return;
+    
+    mmio_write16(common + VIRTIO_COMMON_Q_SELECT, vq->index);
+    mmio_write16(common + VIRTIO_COMMON_Q_MSIX, VIRTIO_MSI_NO_VECTOR);
+    msi_free_vector(vq->vector);
+    vq->vector = 0;
+}
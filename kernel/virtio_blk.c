@@ -0,0 +1,489 @@
+#include "virtio_blk.h"
+#include "blkdev.h"
+#include "irq.h"
+#include "timer.h"
+#include "kernel.h"
+
+// Virtqueue with the requests waiting for ring space
+typedef struct {
+    virtqueue_t vq;
+    virtio_blk_request_t* wait_head;
+    virtio_blk_request_t* wait_tail;
+    uint8_t port;               // Index into ports[]
+} virtio_blk_queue_t;
+
+// Per-function driver state
+typedef struct {
+    virtio_device_t pci;
+    virtio_blk_device_t info;
+    virtio_blk_queue_t queues[VIRTIO_BLK_MAX_CPUS];
+} virtio_blk_port_t;
+
+static virtio_blk_port_t ports[VIRTIO_BLK_MAX_DEVICES];
+static int device_count = 0;
+
+static void virtio_blk_register(void);
+
+// The virtqueue owned by the executing CPU. Each CPU submits to and
+// reaps its own queue, so only local interrupts need disabling.
+static virtio_blk_queue_t* virtio_blk_cpu_queue(virtio_blk_port_t* port) {
+    return &port->queues[0]; // Only the boot CPU runs HueOS
+}
+
+// Append data segments for [addr, addr + length), splitting at size_max
+static int virtio_blk_add_segment(virtio_blk_port_t* port, virtio_sg_t* sg, int n, uint32_t addr, uint32_t length) {
+    uint32_t limit = port->info.size_max;
+    
+    while (length > 0) {
+        if (n >= (int)port->info.seg_max)
+            return -1;
+        
+        uint32_t chunk = (limit && length > limit) ? limit : length;
+        sg[n].addr = addr;
+        sg[n].length = chunk;
+        n++;
+        addr += chunk;
+        length -= chunk;
+    }
+    
+    return n;
+}
+
+// Place a request on the ring without notifying the device. Returns 1 if
+// added, 0 if the ring is full and -1 if the request can never fit.
+static int virtio_blk_issue(virtio_blk_port_t* port, virtio_blk_queue_t* q, virtio_blk_request_t* req) {
+    virtio_sg_t sg[VIRTIO_MAX_INDIRECT];
+    int n = 0;
+    int data = 0;
+    
+    req->hdr.reserved = 0;
+    req->hdr.sector = req->lba;
+    req->result = 0xFF;
+    
+    sg[0].addr = (uint32_t)&req->hdr;
+    sg[0].length = sizeof(virtio_blk_outhdr_t);
+    
+    if (req->op == VIRTIO_BLK_OP_FLUSH) {
+        req->hdr.type = VIRTIO_BLK_T_FLUSH;
+        req->hdr.sector = 0;
+    } else {
+        req->hdr.type = (req->op == VIRTIO_BLK_OP_WRITE) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        
+        if (req->nsg == 0) {
+            data = virtio_blk_add_segment(port, sg + 1, 0, (uint32_t)req->buffer, req->count * 512);
+        } else {
+            for (uint32_t i = 0; i < req->nsg && data >= 0; i++)
+                data = virtio_blk_add_segment(port, sg + 1, data, req->sg[i].addr, req->sg[i].length);
+        }
+        if (data < 0)
+            return -1;
+    }
+    n = 1 + data;
+    
+    sg[n].addr = (uint32_t)&req->result;
+    sg[n].length = 1;
+    n++;
+    
+    if (!q->vq.indirect && n > q->vq.size)
+        return -1;
+    
+    // Reads: header out, data and status in; writes: header and data out
+    int out = (req->op == VIRTIO_BLK_OP_WRITE) ? 1 + data : 1;
+    if (!virtq_add(&q->vq, sg, out, n - out, req))
+        return 0;
+    
+    req->status = VIRTIO_BLK_REQ_ACTIVE;
+    return 1;
+}
+
+static void virtio_blk_finish(virtio_blk_request_t* req, uint8_t status) {
+    req->status = status;
+    if (req->complete)
+        req->complete(req);
+}
+
+// Move waiting requests onto the ring
+static void virtio_blk_issue_waiting(virtio_blk_port_t* port, virtio_blk_queue_t* q) {
+    while (q->wait_head) {
+        virtio_blk_request_t* req = q->wait_head;
+        int result = virtio_blk_issue(port, q, req);
+        
+        if (result == 0)
+            break;
+        
+        q->wait_head = req->next;
+        if (!q->wait_head)
+            q->wait_tail = NULL;
+        req->next = NULL;
+        
+        if (result < 0)
+            virtio_blk_finish(req, VIRTIO_BLK_REQ_ERROR);
+    }
+}
+
+// Reap completions, refill the ring and notify once for the refill
+static int virtio_blk_process_queue(virtio_blk_port_t* port, virtio_blk_queue_t* q) {
+    virtio_blk_request_t* req;
+    int reaped = 0;
+    
+    while ((req = (virtio_blk_request_t*)virtq_get(&q->vq, NULL)) != NULL) {
+        virtio_blk_finish(req, req->result == VIRTIO_BLK_S_OK ? VIRTIO_BLK_REQ_DONE
+                                                              : VIRTIO_BLK_REQ_ERROR);
+        reaped++;
+    }
+    
+    if (reaped && q->wait_head) {
+        virtio_blk_issue_waiting(port, q);
+        virtq_kick(&q->vq);
+    }
+    return reaped;
+}
+
+// Shared PCI interrupt handler
+static void virtio_blk_irq_handler(uint8_t irq) {
+    for (int i = 0; i < device_count; i++) {
+        virtio_blk_port_t* port = &ports[i];
+        
+        if (port->pci.irq != irq || port->pci.msix_enabled)
+            continue;
+        if (!(virtio_read_isr(&port->pci) & VIRTIO_ISR_QUEUE))
+            continue;
+        
+        for (int j = 0; j < port->info.queues; j++)
+            virtio_blk_process_queue(port, &port->queues[j]);
+    }
+}
+
+// MSI-X handler of one virtqueue: no ISR read and no other queue to scan
+static void virtio_blk_msi_handler(void* data) {
+    virtio_blk_queue_t* q = (virtio_blk_queue_t*)data;
+    
+    virtio_blk_process_queue(&ports[q->port], q);
+}
+
+// Give every virtqueue its own MSI-X vector, delivered to the CPU that
+// owns the queue. Returns 0, with the device back on INTx, if any queue
+// cannot get one.
+static int virtio_blk_setup_msix(virtio_blk_port_t* port) {
+    virtio_device_t* dev = &port->pci;
+    
+    if (!virtio_msix_enable(dev))
+        return 0;
+    
+    for (int i = 0; i < port->info.queues; i++) {
+        virtio_blk_queue_t* q = &port->queues[i];
+        
+        if (!virtq_set_vector(&q->vq, virtio_blk_msi_handler, q, (uint8_t)i)) {
+            for (int j = 0; j < i; j++)
+                virtq_clear_vector(&port->queues[j].vq);
+            virtio_msix_disable(dev);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int virtio_blk_setup(virtio_blk_port_t* port) {
+    virtio_device_t* dev = &port->pci;
+    uint32_t wanted = (1u << VIRTIO_BLK_F_SIZE_MAX) | (1u << VIRTIO_BLK_F_SEG_MAX) |
+                      (1u << VIRTIO_BLK_F_BLK_SIZE) | (1u << VIRTIO_BLK_F_FLUSH) |
+                      (1u << VIRTIO_BLK_F_MQ) | (1u << VIRTIO_F_INDIRECT_DESC) |
+                      (1u << VIRTIO_F_EVENT_IDX);
+    
+    if (!dev->device_cfg || !virtio_negotiate(dev, wanted, 0))
+        return 0;
+    
+    uintptr_t cfg = dev->device_cfg;
+    virtio_blk_device_t* info = &port->info;
+    
+    info->size = mmio_read32(cfg + VIRTIO_BLK_CFG_CAPACITY) |
+                 ((uint64_t)mmio_read32(cfg + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+    info->block_size = virtio_has_feature(dev, VIRTIO_BLK_F_BLK_SIZE)
+                       ? mmio_read32(cfg + VIRTIO_BLK_CFG_BLK_SIZE) : 512;
+    info->size_max = virtio_has_feature(dev, VIRTIO_BLK_F_SIZE_MAX)
+                     ? mmio_read32(cfg + VIRTIO_BLK_CFG_SIZE_MAX) : 0;
+    info->seg_max = VIRTIO_BLK_MAX_SEGS;
+    if (virtio_has_feature(dev, VIRTIO_BLK_F_SEG_MAX)) {
+        uint32_t seg_max = mmio_read32(cfg + VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max && seg_max < info->seg_max)
+            info->seg_max = seg_max;
+    }
+    info->flush = virtio_has_feature(dev, VIRTIO_BLK_F_FLUSH);
+    
+    // One virtqueue per CPU
+    uint32_t queues = 1;
+    if (virtio_has_feature(dev, VIRTIO_BLK_F_MQ))
+        queues = mmio_read16(cfg + VIRTIO_BLK_CFG_NUM_QUEUES);
+    if (queues > VIRTIO_BLK_MAX_CPUS)
+        queues = VIRTIO_BLK_MAX_CPUS;
+    
+    info->queues = 0;
+    for (uint32_t i = 0; i < queues; i++) {
+        virtio_blk_queue_t* q = &port->queues[i];
+        
+        if (!virtq_init(dev, &q->vq, (uint16_t)i))
+            break;
+        q->wait_head = NULL;
+        q->wait_tail = NULL;
+        q->port = (uint8_t)(port - ports);
+        info->queues++;
+    }
+    if (info->queues == 0)
+        return 0;
+    
+    if (!virtio_blk_setup_msix(port))
+        irq_install_handler(dev->irq, virtio_blk_irq_handler);
+    virtio_driver_ok(dev);
+    return 1;
+}
+
+void init_virtio_blk(void) {
+    virtio_device_t found[VIRTIO_BLK_MAX_DEVICES];
+    
+    serial_write("Scanning for virtio block devices...\n");
+    device_count = 0;
+    
+    int count = virtio_pci_find(VIRTIO_ID_BLOCK, found, VIRTIO_BLK_MAX_DEVICES);
+    if (count == 0) {
+        serial_write("No virtio block devices detected\n");
+        return;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        virtio_blk_port_t* port = &ports[device_count];
+        
+        port->pci = found[i];
+        if (!virtio_blk_setup(port)) {
+            serial_write("  virtio-blk setup failed\n");
+            continue;
+        }
+        
+        serial_write("Found virtio-blk: IRQ=");
+        serial_write_hex(port->pci.irq);
+        serial_write(" queues=");
+        serial_write_hex(port->info.queues);
+        serial_write(port->queues[0].vq.indirect ? " indirect" : "");
+        serial_write(port->queues[0].vq.event_idx ? " event-idx" : "");
+        serial_write(port->pci.msix_enabled ? " msi-x" : "");
+        serial_write("\n");
+        device_count++;
+    }
+    
+    virtio_blk_register();
+}
+
+// Place a request on the executing CPU's virtqueue. The device is not
+// notified until virtio_blk_commit(), so callers can batch a burst.
+void virtio_blk_queue_request(virtio_blk_request_t* req) {
+    if (req->device >= device_count ||
+        (req->op != VIRTIO_BLK_OP_FLUSH && req->count == 0)) {
+        virtio_blk_finish(req, VIRTIO_BLK_REQ_ERROR);
+        return;
+    }
+    
+    virtio_blk_port_t* port = &ports[req->device];
+    if (req->op == VIRTIO_BLK_OP_FLUSH && !port->info.flush) {
+        virtio_blk_finish(req, VIRTIO_BLK_REQ_DONE); // Write-through device
+        return;
+    }
+    
+    virtio_blk_queue_t* q = virtio_blk_cpu_queue(port);
+    req->next = NULL;
+    req->status = VIRTIO_BLK_REQ_QUEUED;
+    
+    uint32_t flags = irq_save();
+    
+    int result = q->wait_head ? 0 : virtio_blk_issue(port, q, req);
+    if (result == 0) {
+        if (q->wait_tail)
+            q->wait_tail->next = req;
+        else
+            q->wait_head = req;
+        q->wait_tail = req;
+    }
+    
+    irq_restore(flags);
+    
+    if (result < 0)
+        virtio_blk_finish(req, VIRTIO_BLK_REQ_ERROR);
+}
+
+// Notify the device once for everything queued on this CPU
+void virtio_blk_commit(uint8_t device) {
+    if (device >= device_count)
+        return;
+    
+    uint32_t flags = irq_save();
+    virtq_kick(&virtio_blk_cpu_queue(&ports[device])->vq);
+    irq_restore(flags);
+}
+
+void virtio_blk_submit(virtio_blk_request_t* req) {
+    virtio_blk_queue_request(req);
+    virtio_blk_commit(req->device);
+}
+
+// Sleep until a request finishes, polling the queue after the timeout in
+// case an interrupt was lost
+uint8_t virtio_blk_wait(virtio_blk_request_t* req) {
+    uint32_t start = timer_ticks();
+    uint32_t flags = irq_save();
+    
+    while (req->status == VIRTIO_BLK_REQ_QUEUED || req->status == VIRTIO_BLK_REQ_ACTIVE) {
+        if (timer_ticks() - start >= VIRTIO_BLK_TIMEOUT_MS) {
+            virtio_blk_port_t* port = &ports[req->device];
+            
+            serial_write("virtio-blk: request timeout, polling\n");
+            virtio_blk_process_queue(port, virtio_blk_cpu_queue(port));
+            start = timer_ticks();
+            continue;
+        }
+        
+        irq_wait();
+    }
+    
+    irq_restore(flags);
+    return (req->status == VIRTIO_BLK_REQ_DONE) ? 0 : 1;
+}
+
+// Submit a request and sleep until it completes
+static uint8_t virtio_blk_do_request(uint8_t device, uint8_t op, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    virtio_blk_request_t req;
+    
+    req.device = device;
+    req.op = op;
+    req.lba = lba;
+    req.count = count;
+    req.buffer = buffer;
+    req.sg = NULL;
+    req.nsg = 0;
+    req.complete = NULL;
+    req.private_data = NULL;
+    
+    virtio_blk_submit(&req);
+    return virtio_blk_wait(&req);
+}
+
+uint8_t virtio_blk_read_sectors(uint8_t device, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    return virtio_blk_do_request(device, VIRTIO_BLK_OP_READ, lba, count, buffer);
+}
+
+uint8_t virtio_blk_write_sectors(uint8_t device, uint64_t lba, uint32_t count, uint8_t* buffer) {
+    return virtio_blk_do_request(device, VIRTIO_BLK_OP_WRITE, lba, count, buffer);
+}
+
+uint8_t virtio_blk_flush(uint8_t device) {
+    return virtio_blk_do_request(device, VIRTIO_BLK_OP_FLUSH, 0, 0, NULL);
+}
+
+// Block layer glue. Scatter lists map straight onto descriptors, so
+// merged requests of any shape become one virtio request.
+static virtio_blk_request_t blk_native[BLK_REQUEST_POOL];
+static virtio_sg_t blk_sg[BLK_REQUEST_POOL][VIRTIO_BLK_MAX_SEGS];
+
+static void virtio_blk_blk_complete(virtio_blk_request_t* req) {
+    blk_end_request((blk_request_t*)req->private_data, req->status != VIRTIO_BLK_REQ_DONE);
+}
+
+static void virtio_blk_blk_submit(blkdev_t* bdev, blk_request_t* req) {
+    virtio_blk_request_t* native = &blk_native[req->tag];
+    
+    native->device = (uint8_t)(uintptr_t)bdev->driver_data;
+    native->op = (req->op == BIO_FLUSH) ? VIRTIO_BLK_OP_FLUSH :
+                 (req->op == BIO_WRITE) ? VIRTIO_BLK_OP_WRITE : VIRTIO_BLK_OP_READ;
+    native->lba = req->sector;
+    native->count = req->count;
+    native->buffer = NULL;
+    native->sg = blk_sg[req->tag];
+    native->nsg = req->nsg;
+    native->complete = virtio_blk_blk_complete;
+    native->private_data = req;
+    
+    for (uint32_t i = 0; i < req->nsg; i++) {
+        blk_sg[req->tag][i].addr = req->sg[i].addr;
+        blk_sg[req->tag][i].length = req->sg[i].length;
+    }
+    
+    virtio_blk_queue_request(native);
+}
+
+static void virtio_blk_blk_commit(blkdev_t* bdev) {
+    virtio_blk_commit((uint8_t)(uintptr_t)bdev->driver_data);
+}
+
+// Hybrid polling: reap the used ring of this CPU's queue
+static int virtio_blk_blk_poll(blkdev_t* bdev) {
+    virtio_blk_port_t* port = &ports[(uintptr_t)bdev->driver_data];
+    
+    return virtio_blk_process_queue(port, virtio_blk_cpu_queue(port));
+}
+
+static const blkdev_ops_t virtio_blk_ops = {
+    virtio_blk_blk_submit,
+    virtio_blk_blk_commit,
+    virtio_blk_blk_poll,
+    NULL,                       // Lost completions are reaped by poll
+};
+
+// Register the disks with the block layer as virtio0, virtio1, ...
+static void virtio_blk_register(void) {
+    for (int i = 0; i < device_count; i++) {
+        virtio_blk_port_t* port = &ports[i];
+        blkdev_t* bdev = blk_register("virtio", &virtio_blk_ops, (void*)(uintptr_t)i,
+                                      512, port->info.size, 0);
+        if (!bdev)
+            return;
+        
+        // Segments longer than size_max are split when issued; leave room
+        // for that so a request never needs more than seg_max descriptors
+        bdev->max_sectors = 2048;
+        bdev->max_segments = port->info.seg_max;
+        if (port->info.size_max) {
+            uint32_t per_segment = port->info.size_max >> 9;
+            bdev->max_segments = port->info.seg_max / 2;
+            if (bdev->max_segments * per_segment < bdev->max_sectors)
+                bdev->max_sectors = bdev->max_segments * per_segment;
+        }
+        bdev->queue_depth = port->queues[0].vq.size;
+    }
+}
+
+void virtio_blk_print_devices(void) {
+    if (device_count == 0) {
+        return; // Don't print anything if no devices
+    }
+    
+    terminal_writestring("\nVirtIO Block Devices:\n");
+    terminal_writestring("=====================\n");
+    serial_write("\nVirtIO Block Devices:\n");
+    
+    for (int i = 0; i < device_count; i++) {
+        virtio_blk_device_t* dev = &ports[i].info;
+        char num_str[16];
+        
+        terminal_writestring("Device ");
+        terminal_putchar('0' + i);
+        terminal_writestring(": VirtIO Disk\n");
+        serial_write("  Type: VirtIO Disk\n");
+        
+        // Sectors to MB without 64-bit division
+        uint32_t size_mb = (uint32_t)(dev->size >> 11);
+        format_number(size_mb, num_str);
+        terminal_writestring("  Size: ");
+        terminal_writestring(num_str);
+        terminal_writestring(" MB\n");
+        serial_write("  Size: ");
+        serial_write(num_str);
+        serial_write(" MB\n");
+    }
+}
+
+int virtio_blk_get_device_count(void) {
+    return device_count;
+}
+
+virtio_blk_device_t* virtio_blk_get_device(int index) {
+    if (index < 0 || index >= device_count)
+        return NULL;
+    return &ports[index].info;
+}
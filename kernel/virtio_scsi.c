@@ -0,0 +1,456 @@
+#include "virtio_scsi.h"
+#include "irq.h"
+#include "timer.h"
+#include "kernel.h"
+
+// Header and response of one command. The device reads and writes them
+// in place, so a command slot is held until its completion is reaped.
+typedef struct {
+    virtio_scsi_cmd_req_t hdr;
+    virtio_scsi_cmd_resp_t resp;
+    scsi_request_t* req;        // NULL when free
+} virtio_scsi_cmd_t;
+
+// Request virtqueue with its command slots and the requests waiting for
+// ring space
+typedef struct {
+    virtqueue_t vq;
+    virtio_scsi_cmd_t* cmds;    // vq.size slots
+    scsi_request_t* wait_head;
+    scsi_request_t* wait_tail;
+    uint8_t host;               // Index into hosts[]
+} virtio_scsi_queue_t;
+
+// Per-function driver state
+typedef struct {
+    virtio_device_t pci;
+    virtqueue_t control;
+    virtqueue_t event;
+    virtio_scsi_event_t* events; // VIRTIO_SCSI_EVENTS posted buffers
+    virtio_scsi_queue_t queues[VIRTIO_SCSI_MAX_CPUS];
+    uint8_t nqueues;
+    uint16_t max_sg;
+    uint32_t next_id;           // Next task tag
+    virtio_scsi_tmf_req_t tmf;
+    virtio_scsi_tmf_resp_t tmf_resp;
+    uint8_t tmf_pending;        // A LUN reset owns tmf/tmf_resp
+} virtio_scsi_host_t;
+
+static virtio_scsi_host_t hosts[SCSI_MAX_CONTROLLERS];
+
+// The request queue owned by the executing CPU. Each CPU submits to and
+// reaps its own queue, so only local interrupts need disabling.
+static virtio_scsi_queue_t* virtio_scsi_cpu_queue(virtio_scsi_host_t* host) {
+    return &host->queues[0]; // Only the boot CPU runs HueOS
+}
+
+// Single-level LUN addressing
+static void virtio_scsi_set_lun(uint8_t* lun, uint8_t target, uint8_t unit) {
+    memset(lun, 0, 8);
+    lun[0] = 1;
+    lun[1] = target;
+    lun[2] = 0x40;
+    lun[3] = unit;
+}
+
+// Data segments of a request, appended to sg
+static int virtio_scsi_add_data(scsi_request_t* req, virtio_sg_t* sg, int n) {
+    if (req->nsg) {
+        for (uint16_t i = 0; i < req->nsg; i++) {
+            sg[n].addr = req->sg[i].addr;
+            sg[n].length = req->sg[i].length;
+            n++;
+        }
+    } else if (req->length) {
+        sg[n].addr = (uint32_t)req->buffer;
+        sg[n].length = req->length;
+        n++;
+    }
+    return n;
+}
+
+// Place a request on the ring without notifying the device. Returns 1 if
+// added, 0 if the ring or the command slots are full and -1 if the
+// request can never fit.
+static int virtio_scsi_issue(virtio_scsi_host_t* host, virtio_scsi_queue_t* q, scsi_request_t* req) {
+    virtio_sg_t sg[VIRTIO_MAX_INDIRECT];
+    virtio_scsi_cmd_t* cmd = NULL;
+    
+    for (uint16_t i = 0; i < q->vq.size; i++) {
+        if (!q->cmds[i].req) {
+            cmd = &q->cmds[i];
+            break;
+        }
+    }
+    if (!cmd)
+        return 0;
+    
+    // Every command carries a tag; the device queues SIMPLE tasks freely,
+    // and untagged devices are kept to one command by their queue depth
+    memset(&cmd->hdr, 0, sizeof(virtio_scsi_cmd_req_t));
+    virtio_scsi_set_lun(cmd->hdr.lun, req->target, req->lun);
+    cmd->hdr.id = host->next_id++;
+    cmd->hdr.task_attr = VIRTIO_SCSI_S_SIMPLE;
+    memcpy(cmd->hdr.cdb, req->cdb, req->cdb_length);
+    
+    // Header and data-out are read by the device; response and data-in
+    // are written
+    int n = 0;
+    sg[n].addr = (uint32_t)&cmd->hdr;
+    sg[n].length = sizeof(virtio_scsi_cmd_req_t);
+    n++;
+    if (req->direction == SCSI_DIR_OUT)
+        n = virtio_scsi_add_data(req, sg, n);
+    int out = n;
+    sg[n].addr = (uint32_t)&cmd->resp;
+    sg[n].length = sizeof(virtio_scsi_cmd_resp_t);
+    n++;
+    if (req->direction == SCSI_DIR_IN)
+        n = virtio_scsi_add_data(req, sg, n);
+    
+    if (!q->vq.indirect && n > q->vq.size)
+        return -1;
+    if (!virtq_add(&q->vq, sg, out, n - out, cmd))
+        return 0;
+    
+    cmd->req = req;
+    req->status = SCSI_REQ_ACTIVE;
+    return 1;
+}
+
+static void virtio_scsi_finish(scsi_request_t* req, uint8_t status) {
+    req->status = status;
+    if (req->complete)
+        req->complete(req);
+}
+
+// Move waiting requests onto the ring
+static void virtio_scsi_issue_waiting(virtio_scsi_host_t* host, virtio_scsi_queue_t* q) {
+    while (q->wait_head) {
+        scsi_request_t* req = q->wait_head;
+        int result = virtio_scsi_issue(host, q, req);
+        
+        if (result == 0)
+            break;
+        
+        q->wait_head = req->next;
+        if (!q->wait_head)
+            q->wait_tail = NULL;
+        req->next = NULL;
+        
+        if (result < 0)
+            virtio_scsi_finish(req, SCSI_REQ_ERROR);
+    }
+}
+
+// Reap completions, refill the ring and notify once for the refill
+static void virtio_scsi_process_queue(virtio_scsi_host_t* host, virtio_scsi_queue_t* q) {
+    virtio_scsi_cmd_t* cmd;
+    int reaped = 0;
+    
+    while ((cmd = (virtio_scsi_cmd_t*)virtq_get(&q->vq, NULL)) != NULL) {
+        scsi_request_t* req = cmd->req;
+        
+        cmd->req = NULL;
+        reaped++;
+        if (!req)
+            continue;
+        
+        req->host_status = cmd->resp.response;
+        req->target_status = cmd->resp.status;
+        req->residual = cmd->resp.resid;
+        if (cmd->resp.response == VIRTIO_SCSI_S_OK &&
+            cmd->resp.status == SCSI_STATUS_CHECK_CONDITION) {
+            uint32_t len = cmd->resp.sense_len;
+            if (len > SCSI_SENSE_LENGTH)
+                len = SCSI_SENSE_LENGTH;
+            memset(req->sense, 0, SCSI_SENSE_LENGTH);
+            memcpy(req->sense, cmd->resp.sense, len);
+        }
+        
+        virtio_scsi_finish(req, (cmd->resp.response == VIRTIO_SCSI_S_OK &&
+                                 cmd->resp.status == SCSI_STATUS_GOOD) ? SCSI_REQ_DONE
+                                                                       : SCSI_REQ_ERROR);
+    }
+    
+    if (reaped && q->wait_head) {
+        virtio_scsi_issue_waiting(host, q);
+        virtq_kick(&q->vq);
+    }
+}
+
+static void virtio_scsi_post_event(virtio_scsi_host_t* host, virtio_scsi_event_t* ev) {
+    virtio_sg_t sg;
+    
+    memset(ev, 0, sizeof(virtio_scsi_event_t));
+    sg.addr = (uint32_t)ev;
+    sg.length = sizeof(virtio_scsi_event_t);
+    virtq_add(&host->event, &sg, 0, 1, ev);
+}
+
+// Report hotplug and parameter change events and repost their buffers.
+// Devices are only enumerated at boot, so an added LUN needs a rescan.
+static void virtio_scsi_process_events(virtio_scsi_host_t* host) {
+    virtio_scsi_event_t* ev;
+    int reaped = 0;
+    
+    while ((ev = (virtio_scsi_event_t*)virtq_get(&host->event, NULL)) != NULL) {
+        uint32_t type = ev->event & ~VIRTIO_SCSI_T_EVENTS_MISSED;
+        
+        if (ev->event & VIRTIO_SCSI_T_EVENTS_MISSED)
+            serial_write("virtio-scsi: events were lost\n");
+        if (type == VIRTIO_SCSI_T_TRANSPORT_RESET) {
+            serial_write("virtio-scsi: target 0x");
+            serial_write_hex(ev->lun[1]);
+            if (ev->reason == VIRTIO_SCSI_EVT_RESET_RESCAN)
+                serial_write(" added (rescan to use it)\n");
+            else if (ev->reason == VIRTIO_SCSI_EVT_RESET_REMOVED)
+                serial_write(" removed\n");
+            else
+                serial_write(" reset\n");
+        } else if (type == VIRTIO_SCSI_T_PARAM_CHANGE) {
+            serial_write("virtio-scsi: parameters changed on target 0x");
+            serial_write_hex(ev->lun[1]);
+            serial_write("\n");
+        }
+        
+        virtio_scsi_post_event(host, ev);
+        reaped++;
+    }
+    
+    if (reaped)
+        virtq_kick(&host->event);
+}
+
+// MSI-X handler of one request queue
+static void virtio_scsi_msi_queue(void* data) {
+    virtio_scsi_queue_t* q = (virtio_scsi_queue_t*)data;
+    
+    virtio_scsi_process_queue(&hosts[q->host], q);
+}
+
+// MSI-X handler of the event queue
+static void virtio_scsi_msi_event(void* data) {
+    virtio_scsi_process_events((virtio_scsi_host_t*)data);
+}
+
+// Vectors for the event queue and for each request queue, delivered to
+// the CPU that owns it. The control queue is only polled. Returns 0, with
+// the device back on INTx, if any queue cannot get one.
+static int virtio_scsi_setup_msix(virtio_scsi_host_t* host) {
+    virtio_device_t* dev = &host->pci;
+    
+    if (!virtio_msix_enable(dev))
+        return 0;
+    
+    int ok = !host->events || virtq_set_vector(&host->event, virtio_scsi_msi_event, host, 0);
+    int i = 0;
+    while (ok && i < host->nqueues) {
+        virtio_scsi_queue_t* q = &host->queues[i];
+        
+        if (!virtq_set_vector(&q->vq, virtio_scsi_msi_queue, q, (uint8_t)i))
+            ok = 0;
+        else
+            i++;
+    }
+    if (ok)
+        return 1;
+    
+    while (i-- > 0)
+        virtq_clear_vector(&host->queues[i].vq);
+    virtq_clear_vector(&host->event);
+    virtio_msix_disable(dev);
+    return 0;
+}
+
+int virtio_scsi_init(int index, virtio_device_t* pci, scsi_controller_t* ctrl) {
+    virtio_scsi_host_t* host = &hosts[index];
+    virtio_device_t* dev = &host->pci;
+    uint32_t wanted = (1u << VIRTIO_SCSI_F_HOTPLUG) | (1u << VIRTIO_SCSI_F_CHANGE) |
+                      (1u << VIRTIO_F_INDIRECT_DESC) | (1u << VIRTIO_F_EVENT_IDX);
+    
+    memset(host, 0, sizeof(virtio_scsi_host_t));
+    host->pci = *pci;
+    if (!dev->device_cfg || !virtio_negotiate(dev, wanted, 0))
+        return 0;
+    
+    uintptr_t cfg = dev->device_cfg;
+    uint32_t queues = mmio_read32(cfg + VIRTIO_SCSI_CFG_NUM_QUEUES);
+    uint32_t seg_max = mmio_read32(cfg + VIRTIO_SCSI_CFG_SEG_MAX);
+    uint32_t max_sectors = mmio_read32(cfg + VIRTIO_SCSI_CFG_MAX_SECTORS);
+    uint32_t cmd_per_lun = mmio_read32(cfg + VIRTIO_SCSI_CFG_CMD_PER_LUN);
+    mmio_write32(cfg + VIRTIO_SCSI_CFG_SENSE_SIZE, VIRTIO_SCSI_SENSE_SIZE);
+    mmio_write32(cfg + VIRTIO_SCSI_CFG_CDB_SIZE, VIRTIO_SCSI_CDB_SIZE);
+    
+    if (!virtq_init(dev, &host->control, VIRTIO_SCSI_QUEUE_CONTROL) ||
+        !virtq_init(dev, &host->event, VIRTIO_SCSI_QUEUE_EVENT))
+        return 0;
+    
+    // One request queue per CPU
+    if (queues == 0)
+        queues = 1;
+    if (queues > VIRTIO_SCSI_MAX_CPUS)
+        queues = VIRTIO_SCSI_MAX_CPUS;
+    
+    host->nqueues = 0;
+    for (uint32_t i = 0; i < queues; i++) {
+        virtio_scsi_queue_t* q = &host->queues[i];
+        
+        if (!virtq_init(dev, &q->vq, (uint16_t)(VIRTIO_SCSI_QUEUE_REQUEST + i)))
+            break;
+        q->cmds = (virtio_scsi_cmd_t*)kmalloc_aligned(sizeof(virtio_scsi_cmd_t) * q->vq.size, 16);
+        if (!q->cmds)
+            break;
+        memset(q->cmds, 0, sizeof(virtio_scsi_cmd_t) * q->vq.size);
+        q->wait_head = NULL;
+        q->wait_tail = NULL;
+        q->host = (uint8_t)index;
+        host->nqueues++;
+    }
+    if (host->nqueues == 0)
+        return 0;
+    
+    host->events = (virtio_scsi_event_t*)kmalloc_aligned(sizeof(virtio_scsi_event_t) * VIRTIO_SCSI_EVENTS, 16);
+    if (host->events) {
+        for (int i = 0; i < VIRTIO_SCSI_EVENTS; i++)
+            virtio_scsi_post_event(host, &host->events[i]);
+    }
+    
+    // Segments per command: the header and response take two descriptors.
+    // A buffer not starting on a page boundary needs one segment more than
+    // its pages, which scsi_set_limits() keeps spare.
+    virtqueue_t* vq = &host->queues[0].vq;
+    host->max_sg = VIRTIO_SCSI_MAX_SEGS;
+    if (seg_max && seg_max < host->max_sg)
+        host->max_sg = (uint16_t)seg_max;
+    if (!vq->indirect && vq->size - 2 < host->max_sg)
+        host->max_sg = vq->size - 2;
+    if (max_sectors && max_sectors / (PAGE_SIZE / 512) + 1 < host->max_sg)
+        host->max_sg = (uint16_t)(max_sectors / (PAGE_SIZE / 512) + 1);
+    
+    ctrl->host_id = 0xFF; // The host adapter has no target ID
+    ctrl->max_cdb = 16;
+    ctrl->max_lun = 255;    // scsi_request_t.lun; the LUN field takes 14 bits
+    ctrl->max_sg = host->max_sg;
+    ctrl->queue_depth = (uint8_t)(vq->size > 255 ? 255 : vq->size);
+    ctrl->lun_depth = ctrl->queue_depth;
+    if (cmd_per_lun && cmd_per_lun < ctrl->lun_depth)
+        ctrl->lun_depth = (uint8_t)cmd_per_lun;
+    
+    // With MSI-X there is no INTx line for init_scsi() to hook
+    if (virtio_scsi_setup_msix(host))
+        ctrl->irq = 0;
+    
+    virtio_driver_ok(dev);
+    virtq_kick(&host->event);
+    
+    serial_write("Found virtio-scsi: IRQ=");
+    serial_write_hex(dev->irq);
+    serial_write(" queues=");
+    serial_write_hex(host->nqueues);
+    serial_write(vq->indirect ? " indirect" : "");
+    serial_write(vq->event_idx ? " event-idx" : "");
+    serial_write(dev->msix_enabled ? " msi-x" : "");
+    serial_write("\n");
+    return 1;
+}
+
+// Place a request on the executing CPU's request queue and notify the
+// device. Called with interrupts disabled.
+void virtio_scsi_queue(int index, scsi_request_t* req) {
+    virtio_scsi_host_t* host = &hosts[index];
+    virtio_scsi_queue_t* q = virtio_scsi_cpu_queue(host);
+    
+    req->next = NULL;
+    int result = q->wait_head ? 0 : virtio_scsi_issue(host, q, req);
+    if (result == 0) {
+        if (q->wait_tail)
+            q->wait_tail->next = req;
+        else
+            q->wait_head = req;
+        q->wait_tail = req;
+    } else if (result < 0) {
+        virtio_scsi_finish(req, SCSI_REQ_ERROR);
+        return;
+    }
+    
+    virtq_kick(&q->vq);
+}
+
+// INTx handler: completions on every request queue, then events
+void virtio_scsi_interrupt(int index) {
+    virtio_scsi_host_t* host = &hosts[index];
+    
+    if (host->pci.msix_enabled || !(virtio_read_isr(&host->pci) & VIRTIO_ISR_QUEUE))
+        return;
+    
+    for (int i = 0; i < host->nqueues; i++)
+        virtio_scsi_process_queue(host, &host->queues[i]);
+    if (host->events)
+        virtio_scsi_process_events(host);
+}
+
+// Reap the answer to an outstanding LUN reset, if the device has sent it
+static void virtio_scsi_reap_tmf(virtio_scsi_host_t* host) {
+    while (virtq_get(&host->control, NULL)) {
+        host->tmf_pending = 0;
+        serial_write("virtio-scsi: LUN reset, response 0x");
+        serial_write_hex(host->tmf_resp.response);
+        serial_write("\n");
+    }
+}
+
+// A request timed out. Poll for a lost interrupt first; if the request is
+// still outstanding, reset its LUN through the control queue. The device
+// then completes the aborted commands with VIRTIO_SCSI_S_RESET. Called
+// from thread context with interrupts disabled; the response is awaited
+// with irq_wait() so the timer keeps running. A reset the device never
+// answers keeps the control slot until it does, and no new reset is sent
+// meanwhile.
+void virtio_scsi_timeout(int index, scsi_request_t* req) {
+    virtio_scsi_host_t* host = &hosts[index];
+    virtio_sg_t sg[2];
+    
+    for (int i = 0; i < host->nqueues; i++)
+        virtio_scsi_process_queue(host, &host->queues[i]);
+    if (req->status != SCSI_REQ_ACTIVE)
+        return;
+    
+    virtio_scsi_reap_tmf(host);
+    if (host->tmf_pending) {
+        serial_write("virtio-scsi: previous LUN reset still outstanding\n");
+        return;
+    }
+    
+    memset(&host->tmf, 0, sizeof(virtio_scsi_tmf_req_t));
+    host->tmf.type = VIRTIO_SCSI_T_TMF;
+    host->tmf.subtype = VIRTIO_SCSI_T_TMF_LOGICAL_UNIT_RESET;
+    virtio_scsi_set_lun(host->tmf.lun, req->target, req->lun);
+    host->tmf_resp.response = 0xFF;
+    
+    sg[0].addr = (uint32_t)&host->tmf;
+    sg[0].length = sizeof(virtio_scsi_tmf_req_t);
+    sg[1].addr = (uint32_t)&host->tmf_resp;
+    sg[1].length = sizeof(virtio_scsi_tmf_resp_t);
+    if (!virtq_add(&host->control, sg, 1, 1, &host->tmf)) {
+        serial_write("virtio-scsi: control queue full, LUN reset not sent\n");
+        return;
+    }
+    host->tmf_pending = 1;
+    virtq_kick(&host->control);
+    
+    uint32_t start = timer_ticks();
+    for (;;) {
+        virtio_scsi_reap_tmf(host);
+        if (!host->tmf_pending)
+            break;
+        if (irq_in_handler() || timer_ticks() - start >= VIRTIO_SCSI_TMF_TIMEOUT_MS) {
+            serial_write("virtio-scsi: LUN reset timed out\n");
+            return;
+        }
+        irq_wait();
+    }
+    
+    for (int i = 0; i < host->nqueues; i++)
+        virtio_scsi_process_queue(host, &host->queues[i]);
+}